@@ -22,6 +22,7 @@
 #include "stringpool.h"
 #include "fmtstr.h"
 #include "multiplay_gamerules.h"
+#include "checksum_crc.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -29,9 +30,15 @@
 ConVar rr_debugresponses( "rr_debugresponses", "0", FCVAR_NONE, "Show verbose matching output (1 for simple, 2 for rule scoring). If set to 3, it will only show response success/failure for npc_selected NPCs." );
 ConVar rr_debugrule( "rr_debugrule", "", FCVAR_NONE, "If set to the name of the rule, that rule's score will be shown whenever a concept is passed into the response rules system.");
 ConVar rr_dumpresponses( "rr_dumpresponses", "0", FCVAR_NONE, "Dump all response_rules.txt and rules (requires restart)" );
+ConVar rr_ruleindex( "rr_ruleindex", "1", FCVAR_NONE, "Only score the rules whose required concept (or other exact match criterion) matches the query." );
+ConVar rr_compiledrules( "rr_compiledrules", "1", FCVAR_NONE, "Load response rules from a compiled .rrc file when the scripts it was built from haven't changed, and write one after parsing." );
+ConVar rr_validateruleindex( "rr_validateruleindex", "0", FCVAR_NONE, "Score every query both with and without the rule index and warn if the best rules differ." );
 
 static CUtlSymbolTable g_RS;
 
+// Case insensitive, to match the Q_stricmp in CompareUsingMatcher
+static CUtlSymbolTable g_RSIndex( 0, 32, true );
+
 inline static char *CopyString( const char *in )
 {
 	if ( !in )
@@ -683,6 +690,14 @@ public:
 	float		LookupEnumeration( const char *name, bool& found );
 
 	int			FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose );
+	void		ScoreRule( const AI_CriteriaSet& set, int irule, CUtlVector< int >& bestrules, float& bestscore, bool verbose );
+	void		ScoreAllRules( const AI_CriteriaSet& set, CUtlVector< int >& bestrules, float& bestscore, bool verbose );
+	void		ScoreIndexedRules( const AI_CriteriaSet& set, CUtlVector< int >& bestrules, float& bestscore );
+	void		ValidateRuleIndex( const AI_CriteriaSet& set, const CUtlVector< int >& bestrules, float bestscore );
+
+	void		InvalidateRuleIndex()	{ m_bRuleIndexValid = false; }
+	void		BuildRuleIndex();
+	int			FindIndexCriterion( Rule *rule );
 
 	float		ScoreCriteriaAgainstRule( const AI_CriteriaSet& set, int irule, bool verbose = false );
 	float		RecursiveScoreSubcriteriaAgainstRule( const AI_CriteriaSet& set, Criteria *parent, bool& exclude, bool verbose /*=false*/ );
@@ -695,6 +710,11 @@ public:
 
 	void		LoadFromBuffer( const char *scriptfile, const char *buffer, CStringPool &includedFiles );
 
+	void		AddScriptFileCRC( const char *scriptfile, const void *buffer, int length );
+	void		AddMissingScriptFile( const char *scriptfile );
+	bool		LoadCompiledRules( const char *compiledfile );
+	void		SaveCompiledRules( const char *compiledfile );
+
 	void		GetCurrentScript( char *buf, size_t buflen );
 	int			GetCurrentToken() const;
 	void		SetCurrentScript( const char *script );
@@ -710,6 +730,21 @@ public:
 	CUtlDict< Rule, short >	m_Rules;
 	CUtlDict< Enumeration, short > m_Enumerations;
 
+	// Rules that have a required criterion which only matches one exact string can't
+	// score unless the query has that value, so they're bucketed by criterion name
+	// and value. The rest are scored for every query.
+	struct RuleBucket_t
+	{
+		int			first;				// into m_RuleIndexRules
+		int			count;
+	};
+
+	CUtlVector< CUtlSymbol >			m_RuleIndexNames;		// criterion names rules are bucketed by, in g_RSIndex
+	CUtlMap< unsigned int, RuleBucket_t >	m_RuleBuckets;		// ( name slot << 16 ) | value symbol
+	CUtlVector< int >					m_RuleIndexRules;
+	CUtlVector< int >					m_UnindexedRules;
+	bool								m_bRuleIndexValid;
+
 	char		token[ 1204 ];
 
 	bool		m_bUnget;
@@ -727,6 +762,16 @@ public:
 
 	CUtlVector< ScriptEntry >		m_ScriptStack;
 
+	// Every script the current rules were parsed from, for the compiled rules file
+	struct ScriptFileCRC_t
+	{
+		FileNameHandle_t	name;
+		CRC32_t				crc;
+		bool				missing;			// #included but not there, the rules go stale if it turns up
+	};
+
+	CUtlVector< ScriptFileCRC_t >	m_ScriptFiles;
+
 	friend class CDefaultResponseSystemSaveRestoreBlockHandler;
 	friend class CResponseSystemSaveRestoreOps;
 };
@@ -762,6 +807,8 @@ CResponseSystem::CResponseSystem()
 	m_bUnget = false;
 	m_bPrecache = true;
 	m_bCustomManagable = false;
+	m_bRuleIndexValid = false;
+	SetDefLessFunc( m_RuleBuckets );
 }
 
 //-----------------------------------------------------------------------------
@@ -817,6 +864,7 @@ void CResponseSystem::Clear()
 	m_Criteria.RemoveAll();
 	m_Rules.RemoveAll();
 	m_Enumerations.RemoveAll();
+	InvalidateRuleIndex();
 }
 
 //-----------------------------------------------------------------------------
@@ -1676,6 +1724,225 @@ bool CResponseSystem::GetBestResponse( ResponseSearchResult& searchResult, Rule
 	return bret;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Adds irule to the bucket of best rules if it scores at least as
+//			well as the ones already there
+//-----------------------------------------------------------------------------
+void CResponseSystem::ScoreRule( const AI_CriteriaSet& set, int irule, CUtlVector< int >& bestrules, float& bestscore, bool verbose )
+{
+	float score = ScoreCriteriaAgainstRule( set, irule, verbose );
+	// Check equals so that we keep track of all matching rules
+	if ( score >= bestscore )
+	{
+		// Reset bucket
+		if( score != bestscore )
+		{
+			bestscore = score;
+			bestrules.RemoveAll();
+		}
+
+		// Add to bucket
+		bestrules.AddToTail( irule );
+	}
+}
+
+void CResponseSystem::ScoreAllRules( const AI_CriteriaSet& set, CUtlVector< int >& bestrules, float& bestscore, bool verbose )
+{
+	int c = m_Rules.Count();
+	for ( int i = 0; i < c; i++ )
+	{
+		ScoreRule( set, i, bestrules, bestscore, verbose );
+	}
+}
+
+static int __cdecl CompareRuleIndices( const int *a, const int *b )
+{
+	return *a - *b;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Scores only the rules that can match the query. The candidates are
+//			scored in rule order so that ties come out exactly as they would
+//			from ScoreAllRules.
+//-----------------------------------------------------------------------------
+void CResponseSystem::ScoreIndexedRules( const AI_CriteriaSet& set, CUtlVector< int >& bestrules, float& bestscore )
+{
+	if ( !m_bRuleIndexValid )
+	{
+		BuildRuleIndex();
+	}
+
+	CUtlVectorFixedGrowable< int, 256 > candidates;
+	candidates.AddMultipleToTail( m_UnindexedRules.Count(), m_UnindexedRules.Base() );
+
+	int nBuckets = 0;
+	int nNames = m_RuleIndexNames.Count();
+	for ( int i = 0; i < nNames; i++ )
+	{
+		int found = set.FindCriterionIndex( g_RSIndex.String( m_RuleIndexNames[ i ] ) );
+		if ( found == -1 || !set.GetValue( found ) )
+			continue;
+
+		CUtlSymbol value = g_RSIndex.Find( set.GetValue( found ) );
+		if ( !value.IsValid() )
+			continue;
+
+		int idx = m_RuleBuckets.Find( ( (unsigned int)i << 16 ) | (UtlSymId_t)value );
+		if ( idx == m_RuleBuckets.InvalidIndex() )
+			continue;
+
+		const RuleBucket_t &bucket = m_RuleBuckets[ idx ];
+		candidates.AddMultipleToTail( bucket.count, &m_RuleIndexRules[ bucket.first ] );
+		nBuckets++;
+	}
+
+	// each list is already in rule order, so only sort if we joined more than one
+	if ( nBuckets > 1 || ( nBuckets == 1 && m_UnindexedRules.Count() ) )
+	{
+		candidates.Sort( CompareRuleIndices );
+	}
+
+	int c = candidates.Count();
+	for ( int i = 0; i < c; i++ )
+	{
+		ScoreRule( set, candidates[ i ], bestrules, bestscore, false );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: rr_validateruleindex: rescores the query against every rule and
+//			complains if the index gave a different answer
+//-----------------------------------------------------------------------------
+void CResponseSystem::ValidateRuleIndex( const AI_CriteriaSet& set, const CUtlVector< int >& bestrules, float bestscore )
+{
+	CUtlVector< int > fullrules;
+	float fullscore = 0.001f;
+	ScoreAllRules( set, fullrules, fullscore, false );
+
+	bool bMatch = ( fullscore == bestscore && fullrules.Count() == bestrules.Count() );
+	for ( int i = 0; bMatch && i < fullrules.Count(); i++ )
+	{
+		bMatch = ( fullrules[ i ] == bestrules[ i ] );
+	}
+
+	if ( bMatch )
+		return;
+
+	int iConcept = set.FindCriterionIndex( "concept" );
+	Warning( "Response rule index mismatch for concept '%s': indexed %i rules (score %.3f, first '%s'), full %i rules (score %.3f, first '%s')\n",
+		( iConcept != -1 ) ? set.GetValue( iConcept ) : "",
+		bestrules.Count(), bestscore, bestrules.Count() ? m_Rules.GetElementName( bestrules[ 0 ] ) : "",
+		fullrules.Count(), fullscore, fullrules.Count() ? m_Rules.GetElementName( fullrules[ 0 ] ) : "" );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the criterion a rule can be bucketed by, or -1. It has to be
+//			a required, plain string equality, since then the rule is excluded
+//			(scores 0) for any other value. Prefers "concept".
+//-----------------------------------------------------------------------------
+int CResponseSystem::FindIndexCriterion( Rule *rule )
+{
+	int best = -1;
+	int count = rule->m_Criteria.Count();
+	for ( int i = 0; i < count; i++ )
+	{
+		int icriterion = rule->m_Criteria[ i ];
+		Criteria *c = &m_Criteria[ icriterion ];
+		if ( c->IsSubCriteriaType() || !c->required || !c->name )
+			continue;
+
+		Matcher &m = c->matcher;
+		if ( !m.valid || m.isnumeric || m.notequal || m.usemin || m.usemax || !m.GetToken()[0] )
+			continue;
+
+		if ( !Q_stricmp( c->name, "concept" ) )
+			return icriterion;
+
+		if ( best == -1 )
+		{
+			best = icriterion;
+		}
+	}
+
+	return best;
+}
+
+// Can't collide with a bucket key, UTL_INVAL_SYMBOL is never a value
+#define UNINDEXED_RULE	0xFFFFFFFF
+
+//-----------------------------------------------------------------------------
+// Purpose: Buckets the rules for ScoreIndexedRules. Called after loading and
+//			again on the next query if the rules change.
+//-----------------------------------------------------------------------------
+void CResponseSystem::BuildRuleIndex()
+{
+	m_RuleIndexNames.RemoveAll();
+	m_RuleBuckets.RemoveAll();
+	m_RuleIndexRules.RemoveAll();
+	m_UnindexedRules.RemoveAll();
+
+	int c = m_Rules.Count();
+	CUtlVector< unsigned int > ruleKeys;
+	ruleKeys.SetCount( c );
+
+	for ( int i = 0; i < c; i++ )
+	{
+		int icriterion = FindIndexCriterion( &m_Rules[ i ] );
+		if ( icriterion == -1 )
+		{
+			m_UnindexedRules.AddToTail( i );
+			ruleKeys[ i ] = UNINDEXED_RULE;
+			continue;
+		}
+
+		Criteria *crit = &m_Criteria[ icriterion ];
+		CUtlSymbol name = g_RSIndex.AddString( crit->name );
+		int slot = m_RuleIndexNames.Find( name );
+		if ( slot == -1 )
+		{
+			slot = m_RuleIndexNames.AddToTail( name );
+		}
+
+		CUtlSymbol value = g_RSIndex.AddString( crit->matcher.GetToken() );
+		unsigned int key = ( (unsigned int)slot << 16 ) | (UtlSymId_t)value;
+		ruleKeys[ i ] = key;
+
+		int idx = m_RuleBuckets.Find( key );
+		if ( idx == m_RuleBuckets.InvalidIndex() )
+		{
+			RuleBucket_t bucket;
+			bucket.first = 0;
+			bucket.count = 0;
+			idx = m_RuleBuckets.Insert( key, bucket );
+		}
+		m_RuleBuckets[ idx ].count++;
+	}
+
+	// lay the buckets out back to back, each in rule order
+	int first = 0;
+	FOR_EACH_MAP_FAST( m_RuleBuckets, idx )
+	{
+		m_RuleBuckets[ idx ].first = first;
+		first += m_RuleBuckets[ idx ].count;
+		m_RuleBuckets[ idx ].count = 0;
+	}
+
+	m_RuleIndexRules.SetCount( first );
+	for ( int i = 0; i < c; i++ )
+	{
+		if ( ruleKeys[ i ] == UNINDEXED_RULE )
+			continue;
+
+		RuleBucket_t &bucket = m_RuleBuckets[ m_RuleBuckets.Find( ruleKeys[ i ] ) ];
+		m_RuleIndexRules[ bucket.first + bucket.count++ ] = i;
+	}
+
+	m_bRuleIndexValid = true;
+
+	DevMsg( 2, "CResponseSystem:  indexed %i of %i rules into %i buckets on %i criteria\n",
+		c - m_UnindexedRules.Count(), c, m_RuleBuckets.Count(), m_RuleIndexNames.Count() );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : set - 
@@ -1687,23 +1954,19 @@ int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbo
 	CUtlVector< int >	bestrules;
 	float bestscore = 0.001f;
 
-	int c = m_Rules.Count();
-	int i;
-	for ( i = 0; i < c; i++ )
+	// Debugging output wants to see every rule scored
+	const char *pszDebugRule = rr_debugrule.GetString();
+	if ( verbose || ( pszDebugRule && pszDebugRule[0] ) || !rr_ruleindex.GetBool() )
 	{
-		float score = ScoreCriteriaAgainstRule( set, i, verbose );
-		// Check equals so that we keep track of all matching rules
-		if ( score >= bestscore )
-		{
-			// Reset bucket
-			if( score != bestscore )
-			{
-				bestscore = score;
-				bestrules.RemoveAll();
-			}
+		ScoreAllRules( set, bestrules, bestscore, verbose );
+	}
+	else
+	{
+		ScoreIndexedRules( set, bestrules, bestscore );
 
-			// Add to bucket
-			bestrules.AddToTail( i );
+		if ( rr_validateruleindex.GetBool() )
+		{
+			ValidateRuleIndex( set, bestrules, bestscore );
 		}
 	}
 
@@ -1913,9 +2176,12 @@ void CResponseSystem::ParseInclude( CStringPool &includedFiles )
 	if ( !filesystem->ReadFile( includefile, "GAME", buf ) )
 	{
 		DevMsg( "Unable to load #included script %s\n", includefile );
+		AddMissingScriptFile( includefile );
 		return;
 	}
 
+	AddScriptFileCRC( includefile, buf.Base(), buf.TellPut() );
+
 	LoadFromBuffer( includefile, (const char *)buf.PeekGet(), includedFiles );
 }
 
@@ -1997,6 +2263,23 @@ void CResponseSystem::LoadRuleSet( const char *basescript )
 		return;
 	}
 
+	m_ScriptFiles.RemoveAll();
+	AddScriptFileCRC( basescript, buffer, length );
+
+	// The compiled file only describes a whole rule set, so don't use it to add to one
+	char compiledfile[ MAX_PATH ];
+	Q_StripExtension( basescript, compiledfile, sizeof( compiledfile ) );
+	Q_strncat( compiledfile, ".rrc", sizeof( compiledfile ), COPY_ALL_CHARACTERS );
+	bool bCompiled = rr_compiledrules.GetBool() && 
+		!m_Rules.Count() && !m_Criteria.Count() && !m_Responses.Count() && !m_Enumerations.Count();
+
+	if ( bCompiled && LoadCompiledRules( compiledfile ) )
+	{
+		UTIL_FreeFile( buffer );
+		BuildRuleIndex();
+		return;
+	}
+
 	CStringPool includedFiles;
 
 	LoadFromBuffer( basescript, (const char *)buffer, includedFiles );
@@ -2004,6 +2287,645 @@ void CResponseSystem::LoadRuleSet( const char *basescript )
 	UTIL_FreeFile( buffer );
 
 	Assert( m_ScriptStack.Count() == 0 );
+
+	if ( bCompiled )
+	{
+		SaveCompiledRules( compiledfile );
+	}
+
+	BuildRuleIndex();
+}
+
+void CResponseSystem::AddScriptFileCRC( const char *scriptfile, const void *buffer, int length )
+{
+	ScriptFileCRC_t entry;
+	entry.name = filesystem->FindOrAddFileName( scriptfile );
+	CRC32_Init( &entry.crc );
+	CRC32_ProcessBuffer( &entry.crc, buffer, length );
+	CRC32_Final( &entry.crc );
+	entry.missing = false;
+	m_ScriptFiles.AddToTail( entry );
+}
+
+void CResponseSystem::AddMissingScriptFile( const char *scriptfile )
+{
+	ScriptFileCRC_t entry;
+	entry.name = filesystem->FindOrAddFileName( scriptfile );
+	entry.crc = 0;
+	entry.missing = true;
+	m_ScriptFiles.AddToTail( entry );
+}
+
+//-----------------------------------------------------------------------------
+// Compiled rules (.rrc)
+//
+// A flat image of the parsed enumerations, criteria, response groups and rules,
+// written after a script has been parsed and loaded instead of parsing it while
+// the CRCs of the script and all of its #includes still match, and none of the
+// #includes that were missing have appeared since. Every section is an array of
+// fixed size records in the order below, referencing each other by position and
+// the string table by offset. Loading copies them back into the dictionaries.
+//-----------------------------------------------------------------------------
+#define COMPILEDRULES_ID		(('C'<<24)+('R'<<16)+('R'<<8)+'V')
+#define COMPILEDRULES_VERSION	2
+
+struct CompiledRulesHeader_t
+{
+	int			id;
+	int			version;
+	int			responseParamsSize;				// sizeof( AI_ResponseParams )
+	int			numScriptFiles;
+	int			numEnumerations;
+	int			numCriteria;
+	int			numSubcriteria;
+	int			numGroups;
+	int			numResponses;
+	int			numRules;
+	int			numRuleRefs;
+	int			numStringBytes;
+};
+
+struct CompiledScriptFile_t
+{
+	int			name;							// string offsets, -1 for NULL
+	CRC32_t		crc;
+	int			missing;						// the #include wasn't there, crc is unused
+};
+
+struct CompiledEnumeration_t
+{
+	int			name;
+	float		value;
+};
+
+struct CompiledCriterion_t
+{
+	int			dictname;
+	int			name;
+	int			value;
+	float		weight;
+	int			required;
+	int			firstSubcriterion;				// into the subcriteria list
+	int			numSubcriteria;
+	// matcher
+	int			matcherFlags;
+	float		minval;
+	float		maxval;
+	int			token;
+	int			rawtoken;
+};
+
+enum
+{
+	MATCHER_VALID =		(1<<0),
+	MATCHER_NUMERIC =	(1<<1),
+	MATCHER_NOTEQUAL =	(1<<2),
+	MATCHER_USEMIN =	(1<<3),
+	MATCHER_MINEQUALS =	(1<<4),
+	MATCHER_USEMAX =	(1<<5),
+	MATCHER_MAXEQUALS =	(1<<6),
+};
+
+struct CompiledResponseGroup_t
+{
+	int			name;
+	int			firstResponse;
+	int			numResponses;
+	int			flags;
+	AI_ResponseParams rp;
+};
+
+enum
+{
+	GROUP_DEPLETEBEFOREREPEAT =	(1<<0),
+	GROUP_SEQUENTIAL =			(1<<1),
+	GROUP_NOREPEAT =			(1<<2),
+	GROUP_HASFIRST =			(1<<3),
+	GROUP_HASLAST =				(1<<4),
+};
+
+struct CompiledResponse_t
+{
+	int			value;
+	float		weight;
+	int			type;
+	int			first;
+	int			last;
+};
+
+struct CompiledRule_t
+{
+	int			name;
+	int			context;
+	int			flags;
+	int			firstCriterion;					// into the rule reference list
+	int			numCriteria;
+	int			firstResponse;					// into the rule reference list
+	int			numResponses;
+};
+
+enum
+{
+	RULE_MATCHONCE =			(1<<0),
+	RULE_ENABLED =				(1<<1),
+	RULE_APPLYCONTEXTTOWORLD =	(1<<2),
+};
+
+class CCompiledRulesStrings
+{
+public:
+	CCompiledRulesStrings() : m_Offsets( k_eDictCompareTypeCaseSensitive ) {}
+
+	int Add( const char *pString )
+	{
+		if ( !pString )
+			return -1;
+
+		int idx = m_Offsets.Find( pString );
+		if ( idx != m_Offsets.InvalidIndex() )
+			return m_Offsets[ idx ];
+
+		int offset = m_Buffer.TellPut();
+		m_Buffer.PutString( pString );
+		m_Offsets.Insert( pString, offset );
+		return offset;
+	}
+
+	CUtlBuffer				m_Buffer;
+	CUtlDict< int, int >	m_Offsets;
+};
+
+// Bounds checked view of the loaded file
+class CCompiledRulesReader
+{
+public:
+	CCompiledRulesReader( const CUtlBuffer &buf ) : 
+		m_pBase( (const byte *)buf.Base() ), m_nSize( buf.TellPut() ), m_nOffset( 0 ), m_bOverflow( false ), m_pStrings( NULL ), m_nStringBytes( 0 )
+	{
+	}
+
+	template< class T > const T *Section( int count )
+	{
+		if ( count < 0 || m_nOffset + (int64)count * sizeof( T ) > m_nSize )
+		{
+			m_bOverflow = true;
+			return NULL;
+		}
+		const T *p = (const T *)( m_pBase + m_nOffset );
+		m_nOffset += count * sizeof( T );
+		return p;
+	}
+
+	void SetStrings( int numBytes )
+	{
+		m_pStrings = Section< char >( numBytes );
+		m_nStringBytes = numBytes;
+		if ( m_pStrings && numBytes > 0 && m_pStrings[ numBytes - 1 ] != 0 )
+		{
+			m_bOverflow = true;
+		}
+	}
+
+	const char *String( int offset )
+	{
+		if ( offset == -1 )
+			return NULL;
+		if ( !m_pStrings || offset < 0 || offset >= m_nStringBytes )
+		{
+			m_bOverflow = true;
+			return "";
+		}
+		return m_pStrings + offset;
+	}
+
+	bool IsValid() const { return !m_bOverflow; }
+
+private:
+	const byte	*m_pBase;
+	int			m_nSize;
+	int			m_nOffset;
+	bool		m_bOverflow;
+	const char	*m_pStrings;
+	int			m_nStringBytes;
+};
+
+static bool IsCompiledIndexValid( int first, int count, int total )
+{
+	return first >= 0 && count >= 0 && first + count <= total;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads the rule set from a compiled file. Fails, leaving the system
+//			empty, if the file is missing, stale or damaged.
+//-----------------------------------------------------------------------------
+bool CResponseSystem::LoadCompiledRules( const char *compiledfile )
+{
+	MEM_ALLOC_CREDIT();
+
+	CUtlBuffer buf;
+	if ( !filesystem->ReadFile( compiledfile, "MOD", buf ) )
+		return false;
+
+	CCompiledRulesReader reader( buf );
+	const CompiledRulesHeader_t *pHeader = reader.Section< CompiledRulesHeader_t >( 1 );
+	if ( !pHeader || 
+		 pHeader->id != COMPILEDRULES_ID || 
+		 pHeader->version != COMPILEDRULES_VERSION || 
+		 pHeader->responseParamsSize != sizeof( AI_ResponseParams ) )
+	{
+		return false;
+	}
+
+	const CompiledScriptFile_t *pScriptFiles = reader.Section< CompiledScriptFile_t >( pHeader->numScriptFiles );
+	const CompiledEnumeration_t *pEnumerations = reader.Section< CompiledEnumeration_t >( pHeader->numEnumerations );
+	const CompiledCriterion_t *pCriteria = reader.Section< CompiledCriterion_t >( pHeader->numCriteria );
+	const int *pSubcriteria = reader.Section< int >( pHeader->numSubcriteria );
+	const CompiledResponseGroup_t *pGroups = reader.Section< CompiledResponseGroup_t >( pHeader->numGroups );
+	const CompiledResponse_t *pResponses = reader.Section< CompiledResponse_t >( pHeader->numResponses );
+	const CompiledRule_t *pRules = reader.Section< CompiledRule_t >( pHeader->numRules );
+	const int *pRuleRefs = reader.Section< int >( pHeader->numRuleRefs );
+	reader.SetStrings( pHeader->numStringBytes );
+	if ( !reader.IsValid() || pHeader->numScriptFiles < 1 )
+		return false;
+
+	// The base script was just read by LoadRuleSet, check it first and the #includes after it
+	Assert( m_ScriptFiles.Count() == 1 );
+	char basescript[ MAX_PATH ];
+	if ( !filesystem->String( m_ScriptFiles[ 0 ].name, basescript, sizeof( basescript ) ) )
+		return false;
+
+	for ( int i = 0; i < pHeader->numScriptFiles; i++ )
+	{
+		const char *pszScript = reader.String( pScriptFiles[ i ].name );
+		if ( !pszScript )
+			return false;
+
+		if ( i == 0 )
+		{
+			if ( Q_stricmp( pszScript, basescript ) || pScriptFiles[ i ].crc != m_ScriptFiles[ 0 ].crc )
+				return false;
+			continue;
+		}
+
+		CUtlBuffer scriptbuf;
+		bool bExists = filesystem->ReadFile( pszScript, "GAME", scriptbuf );
+		if ( pScriptFiles[ i ].missing )
+		{
+			if ( bExists )
+			{
+				m_ScriptFiles.SetCount( 1 );
+				return false;
+			}
+
+			AddMissingScriptFile( pszScript );
+			continue;
+		}
+
+		if ( !bExists )
+		{
+			m_ScriptFiles.SetCount( 1 );
+			return false;
+		}
+
+		AddScriptFileCRC( pszScript, scriptbuf.Base(), scriptbuf.TellPut() );
+		if ( m_ScriptFiles.Tail().crc != pScriptFiles[ i ].crc )
+		{
+			m_ScriptFiles.SetCount( 1 );
+			return false;
+		}
+	}
+
+	for ( int i = 0; i < pHeader->numEnumerations; i++ )
+	{
+		Enumeration newEnum;
+		newEnum.value = pEnumerations[ i ].value;
+		m_Enumerations.Insert( reader.String( pEnumerations[ i ].name ), newEnum );
+	}
+
+	// Dictionary indices may come out differently, so everything is remapped by position
+	CUtlVector< int > criteriaMap;
+	criteriaMap.SetCount( pHeader->numCriteria );
+	for ( int i = 0; i < pHeader->numCriteria && reader.IsValid(); i++ )
+	{
+		const CompiledCriterion_t &src = pCriteria[ i ];
+		if ( !IsCompiledIndexValid( src.firstSubcriterion, src.numSubcriteria, pHeader->numSubcriteria ) )
+			break;
+
+		Criteria newCriterion;
+		newCriterion.name = CopyString( reader.String( src.name ) );
+		newCriterion.value = CopyString( reader.String( src.value ) );
+		newCriterion.weight.SetFloat( src.weight );
+		newCriterion.required = src.required != 0;
+
+		int j;
+		for ( j = 0; j < src.numSubcriteria; j++ )
+		{
+			// subcriteria are always defined before the criteria that use them
+			int sub = pSubcriteria[ src.firstSubcriterion + j ];
+			if ( sub < 0 || sub >= i )
+				break;
+			newCriterion.subcriteria.AddToTail( criteriaMap[ sub ] );
+		}
+		if ( j != src.numSubcriteria )
+			break;
+
+		Matcher &m = newCriterion.matcher;
+		if ( src.matcherFlags & MATCHER_VALID )
+		{
+			m.valid = true;
+			m.isnumeric = ( src.matcherFlags & MATCHER_NUMERIC ) != 0;
+			m.notequal = ( src.matcherFlags & MATCHER_NOTEQUAL ) != 0;
+			m.usemin = ( src.matcherFlags & MATCHER_USEMIN ) != 0;
+			m.minequals = ( src.matcherFlags & MATCHER_MINEQUALS ) != 0;
+			m.usemax = ( src.matcherFlags & MATCHER_USEMAX ) != 0;
+			m.maxequals = ( src.matcherFlags & MATCHER_MAXEQUALS ) != 0;
+			m.minval = src.minval;
+			m.maxval = src.maxval;
+			m.SetToken( reader.String( src.token ) );
+			m.SetRaw( reader.String( src.rawtoken ) );
+		}
+
+		criteriaMap[ i ] = m_Criteria.Insert( reader.String( src.dictname ), newCriterion );
+	}
+
+	CUtlVector< int > groupMap;
+	groupMap.SetCount( pHeader->numGroups );
+	int nGroupsLoaded = 0;
+	if ( m_Criteria.Count() == pHeader->numCriteria )
+	{
+		for ( ; nGroupsLoaded < pHeader->numGroups && reader.IsValid(); nGroupsLoaded++ )
+		{
+			const CompiledResponseGroup_t &src = pGroups[ nGroupsLoaded ];
+			if ( !IsCompiledIndexValid( src.firstResponse, src.numResponses, pHeader->numResponses ) )
+				break;
+
+			ResponseGroup newGroup;
+			newGroup.rp = src.rp;
+			newGroup.m_bDepleteBeforeRepeat = ( src.flags & GROUP_DEPLETEBEFOREREPEAT ) != 0;
+			newGroup.m_bSequential = ( src.flags & GROUP_SEQUENTIAL ) != 0;
+			newGroup.m_bNoRepeat = ( src.flags & GROUP_NOREPEAT ) != 0;
+			newGroup.m_bHasFirst = ( src.flags & GROUP_HASFIRST ) != 0;
+			newGroup.m_bHasLast = ( src.flags & GROUP_HASLAST ) != 0;
+
+			for ( int j = 0; j < src.numResponses; j++ )
+			{
+				const CompiledResponse_t &srcResponse = pResponses[ src.firstResponse + j ];
+				Response newResponse;
+				newResponse.value = CopyString( reader.String( srcResponse.value ) );
+				newResponse.weight.SetFloat( srcResponse.weight );
+				newResponse.type = srcResponse.type;
+				newResponse.first = srcResponse.first != 0;
+				newResponse.last = srcResponse.last != 0;
+				newGroup.group.AddToTail( newResponse );
+			}
+
+			groupMap[ nGroupsLoaded ] = m_Responses.Insert( reader.String( src.name ), newGroup );
+		}
+	}
+
+	int nRulesLoaded = 0;
+	if ( nGroupsLoaded == pHeader->numGroups )
+	{
+		for ( ; nRulesLoaded < pHeader->numRules && reader.IsValid(); nRulesLoaded++ )
+		{
+			const CompiledRule_t &src = pRules[ nRulesLoaded ];
+			if ( !IsCompiledIndexValid( src.firstCriterion, src.numCriteria, pHeader->numRuleRefs ) ||
+				 !IsCompiledIndexValid( src.firstResponse, src.numResponses, pHeader->numRuleRefs ) )
+				break;
+
+			Rule newRule;
+			newRule.SetContext( reader.String( src.context ) );
+			newRule.m_bMatchOnce = ( src.flags & RULE_MATCHONCE ) != 0;
+			newRule.m_bEnabled = ( src.flags & RULE_ENABLED ) != 0;
+			newRule.m_bApplyContextToWorld = ( src.flags & RULE_APPLYCONTEXTTOWORLD ) != 0;
+
+			int j;
+			for ( j = 0; j < src.numCriteria; j++ )
+			{
+				int ref = pRuleRefs[ src.firstCriterion + j ];
+				if ( ref < 0 || ref >= pHeader->numCriteria )
+					break;
+				newRule.m_Criteria.AddToTail( criteriaMap[ ref ] );
+			}
+			if ( j != src.numCriteria )
+				break;
+
+			for ( j = 0; j < src.numResponses; j++ )
+			{
+				int ref = pRuleRefs[ src.firstResponse + j ];
+				if ( ref < 0 || ref >= pHeader->numGroups )
+					break;
+				newRule.m_Responses.AddToTail( groupMap[ ref ] );
+			}
+			if ( j != src.numResponses )
+				break;
+
+			m_Rules.Insert( reader.String( src.name ), newRule );
+		}
+	}
+
+	if ( m_Criteria.Count() != pHeader->numCriteria || 
+		 m_Responses.Count() != pHeader->numGroups || 
+		 nRulesLoaded != pHeader->numRules || 
+		 !reader.IsValid() )
+	{
+		Warning( "CResponseSystem:  ignoring damaged compiled rules %s\n", compiledfile );
+		Clear();
+		m_ScriptFiles.SetCount( 1 );
+		return false;
+	}
+
+	DevMsg( 1, "CResponseSystem:  %s (%i rules, %i criteria, and %i responses from %i scripts)\n",
+		compiledfile, m_Rules.Count(), m_Criteria.Count(), m_Responses.Count(), m_ScriptFiles.Count() );
+
+	if( rr_dumpresponses.GetBool() )
+	{
+		DumpRules();
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes the rule set that was just parsed
+//-----------------------------------------------------------------------------
+void CResponseSystem::SaveCompiledRules( const char *compiledfile )
+{
+	MEM_ALLOC_CREDIT();
+
+	CCompiledRulesStrings strings;
+	CUtlVector< CompiledScriptFile_t > scriptFiles;
+	CUtlVector< CompiledEnumeration_t > enumerations;
+	CUtlVector< CompiledCriterion_t > criteria;
+	CUtlVector< int > subcriteria;
+	CUtlVector< CompiledResponseGroup_t > groups;
+	CUtlVector< CompiledResponse_t > responses;
+	CUtlVector< CompiledRule_t > rules;
+	CUtlVector< int > ruleRefs;
+
+	for ( int i = 0; i < m_ScriptFiles.Count(); i++ )
+	{
+		char name[ MAX_PATH ];
+		if ( !filesystem->String( m_ScriptFiles[ i ].name, name, sizeof( name ) ) )
+			return;
+
+		CompiledScriptFile_t &dst = scriptFiles[ scriptFiles.AddToTail() ];
+		dst.name = strings.Add( name );
+		dst.crc = m_ScriptFiles[ i ].crc;
+		dst.missing = m_ScriptFiles[ i ].missing ? 1 : 0;
+	}
+
+	for ( int i = 0; i < m_Enumerations.MaxElement(); i++ )
+	{
+		if ( !m_Enumerations.IsValidIndex( i ) )
+			continue;
+
+		CompiledEnumeration_t &dst = enumerations[ enumerations.AddToTail() ];
+		dst.name = strings.Add( m_Enumerations.GetElementName( i ) );
+		dst.value = m_Enumerations[ i ].value;
+	}
+
+	// Records go out in dictionary index order, which is the order they were parsed in
+	CUtlVector< int > criteriaMap;
+	criteriaMap.SetCount( m_Criteria.MaxElement() );
+	for ( int i = 0; i < m_Criteria.MaxElement(); i++ )
+	{
+		criteriaMap[ i ] = -1;
+		if ( !m_Criteria.IsValidIndex( i ) )
+			continue;
+
+		Criteria *c = &m_Criteria[ i ];
+		criteriaMap[ i ] = criteria.Count();
+
+		CompiledCriterion_t &dst = criteria[ criteria.AddToTail() ];
+		dst.dictname = strings.Add( m_Criteria.GetElementName( i ) );
+		dst.name = strings.Add( c->name );
+		dst.value = strings.Add( c->value );
+		dst.weight = c->weight.GetFloat();
+		dst.required = c->required;
+		dst.firstSubcriterion = subcriteria.Count();
+		dst.numSubcriteria = c->subcriteria.Count();
+		for ( int j = 0; j < c->subcriteria.Count(); j++ )
+		{
+			int sub = c->subcriteria[ j ];
+			if ( sub >= i || criteriaMap[ sub ] == -1 )
+				return;
+			subcriteria.AddToTail( criteriaMap[ sub ] );
+		}
+
+		Matcher &m = c->matcher;
+		dst.matcherFlags = 0;
+		dst.minval = m.minval;
+		dst.maxval = m.maxval;
+		dst.token = -1;
+		dst.rawtoken = -1;
+		if ( m.valid )
+		{
+			dst.matcherFlags = MATCHER_VALID | 
+				( m.isnumeric ? MATCHER_NUMERIC : 0 ) |
+				( m.notequal ? MATCHER_NOTEQUAL : 0 ) |
+				( m.usemin ? MATCHER_USEMIN : 0 ) |
+				( m.minequals ? MATCHER_MINEQUALS : 0 ) |
+				( m.usemax ? MATCHER_USEMAX : 0 ) |
+				( m.maxequals ? MATCHER_MAXEQUALS : 0 );
+			dst.token = strings.Add( m.GetToken() );
+			dst.rawtoken = strings.Add( m.GetRaw() );
+		}
+	}
+
+	CUtlVector< int > groupMap;
+	groupMap.SetCount( m_Responses.MaxElement() );
+	for ( int i = 0; i < m_Responses.MaxElement(); i++ )
+	{
+		groupMap[ i ] = -1;
+		if ( !m_Responses.IsValidIndex( i ) )
+			continue;
+
+		ResponseGroup *g = &m_Responses[ i ];
+		groupMap[ i ] = groups.Count();
+
+		CompiledResponseGroup_t &dst = groups[ groups.AddToTail() ];
+		dst.name = strings.Add( m_Responses.GetElementName( i ) );
+		dst.firstResponse = responses.Count();
+		dst.numResponses = g->group.Count();
+		dst.flags = ( g->m_bDepleteBeforeRepeat ? GROUP_DEPLETEBEFOREREPEAT : 0 ) |
+			( g->m_bSequential ? GROUP_SEQUENTIAL : 0 ) |
+			( g->m_bNoRepeat ? GROUP_NOREPEAT : 0 ) |
+			( g->m_bHasFirst ? GROUP_HASFIRST : 0 ) |
+			( g->m_bHasLast ? GROUP_HASLAST : 0 );
+		dst.rp = g->rp;
+
+		for ( int j = 0; j < g->group.Count(); j++ )
+		{
+			Response *r = &g->group[ j ];
+			CompiledResponse_t &dstResponse = responses[ responses.AddToTail() ];
+			dstResponse.value = strings.Add( r->value );
+			dstResponse.weight = r->weight.GetFloat();
+			dstResponse.type = r->type;
+			dstResponse.first = r->first;
+			dstResponse.last = r->last;
+		}
+	}
+
+	int c = m_Rules.Count();
+	for ( int i = 0; i < c; i++ )
+	{
+		Rule *r = &m_Rules[ i ];
+		CompiledRule_t &dst = rules[ rules.AddToTail() ];
+		dst.name = strings.Add( m_Rules.GetElementName( i ) );
+		dst.context = strings.Add( r->GetContext() );
+		dst.flags = ( r->IsMatchOnce() ? RULE_MATCHONCE : 0 ) |
+			( r->IsEnabled() ? RULE_ENABLED : 0 ) |
+			( r->IsApplyContextToWorld() ? RULE_APPLYCONTEXTTOWORLD : 0 );
+
+		dst.firstCriterion = ruleRefs.Count();
+		dst.numCriteria = r->m_Criteria.Count();
+		for ( int j = 0; j < r->m_Criteria.Count(); j++ )
+		{
+			ruleRefs.AddToTail( criteriaMap[ r->m_Criteria[ j ] ] );
+		}
+
+		dst.firstResponse = ruleRefs.Count();
+		dst.numResponses = r->m_Responses.Count();
+		for ( int j = 0; j < r->m_Responses.Count(); j++ )
+		{
+			ruleRefs.AddToTail( groupMap[ r->m_Responses[ j ] ] );
+		}
+	}
+
+	CompiledRulesHeader_t header;
+	header.id = COMPILEDRULES_ID;
+	header.version = COMPILEDRULES_VERSION;
+	header.responseParamsSize = sizeof( AI_ResponseParams );
+	header.numScriptFiles = scriptFiles.Count();
+	header.numEnumerations = enumerations.Count();
+	header.numCriteria = criteria.Count();
+	header.numSubcriteria = subcriteria.Count();
+	header.numGroups = groups.Count();
+	header.numResponses = responses.Count();
+	header.numRules = rules.Count();
+	header.numRuleRefs = ruleRefs.Count();
+	header.numStringBytes = strings.m_Buffer.TellPut();
+
+	CUtlBuffer buf;
+	buf.Put( &header, sizeof( header ) );
+	buf.Put( scriptFiles.Base(), scriptFiles.Count() * sizeof( CompiledScriptFile_t ) );
+	buf.Put( enumerations.Base(), enumerations.Count() * sizeof( CompiledEnumeration_t ) );
+	buf.Put( criteria.Base(), criteria.Count() * sizeof( CompiledCriterion_t ) );
+	buf.Put( subcriteria.Base(), subcriteria.Count() * sizeof( int ) );
+	buf.Put( groups.Base(), groups.Count() * sizeof( CompiledResponseGroup_t ) );
+	buf.Put( responses.Base(), responses.Count() * sizeof( CompiledResponse_t ) );
+	buf.Put( rules.Base(), rules.Count() * sizeof( CompiledRule_t ) );
+	buf.Put( ruleRefs.Base(), ruleRefs.Count() * sizeof( int ) );
+	buf.Put( strings.m_Buffer.Base(), strings.m_Buffer.TellPut() );
+
+	char dir[ MAX_PATH ];
+	Q_ExtractFilePath( compiledfile, dir, sizeof( dir ) );
+	filesystem->CreateDirHierarchy( dir, "MOD" );
+	if ( !filesystem->WriteFile( compiledfile, "MOD", buf ) )
+	{
+		DevMsg( 1, "CResponseSystem:  couldn't write %s\n", compiledfile );
+	}
 }
 
 static ResponseType_t ComputeResponseType( const char *s )
@@ -2607,6 +3529,7 @@ void CResponseSystem::ParseRule( void )
 	if ( validRule )
 	{
 		m_Rules.Insert( ruleName, newRule );
+		InvalidateRuleIndex();
 	}
 	else
 	{
@@ -2804,6 +3727,7 @@ void CResponseSystem::CopyRuleFrom( Rule *pSrcRule, int iRule, CResponseSystem *
 
 	// Add rule.
 	pCustomSystem->m_Rules.Insert( m_Rules.GetElementName( iRule ), dstRule );
+	pCustomSystem->InvalidateRuleIndex();
 }
 
 //-----------------------------------------------------------------------------
@@ -254,6 +254,9 @@ void NextBotCombatCharacter::Spawn( void )
 	m_iMaxHealth = m_iHealth;
 	m_takedamage = DAMAGE_YES;
 
+	// Let players' hitscan weapons rewind us in multiplayer
+	SetLagCompensated( true );
+
 	MDLCACHE_CRITICAL_SECTION();
 	InitBoneControllers( ); 
 
@@ -6,6 +6,8 @@
 
 #include "NextBotManager.h"
 #include "NextBotInterface.h"
+#include "NextBotVisionInterface.h"
+#include "NextBotBodyInterface.h"
 
 #ifdef TERROR
 #include "ZombieBot/Infected/Infected.h"
@@ -14,6 +16,8 @@
 #endif
 
 #include "SharedFunctorUtils.h"
+#include "tier0/fasttimer.h"
+#include "tier0/vprof.h"
 //#include "../../common/blackbox_helper.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -25,6 +29,7 @@ ConVar nb_update_frequency( "nb_update_frequency", ".1", FCVAR_CHEAT );
 ConVar nb_update_framelimit( "nb_update_framelimit", ( IsDebug() ) ? "30" : "15", FCVAR_CHEAT );
 ConVar nb_update_maxslide( "nb_update_maxslide", "2", FCVAR_CHEAT );
 ConVar nb_update_debug( "nb_update_debug", "0", FCVAR_CHEAT );
+ConVar nb_parallel( "nb_parallel", "1", FCVAR_CHEAT, "Trace line of sight for the bots updating this tick on the job thread pool, ahead of their updates" );
 
 //---------------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------
@@ -391,6 +396,11 @@ void NextBotManager::Update( void )
 			nScheduled = m_botList.Count();
 		}
 
+		if ( nb_parallel.GetBool() )
+		{
+			PrepareUpdates();
+		}
+
 		if ( nb_update_debug.GetBool() )
 		{
 			int nIntentionalSliders = 0;
@@ -412,6 +422,35 @@ void NextBotManager::Update( void )
 	}
 }
 
+//---------------------------------------------------------------------------------------------
+/**
+ * Bot updates run one at a time on the main thread, since behaviors change the world as
+ * they go. The expensive part that only reads it - the line of sight traces for each bot's
+ * vision - is done here for every bot about to update, on the job thread pool. Results are
+ * cached in bot order, so the updates themselves find the same answers either way.
+ */
+void NextBotManager::PrepareUpdates( void )
+{
+	VPROF_BUDGET( "NextBotManager::PrepareUpdates", "NextBot" );
+
+	CUtlVector< INextBot * > updating;
+
+	for( int i=m_botList.Head(); i != m_botList.InvalidIndex(); i = m_botList.Next( i ) )
+	{
+		INextBot *bot = m_botList[i];
+
+		if ( IsDead( bot ) )
+			continue;
+
+		if ( m_iUpdateTickrate < 1 || bot->IsFlaggedForUpdate() )
+		{
+			updating.AddToTail( bot );
+		}
+	}
+
+	TheNextBotVisibility().PrepareLineOfSight( updating.Base(), updating.Count(), true );
+}
+
 //---------------------------------------------------------------------------------------------
 bool NextBotManager::ShouldUpdate( INextBot *bot )
 {
@@ -490,6 +529,8 @@ void NextBotManager::NotifyEndUpdate( INextBot *bot )
 void NextBotManager::OnMapLoaded( void )
 {
 	Reset();
+
+	TheNextBotVisibility().Reset();
 }
 
 
@@ -876,6 +917,92 @@ CON_COMMAND( nb_dump_debug_history, "Dumps debug history for the bot under the c
 #endif // NEED_BLACK_BOX
 
 
+#ifdef SERVER_BENCHMARKS
+//---------------------------------------------------------------------------------------------
+// Count how many of the line of sight checks the bots' vision is about to make are clear
+static int NextBotParallelBenchmark_CountClear( const CUtlVector< INextBot * > &bots, int *queries )
+{
+	int clear = 0;
+	CUtlVector< CBaseEntity * > subjects;
+
+	FOR_EACH_VEC( bots, b )
+	{
+		CBaseCombatCharacter *me = bots[b]->GetEntity();
+		IVision *vision = bots[b]->GetVisionInterface();
+		if ( me == NULL || vision == NULL )
+			continue;
+
+		vision->CollectLineOfSightSubjects( &subjects );
+
+		Vector eye = bots[b]->GetBodyInterface()->GetEyePosition();
+		FOR_EACH_VEC( subjects, it )
+		{
+			++(*queries);
+			if ( TheNextBotVisibility().IsLineOfSightClear( me, eye, subjects[ it ] ) )
+			{
+				++clear;
+			}
+		}
+	}
+
+	return clear;
+}
+
+
+//---------------------------------------------------------------------------------------------
+CON_COMMAND_F( nb_parallel_benchmark, "Times working out line of sight for every bot at once, serially and on the job thread pool. Argument is [repeats]. 'exec nb_parallel_benchmark' sets up 64 bots.", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int repeats = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 100;
+
+	CUtlVector< INextBot * > bots;
+	TheNextBots().CollectAllBots( &bots );
+	if ( bots.Count() == 0 )
+	{
+		Msg( "nb_parallel_benchmark: no bots\n" );
+		return;
+	}
+
+	NextBotVisibilityService &service = TheNextBotVisibility();
+
+	CCycleCount duration[2];
+	int queries[2] = { 0, 0 };
+	int clear[2] = { 0, 0 };
+
+	for( int mode=0; mode<2; ++mode )
+	{
+		for( int r=0; r<repeats; ++r )
+		{
+			// start from nothing cached each time
+			service.Reset();
+
+			CFastTimer timer;
+			timer.Start();
+			service.PrepareLineOfSight( bots.Base(), bots.Count(), ( mode == 1 ) );
+			timer.End();
+
+			duration[ mode ] += timer.GetDuration();
+		}
+
+		clear[ mode ] = NextBotParallelBenchmark_CountClear( bots, &queries[ mode ] );
+	}
+
+	service.Reset();
+
+	Msg( "nb_parallel_benchmark: %d bots, %d line of sight checks, %d repeats\n", bots.Count(), queries[0], repeats );
+	Msg( "  serial    %8.3f ms\n", duration[0].GetMillisecondsF() / repeats );
+	Msg( "  parallel  %8.3f ms (%.2fx)\n", duration[1].GetMillisecondsF() / repeats, duration[0].GetMillisecondsF() / MAX( duration[1].GetMillisecondsF(), 0.001 ) );
+
+	if ( queries[0] != queries[1] || clear[0] != clear[1] )
+	{
+		Warning( "nb_parallel_benchmark: FAILED, serial saw %d of %d clear, parallel %d of %d\n", clear[0], queries[0], clear[1], queries[1] );
+	}
+}
+#endif // SERVER_BENCHMARKS
+
+
 //---------------------------------------------------------------------------------------------
 void NextBotManager::CollectAllBots( CUtlVector< INextBot * > *botVector )
 {
@@ -145,6 +145,8 @@ protected:
 	int Register( INextBot *bot );
 	void UnRegister( INextBot *bot );
 
+	void PrepareUpdates( void );						// do the read-only parts of this tick's bot updates up front
+
 	CUtlLinkedList< INextBot * > m_botList;				// list of all active NextBots
 
 	int m_iUpdateTickrate;
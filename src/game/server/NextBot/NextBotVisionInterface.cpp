@@ -12,6 +12,10 @@
 #include "NextBotVisionInterface.h"
 #include "NextBotBodyInterface.h"
 #include "NextBotUtil.h"
+#include "bspfile.h"
+#include "bitvec.h"
+#include "datacache/imdlcache.h"
+#include "vstdlib/jobthread.h"
 
 #ifdef TERROR
 #include "querycache.h"
@@ -25,6 +29,8 @@
 
 ConVar nb_blind( "nb_blind", "0", FCVAR_CHEAT, "Disable vision" );
 ConVar nb_debug_known_entities( "nb_debug_known_entities", "0", FCVAR_CHEAT, "Show the 'known entities' for the bot that is the current spectator target" );
+ConVar nb_vision_service( "nb_vision_service", "1", FCVAR_CHEAT, "Share, cull and cache line of sight traces between bots and the actors they look at" );
+ConVar nb_vision_cache_ticks( "nb_vision_cache_ticks", "3", FCVAR_CHEAT, "How many ticks a line of sight result between actors is reused for", true, 1.0f, false, 0.0f );
 
 
 //------------------------------------------------------------------------------------------
@@ -330,6 +336,7 @@ public:
 	CollectVisible( IVision *vision )
 	{
 		m_vision = vision;
+		m_isRecognized.ClearAll();
 	}
 	
 	bool operator() ( CBaseEntity *entity )
@@ -341,6 +348,12 @@ public:
 			 m_vision->IsAbleToSee( entity, IVision::USE_FOV ) )
 		{
 			m_recognized.AddToTail( entity );	
+
+			int index = entity->entindex();
+			if ( index >= 0 && index < MAX_EDICTS )
+			{
+				m_isRecognized.Set( index );
+			}
 		}
 			
 		return true;
@@ -348,6 +361,12 @@ public:
 	
 	bool Contains( CBaseEntity *entity ) const
 	{
+		int index = entity->entindex();
+		if ( index >= 0 && index < MAX_EDICTS )
+		{
+			return m_isRecognized.IsBitSet( index );
+		}
+
 		for( int i=0; i < m_recognized.Count(); ++i )
 		{
 			if ( entity->entindex() == m_recognized[ i ]->entindex() )
@@ -360,9 +379,88 @@ public:
 	
 	IVision *m_vision;
 	CUtlVector< CBaseEntity * > m_recognized;
+	CBitVec< MAX_EDICTS > m_isRecognized;		// m_recognized by entity index
 };
 
 
+//------------------------------------------------------------------------------------------
+/**
+ * Pick out the potentially visible actors that pass the cheap checks, and so will
+ * need a line of sight trace
+ */
+void IVision::SelectLineOfSightSubjects( const CUtlVector< CBaseEntity * > &potentiallyVisible, CUtlVector< CBaseEntity * > *subjects ) const
+{
+	CBaseCombatCharacter *me = GetBot()->GetEntity();
+
+	FOR_EACH_VEC( potentiallyVisible, it )
+	{
+		CBaseEntity *entity = potentiallyVisible[ it ];
+
+		if ( entity &&
+			 entity->MyCombatCharacterPointer() &&
+			 entity != me &&
+			 entity->IsAlive() &&
+			 !IsIgnored( entity ) &&
+			 IsPotentiallyAbleToSee( entity, USE_FOV ) )
+		{
+			subjects->AddToTail( entity );
+		}
+	}
+}
+
+
+//------------------------------------------------------------------------------------------
+/**
+ * Populate with the actors we already know about that our next vision update is
+ * likely to need line of sight to, so it can be worked out ahead of time.
+ * This only reads what the last update left behind - CollectPotentiallyVisibleEntities()
+ * can be overridden to change state or use random numbers, so it is not called here.
+ * Actors that are new to the next update are traced by the update itself.
+ */
+void IVision::CollectLineOfSightSubjects( CUtlVector< CBaseEntity * > *subjects ) const
+{
+	subjects->RemoveAll();
+
+	if ( nb_blind.GetBool() || !nb_vision_service.GetBool() || GetBot()->GetEntity() == NULL )
+		return;
+
+	CUtlVector< CBaseEntity * > known;
+	FOR_EACH_VEC( m_knownEntityVector, it )
+	{
+		known.AddToTail( m_knownEntityVector[ it ].GetEntity() );
+	}
+
+	SelectLineOfSightSubjects( known, subjects );
+}
+
+
+//------------------------------------------------------------------------------------------
+/**
+ * Work out line of sight to every potentially visible actor that passes the cheap
+ * checks in one batch, so the IsAbleToSee() calls that follow find it cached
+ */
+void IVision::ResolveLineOfSight( const CUtlVector< CBaseEntity * > &potentiallyVisible )
+{
+	VPROF_BUDGET( "IVision::ResolveLineOfSight", "NextBot" );
+
+	CBaseCombatCharacter *me = GetBot()->GetEntity();
+	if ( me == NULL )
+		return;
+
+	CUtlVector< CBaseEntity * > subjects;
+	SelectLineOfSightSubjects( potentiallyVisible, &subjects );
+
+	if ( subjects.Count() == 0 )
+		return;
+
+	CUtlVector< bool > isClear;
+	isClear.SetCount( subjects.Count() );
+
+	Vector eye = GetBot()->GetBodyInterface()->GetEyePosition();
+	TheNextBotVisibility().IsLineOfSightClear( me, eye, subjects.Base(), subjects.Count(), isClear.Base() );
+}
+
+
 //------------------------------------------------------------------------------------------
 void IVision::UpdateKnownEntities( void )
 {
@@ -372,6 +470,11 @@ void IVision::UpdateKnownEntities( void )
 	CUtlVector< CBaseEntity * > potentiallyVisible;
 	CollectPotentiallyVisibleEntities( &potentiallyVisible );
 
+	if ( nb_vision_service.GetBool() )
+	{
+		ResolveLineOfSight( potentiallyVisible );
+	}
+
 	// collect set of visible and recognized entities at this moment
 	CollectVisible visibleNow( this );
 	FOR_EACH_VEC( potentiallyVisible, pit )
@@ -569,6 +672,24 @@ bool IVision::IsAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV,
 {
 	VPROF_BUDGET( "IVision::IsAbleToSee", "NextBotExpensive" );
 
+	if ( !IsPotentiallyAbleToSee( subject, checkFOV ) )
+	{
+		return false;
+	}
+
+	// do actual line-of-sight trace
+	if ( !IsLineOfSightClearToEntity( subject ) )
+	{
+		return false;
+	}
+
+	return IsVisibleEntityNoticed( subject );
+}
+
+
+//------------------------------------------------------------------------------------------
+bool IVision::IsPotentiallyAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV ) const
+{
 	if ( GetBot()->IsRangeGreaterThan( subject, GetMaxVisionRange() ) )
 	{
 		return false;
@@ -603,13 +724,7 @@ bool IVision::IsAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV,
 		}
 	}
 
-	// do actual line-of-sight trace
-	if ( !IsLineOfSightClearToEntity( subject ) )
-	{
-		return false;
-	}
-
-	return IsVisibleEntityNoticed( subject );
+	return true;
 }
 
 
@@ -751,6 +866,13 @@ bool IVision::IsLineOfSightClearToEntity( const CBaseEntity *subject, Vector *vi
 	// TODO: Use plain-old traces until querycache/etc gets integrated
 	VPROF_BUDGET( "IVision::IsLineOfSightClearToEntity", "NextBot" );
 
+	if ( visibleSpot == NULL && nb_vision_service.GetBool() && subject->MyCombatCharacterPointer() && GetBot()->GetEntity() )
+	{
+		// actors go through the shared service
+		Vector eye = GetBot()->GetBodyInterface()->GetEyePosition();
+		return TheNextBotVisibility().IsLineOfSightClear( GetBot()->GetEntity(), eye, const_cast< CBaseEntity * >( subject ) );
+	}
+
 	trace_t result;
 	NextBotTraceFilterIgnoreActors filter( subject, COLLISION_GROUP_NONE );
 
@@ -802,3 +924,426 @@ bool IVision::IsLookingAt( const CBaseCombatCharacter *actor, float cosTolerance
 }
 
 
+//------------------------------------------------------------------------------------------
+//------------------------------------------------------------------------------------------
+NextBotVisibilityService &TheNextBotVisibility( void )
+{
+	static NextBotVisibilityService service;
+	return service;
+}
+
+
+//------------------------------------------------------------------------------------------
+NextBotVisibilityService::NextBotVisibilityService( void )
+{
+	Reset();
+}
+
+
+//------------------------------------------------------------------------------------------
+void NextBotVisibilityService::Reset( void )
+{
+	m_lineOfSight.RemoveAll();
+	m_pending.RemoveAll();
+	m_pendingIndex.RemoveAll();
+	m_pvsCluster = -1;
+	ResetStats();
+}
+
+
+//------------------------------------------------------------------------------------------
+void NextBotVisibilityService::ResetStats( void )
+{
+	memset( &m_stats, 0, sizeof( m_stats ) );
+}
+
+
+//------------------------------------------------------------------------------------------
+void NextBotVisibilityService::DumpStats( void ) const
+{
+	int queries = MAX( m_stats.m_queries, 1 );
+
+	Msg( "NextBot line of sight: %d queries, %d pairs cached\n", m_stats.m_queries, m_lineOfSight.Count() );
+	Msg( "  cache hits       %8d (%.1f%%)\n", m_stats.m_cacheHits, 100.0f * m_stats.m_cacheHits / queries );
+	Msg( "  culled by PVS    %8d (%.1f%%)\n", m_stats.m_pvsCulled, 100.0f * m_stats.m_pvsCulled / queries );
+	Msg( "  shared eye rays  %8d\n", m_stats.m_sharedEyeRays );
+	Msg( "  traces           %8d (%.2f per query)\n", m_stats.m_traces, (float)m_stats.m_traces / queries );
+}
+
+
+//------------------------------------------------------------------------------------------
+static uint32 LineOfSightKey( CBaseEntity *looker, CBaseEntity *subject )
+{
+	return ( (uint32)looker->entindex() << 16 ) | ( (uint32)subject->entindex() & 0xFFFF );
+}
+
+
+//------------------------------------------------------------------------------------------
+bool NextBotVisibilityService::IsFresh( const LineOfSight_t &los, CBaseEntity *looker, CBaseEntity *subject ) const
+{
+	int age = gpGlobals->tickcount - los.m_tick;
+	if ( age < 0 || age >= nb_vision_cache_ticks.GetInt() )
+		return false;
+
+	// the entity indices might have been reused since
+	return los.m_looker == looker->GetRefEHandle() && los.m_subject == subject->GetRefEHandle();
+}
+
+
+//------------------------------------------------------------------------------------------
+void NextBotVisibilityService::Store( CBaseEntity *looker, CBaseEntity *subject, const LineOfSight_t &los )
+{
+	uint32 key = LineOfSightKey( looker, subject );
+	UtlHashHandle_t h = m_lineOfSight.Find( key );
+	if ( h == m_lineOfSight.InvalidHandle() )
+	{
+		m_lineOfSight.Insert( key, los );
+	}
+	else
+	{
+		m_lineOfSight.Element( h ) = los;
+	}
+}
+
+
+//------------------------------------------------------------------------------------------
+/**
+ * Return the PVS of the cluster the eye is in, or NULL if it is outside the world
+ */
+const unsigned char *NextBotVisibilityService::GetPVS( const Vector &eye )
+{
+	// a bot asks once per subject from the same spot
+	if ( m_pvsCluster >= 0 && eye == m_pvsEye )
+		return m_pvs.Base();
+
+	int cluster = engine->GetClusterForOrigin( eye );
+	if ( cluster < 0 )
+		return NULL;
+
+	if ( cluster != m_pvsCluster )
+	{
+		m_pvs.SetCount( MAX_MAP_CLUSTERS/8 );
+		engine->GetPVSForCluster( cluster, m_pvs.Count(), m_pvs.Base() );
+		m_pvsCluster = cluster;
+	}
+
+	m_pvsEye = eye;
+
+	return m_pvs.Base();
+}
+
+
+//------------------------------------------------------------------------------------------
+static bool IsVisionRayClear( const Vector &from, const Vector &to, CBaseEntity *subject )
+{
+	trace_t result;
+	NextBotTraceFilterIgnoreActors filter( subject, COLLISION_GROUP_NONE );
+
+	// not UTIL_TraceLine(), which can draw debug overlays - this runs on job threads
+	Ray_t ray;
+	ray.Init( from, to );
+	enginetrace->TraceRay( ray, MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, &filter, &result );
+
+	return ( result.fraction >= 1.0f && !result.startsolid );
+}
+
+
+//------------------------------------------------------------------------------------------
+/**
+ * Answer the query from the cache if we can, otherwise queue it up to be traced
+ */
+void NextBotVisibilityService::Gather( CBaseCombatCharacter *looker, const Vector &eye, bool isLookerSymmetric, CBaseEntity *subject, bool *isClear )
+{
+	++m_stats.m_queries;
+
+	uint32 key = LineOfSightKey( looker, subject );
+	UtlHashHandle_t h = m_lineOfSight.Find( key );
+	if ( h != m_lineOfSight.InvalidHandle() && IsFresh( m_lineOfSight.Element( h ), looker, subject ) )
+	{
+		++m_stats.m_cacheHits;
+		if ( isClear )
+		{
+			*isClear = m_lineOfSight.Element( h ).m_isClear;
+		}
+		return;
+	}
+
+	UtlHashHandle_t queued = m_pendingIndex.Find( key );
+	if ( queued != m_pendingIndex.InvalidHandle() )
+	{
+		// already asked for in this batch
+		PendingTrace_t &pending = m_pending[ m_pendingIndex.Element( queued ) ];
+		if ( isClear && pending.m_isClear == NULL )
+		{
+			pending.m_isClear = isClear;
+		}
+		return;
+	}
+
+	PendingTrace_t pending;
+	pending.m_isClear = isClear;
+	pending.m_reverse = -1;
+	pending.m_isEyeRayKnown = false;
+	pending.m_traces = 0;
+	pending.m_looker = looker;
+	pending.m_subject = subject;
+	pending.m_result.m_looker = looker->GetRefEHandle();
+	pending.m_result.m_subject = subject->GetRefEHandle();
+	pending.m_result.m_tick = gpGlobals->tickcount;
+	pending.m_result.m_isSymmetric = isLookerSymmetric;
+	pending.m_result.m_isEyeRayClear = false;
+	pending.m_result.m_isClear = false;
+
+	// nothing in a cluster we can't potentially see from here can be visible
+	const unsigned char *pvs = GetPVS( eye );
+	if ( pvs )
+	{
+		Vector mins, maxs;
+		subject->CollisionProp()->WorldSpaceSurroundingBounds( &mins, &maxs );
+		VectorMin( mins, subject->EyePosition(), mins );
+		VectorMax( maxs, subject->EyePosition(), maxs );
+
+		if ( !engine->CheckBoxInPVS( mins, maxs, pvs, m_pvs.Count() ) )
+		{
+			++m_stats.m_pvsCulled;
+			if ( isClear )
+			{
+				*isClear = false;
+			}
+			Store( looker, subject, pending.m_result );
+			return;
+		}
+	}
+
+	if ( isLookerSymmetric )
+	{
+		// if the subject has looked back at us recently, its eye ray was ours reversed
+		UtlHashHandle_t reverse = m_lineOfSight.Find( LineOfSightKey( subject, looker ) );
+		if ( reverse != m_lineOfSight.InvalidHandle() )
+		{
+			const LineOfSight_t &other = m_lineOfSight.Element( reverse );
+			if ( IsFresh( other, subject, looker ) && other.m_isSymmetric )
+			{
+				++m_stats.m_sharedEyeRays;
+				pending.m_isEyeRayKnown = true;
+				pending.m_result.m_isEyeRayClear = other.m_isEyeRayClear;
+
+				if ( other.m_isEyeRayClear )
+				{
+					pending.m_result.m_isClear = true;
+					if ( isClear )
+					{
+						*isClear = true;
+					}
+					Store( looker, subject, pending.m_result );
+					return;
+				}
+			}
+		}
+
+		// likewise if it is about to look back at us in this batch
+		UtlHashHandle_t reverseQueued = m_pendingIndex.Find( LineOfSightKey( subject, looker ) );
+		if ( !pending.m_isEyeRayKnown && reverseQueued != m_pendingIndex.InvalidHandle() )
+		{
+			int other = m_pendingIndex.Element( reverseQueued );
+			if ( m_pending[ other ].m_result.m_isSymmetric && m_pending[ other ].m_reverse < 0 && !m_pending[ other ].m_isEyeRayKnown )
+			{
+				++m_stats.m_sharedEyeRays;
+				pending.m_reverse = other;
+			}
+		}
+	}
+
+	// copy out everything the traces need, so they don't have to touch the entities
+	pending.m_eye = eye;
+	pending.m_subjectEye = subject->EyePosition();
+	pending.m_subjectCenter = subject->WorldSpaceCenter();
+	pending.m_subjectOrigin = subject->GetAbsOrigin();
+
+	m_pendingIndex.Insert( key, m_pending.AddToTail( pending ) );
+}
+
+
+//------------------------------------------------------------------------------------------
+static void PreTraceLineOfSight( void )
+{
+	mdlcache->BeginLock();
+}
+
+
+//------------------------------------------------------------------------------------------
+static void PostTraceLineOfSight( void )
+{
+	mdlcache->EndLock();
+}
+
+
+//------------------------------------------------------------------------------------------
+// May run on a job thread
+void NextBotVisibilityService::TraceEyeRay( PendingTrace_t &pending )
+{
+	if ( pending.m_isEyeRayKnown || pending.m_reverse >= 0 )
+		return;
+
+	++pending.m_traces;
+	pending.m_result.m_isEyeRayClear = IsVisionRayClear( pending.m_eye, pending.m_subjectEye, pending.m_subject );
+}
+
+
+//------------------------------------------------------------------------------------------
+// May run on a job thread
+void NextBotVisibilityService::TraceFallbackRays( PendingTrace_t &pending )
+{
+	LineOfSight_t &result = pending.m_result;
+
+	// the same fallbacks as IsLineOfSightClearToEntity()
+	if ( !result.m_isClear )
+	{
+		++pending.m_traces;
+		result.m_isClear = IsVisionRayClear( pending.m_eye, pending.m_subjectCenter, pending.m_subject );
+	}
+
+	if ( !result.m_isClear )
+	{
+		++pending.m_traces;
+		result.m_isClear = IsVisionRayClear( pending.m_eye, pending.m_subjectOrigin, pending.m_subject );
+	}
+}
+
+
+//------------------------------------------------------------------------------------------
+/**
+ * Trace everything queued up - eyes first, then fallbacks for whatever the eyes can't see -
+ * and store the results in the order they were asked for
+ */
+void NextBotVisibilityService::TracePending( bool isParallel )
+{
+	if ( m_pending.Count() )
+	{
+		if ( isParallel )
+		{
+			ParallelProcess( "NextBotVisibilityService::TraceEyeRay", m_pending.Base(), m_pending.Count(), &TraceEyeRay, &PreTraceLineOfSight, &PostTraceLineOfSight );
+		}
+		else
+		{
+			FOR_EACH_VEC( m_pending, it )
+			{
+				TraceEyeRay( m_pending[ it ] );
+			}
+		}
+
+		FOR_EACH_VEC( m_pending, it )
+		{
+			PendingTrace_t &pending = m_pending[ it ];
+			if ( pending.m_reverse >= 0 )
+			{
+				pending.m_result.m_isEyeRayClear = m_pending[ pending.m_reverse ].m_result.m_isEyeRayClear;
+			}
+			pending.m_result.m_isClear = pending.m_result.m_isEyeRayClear;
+		}
+
+		if ( isParallel )
+		{
+			ParallelProcess( "NextBotVisibilityService::TraceFallbackRays", m_pending.Base(), m_pending.Count(), &TraceFallbackRays, &PreTraceLineOfSight, &PostTraceLineOfSight );
+		}
+		else
+		{
+			FOR_EACH_VEC( m_pending, it )
+			{
+				TraceFallbackRays( m_pending[ it ] );
+			}
+		}
+
+		FOR_EACH_VEC( m_pending, it )
+		{
+			PendingTrace_t &pending = m_pending[ it ];
+
+			m_stats.m_traces += pending.m_traces;
+
+			if ( pending.m_isClear )
+			{
+				*pending.m_isClear = pending.m_result.m_isClear;
+			}
+
+			Store( pending.m_looker, pending.m_subject, pending.m_result );
+		}
+	}
+
+	m_pending.RemoveAll();
+	m_pendingIndex.RemoveAll();
+}
+
+
+//------------------------------------------------------------------------------------------
+void NextBotVisibilityService::IsLineOfSightClear( CBaseCombatCharacter *looker, const Vector &eye, CBaseEntity **subjects, int count, bool *isClear )
+{
+	VPROF_BUDGET( "NextBotVisibilityService::IsLineOfSightClear", "NextBot" );
+
+	if ( count <= 0 )
+		return;
+
+	bool isLookerSymmetric = VectorsAreEqual( eye, looker->EyePosition(), 0.1f );
+
+	for( int i=0; i<count; ++i )
+	{
+		Gather( looker, eye, isLookerSymmetric, subjects[i], &isClear[i] );
+	}
+
+	TracePending( false );
+}
+
+
+//------------------------------------------------------------------------------------------
+void NextBotVisibilityService::PrepareLineOfSight( INextBot **bots, int count, bool isParallel )
+{
+	VPROF_BUDGET( "NextBotVisibilityService::PrepareLineOfSight", "NextBot" );
+
+	CUtlVector< CBaseEntity * > subjects;
+
+	for( int b=0; b<count; ++b )
+	{
+		CBaseCombatCharacter *me = bots[b]->GetEntity();
+		IVision *vision = bots[b]->GetVisionInterface();
+		if ( me == NULL || vision == NULL )
+			continue;
+
+		vision->CollectLineOfSightSubjects( &subjects );
+		if ( subjects.Count() == 0 )
+			continue;
+
+		Vector eye = bots[b]->GetBodyInterface()->GetEyePosition();
+		bool isLookerSymmetric = VectorsAreEqual( eye, me->EyePosition(), 0.1f );
+
+		FOR_EACH_VEC( subjects, it )
+		{
+			Gather( me, eye, isLookerSymmetric, subjects[ it ], NULL );
+		}
+	}
+
+	TracePending( isParallel );
+}
+
+
+//------------------------------------------------------------------------------------------
+bool NextBotVisibilityService::IsLineOfSightClear( CBaseCombatCharacter *looker, const Vector &eye, CBaseEntity *subject )
+{
+	bool isClear = false;
+	IsLineOfSightClear( looker, eye, &subject, 1, &isClear );
+	return isClear;
+}
+
+
+//------------------------------------------------------------------------------------------
+CON_COMMAND_F( nb_vision_stats, "Show how bot line of sight queries have been answered. 'nb_vision_stats reset' clears the counts.", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		TheNextBotVisibility().ResetStats();
+		return;
+	}
+
+	TheNextBotVisibility().DumpStats();
+}
@@ -8,6 +8,7 @@
 
 #include "NextBotComponentInterface.h"
 #include "NextBotKnownEntity.h"
+#include "utlhashtable.h"
 
 class IBody;
 class INextBotEntityFilter;
@@ -84,6 +85,10 @@ public:
 	virtual bool IsAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV, Vector *visibleSpot = NULL ) const;
 	virtual bool IsAbleToSee( const Vector &pos, FieldOfViewCheckType checkFOV ) const;
 
+	// the range, fog, FOV and nav visibility checks IsAbleToSee() makes before tracing line of sight
+	bool IsPotentiallyAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV ) const;
+	void CollectLineOfSightSubjects( CUtlVector< CBaseEntity * > *subjects ) const;	// populate with the known actors our next update is likely to trace line of sight to
+
 	virtual bool IsIgnored( CBaseEntity *subject ) const;		// return true to completely ignore this entity (may not be in sight when this is called)
 	virtual bool IsVisibleEntityNoticed( CBaseEntity *subject ) const;		// return true if we 'notice' the subject, even though we have LOS to it
 
@@ -116,6 +121,8 @@ private:
 	
 	CUtlVector< CKnownEntity > m_knownEntityVector;		// the set of enemies/friends we are aware of
 	void UpdateKnownEntities( void );
+	void SelectLineOfSightSubjects( const CUtlVector< CBaseEntity * > &potentiallyVisible, CUtlVector< CBaseEntity * > *subjects ) const;
+	void ResolveLineOfSight( const CUtlVector< CBaseEntity * > &potentiallyVisible );
 	bool IsAwareOf( const CKnownEntity &known ) const;	// return true if our reaction time has passed for this entity
 	mutable CHandle< CBaseEntity > m_primaryThreat;
 
@@ -223,4 +230,97 @@ inline float IVision::GetMinRecognizeTime( void ) const
 }
 
 
+//----------------------------------------------------------------------------------------------------------------
+/**
+ * Line of sight between actors, shared by the vision of every bot.
+ * Vision rays pass through all combat characters, so a ray between two of them only
+ * depends on its end points. Subjects outside the looker's PVS are culled without a
+ * trace, the eye to eye ray of a pair is traced once for both directions, and results
+ * are reused for nb_vision_cache_ticks ticks.
+ */
+class NextBotVisibilityService
+{
+public:
+	NextBotVisibilityService( void );
+
+	void Reset( void );				// forget everything, for a new map
+
+	/**
+	 * Set isClear[i] to whether the line of sight from the looker's eye to subjects[i] is clear.
+	 * Subjects must be combat characters. Anything not cached is traced together at the end.
+	 */
+	void IsLineOfSightClear( CBaseCombatCharacter *looker, const Vector &eye, CBaseEntity **subjects, int count, bool *isClear );
+	bool IsLineOfSightClear( CBaseCombatCharacter *looker, const Vector &eye, CBaseEntity *subject );
+
+	/**
+	 * Work out line of sight to the actors the given bots already know about, so their next
+	 * vision updates are likely to find it cached. The traces are made from where everyone is
+	 * before any of the bots update, and are reused like any other cached result. With isParallel
+	 * the traces run on the job thread pool, but results are always stored in bot order on the
+	 * calling thread.
+	 */
+	void PrepareLineOfSight( INextBot **bots, int count, bool isParallel );
+
+	void DumpStats( void ) const;
+	void ResetStats( void );
+
+private:
+	struct LineOfSight_t
+	{
+		CBaseHandle m_looker;
+		CBaseHandle m_subject;
+		int m_tick;
+		bool m_isSymmetric;			// the eye ray went from the looker's EyePosition(), so it is also the reverse ray
+		bool m_isEyeRayClear;
+		bool m_isClear;
+	};
+
+	// everything a trace needs is copied in here first, so it can run on any thread
+	struct PendingTrace_t
+	{
+		bool *m_isClear;			// where the answer goes, or NULL if only the cache wants it
+		int m_reverse;				// pending trace the other way that traces our eye ray, or -1
+		bool m_isEyeRayKnown;
+		int m_traces;
+		CBaseEntity *m_looker;
+		CBaseEntity *m_subject;
+		Vector m_eye;
+		Vector m_subjectEye;
+		Vector m_subjectCenter;
+		Vector m_subjectOrigin;
+		LineOfSight_t m_result;
+	};
+
+	bool IsFresh( const LineOfSight_t &los, CBaseEntity *looker, CBaseEntity *subject ) const;
+	void Store( CBaseEntity *looker, CBaseEntity *subject, const LineOfSight_t &los );
+	const unsigned char *GetPVS( const Vector &eye );
+
+	void Gather( CBaseCombatCharacter *looker, const Vector &eye, bool isLookerSymmetric, CBaseEntity *subject, bool *isClear );
+	void TracePending( bool isParallel );
+
+	static void TraceEyeRay( PendingTrace_t &pending );
+	static void TraceFallbackRays( PendingTrace_t &pending );
+
+	CUtlHashtable< uint32, LineOfSight_t > m_lineOfSight;	// by looker and subject entity index
+	CUtlVector< PendingTrace_t > m_pending;
+	CUtlHashtable< uint32, int > m_pendingIndex;			// m_pending by looker and subject entity index
+
+	Vector m_pvsEye;				// last eye position GetPVS() was asked about
+	int m_pvsCluster;				// cluster m_pvs is for
+	CUtlVector< unsigned char > m_pvs;
+
+	struct Stats_t
+	{
+		int m_queries;
+		int m_cacheHits;
+		int m_pvsCulled;
+		int m_sharedEyeRays;
+		int m_traces;
+	};
+	Stats_t m_stats;
+};
+
+extern NextBotVisibilityService &TheNextBotVisibility( void );
+
+
 #endif // _NEXT_BOT_VISION_INTERFACE_H_
@@ -6809,6 +6809,9 @@ void CAI_BaseNPC::NPCInit ( void )
 
 	SetBlocksLOS( false );
 
+	// Let players' hitscan weapons rewind us in multiplayer
+	SetLagCompensated( true );
+
 	SetGravity(1.0);	// Don't change
 	m_takedamage		= DAMAGE_YES;
 	GetMotor()->SetIdealYaw( GetLocalAngles().y );
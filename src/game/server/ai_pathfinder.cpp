@@ -21,6 +21,7 @@
 #include "ai_dynamiclink.h"
 #include "ai_hint.h"
 #include "bitstring.h"
+#include "vstdlib/random.h"
 
 //@todo: bad dependency!
 #include "ai_navigator.h"
@@ -272,14 +273,183 @@ int CAI_Pathfinder::NearestNodeToPoint( const Vector &vecOrigin )
 	return GetNetwork()->NearestNodeToPoint( GetOuter(), vecOrigin );
 }
 
+//-----------------------------------------------------------------------------
+// CAI_PathfindScratch
+//
+// Purpose: Reusable working set for FindBestPath. Per-node state is stamped
+//			with the id of the search that last touched it, so nothing has to
+//			be cleared across the whole network between searches. The open
+//			list is an indexed binary heap ordered on (F, node id), which pops
+//			nodes in exactly the order the old linear scan picked them.
+//-----------------------------------------------------------------------------
+
+class CAI_PathfindScratch
+{
+public:
+	CAI_PathfindScratch()
+	 :	m_iSearch( 0 )
+	{
+	}
+
+	void BeginSearch( int nNodes )
+	{
+		int nOldNodes = m_NodeState.Count();
+		if ( nOldNodes < nNodes )
+		{
+			m_NodeState.AddMultipleToTail( nNodes - nOldNodes );
+			m_NodeParent.AddMultipleToTail( nNodes - nOldNodes );
+			for ( int i = nOldNodes; i < nNodes; i++ )
+			{
+				m_NodeState[i].iSearch = 0;
+			}
+		}
+
+		m_Heap.RemoveAll();
+
+		if ( ++m_iSearch == 0 )
+		{
+			// Search id wrapped, every stamp is suspect
+			for ( int i = 0; i < m_NodeState.Count(); i++ )
+			{
+				m_NodeState[i].iSearch = 0;
+			}
+			m_iSearch = 1;
+		}
+	}
+
+	// Lazily resets a node the first time the current search sees it
+	void Touch( int node )
+	{
+		NodeState_t &state = m_NodeState[node];
+		if ( state.iSearch != m_iSearch )
+		{
+			state.iSearch	 = m_iSearch;
+			state.g			 = FLT_MAX;
+			state.f			 = FLT_MAX;
+			state.iHeapIndex = -1;
+			state.bClosed	 = false;
+			m_NodeParent[node] = NO_NODE;
+		}
+	}
+
+	bool	IsClosed( int node ) const	{ return ( m_NodeState[node].iSearch == m_iSearch && m_NodeState[node].bClosed ); }
+	float	GetG( int node ) const		{ return ( m_NodeState[node].iSearch == m_iSearch ) ? m_NodeState[node].g : FLT_MAX; }
+
+	// Node must have been touched
+	void Set( int node, int parent, float g, float f )
+	{
+		NodeState_t &state = m_NodeState[node];
+		m_NodeParent[node] = parent;
+		state.g = g;
+		state.f = f;
+		state.bClosed = true;
+
+		if ( state.iHeapIndex == -1 )
+		{
+			state.iHeapIndex = m_Heap.AddToTail( node );
+			SiftUp( state.iHeapIndex );
+		}
+		else
+		{
+			SiftUp( state.iHeapIndex );
+			SiftDown( state.iHeapIndex );
+		}
+	}
+
+	bool IsOpenEmpty() const	{ return ( m_Heap.Count() == 0 ); }
+
+	int PopSmallest()
+	{
+		int node = m_Heap[0];
+		m_NodeState[node].iHeapIndex = -1;
+
+		int last = m_Heap.Tail();
+		m_Heap.RemoveMultipleFromTail( 1 );
+		if ( m_Heap.Count() )
+		{
+			m_Heap[0] = last;
+			m_NodeState[last].iHeapIndex = 0;
+			SiftDown( 0 );
+		}
+		return node;
+	}
+
+	int *GetParents()	{ return m_NodeParent.Base(); }
+
+private:
+	struct NodeState_t
+	{
+		unsigned	iSearch;
+		float		g;
+		float		f;
+		int			iHeapIndex;
+		bool		bClosed;
+	};
+
+	// Ties go to the lower node id, as they did in CAI_Network::FindBSSmallest
+	bool IsLess( int a, int b ) const
+	{
+		float fa = m_NodeState[a].f;
+		float fb = m_NodeState[b].f;
+		return ( fa < fb || ( fa == fb && a < b ) );
+	}
+
+	void SwapHeap( int i, int j )
+	{
+		int a = m_Heap[i];
+		int b = m_Heap[j];
+		m_Heap[i] = b;
+		m_Heap[j] = a;
+		m_NodeState[b].iHeapIndex = i;
+		m_NodeState[a].iHeapIndex = j;
+	}
+
+	void SiftUp( int i )
+	{
+		while ( i > 0 )
+		{
+			int parent = ( i - 1 ) >> 1;
+			if ( !IsLess( m_Heap[i], m_Heap[parent] ) )
+				break;
+			SwapHeap( i, parent );
+			i = parent;
+		}
+	}
+
+	void SiftDown( int i )
+	{
+		int nCount = m_Heap.Count();
+		for (;;)
+		{
+			int child = ( i << 1 ) + 1;
+			if ( child >= nCount )
+				break;
+			if ( child + 1 < nCount && IsLess( m_Heap[child + 1], m_Heap[child] ) )
+				child++;
+			if ( !IsLess( m_Heap[child], m_Heap[i] ) )
+				break;
+			SwapHeap( i, child );
+			i = child;
+		}
+	}
+
+	unsigned				m_iSearch;
+	CUtlVector<NodeState_t>	m_NodeState;
+	CUtlVector<int>			m_NodeParent;
+	CUtlVector<int>			m_Heap;
+};
+
+// Pathfinding happens on the main thread; anyone else gets a private scratch
+static CAI_PathfindScratch g_AI_PathfindScratch;
+
 //-----------------------------------------------------------------------------
 // Purpose: Build a path between two nodes
 //-----------------------------------------------------------------------------
 
-AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID) 
+AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 {
 	AI_PROFILE_SCOPE( CAI_Pathfinder_FindBestPath );
-	
+
 	if ( !GetNetwork()->NumNodes() )
 		return NULL;
 
@@ -290,6 +460,185 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	int nNodes = GetNetwork()->NumNodes();
 	CAI_Node **pAInode = GetNetwork()->AccessNodes();
 
+	CAI_PathfindScratch threadScratch;
+	CAI_PathfindScratch &scratch = ( ThreadInMainThread() ) ? g_AI_PathfindScratch : threadScratch;
+
+	// ------------- INITIALIZE ------------------------
+	scratch.BeginSearch( nNodes );
+
+	float startH = 0.1*(pAInode[startID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length(); // Don't want to over estimate
+
+	scratch.Touch( startID );
+	scratch.Set( startID, NO_NODE, 0, startH );
+
+	// --------------- FIND BEST PATH ------------------
+	while ( !scratch.IsOpenEmpty() )
+	{
+		int smallestID = scratch.PopSmallest();
+
+		CAI_Node *pSmallestNode = pAInode[smallestID];
+
+		if (GetOuter()->IsUnusableNode(smallestID, pSmallestNode->GetHint()))
+			continue;
+
+		if (smallestID == endID)
+		{
+			AI_Waypoint_t* route = MakeRouteFromParents(scratch.GetParents(), endID);
+			return route;
+		}
+
+		float smallestG = scratch.GetG( smallestID );
+
+		// Check this if the node is immediately in the path after the startNode
+		// that it isn't blocked
+		for (int link=0; link < pSmallestNode->NumLinks();link++)
+		{
+			CAI_Link *nodeLink = pSmallestNode->GetLinkByIndex(link);
+
+			if (!IsLinkUsable(nodeLink,smallestID))
+				continue;
+
+			// FIXME: the cost function should take into account Node costs (danger, flanking, etc).
+			int moveType = nodeLink->m_iAcceptedMoveTypes[GetHullType()] & CapabilitiesGet();
+			int testID	 = nodeLink->DestNodeID(smallestID);
+
+			Vector r1 = pSmallestNode->GetPosition(GetHullType());
+			Vector r2 = pAInode[testID]->GetPosition(GetHullType());
+			float dist   = GetOuter()->GetNavigator()->MovementCost( moveType, r1, r2 ); // MovementCost takes ref parameters!!
+
+			if ( dist == FLT_MAX )
+				continue;
+
+			float new_g  = smallestG + dist;
+
+			if ( !scratch.IsClosed(testID) || (new_g < scratch.GetG(testID)) )
+			{
+				float new_h = (pAInode[testID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length();
+
+				scratch.Touch( testID );
+				scratch.Set( testID, smallestID, new_g, new_g + new_h );
+			}
+		}
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Times FindBestPath against the old linear scan on the same set of
+//			random node pairs, and checks that both produce the same routes
+//-----------------------------------------------------------------------------
+
+static bool AI_RoutesMatch( AI_Waypoint_t *pRouteA, AI_Waypoint_t *pRouteB )
+{
+	while ( pRouteA && pRouteB )
+	{
+		if ( pRouteA->iNodeID != pRouteB->iNodeID )
+			return false;
+		pRouteA = pRouteA->GetNext();
+		pRouteB = pRouteB->GetNext();
+	}
+	return ( pRouteA == pRouteB );
+}
+
+void CC_AI_PathfindBench( const CCommand &args )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	// Use the first selected NPC, otherwise the first NPC there is
+	CAI_BaseNPC *pNPC = gEntList.NextEntByClass( (CAI_BaseNPC *)NULL );
+	for ( CAI_BaseNPC *pTest = pNPC; pTest; pTest = gEntList.NextEntByClass( pTest ) )
+	{
+		if ( pTest->m_debugOverlays & OVERLAY_NPC_SELECTED_BIT )
+		{
+			pNPC = pTest;
+			break;
+		}
+	}
+
+	if ( !pNPC || !pNPC->GetPathfinder() || !pNPC->GetPathfinder()->GetNetwork() )
+	{
+		Msg( "ai_pathfind_bench: no NPC to path with\n" );
+		return;
+	}
+
+	CAI_Pathfinder *pPathfinder = pNPC->GetPathfinder();
+	int nNodes = pPathfinder->GetNetwork()->NumNodes();
+	if ( nNodes < 2 )
+	{
+		Msg( "ai_pathfind_bench: network has too few nodes\n" );
+		return;
+	}
+
+	int nSearches = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 1000;
+
+	CUtlVector<int> pairs;
+	pairs.SetCount( nSearches * 2 );
+
+	CUniformRandomStream randomStream;
+	randomStream.SetSeed( 0x5f3759df );
+	for ( int i = 0; i < pairs.Count(); i++ )
+	{
+		pairs[i] = randomStream.RandomInt( 0, nNodes - 1 );
+	}
+
+	int nFound = 0;
+	int nMismatched = 0;
+
+	float flStart = Plat_FloatTime();
+	for ( int i = 0; i < nSearches; i++ )
+	{
+		AI_Waypoint_t *pRoute = pPathfinder->FindBestPathLinearScan( pairs[i*2], pairs[i*2+1] );
+		DeleteAll( pRoute );
+	}
+	float flLinearTime = Plat_FloatTime() - flStart;
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nSearches; i++ )
+	{
+		AI_Waypoint_t *pRoute = pPathfinder->FindBestPath( pairs[i*2], pairs[i*2+1] );
+		if ( pRoute )
+			nFound++;
+		DeleteAll( pRoute );
+	}
+	float flHeapTime = Plat_FloatTime() - flStart;
+
+	// Verify outside of the timed loops
+	for ( int i = 0; i < nSearches; i++ )
+	{
+		AI_Waypoint_t *pLinearRoute = pPathfinder->FindBestPathLinearScan( pairs[i*2], pairs[i*2+1] );
+		AI_Waypoint_t *pHeapRoute = pPathfinder->FindBestPath( pairs[i*2], pairs[i*2+1] );
+		if ( !AI_RoutesMatch( pLinearRoute, pHeapRoute ) )
+			nMismatched++;
+		DeleteAll( pLinearRoute );
+		DeleteAll( pHeapRoute );
+	}
+
+	Msg( "ai_pathfind_bench: %s, %d nodes, %d searches (%d routes found)\n", pNPC->GetClassname(), nNodes, nSearches, nFound );
+	Msg( "  linear scan : %8.3f ms total, %10.1f searches/sec\n", flLinearTime * 1000.0f, ( flLinearTime > 0 ) ? nSearches / flLinearTime : 0.0f );
+	Msg( "  binary heap : %8.3f ms total, %10.1f searches/sec\n", flHeapTime * 1000.0f, ( flHeapTime > 0 ) ? nSearches / flHeapTime : 0.0f );
+	if ( nMismatched )
+	{
+		Warning( "  %d of %d routes differ between the two searches!\n", nMismatched, nSearches );
+	}
+}
+static ConCommand ai_pathfind_bench("ai_pathfind_bench", CC_AI_PathfindBench, "Times node graph pathfinding with the binary heap open list against the old linear scan, using the selected NPC (or the first NPC).\n\tArguments:	[number of searches]", FCVAR_CHEAT);
+
+//-----------------------------------------------------------------------------
+// Purpose: Build a path between two nodes by scanning every node for the
+//			next open one. O(N^2) in the node count; only used as the baseline
+//			for ai_pathfind_bench.
+//-----------------------------------------------------------------------------
+
+AI_Waypoint_t *CAI_Pathfinder::FindBestPathLinearScan(int startID, int endID) 
+{
+	if ( !GetNetwork()->NumNodes() )
+		return NULL;
+
+	int nNodes = GetNetwork()->NumNodes();
+	CAI_Node **pAInode = GetNetwork()->AccessNodes();
+
 	CVarBitVec	openBS(nNodes);
 	CVarBitVec	closeBS(nNodes);
 
@@ -21,6 +21,7 @@ struct AI_Waypoint_t;
 class CAI_Link;
 class CAI_Network;
 class CAI_Node;
+class CCommand;
 
 
 //-----------------------------------------------------------------------------
@@ -106,6 +107,12 @@ protected:
 
 private:
 	friend class CPathfindNearestNodeFilter;
+	friend void CC_AI_PathfindBench( const CCommand &args );
+
+	//---------------------------------
+
+	// The original open-list scan, kept as the reference for ai_pathfind_bench
+	AI_Waypoint_t*	FindBestPathLinearScan(int startID, int endID);
 
 	//---------------------------------
 
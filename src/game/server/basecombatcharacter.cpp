@@ -38,6 +38,7 @@
 #include "rumble_shared.h"
 #include "saverestoretypes.h"
 #include "nav_mesh.h"
+#include "ilagcompensationmanager.h"
 
 #ifdef TF_DLL
 #include "nav_mesh/tf_nav_area.h"
@@ -748,6 +749,8 @@ CBaseCombatCharacter::CBaseCombatCharacter( void )
 
 	m_bForceServerRagdoll = ai_force_serverside_ragdoll.GetBool();
 
+	m_bLagCompensated = false;
+
 #ifdef GLOWS_ENABLE
 	m_bGlowEnabled.Set( false );
 #endif // GLOWS_ENABLE
@@ -859,10 +862,33 @@ void CBaseCombatCharacter::UpdateOnRemove( void )
 	RemoveGlowEffect();
 #endif // GLOWS_ENABLE
 
+	SetLagCompensated( false );
+
 	// Chain at end to mimic destructor unwind order
 	BaseClass::UpdateOnRemove();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Opt a non-player character in or out of lag compensation, so
+//			players' hitscan weapons see it where it was on their screen.
+//			Players are always lag compensated.
+//-----------------------------------------------------------------------------
+void CBaseCombatCharacter::SetLagCompensated( bool bLagCompensated )
+{
+	if ( IsPlayer() || bLagCompensated == m_bLagCompensated )
+		return;
+
+	m_bLagCompensated = bLagCompensated;
+	if ( bLagCompensated )
+	{
+		lagcompensation->AddAdditionalEntity( this );
+	}
+	else
+	{
+		lagcompensation->RemoveAdditionalEntity( this );
+	}
+}
+
 
 //=========================================================
 // CorpseGib - create some gore and get rid of a character's
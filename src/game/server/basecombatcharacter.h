@@ -400,6 +400,10 @@ public:
 
 	bool				m_bForceServerRagdoll;
 
+	// Lag compensation for non-player characters, see player_lagcompensation.cpp
+	void				SetLagCompensated( bool bLagCompensated );
+	bool				IsLagCompensated() const { return m_bLagCompensated; }
+
 	// Pickup prevention
 	bool				IsAllowedToPickupWeapons( void ) { return !m_bPreventWeaponPickup; }
 	void				SetPreventWeaponPickup( bool bPrevent ) { m_bPreventWeaponPickup = bPrevent; }
@@ -513,6 +517,8 @@ private:
 	// cached off as the CurrentWeaponProficiency.
 	WeaponProficiency_t m_CurrentWeaponProficiency;
 
+	bool				m_bLagCompensated;		// registered with the lag compensation manager
+
 	// ---------------
 	//  Relationships
 	// ---------------
@@ -61,6 +61,7 @@
 #include "ModelSoundsCache.h"
 #include "env_debughistory.h"
 #include "tier1/utlstring.h"
+#include "utlhash.h"
 #include "utlhashtable.h"
 #include "vscript_server.h"
 
@@ -703,6 +704,13 @@ CBaseEntity *CBaseEntity::GetFollowedEntity()
 void CBaseEntity::SetClassname( const char *className )
 {
 	m_iClassname = AllocPooledString( className );
+	gEntList.UpdateEntityLookup( this );
+}
+
+void CBaseEntity::SetName( string_t newName )
+{
+	m_iName = newName;
+	gEntList.UpdateEntityLookup( this );
 }
 
 void CBaseEntity::SetModelIndex( int index )
@@ -3702,6 +3710,8 @@ int CBaseEntity::Restore( IRestore &restore )
 		m_hGroundEntity->AddEntityToGroundList( this );
 	}
 
+	gEntList.UpdateEntityLookup( this );
+
 	return status;
 }
 
@@ -4337,6 +4347,69 @@ void CBaseEntity::OnEntityEvent( EntityEvent_t event, void *pEventData )
 ConVar ent_messages_draw( "ent_messages_draw", "0", FCVAR_CHEAT, "Visualizes all entity input/output activity." );
 
 
+//-----------------------------------------------------------------------------
+// Input dispatch. Input names are interned without regard to case, matching the
+// Q_stricmp that used to find them, and each datamap gets a hash from those
+// symbols to the input descriptions in it and its base maps the first time an
+// entity using it accepts an input. Only the datamaps add names to the table;
+// names fired at entities are just looked up, so bad map I/O can't grow it.
+//-----------------------------------------------------------------------------
+static CUtlSymbolTable s_InputSymbols( 0, 256, true );
+
+struct inputdispatch_t
+{
+	CUtlHashFast< typedescription_t *, CUtlHashFastGenericHash > m_Inputs;
+};
+
+// returns an invalid symbol for names that aren't in any input dispatch table yet
+static CUtlSymbol GetInputSymbol( const char *szInputName )
+{
+	if ( !szInputName )
+		return CUtlSymbol();
+
+	return s_InputSymbols.Find( szInputName );
+}
+
+static inputdispatch_t *GetInputDispatch( datamap_t *pMap )
+{
+	if ( pMap->inputDispatch )
+		return pMap->inputDispatch;
+
+	int nInputs = 0;
+	for ( datamap_t *dmap = pMap; dmap != NULL; dmap = dmap->baseMap )
+	{
+		for ( int i = 0; i < dmap->dataNumFields; i++ )
+		{
+			if ( ( dmap->dataDesc[i].flags & FTYPEDESC_INPUT ) && dmap->dataDesc[i].externalName )
+			{
+				nInputs++;
+			}
+		}
+	}
+
+	inputdispatch_t *pDispatch = new inputdispatch_t;
+	pDispatch->m_Inputs.Init( SmallestPowerOfTwoGreaterOrEqual( MAX( nInputs, 1 ) ) );
+
+	// the most derived map comes first, and the first input by a name is the one that's used
+	for ( datamap_t *dmap = pMap; dmap != NULL; dmap = dmap->baseMap )
+	{
+		for ( int i = 0; i < dmap->dataNumFields; i++ )
+		{
+			if ( ( dmap->dataDesc[i].flags & FTYPEDESC_INPUT ) && dmap->dataDesc[i].externalName )
+			{
+				CUtlSymbol sym = s_InputSymbols.AddString( dmap->dataDesc[i].externalName );
+				if ( pDispatch->m_Inputs.Find( sym ) == pDispatch->m_Inputs.InvalidHandle() )
+				{
+					pDispatch->m_Inputs.Insert( sym, &dmap->dataDesc[i] );
+				}
+			}
+		}
+	}
+
+	pMap->inputDispatch = pDispatch;
+	return pDispatch;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: calls the appropriate message mapped function in the entity according
 //			to the fired action.
@@ -4359,119 +4432,111 @@ bool CBaseEntity::AcceptInput( const char *szInputName, CBaseEntity *pActivator,
 		NDebugOverlay::Box( GetAbsOrigin(), Vector(-4, -4, -4), Vector(4, 4, 4), 0, 255, 0, 0, 3 );
 	}
 
-	// loop through the data description list, restoring each data desc block
-	for ( datamap_t *dmap = GetDataDescMap(); dmap != NULL; dmap = dmap->baseMap )
+	// build the table first, so every name it accepts has a symbol
+	inputdispatch_t *pDispatch = GetInputDispatch( GetDataDescMap() );
+	UtlHashFastHandle_t hInput = pDispatch->m_Inputs.Find( GetInputSymbol( szInputName ) );
+	if ( hInput == pDispatch->m_Inputs.InvalidHandle() )
 	{
-		// search through all the actions in the data description, looking for a match
-		for ( int i = 0; i < dmap->dataNumFields; i++ )
-		{
-			if ( dmap->dataDesc[i].flags & FTYPEDESC_INPUT )
-			{
-				if ( !Q_stricmp(dmap->dataDesc[i].externalName, szInputName) )
-				{
-					// found a match
-
-					char szBuffer[256];
-					// mapper debug message
-					if (pCaller != NULL)
-					{
-						Q_snprintf( szBuffer, sizeof(szBuffer), "(%0.2f) input %s: %s.%s(%s)\n", gpGlobals->curtime, STRING(pCaller->m_iName), GetDebugName(), szInputName, Value.String() );
-					}
-					else
-					{
-						Q_snprintf( szBuffer, sizeof(szBuffer), "(%0.2f) input <NULL>: %s.%s(%s)\n", gpGlobals->curtime, GetDebugName(), szInputName, Value.String() );
-					}
-					DevMsg( 2, "%s", szBuffer );
-					ADD_DEBUG_HISTORY( HISTORY_ENTITY_IO, szBuffer );
+		DevMsg( 2, "unhandled input: (%s) -> (%s,%s)\n", szInputName, STRING(m_iClassname), GetDebugName()/*,", from (%s,%s)" STRING(pCaller->m_iClassname), STRING(pCaller->m_iName)*/ );
+		return false;
+	}
 
-					if (m_debugOverlays & OVERLAY_MESSAGE_BIT)
-					{
-						DrawInputOverlay(szInputName,pCaller,Value);
-					}
+	typedescription_t *pDesc = pDispatch->m_Inputs.Element( hInput );
 
-					// convert the value if necessary
-					if ( Value.FieldType() != dmap->dataDesc[i].fieldType )
-					{
-						if ( !(Value.FieldType() == FIELD_VOID && dmap->dataDesc[i].fieldType == FIELD_STRING) ) // allow empty strings
-						{
-							if ( !Value.Convert( (fieldtype_t)dmap->dataDesc[i].fieldType ) )
-							{
-								// bad conversion
-								Warning( "!! ERROR: bad input/output link:\n!! %s(%s,%s) doesn't match type from %s(%s)\n", 
-									STRING(m_iClassname), GetDebugName(), szInputName, 
-									( pCaller != NULL ) ? STRING(pCaller->m_iClassname) : "<null>",
-									( pCaller != NULL ) ? STRING(pCaller->m_iName) : "<null>" );
-								return false;
-							}
-						}
-					}
+	char szBuffer[256];
+	// mapper debug message
+	if (pCaller != NULL)
+	{
+		Q_snprintf( szBuffer, sizeof(szBuffer), "(%0.2f) input %s: %s.%s(%s)\n", gpGlobals->curtime, STRING(pCaller->m_iName), GetDebugName(), szInputName, Value.String() );
+	}
+	else
+	{
+		Q_snprintf( szBuffer, sizeof(szBuffer), "(%0.2f) input <NULL>: %s.%s(%s)\n", gpGlobals->curtime, GetDebugName(), szInputName, Value.String() );
+	}
+	DevMsg( 2, "%s", szBuffer );
+	ADD_DEBUG_HISTORY( HISTORY_ENTITY_IO, szBuffer );
 
-					// call the input handler, or if there is none just set the value
-					inputfunc_t pfnInput = dmap->dataDesc[i].inputFunc;
+	if (m_debugOverlays & OVERLAY_MESSAGE_BIT)
+	{
+		DrawInputOverlay(szInputName,pCaller,Value);
+	}
 
-					if ( pfnInput )
-					{ 
-						// Package the data into a struct for passing to the input handler.
-						inputdata_t data;
-						data.pActivator = pActivator;
-						data.pCaller = pCaller;
-						data.value = Value;
-						data.nOutputID = outputID;
+	// convert the value if necessary
+	if ( Value.FieldType() != pDesc->fieldType )
+	{
+		if ( !(Value.FieldType() == FIELD_VOID && pDesc->fieldType == FIELD_STRING) ) // allow empty strings
+		{
+			if ( !Value.Convert( (fieldtype_t)pDesc->fieldType ) )
+			{
+				// bad conversion
+				Warning( "!! ERROR: bad input/output link:\n!! %s(%s,%s) doesn't match type from %s(%s)\n", 
+					STRING(m_iClassname), GetDebugName(), szInputName, 
+					( pCaller != NULL ) ? STRING(pCaller->m_iClassname) : "<null>",
+					( pCaller != NULL ) ? STRING(pCaller->m_iName) : "<null>" );
+				return false;
+			}
+		}
+	}
 
-						// Now, see if there's a function named Input<Name of Input> in this entity's script file. 
-						// If so, execute it and let it decide whether to allow the default behavior to also execute.
-						bool bCallInputFunc = true; // Always assume default behavior (do call the input function)
-						ScriptVariant_t functionReturn;
+	// call the input handler, or if there is none just set the value
+	inputfunc_t pfnInput = pDesc->inputFunc;
 
-						if ( m_ScriptScope.IsInitialized() )
-						{
-							char szScriptFunctionName[255];
-							Q_strcpy( szScriptFunctionName, "Input" );
-							Q_strcat( szScriptFunctionName, szInputName, 255 );
+	if ( pfnInput )
+	{ 
+		// Package the data into a struct for passing to the input handler.
+		inputdata_t data;
+		data.pActivator = pActivator;
+		data.pCaller = pCaller;
+		data.value = Value;
+		data.nOutputID = outputID;
 
-							g_pScriptVM->SetValue( "activator", ( pActivator ) ? ScriptVariant_t( pActivator->GetScriptInstance() ) : SCRIPT_VARIANT_NULL );
-							g_pScriptVM->SetValue( "caller", ( pCaller ) ? ScriptVariant_t( pCaller->GetScriptInstance() ) : SCRIPT_VARIANT_NULL );
+		// Now, see if there's a function named Input<Name of Input> in this entity's script file. 
+		// If so, execute it and let it decide whether to allow the default behavior to also execute.
+		bool bCallInputFunc = true; // Always assume default behavior (do call the input function)
+		ScriptVariant_t functionReturn;
 
-							if( CallScriptFunction( szScriptFunctionName, &functionReturn ) )
-							{
-								bCallInputFunc = functionReturn;
-							}
-						}
+		if ( m_ScriptScope.IsInitialized() )
+		{
+			char szScriptFunctionName[255];
+			Q_strcpy( szScriptFunctionName, "Input" );
+			Q_strcat( szScriptFunctionName, szInputName, 255 );
 
-						if( bCallInputFunc )
-						{
-							(this->*pfnInput)( data );
-						}
-					
-						if ( m_ScriptScope.IsInitialized() )
-						{
-							g_pScriptVM->ClearValue( "activator" );
-							g_pScriptVM->ClearValue( "caller" );
-						}
-					}
-					else if ( dmap->dataDesc[i].flags & FTYPEDESC_KEY )
-					{
-						// set the value directly
-						Value.SetOther( ((char*)this) + dmap->dataDesc[i].fieldOffset[ TD_OFFSET_NORMAL ]);
-					
-						// TODO: if this becomes evil and causes too many full entity updates, then we should make
-						// a macro like this:
-						//
-						// define MAKE_INPUTVAR(x) void Note##x##Modified() { x.GetForModify(); }
-						//
-						// Then the datadesc points at that function and we call it here. The only pain is to add
-						// that function for all the DEFINE_INPUT calls.
-						NetworkStateChanged();
-					}
+			g_pScriptVM->SetValue( "activator", ( pActivator ) ? ScriptVariant_t( pActivator->GetScriptInstance() ) : SCRIPT_VARIANT_NULL );
+			g_pScriptVM->SetValue( "caller", ( pCaller ) ? ScriptVariant_t( pCaller->GetScriptInstance() ) : SCRIPT_VARIANT_NULL );
 
-					return true;
-				}
+			if( CallScriptFunction( szScriptFunctionName, &functionReturn ) )
+			{
+				bCallInputFunc = functionReturn;
 			}
 		}
+
+		if( bCallInputFunc )
+		{
+			(this->*pfnInput)( data );
+		}
+	
+		if ( m_ScriptScope.IsInitialized() )
+		{
+			g_pScriptVM->ClearValue( "activator" );
+			g_pScriptVM->ClearValue( "caller" );
+		}
+	}
+	else if ( pDesc->flags & FTYPEDESC_KEY )
+	{
+		// set the value directly
+		Value.SetOther( ((char*)this) + pDesc->fieldOffset[ TD_OFFSET_NORMAL ]);
+	
+		// TODO: if this becomes evil and causes too many full entity updates, then we should make
+		// a macro like this:
+		//
+		// define MAKE_INPUTVAR(x) void Note##x##Modified() { x.GetForModify(); }
+		//
+		// Then the datadesc points at that function and we call it here. The only pain is to add
+		// that function for all the DEFINE_INPUT calls.
+		NetworkStateChanged();
 	}
 
-	DevMsg( 2, "unhandled input: (%s) -> (%s,%s)\n", szInputName, STRING(m_iClassname), GetDebugName()/*,", from (%s,%s)" STRING(pCaller->m_iClassname), STRING(pCaller->m_iName)*/ );
-	return false;
+	return true;
 }
 
 //-----------------------------------------------------------------------------
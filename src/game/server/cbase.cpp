@@ -731,8 +731,14 @@ CEventQueue g_EventQueue;
 
 CEventQueue::CEventQueue()
 {
-	m_Events.m_flFireTime = -FLT_MAX;
-	m_Events.m_pNext = NULL;
+	memset( m_Wheel0, 0, sizeof( m_Wheel0 ) );
+	memset( m_Wheel, 0, sizeof( m_Wheel ) );
+	memset( &m_Overflow, 0, sizeof( m_Overflow ) );
+	m_nCurrentTick = 0;
+	m_flTickInterval = 0.0f;
+	m_nEventCount = 0;
+	m_nWheel0Count = 0;
+	m_nNextSerial = 0;
 
 	Init();
 }
@@ -846,33 +852,32 @@ void CEventQueue::Init( void )
 void CEventQueue::Clear( void )
 {
 	// delete all the events in the queue
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-	
-	while ( pe != NULL )
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetEventsInOrder( events );
+	for ( int i = 0; i < events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
-		delete pe;
-		pe = next;
+		delete events[i];
 	}
 
-	m_Events.m_pNext = NULL;
+	memset( m_Wheel0, 0, sizeof( m_Wheel0 ) );
+	memset( m_Wheel, 0, sizeof( m_Wheel ) );
+	memset( &m_Overflow, 0, sizeof( m_Overflow ) );
+	memset( m_pCallerEvents, 0, sizeof( m_pCallerEvents ) );
+	memset( m_pTargetEvents, 0, sizeof( m_pTargetEvents ) );
+	m_nEventCount = 0;
+	m_nWheel0Count = 0;
 }
 
 void CEventQueue::Dump( void )
 {
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetEventsInOrder( events );
 
-	Msg("Dumping event queue. Current time is: %.2f\n",
-#ifdef TF_DLL
-		engine->GetServerTime()
-#else
-		gpGlobals->curtime
-#endif
-		);
+	Msg("Dumping event queue. Current time is: %.2f\n", GetCurTime() );
 
-	while ( pe != NULL )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
+		EventQueuePrioritizedEvent_t *pe = events[i];
 
 		Msg("   (%.2f) Target: '%s', Input: '%s', Parameter '%s'. Activator: '%s', Caller '%s'.  \n", 
 			pe->m_flFireTime, 
@@ -881,13 +886,79 @@ void CEventQueue::Dump( void )
 			pe->m_VariantValue.String(),
 			pe->m_pActivator ? pe->m_pActivator->GetDebugName() : "None", 
 			pe->m_pCaller ? pe->m_pCaller->GetDebugName() : "None"  );
-
-		pe = next;
 	}
 
 	Msg("Finished dump.\n");
 }
 
+float CEventQueue::GetCurTime() const
+{
+#ifdef TF_DLL
+	return engine->GetServerTime();
+#else
+	return gpGlobals->curtime;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The wheel slot for a time. Never goes down as the time goes up, so an
+//			event in an earlier slot always fires before one in a later slot.
+//-----------------------------------------------------------------------------
+int64 CEventQueue::TimeToTick( float flTime ) const
+{
+	double flTick = floor( (double)flTime / m_flTickInterval );
+	const double flLimit = (double)( 1LL << 60 );
+	return (int64)clamp( flTick, -flLimit, flLimit );
+}
+
+static inline bool EventFiresBefore( const EventQueuePrioritizedEvent_t *pLeft, const EventQueuePrioritizedEvent_t *pRight )
+{
+	if ( pLeft->m_flFireTime != pRight->m_flFireTime )
+		return pLeft->m_flFireTime < pRight->m_flFireTime;
+
+	// same time, first in first out
+	return (int)( pLeft->m_nSerial - pRight->m_nSerial ) < 0;
+}
+
+static int EventFireOrderCompare( EventQueuePrioritizedEvent_t * const *ppLeft, EventQueuePrioritizedEvent_t * const *ppRight )
+{
+	if ( EventFiresBefore( *ppLeft, *ppRight ) )
+		return -1;
+	return EventFiresBefore( *ppRight, *ppLeft ) ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Every event in the queue, in the order they'll fire
+//-----------------------------------------------------------------------------
+void CEventQueue::GetEventsInOrder( CUtlVector< EventQueuePrioritizedEvent_t * > &events )
+{
+	events.EnsureCapacity( m_nEventCount );
+
+	for ( int i = 0; i < WHEEL_SIZE0; i++ )
+	{
+		for ( EventQueuePrioritizedEvent_t *pe = m_Wheel0[i].m_pHead; pe; pe = pe->m_pNext )
+		{
+			events.AddToTail( pe );
+		}
+	}
+	for ( int nLevel = 0; nLevel < WHEEL_LEVELS; nLevel++ )
+	{
+		for ( int i = 0; i < WHEEL_SIZE; i++ )
+		{
+			for ( EventQueuePrioritizedEvent_t *pe = m_Wheel[nLevel][i].m_pHead; pe; pe = pe->m_pNext )
+			{
+				events.AddToTail( pe );
+			}
+		}
+	}
+	for ( EventQueuePrioritizedEvent_t *pe = m_Overflow.m_pHead; pe; pe = pe->m_pNext )
+	{
+		events.AddToTail( pe );
+	}
+
+	events.Sort( EventFireOrderCompare );
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: adds the action into the correct spot in the priority queue, targeting entity via string name
@@ -949,36 +1020,231 @@ void CEventQueue::AddEvent( CBaseEntity *target, const char *action, float fireD
 //-----------------------------------------------------------------------------
 void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
 {
-	// loop through the actions looking for a place to insert
-	EventQueuePrioritizedEvent_t *pe;
-	for ( pe = &m_Events; pe->m_pNext != NULL; pe = pe->m_pNext )
+	if ( !m_nEventCount )
 	{
-		if ( pe->m_pNext->m_flFireTime > newEvent->m_flFireTime )
+		// nothing in the wheel, so it can start from now, at the current tick rate
+		m_flTickInterval = ( gpGlobals->interval_per_tick > 0.0f ) ? gpGlobals->interval_per_tick : DEFAULT_TICK_INTERVAL;
+		m_nCurrentTick = TimeToTick( GetCurTime() );
+	}
+
+	newEvent->m_nSerial = m_nNextSerial++;
+	InsertIntoWheel( newEvent );
+
+	newEvent->m_pPrevForCaller = NULL;
+	newEvent->m_pNextForCaller = NULL;
+	if ( newEvent->m_pCaller.IsValid() )
+	{
+		EventQueuePrioritizedEvent_t *&pHead = m_pCallerEvents[newEvent->m_pCaller.GetEntryIndex()];
+		newEvent->m_pNextForCaller = pHead;
+		if ( pHead )
 		{
-			break;
+			pHead->m_pPrevForCaller = newEvent;
 		}
+		pHead = newEvent;
 	}
 
-	Assert( pe );
-
-	// insert
-	newEvent->m_pNext = pe->m_pNext;
-	newEvent->m_pPrev = pe;
-	pe->m_pNext = newEvent;
-	if ( newEvent->m_pNext )
+	newEvent->m_pPrevForTarget = NULL;
+	newEvent->m_pNextForTarget = NULL;
+	if ( newEvent->m_pEntTarget.IsValid() )
 	{
-		newEvent->m_pNext->m_pPrev = newEvent;
+		EventQueuePrioritizedEvent_t *&pHead = m_pTargetEvents[newEvent->m_pEntTarget.GetEntryIndex()];
+		newEvent->m_pNextForTarget = pHead;
+		if ( pHead )
+		{
+			pHead->m_pPrevForTarget = newEvent;
+		}
+		pHead = newEvent;
 	}
+
+	m_nEventCount++;
 }
 
 void CEventQueue::RemoveEvent( EventQueuePrioritizedEvent_t *pe )
 {
-	Assert( pe->m_pPrev );
-	pe->m_pPrev->m_pNext = pe->m_pNext;
+	UnlinkFromSlot( pe );
+
+	if ( pe->m_pCaller.IsValid() )
+	{
+		if ( pe->m_pPrevForCaller )
+		{
+			pe->m_pPrevForCaller->m_pNextForCaller = pe->m_pNextForCaller;
+		}
+		else
+		{
+			m_pCallerEvents[pe->m_pCaller.GetEntryIndex()] = pe->m_pNextForCaller;
+		}
+		if ( pe->m_pNextForCaller )
+		{
+			pe->m_pNextForCaller->m_pPrevForCaller = pe->m_pPrevForCaller;
+		}
+	}
+
+	if ( pe->m_pEntTarget.IsValid() )
+	{
+		if ( pe->m_pPrevForTarget )
+		{
+			pe->m_pPrevForTarget->m_pNextForTarget = pe->m_pNextForTarget;
+		}
+		else
+		{
+			m_pTargetEvents[pe->m_pEntTarget.GetEntryIndex()] = pe->m_pNextForTarget;
+		}
+		if ( pe->m_pNextForTarget )
+		{
+			pe->m_pNextForTarget->m_pPrevForTarget = pe->m_pPrevForTarget;
+		}
+	}
+
+	m_nEventCount--;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Files an event in the first level slot for its tick if that's less
+//			than a turn away, otherwise in the level whose slots are about as far
+//			apart as it is.
+//-----------------------------------------------------------------------------
+void CEventQueue::InsertIntoWheel( EventQueuePrioritizedEvent_t *pe )
+{
+	int64 nTick = TimeToTick( pe->m_flFireTime );
+	int64 nDelta = nTick - m_nCurrentTick;
+
+	EventQueueSlot_t *pSlot = &m_Overflow;
+	if ( nDelta < WHEEL_SIZE0 )
+	{
+		// anything overdue goes in the slot the wheel is at
+		nTick = MAX( nTick, m_nCurrentTick );
+		pSlot = &m_Wheel0[nTick & ( WHEEL_SIZE0 - 1 )];
+		m_nWheel0Count++;
+	}
+	else
+	{
+		for ( int nLevel = 0; nLevel < WHEEL_LEVELS; nLevel++ )
+		{
+			int nShift = WHEEL_BITS0 + nLevel * WHEEL_BITS;
+			if ( nDelta < ( 1LL << ( nShift + WHEEL_BITS ) ) )
+			{
+				pSlot = &m_Wheel[nLevel][( nTick >> nShift ) & ( WHEEL_SIZE - 1 )];
+				break;
+			}
+		}
+	}
+
+	InsertIntoSlot( pSlot, pe );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Slots are kept in firing order. Events mostly arrive in order, so
+//			look from the back.
+//-----------------------------------------------------------------------------
+void CEventQueue::InsertIntoSlot( EventQueueSlot_t *pSlot, EventQueuePrioritizedEvent_t *pe )
+{
+	EventQueuePrioritizedEvent_t *pAfter = pSlot->m_pTail;
+	while ( pAfter && EventFiresBefore( pe, pAfter ) )
+	{
+		pAfter = pAfter->m_pPrev;
+	}
+
+	pe->m_pSlot = pSlot;
+	pe->m_pPrev = pAfter;
+	pe->m_pNext = pAfter ? pAfter->m_pNext : pSlot->m_pHead;
+	if ( pAfter )
+	{
+		pAfter->m_pNext = pe;
+	}
+	else
+	{
+		pSlot->m_pHead = pe;
+	}
+	if ( pe->m_pNext )
+	{
+		pe->m_pNext->m_pPrev = pe;
+	}
+	else
+	{
+		pSlot->m_pTail = pe;
+	}
+}
+
+void CEventQueue::UnlinkFromSlot( EventQueuePrioritizedEvent_t *pe )
+{
+	EventQueueSlot_t *pSlot = pe->m_pSlot;
+	if ( pe->m_pPrev )
+	{
+		pe->m_pPrev->m_pNext = pe->m_pNext;
+	}
+	else
+	{
+		pSlot->m_pHead = pe->m_pNext;
+	}
 	if ( pe->m_pNext )
 	{
 		pe->m_pNext->m_pPrev = pe->m_pPrev;
 	}
+	else
+	{
+		pSlot->m_pTail = pe->m_pPrev;
+	}
+
+	if ( pSlot >= m_Wheel0 && pSlot < m_Wheel0 + WHEEL_SIZE0 )
+	{
+		m_nWheel0Count--;
+	}
+	pe->m_pSlot = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Spreads a higher level slot out over the levels below, now the wheel
+//			has come round to it.
+//-----------------------------------------------------------------------------
+void CEventQueue::Cascade( EventQueueSlot_t *pSlot )
+{
+	EventQueuePrioritizedEvent_t *pe = pSlot->m_pHead;
+	pSlot->m_pHead = pSlot->m_pTail = NULL;
+
+	while ( pe )
+	{
+		EventQueuePrioritizedEvent_t *pNext = pe->m_pNext;
+		InsertIntoWheel( pe );
+		pe = pNext;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Moves the wheel on to nTick, which must be the current tick or the
+//			start of a later turn of the first level if that level is empty.
+//			Returns false if nTick is already where the wheel is.
+//-----------------------------------------------------------------------------
+bool CEventQueue::AdvanceWheel( int64 nTick )
+{
+	if ( nTick <= m_nCurrentTick )
+		return false;
+
+	// skipping ticks is only allowed while nothing is due in them
+	Assert( nTick == m_nCurrentTick + 1 || !m_nWheel0Count );
+	Assert( nTick == m_nCurrentTick + 1 || ( ( nTick - 1 ) >> WHEEL_BITS0 ) == ( m_nCurrentTick >> WHEEL_BITS0 ) );
+	m_nCurrentTick = nTick;
+
+	if ( m_nCurrentTick & ( WHEEL_SIZE0 - 1 ) )
+		return true;
+
+	// a turn of the first level, bring down the next slot of each level that's also turned
+	int nShift = WHEEL_BITS0;
+	for ( int nLevel = 0; nLevel < WHEEL_LEVELS; nLevel++, nShift += WHEEL_BITS )
+	{
+		int nIndex = ( m_nCurrentTick >> nShift ) & ( WHEEL_SIZE - 1 );
+		Cascade( &m_Wheel[nLevel][nIndex] );
+		if ( nIndex )
+			return true;
+	}
+
+	// the whole wheel turned, anything in the overflow that's now in reach goes in
+	while ( m_Overflow.m_pHead && TimeToTick( m_Overflow.m_pHead->m_flFireTime ) - m_nCurrentTick < ( 1LL << WHEEL_RANGE_BITS ) )
+	{
+		EventQueuePrioritizedEvent_t *pe = m_Overflow.m_pHead;
+		UnlinkFromSlot( pe );
+		InsertIntoWheel( pe );
+	}
+	return true;
 }
 
 
@@ -986,20 +1252,51 @@ void CEventQueue::RemoveEvent( EventQueuePrioritizedEvent_t *pe )
 // Purpose: fires off any events in the queue who's fire time is (or before) the present time
 //-----------------------------------------------------------------------------
 void CEventQueue::ServiceEvents( void )
+{
+	ServiceEvents( GetCurTime() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: fires off any events whose fire time is (or before) flCurTime, in
+//			fire time order, and in the order they were added for the same time
+//-----------------------------------------------------------------------------
+void CEventQueue::ServiceEvents( float flCurTime )
 {
 	if (!CBaseEntity::Debug_ShouldStep())
 	{
 		return;
 	}
 
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	if ( !m_nEventCount )
+		return;
 
-#ifdef TF_DLL
-	while ( pe != NULL && pe->m_flFireTime <= engine->GetServerTime() )
-#else
-	while ( pe != NULL && pe->m_flFireTime <= gpGlobals->curtime )
-#endif
+	int64 nCurTick = TimeToTick( flCurTime );
+
+	while ( 1 )
 	{
+		// everything in a slot before the current tick is due, in the current tick's slot it depends on the time
+		EventQueuePrioritizedEvent_t *pe = m_Wheel0[m_nCurrentTick & ( WHEEL_SIZE0 - 1 )].m_pHead;
+		if ( !pe )
+		{
+			if ( m_nCurrentTick >= nCurTick || !m_nEventCount )
+				break;
+
+			int64 nNextTick = m_nCurrentTick + 1;
+			if ( !m_nWheel0Count )
+			{
+				// nothing in this turn of the first level, go straight to the next one (or to now)
+				nNextTick = MIN( ( m_nCurrentTick | ( WHEEL_SIZE0 - 1 ) ) + 1, nCurTick );
+			}
+			AdvanceWheel( nNextTick );
+			continue;
+		}
+
+		if ( pe->m_flFireTime > flCurTime )
+		{
+			Assert( m_nCurrentTick == nCurTick );
+			break;
+		}
+
 		MDLCACHE_CRITICAL_SECTION();
 
 		bool targetFound = false;
@@ -1079,9 +1376,6 @@ void CEventQueue::ServiceEvents( void )
 				break;
 			}
 		}
-
-		// restart the list (to catch any new items have probably been added to the queue)
-		pe = m_Events.m_pNext;	
 	}
 }
 
@@ -1106,10 +1400,10 @@ static ConCommand dumpeventqueue( "dumpeventqueue", CC_DumpEventQueue, "Dump the
 //-----------------------------------------------------------------------------
 void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 {
-	if (!pCaller)
+	if (!pCaller || !pCaller->GetRefEHandle().IsValid())
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = m_pCallerEvents[pCaller->GetRefEHandle().GetEntryIndex()];
 
 	while (pCur != NULL)
 	{
@@ -1126,7 +1420,7 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextForCaller;
 
 		if (bDelete)
 		{
@@ -1144,10 +1438,10 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 //-----------------------------------------------------------------------------
 void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 {
-	if (!pTarget)
+	if (!pTarget || !pTarget->GetRefEHandle().IsValid())
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = m_pTargetEvents[pTarget->GetRefEHandle().GetEntryIndex()];
 
 	while (pCur != NULL)
 	{
@@ -1162,7 +1456,7 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextForTarget;
 
 		if (bDelete)
 		{
@@ -1179,10 +1473,10 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 //-----------------------------------------------------------------------------
 bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName )
 {
-	if (!pTarget)
+	if (!pTarget || !pTarget->GetRefEHandle().IsValid())
 		return false;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = m_pTargetEvents[pTarget->GetRefEHandle().GetEntryIndex()];
 
 	while (pCur != NULL)
 	{
@@ -1195,7 +1489,7 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 				return true;
 		}
 
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextForTarget;
 	}
 
 	return false;
@@ -1213,7 +1507,7 @@ void ServiceEventQueue( void )
 // save data description for the event queue
 BEGIN_SIMPLE_DATADESC( CEventQueue )
 	// These are saved explicitly in CEventQueue::Save below
-	// DEFINE_FIELD( m_Events, EventQueuePrioritizedEvent_t ),
+	// DEFINE_FIELD( m_Wheel0, EventQueueSlot_t ),
 
 	DEFINE_FIELD( m_iListCount, FIELD_INTEGER ),	// this value is only used during save/restore
 END_DATADESC()
@@ -1238,21 +1532,19 @@ END_DATADESC()
 int CEventQueue::Save( ISave &save )
 {
 	// count the number of items in the queue
-	EventQueuePrioritizedEvent_t *pe;
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetEventsInOrder( events );
 
-	m_iListCount = 0;
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
-	{
-		m_iListCount++;
-	}
+	m_iListCount = events.Count();
 
 	// save that value out to disk, so we know how many to restore
 	if ( !save.WriteFields( "EventQueue", this, NULL, m_DataMap.dataDesc, m_DataMap.dataNumFields ) )
 		return 0;
 	
 	// cycle through all the events, saving them all
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
+		EventQueuePrioritizedEvent_t *pe = events[i];
 		if ( !save.WriteFields( "PEvent", pe, NULL, pe->m_DataMap.dataDesc, pe->m_DataMap.dataNumFields ) )
 			return 0;
 	}
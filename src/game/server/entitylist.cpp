@@ -280,6 +280,220 @@ void SimThink_EntityChanged( CBaseEntity *pEntity )
 	g_SimThinkManager.EntityChanged( pEntity );
 }
 
+// Maps targetnames and classnames to the entities that have them, so the
+// FindEntityByName/FindEntityByClassname searches the I/O system makes for every
+// fired event don't have to string compare every entity. Each index is a hash
+// table of chains threaded through the entity slots. A chain holds its entities
+// in global list order, so iterating with a start entity finds the same
+// entities in the same order as walking the list.
+ConVar ent_lookup_index( "ent_lookup_index", "1", FCVAR_CHEAT, "Use the targetname/classname indexes for entity searches instead of walking the entity list." );
+ConVar ent_lookup_index_verify( "ent_lookup_index_verify", "0", FCVAR_CHEAT, "Check every indexed entity search against a walk of the entity list." );
+
+#define ENTITY_LOOKUP_BUCKETS	4096
+#define ENTITY_LOOKUP_INVALID	0xFFFF
+
+// Order entities were added to the list, which is the order the list is in
+static uint32 g_EntityListSerial[NUM_ENT_ENTRIES];
+static uint32 g_nNextEntityListSerial;
+
+//-----------------------------------------------------------------------------
+// Purpose: Case insensitive hash that agrees with CBaseEntity::NameMatches
+//-----------------------------------------------------------------------------
+static uint32 EntityLookupHash( const char *pszName )
+{
+	uint32 nHash = 2166136261u;
+	for ( const unsigned char *p = (const unsigned char *)pszName; *p; ++p )
+	{
+		unsigned char c = *p;
+		if ( (unsigned char)( c - 'A' ) <= ( 'Z' - 'A' ) )
+		{
+			c |= 0x20;
+		}
+		nHash = ( nHash ^ c ) * 16777619u;
+	}
+	return nHash ^ ( nHash >> 16 );
+}
+
+struct EntityLookupStats_t
+{
+	int m_nLookups;
+	int m_nScans;			// wildcards, empty names, or the index turned off
+	int m_nVisited;			// chain entries looked at by indexed lookups
+	int m_nRejected;		// ...that turned out to be some other name
+	int m_nVerifyFailures;
+};
+
+class CEntityLookupIndex
+{
+public:
+	CEntityLookupIndex()
+	{
+		Clear();
+	}
+
+	void Clear()
+	{
+		for ( int i = 0; i < ENTITY_LOOKUP_BUCKETS; i++ )
+		{
+			m_Heads[i] = m_Tails[i] = ENTITY_LOOKUP_INVALID;
+		}
+		for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+		{
+			m_Nodes[i].m_bLinked = false;
+		}
+		m_nLinked = 0;
+		memset( &m_Stats, 0, sizeof( m_Stats ) );
+	}
+
+	// Puts an entity slot in the chain for a name, or takes it out for NULL_STRING
+	void Update( int iSlot, string_t iszName )
+	{
+		Node_t &node = m_Nodes[iSlot];
+		if ( iszName == NULL_STRING )
+		{
+			Unlink( iSlot );
+			return;
+		}
+
+		uint32 nHash = EntityLookupHash( STRING( iszName ) );
+		if ( node.m_bLinked && node.m_nHash == nHash )
+			return;
+
+		Unlink( iSlot );
+		node.m_nHash = nHash;
+		node.m_nSerial = g_EntityListSerial[iSlot];
+		node.m_bLinked = true;
+		++m_nLinked;
+
+		// almost always the newest entity with this name, so check the tail first
+		int iBucket = nHash & ( ENTITY_LOOKUP_BUCKETS - 1 );
+		int iNext = ENTITY_LOOKUP_INVALID;
+		if ( m_Tails[iBucket] != ENTITY_LOOKUP_INVALID && m_Nodes[m_Tails[iBucket]].m_nSerial > node.m_nSerial )
+		{
+			iNext = m_Heads[iBucket];
+			while ( m_Nodes[iNext].m_nSerial < node.m_nSerial )
+			{
+				iNext = m_Nodes[iNext].m_iNext;
+			}
+		}
+
+		int iPrev = ( iNext != ENTITY_LOOKUP_INVALID ) ? m_Nodes[iNext].m_iPrev : m_Tails[iBucket];
+		node.m_iNext = iNext;
+		node.m_iPrev = iPrev;
+		if ( iPrev != ENTITY_LOOKUP_INVALID )
+		{
+			m_Nodes[iPrev].m_iNext = iSlot;
+		}
+		else
+		{
+			m_Heads[iBucket] = iSlot;
+		}
+		if ( iNext != ENTITY_LOOKUP_INVALID )
+		{
+			m_Nodes[iNext].m_iPrev = iSlot;
+		}
+		else
+		{
+			m_Tails[iBucket] = iSlot;
+		}
+	}
+
+	void Unlink( int iSlot )
+	{
+		Node_t &node = m_Nodes[iSlot];
+		if ( !node.m_bLinked )
+			return;
+
+		int iBucket = node.m_nHash & ( ENTITY_LOOKUP_BUCKETS - 1 );
+		if ( node.m_iPrev != ENTITY_LOOKUP_INVALID )
+		{
+			m_Nodes[node.m_iPrev].m_iNext = node.m_iNext;
+		}
+		else
+		{
+			m_Heads[iBucket] = node.m_iNext;
+		}
+		if ( node.m_iNext != ENTITY_LOOKUP_INVALID )
+		{
+			m_Nodes[node.m_iNext].m_iPrev = node.m_iPrev;
+		}
+		else
+		{
+			m_Tails[iBucket] = node.m_iPrev;
+		}
+		node.m_bLinked = false;
+		--m_nLinked;
+	}
+
+	//-----------------------------------------------------------------------------
+	// Purpose: First entity slot after pStartEntity, in list order, that might
+	//			have a name with this hash. Callers still have to check the name.
+	//-----------------------------------------------------------------------------
+	int First( CBaseEntity *pStartEntity, uint32 nHash ) const
+	{
+		int iBucket = nHash & ( ENTITY_LOOKUP_BUCKETS - 1 );
+		if ( !pStartEntity )
+			return m_Heads[iBucket];
+
+		// carrying on from the last match is the usual case, and it's in this chain
+		int iStart = pStartEntity->GetRefEHandle().GetEntryIndex();
+		const Node_t &start = m_Nodes[iStart];
+		if ( start.m_bLinked && ( start.m_nHash & ( ENTITY_LOOKUP_BUCKETS - 1 ) ) == (uint32)iBucket )
+			return start.m_iNext;
+
+		uint32 nStartSerial = g_EntityListSerial[iStart];
+		int iSlot = m_Heads[iBucket];
+		while ( iSlot != ENTITY_LOOKUP_INVALID && m_Nodes[iSlot].m_nSerial <= nStartSerial )
+		{
+			iSlot = m_Nodes[iSlot].m_iNext;
+		}
+		return iSlot;
+	}
+
+	int Next( int iSlot ) const				{ return m_Nodes[iSlot].m_iNext; }
+	uint32 Hash( int iSlot ) const			{ return m_Nodes[iSlot].m_nHash; }
+	int Count() const						{ return m_nLinked; }
+
+	void GetChainStats( int &nUsedBuckets, int &nLongestChain ) const
+	{
+		nUsedBuckets = 0;
+		nLongestChain = 0;
+		for ( int i = 0; i < ENTITY_LOOKUP_BUCKETS; i++ )
+		{
+			int nLength = 0;
+			for ( int iSlot = m_Heads[i]; iSlot != ENTITY_LOOKUP_INVALID; iSlot = m_Nodes[iSlot].m_iNext )
+			{
+				++nLength;
+			}
+			if ( nLength )
+			{
+				++nUsedBuckets;
+			}
+			nLongestChain = MAX( nLongestChain, nLength );
+		}
+	}
+
+	EntityLookupStats_t m_Stats;
+
+private:
+	struct Node_t
+	{
+		uint32			m_nHash;
+		uint32			m_nSerial;
+		unsigned short	m_iNext;
+		unsigned short	m_iPrev;
+		bool			m_bLinked;
+	};
+
+	Node_t			m_Nodes[NUM_ENT_ENTRIES];
+	unsigned short	m_Heads[ENTITY_LOOKUP_BUCKETS];
+	unsigned short	m_Tails[ENTITY_LOOKUP_BUCKETS];
+	int				m_nLinked;
+};
+
+static CEntityLookupIndex g_EntityNameIndex;
+static CEntityLookupIndex g_EntityClassnameIndex;
+
 static CBaseEntityClassList *s_pClassLists = NULL;
 CBaseEntityClassList::CBaseEntityClassList()
 {
@@ -475,13 +689,11 @@ bool CGlobalEntityList::IsEntityPtr( void *pTest )
 }
 
 //-----------------------------------------------------------------------------
-// Purpose: Iterates the entities with a given classname.
-// Input  : pStartEntity - Last entity found, NULL to start a new iteration.
-//			szName - Classname to search for.
+// Purpose: Walks the whole entity list, for searches the indexes can't answer.
 //-----------------------------------------------------------------------------
-CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName, IEntityFindFilter *pFilter )
+static CBaseEntity *FindEntityByClassnameScan( CBaseEntity *pStartEntity, const char *szName, IEntityFindFilter *pFilter )
 {
-	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
+	const CEntInfo *pInfo = pStartEntity ? gEntList.GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : gEntList.FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
 	{
@@ -504,6 +716,93 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity
 	return NULL;
 }
 
+static CBaseEntity *FindEntityByNameScan( CBaseEntity *pStartEntity, const char *szName, IEntityFindFilter *pFilter )
+{
+	const CEntInfo *pInfo = pStartEntity ? gEntList.GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : gEntList.FirstEntInfo();
+
+	for ( ;pInfo; pInfo = pInfo->m_pNext )
+	{
+		CBaseEntity *ent = (CBaseEntity *)pInfo->m_pEntity;
+		if ( !ent )
+		{
+			DevWarning( "NULL entity in global entity list!\n" );
+			continue;
+		}
+
+		if ( !ent->GetEntityName() )
+			continue;
+
+		if ( ent->NameMatches( szName ) )
+		{
+			if ( pFilter && !pFilter->ShouldFindEntity(ent) )
+				continue;
+
+			return ent;
+		}
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Same as the scans above, but only looks at the entities in the
+//			name's chain of one of the indexes.
+//-----------------------------------------------------------------------------
+static CBaseEntity *FindEntityIndexed( CEntityLookupIndex &index, CBaseEntity *pStartEntity, const char *szName, bool bClassname, IEntityFindFilter *pFilter )
+{
+	EntityLookupStats_t &stats = index.m_Stats;
+	++stats.m_nLookups;
+
+	CBaseEntity *pResult = NULL;
+	uint32 nHash = EntityLookupHash( szName );
+	for ( int iSlot = index.First( pStartEntity, nHash ); iSlot != ENTITY_LOOKUP_INVALID; iSlot = index.Next( iSlot ) )
+	{
+		++stats.m_nVisited;
+		CBaseEntity *pEntity = (CBaseEntity *)gEntList.GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+		if ( index.Hash( iSlot ) != nHash || !( bClassname ? pEntity->ClassMatches( szName ) : pEntity->NameMatches( szName ) ) )
+		{
+			++stats.m_nRejected;
+			continue;
+		}
+
+		if ( pFilter && !pFilter->ShouldFindEntity( pEntity ) )
+			continue;
+
+		pResult = pEntity;
+		break;
+	}
+
+	// filters may keep state, so only check unfiltered searches
+	if ( ent_lookup_index_verify.GetBool() && !pFilter )
+	{
+		CBaseEntity *pExpected = bClassname ? FindEntityByClassnameScan( pStartEntity, szName, NULL ) : FindEntityByNameScan( pStartEntity, szName, NULL );
+		if ( pExpected != pResult )
+		{
+			++stats.m_nVerifyFailures;
+			Warning( "Entity %s index found %d for '%s', the entity list has %d\n", bClassname ? "classname" : "targetname",
+				pResult ? pResult->entindex() : -1, szName, pExpected ? pExpected->entindex() : -1 );
+		}
+	}
+
+	return pResult;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Iterates the entities with a given classname.
+// Input  : pStartEntity - Last entity found, NULL to start a new iteration.
+//			szName - Classname to search for.
+//-----------------------------------------------------------------------------
+CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName, IEntityFindFilter *pFilter )
+{
+	if ( !ent_lookup_index.GetBool() || !szName || !szName[0] || V_strchr( szName, '*' ) )
+	{
+		++g_EntityClassnameIndex.m_Stats.m_nScans;
+		return FindEntityByClassnameScan( pStartEntity, szName, pFilter );
+	}
+
+	return FindEntityIndexed( g_EntityClassnameIndex, pStartEntity, szName, true, pFilter );
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: Finds an entity given a procedural name.
@@ -596,30 +895,13 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 		return NULL;
 	}
 	
-	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
-
-	for ( ;pInfo; pInfo = pInfo->m_pNext )
+	if ( !ent_lookup_index.GetBool() || V_strchr( szName, '*' ) )
 	{
-		CBaseEntity *ent = (CBaseEntity *)pInfo->m_pEntity;
-		if ( !ent )
-		{
-			DevWarning( "NULL entity in global entity list!\n" );
-			continue;
-		}
-
-		if ( !ent->m_iName )
-			continue;
-
-		if ( ent->NameMatches( szName ) )
-		{
-			if ( pFilter && !pFilter->ShouldFindEntity(ent) )
-				continue;
-
-			return ent;
-		}
+		++g_EntityNameIndex.m_Stats.m_nScans;
+		return FindEntityByNameScan( pStartEntity, szName, pFilter );
 	}
 
-	return NULL;
+	return FindEntityIndexed( g_EntityNameIndex, pStartEntity, szName, false, pFilter );
 }
 
 //-----------------------------------------------------------------------------
@@ -1128,6 +1410,10 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	
 	// NOTE: Must be a CBaseEntity on server
 	Assert( pBaseEnt );
+
+	g_EntityListSerial[handle.GetEntryIndex()] = ++g_nNextEntityListSerial;
+	UpdateEntityLookup( pBaseEnt );
+
 	//DevMsg(2,"Created %s\n", pBaseEnt->GetClassname() );
 	for ( i = m_entityListeners.Count()-1; i >= 0; i-- )
 	{
@@ -1158,6 +1444,9 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts--;
 
+	g_EntityNameIndex.Unlink( handle.GetEntryIndex() );
+	g_EntityClassnameIndex.Unlink( handle.GetEntryIndex() );
+
 	m_iNumEnts--;
 }
 
@@ -1178,6 +1467,9 @@ void CGlobalEntityList::NotifySpawn( CBaseEntity *pEnt )
 	if ( !pEnt )
 		return;
 
+	// keyvalues write straight into m_iName and m_iClassname
+	UpdateEntityLookup( pEnt );
+
 	//DevMsg(2,"Deleted %s\n", pBaseEnt->GetClassname() );
 	for ( int i = m_entityListeners.Count()-1; i >= 0; i-- )
 	{
@@ -1185,6 +1477,20 @@ void CGlobalEntityList::NotifySpawn( CBaseEntity *pEnt )
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Refiles an entity in the targetname and classname indexes after
+//			either may have changed.
+//-----------------------------------------------------------------------------
+void CGlobalEntityList::UpdateEntityLookup( CBaseEntity *pEnt )
+{
+	CBaseHandle hEnt = pEnt->GetRefEHandle();
+	if ( !hEnt.IsValid() )
+		return;
+
+	g_EntityNameIndex.Update( hEnt.GetEntryIndex(), pEnt->GetEntityName() );
+	g_EntityClassnameIndex.Update( hEnt.GetEntryIndex(), pEnt->m_iClassname );
+}
+
 // NOTE: This doesn't happen in OnRemoveEntity() specifically because 
 // listeners may want to reference the object as it's being deleted
 // OnRemoveEntity isn't called until the destructor and all data is invalid.
@@ -1667,3 +1973,34 @@ CON_COMMAND(report_simthinklist, "Lists all simulating/thinking entities")
 	list.ReportEntityList();
 }
 
+static void ReportEntityLookupIndex( const char *pszName, CEntityLookupIndex &index, bool bReset )
+{
+	EntityLookupStats_t &stats = index.m_Stats;
+	int nUsedBuckets, nLongestChain;
+	index.GetChainStats( nUsedBuckets, nLongestChain );
+
+	Msg( "%s: %d entities in %d chains, longest %d\n", pszName, index.Count(), nUsedBuckets, nLongestChain );
+	Msg( "  %d indexed lookups, %.2f entities looked at each (%.2f other names), %d list scans\n", stats.m_nLookups,
+		stats.m_nLookups ? (float)stats.m_nVisited / stats.m_nLookups : 0.0f, stats.m_nLookups ? (float)stats.m_nRejected / stats.m_nLookups : 0.0f, stats.m_nScans );
+	if ( stats.m_nVerifyFailures )
+	{
+		Msg( "  %d lookups didn't match the list scan!\n", stats.m_nVerifyFailures );
+	}
+
+	if ( bReset )
+	{
+		memset( &stats, 0, sizeof( stats ) );
+	}
+}
+
+CON_COMMAND(report_entity_lookup_stats, "Reports how targetname/classname searches used the entity indexes. 'report_entity_lookup_stats reset' also clears the counts.")
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	bool bReset = ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) );
+	Msg( "%d entities, index %s\n", gEntList.NumberOfEntities(), ent_lookup_index.GetBool() ? "on" : "off" );
+	ReportEntityLookupIndex( "targetname", g_EntityNameIndex, bReset );
+	ReportEntityLookupIndex( "classname", g_EntityClassnameIndex, bReset );
+}
+
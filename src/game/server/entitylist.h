@@ -112,6 +112,8 @@ public:
 	void NotifyCreateEntity( CBaseEntity *pEnt );
 	void NotifySpawn( CBaseEntity *pEnt );
 	void NotifyRemoveEntity( CBaseHandle hEnt );
+	// an entity's targetname or classname changed, refile it in the search indexes
+	void UpdateEntityLookup( CBaseEntity *pEnt );
 	// iteration functions
 
 	// returns the next entity after pCurrentEnt;  if pCurrentEnt is NULL, return the first entity
@@ -16,6 +16,8 @@
 
 #include "mempool.h"
 
+struct EventQueueSlot_t;
+
 struct EventQueuePrioritizedEvent_t
 {
 	float m_flFireTime;
@@ -28,14 +30,31 @@ struct EventQueuePrioritizedEvent_t
 
 	variant_t m_VariantValue;	// variable-type parameter
 
+	// the timer wheel slot this event is in, and its neighbours there
+	EventQueueSlot_t *m_pSlot;
 	EventQueuePrioritizedEvent_t *m_pNext;
 	EventQueuePrioritizedEvent_t *m_pPrev;
 
+	// order the event was added in, breaks ties between events with the same fire time
+	unsigned int m_nSerial;
+
+	// other events from the same caller and to the same target entity
+	EventQueuePrioritizedEvent_t *m_pNextForCaller;
+	EventQueuePrioritizedEvent_t *m_pPrevForCaller;
+	EventQueuePrioritizedEvent_t *m_pNextForTarget;
+	EventQueuePrioritizedEvent_t *m_pPrevForTarget;
+
 	DECLARE_SIMPLE_DATADESC();
 
 	DECLARE_FIXEDSIZE_ALLOCATOR( PrioritizedEvent_t );
 };
 
+struct EventQueueSlot_t
+{
+	EventQueuePrioritizedEvent_t *m_pHead;
+	EventQueuePrioritizedEvent_t *m_pTail;
+};
+
 class CEventQueue
 {
 public:
@@ -50,6 +69,9 @@ public:
 
 	// services the queue, firing off any events who's time hath come
 	void ServiceEvents( void );
+	void ServiceEvents( float flCurTime );
+
+	int GetEventCount() const { return m_nEventCount; }
 
 	// debugging
 	void ValidateQueue( void );
@@ -68,12 +90,48 @@ public:
 
 private:
 
+	// A hierarchical timer wheel keyed on server ticks. The first level has a
+	// slot per tick, each level above has slots covering a whole turn of the
+	// level below, and those get spread out over it as the wheel comes round.
+	// Slots hold their events in firing order.
+	enum
+	{
+		WHEEL_BITS0 = 8,
+		WHEEL_SIZE0 = 1 << WHEEL_BITS0,
+		WHEEL_BITS = 6,
+		WHEEL_SIZE = 1 << WHEEL_BITS,
+		WHEEL_LEVELS = 3,		// above the first
+		WHEEL_RANGE_BITS = WHEEL_BITS0 + WHEEL_LEVELS * WHEEL_BITS,
+	};
+
 	void AddEvent( EventQueuePrioritizedEvent_t *event );
 	void RemoveEvent( EventQueuePrioritizedEvent_t *pe );
 
+	float GetCurTime() const;
+	int64 TimeToTick( float flTime ) const;
+	void InsertIntoWheel( EventQueuePrioritizedEvent_t *pe );
+	void InsertIntoSlot( EventQueueSlot_t *pSlot, EventQueuePrioritizedEvent_t *pe );
+	void UnlinkFromSlot( EventQueuePrioritizedEvent_t *pe );
+	bool AdvanceWheel( int64 nTick );
+	void Cascade( EventQueueSlot_t *pSlot );
+	void GetEventsInOrder( CUtlVector< EventQueuePrioritizedEvent_t * > &events );
+
 	DECLARE_SIMPLE_DATADESC();
-	EventQueuePrioritizedEvent_t m_Events;
 	int m_iListCount;
+
+	EventQueueSlot_t m_Wheel0[WHEEL_SIZE0];
+	EventQueueSlot_t m_Wheel[WHEEL_LEVELS][WHEEL_SIZE];
+	EventQueueSlot_t m_Overflow;		// further off than the wheel reaches
+	int64 m_nCurrentTick;				// the first level slot the wheel is at
+	float m_flTickInterval;
+	int m_nEventCount;
+	int m_nWheel0Count;
+	unsigned int m_nNextSerial;
+
+	// events by the entry index of their caller and target handles, for
+	// CancelEvents, CancelEventOn and HasEventPending
+	EventQueuePrioritizedEvent_t *m_pCallerEvents[NUM_ENT_ENTRIES];
+	EventQueuePrioritizedEvent_t *m_pTargetEvents[NUM_ENT_ENTRIES];
 };
 
 extern CEventQueue g_EventQueue;
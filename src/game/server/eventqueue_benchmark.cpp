@@ -0,0 +1,180 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: eventqueue_benchmark, pushes a large number of entity I/O events
+//			through a CEventQueue of its own and times adding, cancelling and
+//			firing them, checking they fire in order.
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "eventqueue.h"
+#include "tier0/fasttimer.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define EVENTQUEUE_BENCHMARK_ENTITIES	64		// entities the events go between
+#define EVENTQUEUE_BENCHMARK_CANCELLED	8		// callers whose events get cancelled
+
+static int s_nEventQueueBenchmarkNext;		// rank of the event that should fire next
+static int s_nEventQueueBenchmarkErrors;
+
+//-----------------------------------------------------------------------------
+// Purpose: Target for the benchmark's events. Each event carries the position it
+//			should fire in, or -1 if it should have been cancelled.
+//-----------------------------------------------------------------------------
+class CEventQueueBenchmarkTarget : public CLogicalEntity
+{
+public:
+	DECLARE_CLASS( CEventQueueBenchmarkTarget, CLogicalEntity );
+	DECLARE_DATADESC();
+
+	void InputFire( inputdata_t &inputdata )
+	{
+		if ( inputdata.value.Int() != s_nEventQueueBenchmarkNext )
+		{
+			s_nEventQueueBenchmarkErrors++;
+		}
+		s_nEventQueueBenchmarkNext++;
+	}
+};
+
+LINK_ENTITY_TO_CLASS( eventqueue_benchmark_target, CEventQueueBenchmarkTarget );
+
+BEGIN_DATADESC( CEventQueueBenchmarkTarget )
+	DEFINE_INPUTFUNC( FIELD_INTEGER, "Fire", InputFire ),
+END_DATADESC()
+
+struct EventQueueBenchmarkEvent_t
+{
+	int m_nTick;
+	int m_nIndex;
+};
+
+static int EventQueueBenchmarkCompare( const EventQueueBenchmarkEvent_t *pLeft, const EventQueueBenchmarkEvent_t *pRight )
+{
+	if ( pLeft->m_nTick != pRight->m_nTick )
+		return pLeft->m_nTick - pRight->m_nTick;
+	return pLeft->m_nIndex - pRight->m_nIndex;
+}
+
+static double EventQueueBenchmark_NsPer( const CFastTimer &timer, int nCount )
+{
+	return timer.GetDuration().GetSeconds() * 1000000000.0 / MAX( nCount, 1 );
+}
+
+CON_COMMAND_F( eventqueue_benchmark, "Times adding, cancelling and firing entity I/O events in a private event queue. Arguments are [events] [ticks to spread them over].", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nEvents = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 100000;
+	int nTicks = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 4096;
+
+	CBaseEntity *pEntities[EVENTQUEUE_BENCHMARK_ENTITIES];
+	for ( int i = 0; i < EVENTQUEUE_BENCHMARK_ENTITIES; i++ )
+	{
+		pEntities[i] = CreateEntityByName( "eventqueue_benchmark_target" );
+		if ( !pEntities[i] )
+		{
+			Warning( "eventqueue_benchmark: couldn't create the target entities\n" );
+			for ( int j = 0; j < i; j++ )
+			{
+				UTIL_Remove( pEntities[j] );
+			}
+			return;
+		}
+		DispatchSpawn( pEntities[i] );
+	}
+
+	// spread the events over the ticks with plenty landing on the same tick, then
+	// work out the order they should fire in, leaving out the ones that get cancelled
+	CUtlVector< EventQueueBenchmarkEvent_t > order;
+	order.SetCount( nEvents );
+	uint32 nSeed = 12345;
+	FOR_EACH_VEC( order, i )
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		order[i].m_nTick = ( nSeed >> 8 ) % nTicks;
+		order[i].m_nIndex = i;
+	}
+
+	CUtlVector< int > rank;
+	rank.SetCount( nEvents );
+	CUtlVector< EventQueueBenchmarkEvent_t > sorted;
+	sorted.CopyArray( order.Base(), order.Count() );
+	sorted.Sort( EventQueueBenchmarkCompare );
+	int nExpected = 0;
+	FOR_EACH_VEC( sorted, i )
+	{
+		int nIndex = sorted[i].m_nIndex;
+		rank[nIndex] = ( ( nIndex % EVENTQUEUE_BENCHMARK_ENTITIES ) < EVENTQUEUE_BENCHMARK_CANCELLED ) ? -1 : nExpected++;
+	}
+
+	CEventQueue *pQueue = new CEventQueue;
+	float flInterval = gpGlobals->interval_per_tick;
+	float flStartTime = gpGlobals->curtime;
+
+	CFastTimer addTimer;
+	addTimer.Start();
+	FOR_EACH_VEC( order, i )
+	{
+		variant_t value;
+		value.SetInt( rank[i] );
+		CBaseEntity *pCaller = pEntities[i % EVENTQUEUE_BENCHMARK_ENTITIES];
+		CBaseEntity *pTarget = pEntities[( i * 13 + 7 ) % EVENTQUEUE_BENCHMARK_ENTITIES];
+		pQueue->AddEvent( pTarget, "Fire", value, order[i].m_nTick * flInterval, NULL, pCaller );
+	}
+	addTimer.End();
+
+	CFastTimer pendingTimer;
+	int nPending = 0;
+	pendingTimer.Start();
+	for ( int i = 0; i < EVENTQUEUE_BENCHMARK_ENTITIES; i++ )
+	{
+		nPending += pQueue->HasEventPending( pEntities[i], "Fire" ) ? 1 : 0;
+		nPending += pQueue->HasEventPending( pEntities[i], "NoSuchInput" ) ? 1 : 0;
+	}
+	pendingTimer.End();
+
+	CFastTimer cancelTimer;
+	cancelTimer.Start();
+	for ( int i = 0; i < EVENTQUEUE_BENCHMARK_CANCELLED; i++ )
+	{
+		pQueue->CancelEvents( pEntities[i] );
+	}
+	cancelTimer.End();
+	int nQueued = pQueue->GetEventCount();
+
+	s_nEventQueueBenchmarkNext = 0;
+	s_nEventQueueBenchmarkErrors = 0;
+
+	// step through the ticks the way the server would
+	CFastTimer fireTimer;
+	fireTimer.Start();
+	for ( int nTick = 0; nTick <= nTicks; nTick++ )
+	{
+		pQueue->ServiceEvents( flStartTime + nTick * flInterval );
+	}
+	fireTimer.End();
+
+	int nLeft = pQueue->GetEventCount();
+	delete pQueue;
+
+	for ( int i = 0; i < EVENTQUEUE_BENCHMARK_ENTITIES; i++ )
+	{
+		UTIL_Remove( pEntities[i] );
+	}
+
+	Msg( "eventqueue_benchmark: %d events over %d ticks, %d between %d entities\n", nEvents, nTicks, nEvents, EVENTQUEUE_BENCHMARK_ENTITIES );
+	Msg( "  add      %8.1f ns/event\n", EventQueueBenchmark_NsPer( addTimer, nEvents ) );
+	Msg( "  pending  %8.1f ns/query (%d of %d true)\n", EventQueueBenchmark_NsPer( pendingTimer, EVENTQUEUE_BENCHMARK_ENTITIES * 2 ), nPending, EVENTQUEUE_BENCHMARK_ENTITIES * 2 );
+	Msg( "  cancel   %8.1f ns/event (%d cancelled)\n", EventQueueBenchmark_NsPer( cancelTimer, nEvents - nQueued ), nEvents - nQueued );
+	Msg( "  fire     %8.1f ns/event (%.2f ms total)\n", EventQueueBenchmark_NsPer( fireTimer, nQueued ), fireTimer.GetDuration().GetMillisecondsF() );
+
+	if ( nQueued != nExpected || s_nEventQueueBenchmarkNext != nExpected || nLeft || s_nEventQueueBenchmarkErrors )
+	{
+		Warning( "eventqueue_benchmark: FAILED, %d queued, %d fired of %d expected, %d left over, %d out of order\n",
+			nQueued, s_nEventQueueBenchmarkNext, nExpected, nLeft, s_nEventQueueBenchmarkErrors );
+	}
+}
@@ -807,6 +807,18 @@ bool CHL2MP_Player::WantsLagCompensationOnEntity( const CBasePlayer *pPlayer, co
 	return true;
 }
 
+bool CHL2MP_Player::WantsLagCompensationOnNPC( const CBaseCombatCharacter *pNPC, const CUserCmd *pCmd, const CBitVec<MAX_EDICTS> *pEntityTransmitBits ) const
+{
+	// No need to lag compensate at all if we're not attacking in this command and
+	// we haven't attacked recently.
+	if ( !( pCmd->buttons & (IN_ATTACK | IN_ATTACK2) ) && (pCmd->command_number - m_iLastWeaponFireUsercmd > 5) )
+	{
+		return false;
+	}
+
+	return BaseClass::WantsLagCompensationOnNPC( pNPC, pCmd, pEntityTransmitBits );
+}
+
 Activity CHL2MP_Player::TranslateTeamActivity( Activity ActToTranslate )
 {
 	if ( m_iModelType == TEAM_COMBINE )
@@ -12,6 +12,7 @@
 #endif
 
 class CBasePlayer;
+class CBaseCombatCharacter;
 class CUserCmd;
 
 //-----------------------------------------------------------------------------
@@ -24,6 +25,10 @@ public:
 	virtual void	StartLagCompensation( CBasePlayer *player, CUserCmd *cmd ) = 0;
 	virtual void	FinishLagCompensation( CBasePlayer *player ) = 0;
 	virtual bool	IsCurrentlyDoingLagCompensation() const = 0;
+
+	// Non-player characters (NPCs, NextBots) that should be rewound as well
+	virtual void	AddAdditionalEntity( CBaseCombatCharacter *pEntity ) = 0;
+	virtual void	RemoveAdditionalEntity( CBaseCombatCharacter *pEntity ) = 0;
 };
 
 extern ILagCompensationManager *lagcompensation;
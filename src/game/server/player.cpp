@@ -800,6 +800,15 @@ bool CBasePlayer::WantsLagCompensationOnEntity( const CBasePlayer *pPlayer, cons
 	return true;
 }
 
+bool CBasePlayer::WantsLagCompensationOnNPC( const CBaseCombatCharacter *pNPC, const CUserCmd *pCmd, const CBitVec<MAX_EDICTS> *pEntityTransmitBits ) const
+{
+	// If this entity hasn't been transmitted to us and acked, then don't bother lag compensating it.
+	if ( pEntityTransmitBits && !pEntityTransmitBits->Get( pNPC->entindex() ) )
+		return false;
+
+	return true;
+}
+
 void CBasePlayer::PauseBonusProgress( bool bPause )
 {
 	m_bPauseBonusProgress = bPause;
@@ -13,6 +13,7 @@
 #include "utllinkedlist.h"
 #include "BaseAnimatingOverlay.h"
 #include "tier0/vprof.h"
+#include "collisionutils.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -127,29 +128,258 @@ public:
 };
 
 
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Fixed capacity lag history for one entity, newest record first.
+//			Every field lives in its own array indexed by ring slot, so the
+//			binary search on simulation time only touches the time array and
+//			recording never allocates once the ring exists.
+//-----------------------------------------------------------------------------
+class CLagTrack
+{
+public:
+	CLagTrack()
+	{
+		m_nCapacity = 0;
+		m_nMask = 0;
+		m_iHead = 0;
+		m_nCount = 0;
+		m_nHeadSerial = 0;
+		m_nBreakSerial = 0;
+
+		m_flSimulationTime = NULL;
+		m_fFlags = NULL;
+		m_vecOrigin = NULL;
+		m_vecAngles = NULL;
+		m_vecMinsPreScaled = NULL;
+		m_vecMaxsPreScaled = NULL;
+		m_masterSequence = NULL;
+		m_masterCycle = NULL;
+		m_layerRecords = NULL;
+		m_flPoseParameters = NULL;
+	}
+
+	~CLagTrack()
+	{
+		Purge();
+	}
+
+	// Frees the ring
+	void Purge()
+	{
+		delete[] m_flSimulationTime;
+		delete[] m_fFlags;
+		delete[] m_vecOrigin;
+		delete[] m_vecAngles;
+		delete[] m_vecMinsPreScaled;
+		delete[] m_vecMaxsPreScaled;
+		delete[] m_masterSequence;
+		delete[] m_masterCycle;
+		delete[] m_layerRecords;
+		delete[] m_flPoseParameters;
+
+		m_flSimulationTime = NULL;
+		m_fFlags = NULL;
+		m_vecOrigin = NULL;
+		m_vecAngles = NULL;
+		m_vecMinsPreScaled = NULL;
+		m_vecMaxsPreScaled = NULL;
+		m_masterSequence = NULL;
+		m_masterCycle = NULL;
+		m_layerRecords = NULL;
+		m_flPoseParameters = NULL;
+
+		m_nCapacity = 0;
+		m_nMask = 0;
+		RemoveAll();
+	}
+
+	// Forgets the history but keeps the ring around
+	void RemoveAll()
+	{
+		m_iHead = 0;
+		m_nCount = 0;
+		m_nBreakSerial = m_nHeadSerial;
+	}
+
+	int		Count() const								{ return m_nCount; }
+
+	// Ring slot of the record iAge records older than the newest one
+	int		Slot( int iAge ) const						{ Assert( iAge >= 0 && iAge < m_nCount ); return ( m_iHead - iAge ) & m_nMask; }
+
+	float	GetSimulationTime( int iAge ) const			{ return m_flSimulationTime[ Slot( iAge ) ]; }
+	float	GetOldestSimulationTime() const				{ return GetSimulationTime( m_nCount - 1 ); }
+
+	// Returns the ring slot for a new newest record, overwriting the oldest
+	// record if the ring is full
+	int AddToHead()
+	{
+		if ( !m_nCapacity )
+		{
+			Allocate();
+		}
+
+		m_iHead = ( m_iHead + 1 ) & m_nMask;
+		++m_nHeadSerial;
+		if ( m_nCount < m_nCapacity )
+		{
+			++m_nCount;
+		}
+		return m_iHead;
+	}
+
+	void RemoveTail()
+	{
+		Assert( m_nCount > 0 );
+		--m_nCount;
+	}
+
+	// Backtracking walks from the newest record towards older ones and gives up
+	// at a dead record, or at a record that is too far from the one after it.
+	// Rather than walking, remember the newest record that would stop the walk.
+	void MarkDiscontinuity( float flTeleportDistanceSqr )
+	{
+		if ( !( m_fFlags[ Slot( 0 ) ] & LC_ALIVE ) )
+		{
+			m_nBreakSerial = m_nHeadSerial;
+		}
+		else if ( m_nCount > 1 )
+		{
+			Vector delta = m_vecOrigin[ Slot( 1 ) ] - m_vecOrigin[ Slot( 0 ) ];
+			if ( delta.Length2DSqr() > flTeleportDistanceSqr )
+			{
+				m_nBreakSerial = MAX( m_nBreakSerial, m_nHeadSerial - 1 );
+			}
+		}
+	}
+
+	// Can the backtrack walk reach this record?
+	bool IsReachable( int iAge ) const
+	{
+		return ( m_nHeadSerial - (unsigned int)iAge ) > m_nBreakSerial;
+	}
+
+	// Age of the newest record at or before flTargetTime, or the oldest record
+	// if they are all newer
+	int FindRecord( float flTargetTime ) const
+	{
+		Assert( m_nCount > 0 );
+
+		// Simulation times decrease with age
+		int lo = 0;
+		int hi = m_nCount - 1;
+		while ( lo < hi )
+		{
+			int mid = ( lo + hi ) >> 1;
+			if ( GetSimulationTime( mid ) <= flTargetTime )
+			{
+				hi = mid;
+			}
+			else
+			{
+				lo = mid + 1;
+			}
+		}
+		return lo;
+	}
+
+private:
+	void Allocate()
+	{
+		// Enough ticks for the largest sv_maxunlag plus the 200ms of slack
+		// StartLagCompensation allows on the client's command tick
+		int nTicks = TIME_TO_TICKS( 1.2f ) + 2;
+		m_nCapacity = 1;
+		while ( m_nCapacity < nTicks )
+		{
+			m_nCapacity <<= 1;
+		}
+		m_nMask = m_nCapacity - 1;
+
+		m_flSimulationTime	= new float[ m_nCapacity ];
+		m_fFlags			= new int[ m_nCapacity ];
+		m_vecOrigin			= new Vector[ m_nCapacity ];
+		m_vecAngles			= new QAngle[ m_nCapacity ];
+		m_vecMinsPreScaled	= new Vector[ m_nCapacity ];
+		m_vecMaxsPreScaled	= new Vector[ m_nCapacity ];
+		m_masterSequence	= new int[ m_nCapacity ];
+		m_masterCycle		= new float[ m_nCapacity ];
+		m_layerRecords		= new LayerRecord[ m_nCapacity * MAX_LAYER_RECORDS ];
+		m_flPoseParameters	= new float[ m_nCapacity * MAXSTUDIOPOSEPARAM ];
+
+		m_iHead = m_nMask;
+		m_nCount = 0;
+	}
+
+	int				m_nCapacity;
+	int				m_nMask;
+	int				m_iHead;
+	int				m_nCount;
+
+	// Serial numbers count every record ever added, the newest has m_nHeadSerial
+	unsigned int	m_nHeadSerial;
+	unsigned int	m_nBreakSerial;
+
+public:
+	float			*m_flSimulationTime;
+	int				*m_fFlags;
+	Vector			*m_vecOrigin;
+	QAngle			*m_vecAngles;
+	Vector			*m_vecMinsPreScaled;
+	Vector			*m_vecMaxsPreScaled;
+	int				*m_masterSequence;
+	float			*m_masterCycle;
+	LayerRecord		*m_layerRecords;		// MAX_LAYER_RECORDS per slot
+	float			*m_flPoseParameters;	// MAXSTUDIOPOSEPARAM per slot
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: What a backtrack changed on one entity, and what to put back
+//-----------------------------------------------------------------------------
+struct LagRestore_t
+{
+	int						m_iEntIndex;
+	LagRecord				m_Restore;	// entity data before we moved it back
+	LagRecord				m_Change;	// entity data where we moved it back
+};
+
+
+//
+// Try to take the entity from its current origin to vWantedPos.
+// If it can't get there, leave the entity where it is.
 //
-// Try to take the player from his current origin to vWantedPos.
-// If it can't get there, leave the player where he is.
-// 
 
 ConVar sv_unlag_debug( "sv_unlag_debug", "0", FCVAR_GAMEDLL | FCVAR_DEVELOPMENTONLY );
 
+ConVar sv_unlag_npcs( "sv_unlag_npcs", "1", FCVAR_DEVELOPMENTONLY, "Enables lag compensation of NPCs and NextBots" );
+ConVar sv_unlag_npc_hull_bloat( "sv_unlag_npc_hull_bloat", "24", FCVAR_DEVELOPMENTONLY, "Units an NPC hull is grown by before testing it against the shooter's aim ray" );
+ConVar sv_unlag_npc_ray_spread( "sv_unlag_npc_ray_spread", "0.1", FCVAR_DEVELOPMENTONLY, "Additional NPC hull growth per unit of distance from the shooter, to cover weapon spread" );
+
 float g_flFractionScale = 0.95;
-static void RestorePlayerTo( CBasePlayer *pPlayer, const Vector &vWantedPos )
+
+static unsigned int LagCompensationSolidMask( CBaseCombatCharacter *pEntity )
+{
+	return pEntity->IsPlayer() ? MASK_PLAYERSOLID : pEntity->PhysicsSolidMaskForEntity();
+}
+
+static void RestoreEntityTo( CBaseCombatCharacter *pEntity, const Vector &vWantedPos )
 {
 	// Try to move to the wanted position from our current position.
 	trace_t tr;
-	VPROF_BUDGET( "RestorePlayerTo", "CLagCompensationManager" );
-	UTIL_TraceEntity( pPlayer, vWantedPos, vWantedPos, MASK_PLAYERSOLID, pPlayer, COLLISION_GROUP_PLAYER_MOVEMENT, &tr );
+	VPROF_BUDGET( "RestoreEntityTo", "CLagCompensationManager" );
+	int collisionGroup = pEntity->IsPlayer() ? COLLISION_GROUP_PLAYER_MOVEMENT : pEntity->GetCollisionGroup();
+	UTIL_TraceEntity( pEntity, vWantedPos, vWantedPos, LagCompensationSolidMask( pEntity ), pEntity, collisionGroup, &tr );
 	if ( tr.startsolid || tr.allsolid )
 	{
 		if ( sv_unlag_debug.GetBool() )
 		{
-			DevMsg( "RestorePlayerTo() could not restore player position for client \"%s\" ( %.1f %.1f %.1f )\n",
-					pPlayer->GetPlayerName(), vWantedPos.x, vWantedPos.y, vWantedPos.z );
+			DevMsg( "RestoreEntityTo() could not restore position for \"%s\" ( %.1f %.1f %.1f )\n",
+					pEntity->GetDebugName(), vWantedPos.x, vWantedPos.y, vWantedPos.z );
 		}
 
-		UTIL_TraceEntity( pPlayer, pPlayer->GetLocalOrigin(), vWantedPos, MASK_PLAYERSOLID, pPlayer, COLLISION_GROUP_PLAYER_MOVEMENT, &tr );
+		UTIL_TraceEntity( pEntity, pEntity->GetLocalOrigin(), vWantedPos, LagCompensationSolidMask( pEntity ), pEntity, collisionGroup, &tr );
 		if ( tr.startsolid || tr.allsolid )
 		{
 			// In this case, the guy got stuck back wherever we lag compensated him to. Nasty.
@@ -161,8 +391,8 @@ static void RestorePlayerTo( CBasePlayer *pPlayer, const Vector &vWantedPos )
 		{
 			// We can get to a valid place, but not all the way back to where we were.
 			Vector vPos;
-			VectorLerp( pPlayer->GetLocalOrigin(), vWantedPos, tr.fraction * g_flFractionScale, vPos );
-			UTIL_SetOrigin( pPlayer, vPos, true );
+			VectorLerp( pEntity->GetLocalOrigin(), vWantedPos, tr.fraction * g_flFractionScale, vPos );
+			UTIL_SetOrigin( pEntity, vPos, true );
 
 			if ( sv_unlag_debug.GetBool() )
 				DevMsg( " restore got most of the way\n" );
@@ -170,14 +400,14 @@ static void RestorePlayerTo( CBasePlayer *pPlayer, const Vector &vWantedPos )
 	}
 	else
 	{
-		// Cool, the player can go back to whence he came.
-		UTIL_SetOrigin( pPlayer, tr.endpos, true );
+		// Cool, the entity can go back to whence it came.
+		UTIL_SetOrigin( pEntity, tr.endpos, true );
 	}
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: 
+// Purpose:
 //-----------------------------------------------------------------------------
 class CLagCompensationManager : public CAutoGameSystemPerFrame, public ILagCompensationManager
 {
@@ -185,6 +415,9 @@ public:
 	CLagCompensationManager( char const *name ) : CAutoGameSystemPerFrame( name ), m_flTeleportDistanceSqr( 64 *64 )
 	{
 		m_isCurrentlyDoingCompensation = false;
+		m_pCurrentPlayer = NULL;
+		m_bNeedToRestore = false;
+		m_bHasHistory = false;
 	}
 
 	// IServerSystem stuff
@@ -196,6 +429,7 @@ public:
 	virtual void LevelShutdownPostEntity()
 	{
 		ClearHistory();
+		m_AdditionalEntities.Purge();
 	}
 
 	// called after entities think
@@ -209,24 +443,36 @@ public:
 
 	bool			IsCurrentlyDoingLagCompensation() const OVERRIDE { return m_isCurrentlyDoingCompensation; }
 
+	void			AddAdditionalEntity( CBaseCombatCharacter *pEntity ) OVERRIDE;
+	void			RemoveAdditionalEntity( CBaseCombatCharacter *pEntity ) OVERRIDE;
+
 private:
-	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
+	void			RecordEntity( CBaseCombatCharacter *pEntity, float flDeadtime );
+	void			BacktrackEntity( CBaseCombatCharacter *pEntity, float flTargetTime, const Vector *pRayStart, const Vector *pRayDelta );
 
 	void ClearHistory()
 	{
-		for ( int i=0; i<MAX_PLAYERS; i++ )
-			m_PlayerTrack[i].Purge();
+		if ( !m_bHasHistory )
+			return;
+
+		for ( int i=0; i<MAX_EDICTS; i++ )
+			m_EntityTrack[i].Purge();
+		m_bHasHistory = false;
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	// keep a ring of lag records for each player and each additional entity, by entity index
+	CLagTrack				m_EntityTrack[ MAX_EDICTS ];
+
+	bool					m_bHasHistory;
+
+	// Non-player characters that asked to be lag compensated
+	CUtlVector< CHandle< CBaseCombatCharacter > >	m_AdditionalEntities;
 
 	// Scratchpad for determining what needs to be restored
-	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
+	CBitVec<MAX_EDICTS>		m_RestoreEntity;
 	bool					m_bNeedToRestore;
-	
-	LagRecord				m_RestoreData[ MAX_PLAYERS ];	// player data before we moved him back
-	LagRecord				m_ChangeData[ MAX_PLAYERS ];	// player data where we moved him back
+
+	CUtlVector< LagRestore_t >	m_RestoreData;	// entities we moved back this session
 
 	CBasePlayer				*m_pCurrentPlayer;	// The player we are doing lag compensation for
 
@@ -239,6 +485,30 @@ static CLagCompensationManager g_LagCompensationManager( "CLagCompensationManage
 ILagCompensationManager *lagcompensation = &g_LagCompensationManager;
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Non-player characters opt in through CBaseCombatCharacter::SetLagCompensated
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::AddAdditionalEntity( CBaseCombatCharacter *pEntity )
+{
+	Assert( pEntity && !pEntity->IsPlayer() );
+
+	CHandle< CBaseCombatCharacter > hEntity( pEntity );
+	if ( m_AdditionalEntities.Find( hEntity ) == m_AdditionalEntities.InvalidIndex() )
+	{
+		m_AdditionalEntities.AddToTail( hEntity );
+	}
+}
+
+void CLagCompensationManager::RemoveAdditionalEntity( CBaseCombatCharacter *pEntity )
+{
+	CHandle< CBaseCombatCharacter > hEntity( pEntity );
+	m_AdditionalEntities.FindAndFastRemove( hEntity );
+
+	// The entity index will get reused, don't leave this history lying around
+	m_EntityTrack[ pEntity->entindex() ].Purge();
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Called once per frame after all entities have had a chance to think
 //-----------------------------------------------------------------------------
@@ -249,96 +519,111 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 		ClearHistory();
 		return;
 	}
-	
+
 	m_flTeleportDistanceSqr = sv_lagcompensation_teleport_dist.GetFloat() * sv_lagcompensation_teleport_dist.GetFloat();
 
 	VPROF_BUDGET( "FrameUpdatePostEntityThink", "CLagCompensationManager" );
 
-	// remove all records before that time:
-	int flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
+	// remove all records before that time (allowing for the 200ms
+	// StartLagCompensation lets the command tick be off by)
+	float flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat() - 0.2f;
 
 	// Iterate all active players
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
-
 		if ( !pPlayer )
 		{
-			if ( track->Count() > 0 )
-			{
-				track->RemoveAll();
-			}
-
+			m_EntityTrack[i].RemoveAll();
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
+		RecordEntity( pPlayer, flDeadtime );
+	}
 
-		// remove tail records that are too old
-		intp tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
+	// And everything else that wants it
+	bool bUnlagNPCs = sv_unlag_npcs.GetBool();
+	FOR_EACH_VEC_BACK( m_AdditionalEntities, i )
+	{
+		CBaseCombatCharacter *pEntity = m_AdditionalEntities[i];
+		if ( !pEntity )
 		{
-			LagRecord &tail = track->Element( tailIndex );
-
-			// if tail is within limits, stop
-			if ( tail.m_flSimulationTime >= flDeadtime )
-				break;
-			
-			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
+			m_AdditionalEntities.FastRemove( i );
+			continue;
 		}
 
-		// check if head has same simulation time
-		if ( track->Count() > 0 )
+		if ( !bUnlagNPCs )
 		{
-			LagRecord &head = track->Element( track->Head() );
-
-			// check if player changed simulation time since last time updated
-			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
-				continue; // don't add new entry for same or older time
+			m_EntityTrack[ pEntity->entindex() ].RemoveAll();
+			continue;
 		}
 
-		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+		RecordEntity( pEntity, flDeadtime );
+	}
 
-		record.m_fFlags = 0;
-		if ( pPlayer->IsAlive() )
-		{
-			record.m_fFlags |= LC_ALIVE;
-		}
+	//Clear the current player.
+	m_pCurrentPlayer = NULL;
+}
 
-		record.m_flSimulationTime	= pPlayer->GetSimulationTime();
-		record.m_vecAngles			= pPlayer->GetLocalAngles();
-		record.m_vecOrigin			= pPlayer->GetLocalOrigin();
-		record.m_vecMinsPreScaled	= pPlayer->CollisionProp()->OBBMinsPreScaled();
-		record.m_vecMaxsPreScaled	= pPlayer->CollisionProp()->OBBMaxsPreScaled();
+void CLagCompensationManager::RecordEntity( CBaseCombatCharacter *pEntity, float flDeadtime )
+{
+	CLagTrack *track = &m_EntityTrack[ pEntity->entindex() ];
 
-		int layerCount = pPlayer->GetNumAnimOverlays();
-		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
-		{
-			CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
-			if( currentLayer )
-			{
-				record.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-				record.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-				record.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-				record.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
-			}
-		}
-		record.m_masterSequence = pPlayer->GetSequence();
-		record.m_masterCycle = pPlayer->GetCycle();
+	// remove tail records that are too old
+	while ( track->Count() > 0 && track->GetOldestSimulationTime() < flDeadtime )
+	{
+		track->RemoveTail();
+	}
 
-		for( int i=0; i<MAXSTUDIOPOSEPARAM; i++ )
+	// check if head has same simulation time
+	if ( track->Count() > 0 )
+	{
+		// check if entity changed simulation time since last time updated
+		if ( track->GetSimulationTime( 0 ) >= pEntity->GetSimulationTime() )
+			return; // don't add new entry for same or older time
+	}
+
+	// add new record to entity track
+	int slot = track->AddToHead();
+	m_bHasHistory = true;
+
+	int fFlags = 0;
+	if ( pEntity->IsAlive() )
+	{
+		fFlags |= LC_ALIVE;
+	}
+
+	track->m_fFlags[slot]				= fFlags;
+	track->m_flSimulationTime[slot]		= pEntity->GetSimulationTime();
+	track->m_vecAngles[slot]			= pEntity->GetLocalAngles();
+	track->m_vecOrigin[slot]			= pEntity->GetLocalOrigin();
+	track->m_vecMinsPreScaled[slot]		= pEntity->CollisionProp()->OBBMinsPreScaled();
+	track->m_vecMaxsPreScaled[slot]		= pEntity->CollisionProp()->OBBMaxsPreScaled();
+
+	LayerRecord *pLayerRecords = &track->m_layerRecords[ slot * MAX_LAYER_RECORDS ];
+	int layerCount = MIN( pEntity->GetNumAnimOverlays(), MAX_LAYER_RECORDS );
+	for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+	{
+		CAnimationLayer *currentLayer = pEntity->GetAnimOverlay(layerIndex);
+		if( currentLayer )
 		{
-			record.m_flPoseParameters[i] = pPlayer->GetPoseParameter(i);
+			pLayerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
+			pLayerRecords[layerIndex].m_order = currentLayer->m_nOrder;
+			pLayerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
+			pLayerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
 		}
 	}
+	track->m_masterSequence[slot] = pEntity->GetSequence();
+	track->m_masterCycle[slot] = pEntity->GetCycle();
 
-	//Clear the current player.
-	m_pCurrentPlayer = NULL;
+	float *pPoseParameters = &track->m_flPoseParameters[ slot * MAXSTUDIOPOSEPARAM ];
+	for( int i=0; i<MAXSTUDIOPOSEPARAM; i++ )
+	{
+		pPoseParameters[i] = pEntity->GetPoseParameter(i);
+	}
+
+	track->MarkDiscontinuity( m_flTeleportDistanceSqr );
 }
 
 // Called during player movement to set up/restore after lag compensation
@@ -355,12 +640,13 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		return;
 	}
 
-	// Assume no players need to be restored
-	m_RestorePlayer.ClearAll();
+	// Assume no entities need to be restored
+	m_RestoreEntity.ClearAll();
+	m_RestoreData.RemoveAll();
 	m_bNeedToRestore = false;
 
 	m_pCurrentPlayer = player;
-	
+
 	if ( !player->m_bLagCompensation		// Player not wanting lag compensation
 		 || (gpGlobals->maxClients <= 1)	// no lag compensation in single player
 		 || !sv_unlag.GetBool()				// disabled by server admin
@@ -371,8 +657,6 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 
 	// NOTE: Put this here so that it won't show up in single player mode.
 	VPROF_BUDGET( "StartLagCompensation", VPROF_BUDGETGROUP_OTHER_NETWORKING );
-	Q_memset( m_RestoreData, 0, sizeof( m_RestoreData ) );
-	Q_memset( m_ChangeData, 0, sizeof( m_ChangeData ) );
 
 	m_isCurrentlyDoingCompensation = true;
 
@@ -381,7 +665,7 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 	// correct is the amout of time we have to correct game time
 	float correct = 0.0f;
 
-	INetChannelInfo *nci = engine->GetPlayerNetInfo( player->entindex() ); 
+	INetChannelInfo *nci = engine->GetPlayerNetInfo( player->entindex() );
 
 	if ( nci )
 	{
@@ -394,11 +678,11 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 
 	// add view interpolation latency see C_BaseEntity::GetInterpolationAmount()
 	correct += TICKS_TO_TIME( lerpTicks );
-	
+
 	// check bouns [0,sv_maxunlag]
 	correct = clamp( correct, 0.0f, sv_maxunlag.GetFloat() );
 
-	// correct tick send by player 
+	// correct tick send by player
 	int targettick = cmd->tick_count - lerpTicks;
 
 	// calc difference between tick send by player and our latency based tick
@@ -410,7 +694,7 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		// DevMsg("StartLagCompensation: delta too big (%.3f)\n", deltaTime );
 		targettick = gpGlobals->tickcount - TIME_TO_TICKS( correct );
 	}
-	
+
 	// Iterate all active players
 	const CBitVec<MAX_EDICTS> *pEntityTransmitBits = engine->GetEntityTransmitBitsForClient( player->entindex() - 1 );
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
@@ -433,108 +717,111 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 			continue;
 
 		// Move other player back in time
-		BacktrackPlayer( pPlayer, TICKS_TO_TIME( targettick ) );
+		BacktrackEntity( pPlayer, TICKS_TO_TIME( targettick ), NULL, NULL );
+	}
+
+	if ( !sv_unlag_npcs.GetBool() || !m_AdditionalEntities.Count() )
+		return;
+
+	// NPCs only get moved if the shooter's aim could hit them where they were
+	Vector vecForward;
+	AngleVectors( cmd->viewangles, &vecForward );
+	Vector vecRayStart = player->Weapon_ShootPosition();
+	Vector vecRayDelta = vecForward * MAX_TRACE_LENGTH;
+
+	FOR_EACH_VEC( m_AdditionalEntities, i )
+	{
+		CBaseCombatCharacter *pEntity = m_AdditionalEntities[i];
+		if ( !pEntity )
+			continue;
+
+		if ( !player->WantsLagCompensationOnNPC( pEntity, cmd, pEntityTransmitBits ) )
+			continue;
+
+		BacktrackEntity( pEntity, TICKS_TO_TIME( targettick ), &vecRayStart, &vecRayDelta );
 	}
 }
 
-void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
+void CLagCompensationManager::BacktrackEntity( CBaseCombatCharacter *pEntity, float flTargetTime, const Vector *pRayStart, const Vector *pRayDelta )
 {
 	Vector org;
 	Vector minsPreScaled;
 	Vector maxsPreScaled;
 	QAngle ang;
 
-	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
-	int pl_index = pPlayer->entindex() - 1;
+	VPROF_BUDGET( "BacktrackEntity", "CLagCompensationManager" );
+	int ent_index = pEntity->entindex();
 
-	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
+	// get track history of this entity
+	CLagTrack *track = &m_EntityTrack[ ent_index ];
 
 	// check if we have at leat one entry
 	if ( track->Count() <= 0 )
 		return;
 
-	intp curr = track->Head();
+	// find the record to move back to, and the newer one to interpolate towards
+	int iRecord = track->FindRecord( flTargetTime );
+	int iPrevRecord = iRecord - 1;
 
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
+	// The walk back from the present would have stopped at a dead or teleported record
+	if ( !track->IsReachable( iRecord ) )
+		return;
 
-	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	Vector delta = track->m_vecOrigin[ track->Slot( 0 ) ] - pEntity->GetLocalOrigin();
+	if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
 	{
-		// remember last record
-		prevRecord = record;
-
-		// get next record
-		record = &track->Element( curr );
-
-		if ( !(record->m_fFlags & LC_ALIVE) )
-		{
-			// player most be alive, lost track
-			return;
-		}
-
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
-		{
-			// lost track, too much difference
-			return; 
-		}
-
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
-
-		prevOrg = record->m_vecOrigin;
-
-		// go one step back
-		curr = track->Next( curr );
+		// lost track, too much difference
+		return;
 	}
 
-	Assert( record );
-
-	if ( !record )
-	{
-		if ( sv_unlag_debug.GetBool() )
-		{
-			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
-		}
-
-		return; // that should never happen
-	}
+	int record = track->Slot( iRecord );
+	int prevRecord = ( iPrevRecord >= 0 ) ? track->Slot( iPrevRecord ) : -1;
 
 	float frac = 0.0f;
-	if ( prevRecord && 
-		 (record->m_flSimulationTime < flTargetTime) &&
-		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
+	if ( prevRecord != -1 &&
+		 (track->m_flSimulationTime[record] < flTargetTime) &&
+		 (track->m_flSimulationTime[record] < track->m_flSimulationTime[prevRecord]) )
 	{
 		// we didn't find the exact time but have a valid previous record
 		// so interpolate between these two records;
 
-		Assert( prevRecord->m_flSimulationTime > record->m_flSimulationTime );
-		Assert( flTargetTime < prevRecord->m_flSimulationTime );
+		Assert( track->m_flSimulationTime[prevRecord] > track->m_flSimulationTime[record] );
+		Assert( flTargetTime < track->m_flSimulationTime[prevRecord] );
 
 		// calc fraction between both records
-		frac = ( flTargetTime - record->m_flSimulationTime ) / 
-			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
+		frac = ( flTargetTime - track->m_flSimulationTime[record] ) /
+			( track->m_flSimulationTime[prevRecord] - track->m_flSimulationTime[record] );
 
 		Assert( frac > 0 && frac < 1 ); // should never extrapolate
 
-		ang				= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
-		org				= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
-		minsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
-		maxsPreScaled	= Lerp( frac, record->m_vecMaxsPreScaled, prevRecord->m_vecMaxsPreScaled );
+		ang				= Lerp( frac, track->m_vecAngles[record], track->m_vecAngles[prevRecord] );
+		org				= Lerp( frac, track->m_vecOrigin[record], track->m_vecOrigin[prevRecord] );
+		minsPreScaled	= Lerp( frac, track->m_vecMinsPreScaled[record], track->m_vecMinsPreScaled[prevRecord] );
+		maxsPreScaled	= Lerp( frac, track->m_vecMaxsPreScaled[record], track->m_vecMaxsPreScaled[prevRecord] );
 	}
 	else
 	{
 		// we found the exact record or no other record to interpolate with
 		// just copy these values since they are the best we have
-		org				= record->m_vecOrigin;
-		ang				= record->m_vecAngles;
-		minsPreScaled	= record->m_vecMinsPreScaled;
-		maxsPreScaled	= record->m_vecMaxsPreScaled;
+		org				= track->m_vecOrigin[record];
+		ang				= track->m_vecAngles[record];
+		minsPreScaled	= track->m_vecMinsPreScaled[record];
+		maxsPreScaled	= track->m_vecMaxsPreScaled[record];
+	}
+
+	// Don't bother moving anything the shot can't reach, wherever it was
+	if ( pRayStart )
+	{
+		float flBloat = sv_unlag_npc_hull_bloat.GetFloat() + sv_unlag_npc_ray_spread.GetFloat() * org.DistTo( *pRayStart );
+		Vector vecBloat( flBloat, flBloat, flBloat );
+
+		// Hulls are recorded before model scale is applied
+		float flScale = pEntity->GetModelScale();
+		Vector vecMins = org + minsPreScaled * flScale - vecBloat;
+		Vector vecMaxs = org + maxsPreScaled * flScale + vecBloat;
+
+		if ( !IsBoxIntersectingRay( vecMins, vecMaxs, *pRayStart, *pRayDelta ) )
+			return;
 	}
 
 	// See if this is still a valid position for us to teleport to
@@ -542,37 +829,36 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	{
 		// Try to move to the wanted position from our current position.
 		trace_t tr;
-		UTIL_TraceEntity( pPlayer, org, org, MASK_PLAYERSOLID, &tr );
+		UTIL_TraceEntity( pEntity, org, org, LagCompensationSolidMask( pEntity ), &tr );
 		if ( tr.startsolid || tr.allsolid )
 		{
 			if ( sv_unlag_debug.GetBool() )
-				DevMsg( "WARNING: BackupPlayer trying to back player into a bad position - client %s\n", pPlayer->GetPlayerName() );
+				DevMsg( "WARNING: BacktrackEntity trying to back entity into a bad position - %s\n", pEntity->GetDebugName() );
 
-			CBasePlayer *pHitPlayer = dynamic_cast<CBasePlayer *>( tr.m_pEnt );
+			CBaseCombatCharacter *pHitEntity = tr.m_pEnt ? tr.m_pEnt->MyCombatCharacterPointer() : NULL;
+			bool bHitTracked = pHitEntity && ( pHitEntity->IsPlayer() || ( pHitEntity->IsLagCompensated() && sv_unlag_npcs.GetBool() ) );
 
 			// don't lag compensate the current player
-			if ( pHitPlayer && ( pHitPlayer != m_pCurrentPlayer ) )	
+			if ( bHitTracked && ( pHitEntity != m_pCurrentPlayer ) )
 			{
-				// If we haven't backtracked this player, do it now
+				// If we haven't backtracked this entity, do it now
 				// this deliberately ignores WantsLagCompensationOnEntity.
-				if ( !m_RestorePlayer.Get( pHitPlayer->entindex() - 1 ) )
+				if ( !m_RestoreEntity.Get( pHitEntity->entindex() ) )
 				{
-					// prevent recursion - save a copy of m_RestorePlayer,
-					// pretend that this player is off-limits
-					int pl_index = pPlayer->entindex() - 1;
+					// prevent recursion - pretend that this entity is off-limits
 
 					// Temp turn this flag on
-					m_RestorePlayer.Set( pl_index );
+					m_RestoreEntity.Set( ent_index );
 
-					BacktrackPlayer( pHitPlayer, flTargetTime );
+					BacktrackEntity( pHitEntity, flTargetTime, NULL, NULL );
 
 					// Remove the temp flag
-					m_RestorePlayer.Clear( pl_index );
-				}				
+					m_RestoreEntity.Clear( ent_index );
+				}
 			}
 
 			// now trace us back as far as we can go
-			UTIL_TraceEntity( pPlayer, pPlayer->GetLocalOrigin(), org, MASK_PLAYERSOLID, &tr );
+			UTIL_TraceEntity( pEntity, pEntity->GetLocalOrigin(), org, LagCompensationSolidMask( pEntity ), &tr );
 
 			if ( tr.startsolid || tr.allsolid )
 			{
@@ -585,8 +871,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			{
 				// We can get to a valid place, but not all the way to the target
 				Vector vPos;
-				VectorLerp( pPlayer->GetLocalOrigin(), org, tr.fraction * g_flFractionScale, vPos );
-				
+				VectorLerp( pEntity->GetLocalOrigin(), org, tr.fraction * g_flFractionScale, vPos );
+
 				// This is as close as we're going to get
 				org = vPos;
 
@@ -595,36 +881,38 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			}
 		}
 	}
-	
-	// See if this represents a change for the player
+
+	// See if this represents a change for the entity
 	int flags = 0;
-	LagRecord *restore = &m_RestoreData[ pl_index ];
-	LagRecord *change  = &m_ChangeData[ pl_index ];
+	LagRestore_t &restoreData = m_RestoreData[ m_RestoreData.AddToTail() ];
+	restoreData.m_iEntIndex = ent_index;
+	LagRecord *restore = &restoreData.m_Restore;
+	LagRecord *change  = &restoreData.m_Change;
 
-	QAngle angdiff = pPlayer->GetLocalAngles() - ang;
-	Vector orgdiff = pPlayer->GetLocalOrigin() - org;
+	QAngle angdiff = pEntity->GetLocalAngles() - ang;
+	Vector orgdiff = pEntity->GetLocalOrigin() - org;
 
 	// Always remember the pristine simulation time in case we need to restore it.
-	restore->m_flSimulationTime = pPlayer->GetSimulationTime();
+	restore->m_flSimulationTime = pEntity->GetSimulationTime();
 
 	if ( angdiff.LengthSqr() > LAG_COMPENSATION_EPS_SQR )
 	{
 		flags |= LC_ANGLES_CHANGED;
-		restore->m_vecAngles = pPlayer->GetLocalAngles();
-		pPlayer->SetLocalAngles( ang );
+		restore->m_vecAngles = pEntity->GetLocalAngles();
+		pEntity->SetLocalAngles( ang );
 		change->m_vecAngles = ang;
 	}
 
 	// Use absolute equality here
-	if ( minsPreScaled != pPlayer->CollisionProp()->OBBMinsPreScaled() || maxsPreScaled != pPlayer->CollisionProp()->OBBMaxsPreScaled() )
+	if ( minsPreScaled != pEntity->CollisionProp()->OBBMinsPreScaled() || maxsPreScaled != pEntity->CollisionProp()->OBBMaxsPreScaled() )
 	{
 		flags |= LC_SIZE_CHANGED;
 
-		restore->m_vecMinsPreScaled = pPlayer->CollisionProp()->OBBMinsPreScaled();
-		restore->m_vecMaxsPreScaled = pPlayer->CollisionProp()->OBBMaxsPreScaled();
-		
-		pPlayer->SetSize( minsPreScaled, maxsPreScaled );
-		
+		restore->m_vecMinsPreScaled = pEntity->CollisionProp()->OBBMinsPreScaled();
+		restore->m_vecMaxsPreScaled = pEntity->CollisionProp()->OBBMaxsPreScaled();
+
+		pEntity->SetSize( minsPreScaled, maxsPreScaled );
+
 		change->m_vecMinsPreScaled = minsPreScaled;
 		change->m_vecMaxsPreScaled = maxsPreScaled;
 	}
@@ -633,8 +921,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	if ( orgdiff.LengthSqr() > LAG_COMPENSATION_EPS_SQR )
 	{
 		flags |= LC_ORIGIN_CHANGED;
-		restore->m_vecOrigin = pPlayer->GetLocalOrigin();
-		pPlayer->SetLocalOrigin( org );
+		restore->m_vecOrigin = pEntity->GetLocalOrigin();
+		pEntity->SetLocalOrigin( org );
 		change->m_vecOrigin = org;
 	}
 
@@ -642,61 +930,69 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	// standing still, but you breathe even on the server.
 	// This is quicker than actually comparing all bazillion floats.
 	flags |= LC_ANIMATION_CHANGED;
-	restore->m_masterSequence = pPlayer->GetSequence();
-	restore->m_masterCycle = pPlayer->GetCycle();
+	restore->m_masterSequence = pEntity->GetSequence();
+	restore->m_masterCycle = pEntity->GetCycle();
+
+	for( int i=0; i<MAXSTUDIOPOSEPARAM; i++ )
+	{
+		restore->m_flPoseParameters[i] = pEntity->GetPoseParameter(i);
+	}
 
 	bool interpolationAllowed = false;
-	if( prevRecord && (record->m_masterSequence == prevRecord->m_masterSequence) )
+	if( prevRecord != -1 && (track->m_masterSequence[record] == track->m_masterSequence[prevRecord]) )
 	{
 		// If the master state changes, all layers will be invalid too, so don't interp (ya know, interp barely ever happens anyway)
 		interpolationAllowed = true;
 	}
-	
+
+	const float *pRecordPoseParameters = &track->m_flPoseParameters[ record * MAXSTUDIOPOSEPARAM ];
+
 	////////////////////////
 	// First do the master settings
 	bool interpolatedMasters = false;
 	if( frac > 0.0f && interpolationAllowed )
 	{
 		interpolatedMasters = true;
-		pPlayer->SetSequence( Lerp( frac, record->m_masterSequence, prevRecord->m_masterSequence ) );
-		pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
+		pEntity->SetSequence( Lerp( frac, track->m_masterSequence[record], track->m_masterSequence[prevRecord] ) );
+		pEntity->SetCycle( Lerp( frac, track->m_masterCycle[record], track->m_masterCycle[prevRecord] ) );
 
-		if( record->m_masterCycle > prevRecord->m_masterCycle )
+		if( track->m_masterCycle[record] > track->m_masterCycle[prevRecord] )
 		{
 			// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
 			// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
-			float newCycle = Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle + 1 );
-			pPlayer->SetCycle(newCycle < 1 ? newCycle : newCycle - 1 );// and make sure .9 to 1.2 does not end up 1.05
+			float newCycle = Lerp( frac, track->m_masterCycle[record], track->m_masterCycle[prevRecord] + 1 );
+			pEntity->SetCycle(newCycle < 1 ? newCycle : newCycle - 1 );// and make sure .9 to 1.2 does not end up 1.05
 		}
 		else
 		{
-			pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
+			pEntity->SetCycle( Lerp( frac, track->m_masterCycle[record], track->m_masterCycle[prevRecord] ) );
 		}
 
 		for( int i=0; i<MAXSTUDIOPOSEPARAM; i++ )
 		{
 			//don't lerp pose params, just pick the closest
-			pPlayer->SetPoseParameter( i, record->m_flPoseParameters[i] );
-			//pAnimating->SetPoseParameter( i, Lerp( frac, record->m_flPoseParameters[i], prevRecord->m_flPoseParameters[i] ) );
+			pEntity->SetPoseParameter( i, pRecordPoseParameters[i] );
 		}
 	}
 	if( !interpolatedMasters )
 	{
-		pPlayer->SetSequence(record->m_masterSequence);
-		pPlayer->SetCycle(record->m_masterCycle);
+		pEntity->SetSequence(track->m_masterSequence[record]);
+		pEntity->SetCycle(track->m_masterCycle[record]);
 
 		for( int i=0; i<MAXSTUDIOPOSEPARAM; i++ )
 		{
-			pPlayer->SetPoseParameter( i, record->m_flPoseParameters[i] );
+			pEntity->SetPoseParameter( i, pRecordPoseParameters[i] );
 		}
 	}
 
 	////////////////////////
 	// Now do all the layers
-	int layerCount = pPlayer->GetNumAnimOverlays();
+	const LayerRecord *pRecordLayers = &track->m_layerRecords[ record * MAX_LAYER_RECORDS ];
+	const LayerRecord *pPrevRecordLayers = ( prevRecord != -1 ) ? &track->m_layerRecords[ prevRecord * MAX_LAYER_RECORDS ] : NULL;
+	int layerCount = MIN( pEntity->GetNumAnimOverlays(), MAX_LAYER_RECORDS );
 	for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
 	{
-		CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
+		CAnimationLayer *currentLayer = pEntity->GetAnimOverlay(layerIndex);
 		if( currentLayer )
 		{
 			restore->m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
@@ -707,8 +1003,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			bool interpolated = false;
 			if( (frac > 0.0f)  &&  interpolationAllowed )
 			{
-				LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
-				LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
+				const LayerRecord &recordsLayerRecord = pRecordLayers[layerIndex];
+				const LayerRecord &prevRecordsLayerRecord = pPrevRecordLayers[layerIndex];
 				if( (recordsLayerRecord.m_order == prevRecordsLayerRecord.m_order)
 					&& (recordsLayerRecord.m_sequence == prevRecordsLayerRecord.m_sequence)
 					)
@@ -734,33 +1030,36 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			if( !interpolated )
 			{
 				//Either no interp, or interp failed.  Just use record.
-				currentLayer->m_flCycle = record->m_layerRecords[layerIndex].m_cycle;
-				currentLayer->m_nOrder = record->m_layerRecords[layerIndex].m_order;
-				currentLayer->m_nSequence = record->m_layerRecords[layerIndex].m_sequence;
-				currentLayer->m_flWeight = record->m_layerRecords[layerIndex].m_weight;
+				currentLayer->m_flCycle = pRecordLayers[layerIndex].m_cycle;
+				currentLayer->m_nOrder = pRecordLayers[layerIndex].m_order;
+				currentLayer->m_nSequence = pRecordLayers[layerIndex].m_sequence;
+				currentLayer->m_flWeight = pRecordLayers[layerIndex].m_weight;
 			}
 		}
 	}
-	
+
 	if ( !flags )
+	{
+		m_RestoreData.RemoveMultipleFromTail( 1 );
 		return; // we didn't change anything
+	}
 
 	if ( sv_lagflushbonecache.GetBool() )
-		pPlayer->InvalidateBoneCache();
+		pEntity->InvalidateBoneCache();
 
 	/*char text[256]; Q_snprintf( text, sizeof(text), "time %.2f", flTargetTime );
-	pPlayer->DrawServerHitboxes( 10 );
+	pEntity->DrawServerHitboxes( 10 );
 	NDebugOverlay::Text( org, text, false, 10 );
-	NDebugOverlay::EntityBounds( pPlayer, 255, 0, 0, 32, 10 ); */
+	NDebugOverlay::EntityBounds( pEntity, 255, 0, 0, 32, 10 ); */
 
-	m_RestorePlayer.Set( pl_index ); //remember that we changed this player
-	m_bNeedToRestore = true;  // we changed at least one player
+	m_RestoreEntity.Set( ent_index ); //remember that we changed this entity
+	m_bNeedToRestore = true;  // we changed at least one entity
 	restore->m_fFlags = flags; // we need to restore these flags
 	change->m_fFlags = flags; // we have changed these flags
 
 	if( sv_showlagcompensation.GetInt() == 1 )
 	{
-		pPlayer->DrawServerHitboxes(4, true);
+		pEntity->DrawServerHitboxes(4, true);
 	}
 }
 
@@ -774,52 +1073,54 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 	if ( !m_bNeedToRestore )
 	{
 		m_isCurrentlyDoingCompensation = false;
-		return; // no player was changed at all
+		return; // no entity was changed at all
 	}
 
-	// Iterate all active players
-	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+	// Iterate all the entities we moved, newest first so that anything
+	// moved twice ends up back where it started
+	FOR_EACH_VEC_BACK( m_RestoreData, iRestore )
 	{
-		int pl_index = i - 1;
-		
-		if ( !m_RestorePlayer.Get( pl_index ) )
+		int ent_index = m_RestoreData[iRestore].m_iEntIndex;
+
+		if ( !m_RestoreEntity.Get( ent_index ) )
 		{
-			// player wasn't changed by lag compensation
+			// entity wasn't changed by lag compensation
 			continue;
 		}
 
-		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
-		if ( !pPlayer )
+		CBaseEntity *pBaseEntity = UTIL_EntityByIndex( ent_index );
+		CBaseCombatCharacter *pEntity = pBaseEntity ? pBaseEntity->MyCombatCharacterPointer() : NULL;
+		if ( !pEntity )
 		{
 			continue;
 		}
 
-		LagRecord *restore = &m_RestoreData[ pl_index ];
-		LagRecord *change  = &m_ChangeData[ pl_index ];
+		LagRecord *restore = &m_RestoreData[iRestore].m_Restore;
+		LagRecord *change  = &m_RestoreData[iRestore].m_Change;
 
 		bool restoreSimulationTime = false;
 
 		if ( restore->m_fFlags & LC_SIZE_CHANGED )
 		{
 			restoreSimulationTime = true;
-	
+
 			// see if simulation made any changes, if no, then do the restore, otherwise,
 			//  leave new values in
-			if ( pPlayer->CollisionProp()->OBBMinsPreScaled() == change->m_vecMinsPreScaled &&
-				pPlayer->CollisionProp()->OBBMaxsPreScaled() == change->m_vecMaxsPreScaled )
+			if ( pEntity->CollisionProp()->OBBMinsPreScaled() == change->m_vecMinsPreScaled &&
+				pEntity->CollisionProp()->OBBMaxsPreScaled() == change->m_vecMaxsPreScaled )
 			{
 				// Restore it
-				pPlayer->SetSize( restore->m_vecMinsPreScaled, restore->m_vecMaxsPreScaled );
+				pEntity->SetSize( restore->m_vecMinsPreScaled, restore->m_vecMaxsPreScaled );
 			}
 		}
 
 		if ( restore->m_fFlags & LC_ANGLES_CHANGED )
-		{		   
+		{
 			restoreSimulationTime = true;
 
-			if ( pPlayer->GetLocalAngles() == change->m_vecAngles )
+			if ( pEntity->GetLocalAngles() == change->m_vecAngles )
 			{
-				pPlayer->SetLocalAngles( restore->m_vecAngles );
+				pEntity->SetLocalAngles( restore->m_vecAngles );
 			}
 		}
 
@@ -828,12 +1129,12 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 			restoreSimulationTime = true;
 
 			// Okay, let's see if we can do something reasonable with the change
-			Vector delta = pPlayer->GetLocalOrigin() - change->m_vecOrigin;
-			
-			// If it moved really far, just leave the player in the new spot!!!
+			Vector delta = pEntity->GetLocalOrigin() - change->m_vecOrigin;
+
+			// If it moved really far, just leave the entity in the new spot!!!
 			if ( delta.Length2DSqr() < m_flTeleportDistanceSqr )
 			{
-				RestorePlayerTo( pPlayer, restore->m_vecOrigin + delta );
+				RestoreEntityTo( pEntity, restore->m_vecOrigin + delta );
 			}
 		}
 
@@ -841,13 +1142,13 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 		{
 			restoreSimulationTime = true;
 
-			pPlayer->SetSequence(restore->m_masterSequence);
-			pPlayer->SetCycle(restore->m_masterCycle);
+			pEntity->SetSequence(restore->m_masterSequence);
+			pEntity->SetCycle(restore->m_masterCycle);
 
-			int layerCount = pPlayer->GetNumAnimOverlays();
+			int layerCount = MIN( pEntity->GetNumAnimOverlays(), MAX_LAYER_RECORDS );
 			for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
 			{
-				CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
+				CAnimationLayer *currentLayer = pEntity->GetAnimOverlay(layerIndex);
 				if( currentLayer )
 				{
 					currentLayer->m_flCycle = restore->m_layerRecords[layerIndex].m_cycle;
@@ -859,17 +1160,16 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 
 			for( int i=0; i<MAXSTUDIOPOSEPARAM; i++ )
 			{
-				pPlayer->SetPoseParameter( i, restore->m_flPoseParameters[i] );
+				pEntity->SetPoseParameter( i, restore->m_flPoseParameters[i] );
 			}
 		}
 
 		if ( restoreSimulationTime )
 		{
-			pPlayer->SetSimulationTime( restore->m_flSimulationTime );
+			pEntity->SetSimulationTime( restore->m_flSimulationTime );
 		}
 	}
 
+	m_RestoreData.RemoveAll();
 	m_isCurrentlyDoingCompensation = false;
 }
-
-
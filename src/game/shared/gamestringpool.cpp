@@ -11,15 +11,46 @@
 #include "igamesystem.h"
 #include "gamestringpool.h"
 
-#include "tier1/stringpool.h"
+#include "tier0/fasttimer.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
+#define GAMESTRING_BLOCK_SIZE		( 16 * 1024 )	// string storage is carved out of blocks this big
+#define GAMESTRING_ALIGN			8
+#define GAMESTRING_RECYCLE_CLASSES	16				// removed strings up to this many GAMESTRING_ALIGNs get reused
+
 //-----------------------------------------------------------------------------
-// Purpose: The actual storage for pooled per-level strings
+// Purpose: Case insensitive hash that agrees with Q_stricmp, also returns the length
 //-----------------------------------------------------------------------------
-class CGameStringPool : public CStringPool,	public CBaseGameSystem
+static inline uint32 GameStringHash( const char *pszValue, int *pLen )
+{
+	const unsigned char *p = (const unsigned char *)pszValue;
+	uint32 nHash = 2166136261u;
+	for ( ; *p; ++p )
+	{
+		unsigned char c = *p;
+		if ( (unsigned char)( c - 'A' ) <= ( 'Z' - 'A' ) )
+		{
+			c |= 0x20;
+		}
+		nHash = ( nHash ^ c ) * 16777619u;
+	}
+	*pLen = p - (const unsigned char *)pszValue;
+
+	// mix the bottom bits, they pick the slot
+	nHash ^= nHash >> 15;
+	nHash *= 0x2c1b3c6d;
+	nHash ^= nHash >> 12;
+	return nHash;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The actual storage for pooled per-level strings. An open addressed
+//			table of string pointers with their hashes and lengths, the strings
+//			themselves live in large blocks freed at level shutdown.
+//-----------------------------------------------------------------------------
+class CGameStringPool : public CBaseGameSystem
 {
 	virtual char const *Name() { return "CGameStringPool"; }
 
@@ -29,9 +60,22 @@ class CGameStringPool : public CStringPool,	public CBaseGameSystem
 	}
 
 public:
+	CGameStringPool()
+	{
+		m_pEntries = NULL;
+		m_nMask = 0;
+		m_nCount = 0;
+		m_nTombstones = 0;
+		m_nBlockUsed = 0;
+		m_nBlockSize = 0;
+		ResetStats();
+		Rehash( 0 );
+	}
+
 	~CGameStringPool()
 	{
 		Cleanup();
+		delete [] m_pEntries;
 	}
 
 	void Cleanup()
@@ -43,9 +87,15 @@ public:
 	
 	void PurgeDeferredDeleteList()
 	{
+		// Removed strings may still be referenced until now, after this their
+		// storage goes back to the pool for strings of the same size.
 		for ( int i = 0; i < m_DeferredDeleteList.Count(); ++ i )
 		{
-			free( ( void * )m_DeferredDeleteList[ i ] );
+			int nClass = m_DeferredDeleteList[i].m_nSize / GAMESTRING_ALIGN - 1;
+			if ( nClass < GAMESTRING_RECYCLE_CLASSES )
+			{
+				m_RecycledStrings[nClass].AddToTail( m_DeferredDeleteList[i].m_pString );
+			}
 		}
 		m_DeferredDeleteList.Purge();
 	}
@@ -55,23 +105,113 @@ public:
 		m_KeyLookupCache.Purge();
 	}
 
-	void Dump( void )
+	unsigned int Count() const
+	{
+		return m_nCount;
+	}
+
+	const char *Find( const char *pszValue )
+	{
+		int nLen;
+		uint32 nHash = GameStringHash( pszValue, &nLen );
+		int nSlot = FindSlot( pszValue, nHash, nLen );
+		return ( nSlot >= 0 ) ? m_pEntries[nSlot].m_pString : NULL;
+	}
+
+	const char *Allocate( const char *pszValue )
 	{
-		for ( int i = m_Strings.FirstInorder(); i != m_Strings.InvalidIndex(); i = m_Strings.NextInorder(i) )
+		int nLen;
+		uint32 nHash = GameStringHash( pszValue, &nLen );
+		int nSlot = FindSlot( pszValue, nHash, nLen );
+		if ( nSlot >= 0 )
+			return m_pEntries[nSlot].m_pString;
+
+		if ( ( m_nCount + m_nTombstones + 1 ) * 4 > ( m_nMask + 1 ) * 3 )
 		{
-			DevMsg( "  %d (0x%p) : %s\n", i, m_Strings[i], m_Strings[i] );
+			Rehash( ( m_nCount + 1 ) * 2 );
 		}
-		DevMsg( "\n" );
-		DevMsg( "Size:  %d items\n", m_Strings.Count() );
+
+		char *pszNew = AllocStorage( nLen + 1 );
+		memcpy( pszNew, pszValue, nLen + 1 );
+
+		GameString_t *pEntry = &m_pEntries[FindFreeSlot( nHash )];
+		if ( pEntry->m_pString == s_pTombstone )
+		{
+			--m_nTombstones;
+		}
+		pEntry->m_pString = pszNew;
+		pEntry->m_nHash = nHash;
+		pEntry->m_nLen = nLen;
+		++m_nCount;
+		m_nStringBytes += nLen + 1;
+		return pszNew;
+	}
+
+	void FreeAll()
+	{
+		for ( int i = 0; i < m_Blocks.Count(); i++ )
+		{
+			free( m_Blocks[i] );
+		}
+		m_Blocks.Purge();
+		m_nBlockUsed = 0;
+		m_nBlockSize = 0;
+
+		for ( int i = 0; i < GAMESTRING_RECYCLE_CLASSES; i++ )
+		{
+			m_RecycledStrings[i].Purge();
+		}
+
+		// the deferred list points into the blocks as well
+		m_DeferredDeleteList.Purge();
+
+		memset( m_pEntries, 0, ( m_nMask + 1 ) * sizeof( GameString_t ) );
+		m_nCount = 0;
+		m_nTombstones = 0;
+		ResetStats();
+	}
+
+	void Dump( bool bStrings )
+	{
+		if ( bStrings )
+		{
+			CUtlVector< const char * > strings;
+			strings.EnsureCapacity( m_nCount );
+			for ( int i = 0; i <= m_nMask; i++ )
+			{
+				if ( IsLive( m_pEntries[i] ) )
+				{
+					strings.AddToTail( m_pEntries[i].m_pString );
+				}
+			}
+			strings.Sort( CompareStrings );
+
+			FOR_EACH_VEC( strings, i )
+			{
+				DevMsg( "  %d (0x%p) : %s\n", i, strings[i], strings[i] );
+			}
+			DevMsg( "\n" );
+			DevMsg( "Size:  %d items\n", m_nCount );
+		}
+
+		DumpStats();
 	}
 
 	void Remove( const char *pszValue )
 	{
-		int i = m_Strings.Find( pszValue );
-		if ( i != m_Strings.InvalidIndex() )
+		int nLen;
+		uint32 nHash = GameStringHash( pszValue, &nLen );
+		int nSlot = FindSlot( pszValue, nHash, nLen );
+		if ( nSlot >= 0 )
 		{
-			m_DeferredDeleteList.AddToTail( m_Strings[ i ] );
-			m_Strings.RemoveAt( i );
+			GameString_t &entry = m_pEntries[nSlot];
+			DeferredString_t deferred = { entry.m_pString, StorageSize( entry.m_nLen + 1 ) };
+			m_DeferredDeleteList.AddToTail( deferred );
+			m_nStringBytes -= entry.m_nLen + 1;
+
+			entry.m_pString = s_pTombstone;
+			--m_nCount;
+			++m_nTombstones;
 		}
 	}
 
@@ -86,11 +226,205 @@ public:
 	}
 
 private:
-	CUtlVector< const char * > m_DeferredDeleteList;
+	struct GameString_t
+	{
+		const char	*m_pString;		// NULL for an empty slot, s_pTombstone for a removed one
+		uint32		m_nHash;
+		int			m_nLen;
+	};
+
+	struct DeferredString_t
+	{
+		char	*m_pString;
+		int		m_nSize;
+	};
+
+	static bool IsLive( const GameString_t &entry )
+	{
+		return entry.m_pString && entry.m_pString != s_pTombstone;
+	}
+
+	static int CompareStrings( const char * const *ppLeft, const char * const *ppRight )
+	{
+		return Q_stricmp( *ppLeft, *ppRight );
+	}
+
+	static int StorageSize( int nBytes )
+	{
+		return ( nBytes + GAMESTRING_ALIGN - 1 ) & ~( GAMESTRING_ALIGN - 1 );
+	}
+
+	int FindSlot( const char *pszValue, uint32 nHash, int nLen )
+	{
+		++m_nLookups;
+		for ( int i = nHash & m_nMask; ; i = ( i + 1 ) & m_nMask )
+		{
+			const GameString_t &entry = m_pEntries[i];
+			if ( !entry.m_pString )
+				return -1;
+
+			if ( entry.m_nHash == nHash && entry.m_nLen == nLen && entry.m_pString != s_pTombstone && !Q_stricmp( entry.m_pString, pszValue ) )
+				return i;
+
+			++m_nProbes;
+		}
+	}
+
+	int FindFreeSlot( uint32 nHash )
+	{
+		for ( int i = nHash & m_nMask; ; i = ( i + 1 ) & m_nMask )
+		{
+			if ( !IsLive( m_pEntries[i] ) )
+				return i;
+		}
+	}
+
+	// Grows the table to fit nCount strings, dropping tombstones
+	void Rehash( int nCount )
+	{
+		int nSize = 256;
+		while ( nSize * 3 < nCount * 4 )
+		{
+			nSize *= 2;
+		}
+
+		GameString_t *pOldEntries = m_pEntries;
+		int nOldSize = pOldEntries ? m_nMask + 1 : 0;	// NULL the first time, from the constructor
+
+		m_pEntries = new GameString_t[nSize];
+		memset( m_pEntries, 0, nSize * sizeof( GameString_t ) );
+		m_nMask = nSize - 1;
+		m_nTombstones = 0;
+
+		for ( int i = 0; i < nOldSize; i++ )
+		{
+			if ( IsLive( pOldEntries[i] ) )
+			{
+				m_pEntries[FindFreeSlot( pOldEntries[i].m_nHash )] = pOldEntries[i];
+			}
+		}
+		delete [] pOldEntries;
+	}
+
+	char *AllocStorage( int nBytes )
+	{
+		int nSize = StorageSize( nBytes );
+
+		int nClass = nSize / GAMESTRING_ALIGN - 1;
+		if ( nClass < GAMESTRING_RECYCLE_CLASSES && m_RecycledStrings[nClass].Count() )
+		{
+			char *pRecycled = m_RecycledStrings[nClass].Tail();
+			m_RecycledStrings[nClass].RemoveMultipleFromTail( 1 );
+			return pRecycled;
+		}
+
+		if ( m_nBlockUsed + nSize > m_nBlockSize )
+		{
+			m_nBlockSize = MAX( nSize, GAMESTRING_BLOCK_SIZE );
+			m_nBlockUsed = 0;
+			m_Blocks.AddToTail( (char *)malloc( m_nBlockSize ) );
+			m_nBlockBytes += m_nBlockSize;
+		}
+
+		char *pStorage = m_Blocks.Tail() + m_nBlockUsed;
+		m_nBlockUsed += nSize;
+		return pStorage;
+	}
+
+	void ResetStats()
+	{
+		m_nStringBytes = 0;
+		m_nBlockBytes = 0;
+		m_nLookups = 0;
+		m_nProbes = 0;
+	}
+
+	void DumpStats();
+
+	static const char s_pTombstone[];
+
+	GameString_t	*m_pEntries;
+	int				m_nMask;
+	int				m_nCount;
+	int				m_nTombstones;
+
+	CUtlVector< char * > m_Blocks;
+	int				m_nBlockUsed;
+	int				m_nBlockSize;
+	CUtlVector< char * > m_RecycledStrings[GAMESTRING_RECYCLE_CLASSES];
+
+	CUtlVector< DeferredString_t > m_DeferredDeleteList;
 
 	CUtlHashtable< const void*, const char* > m_KeyLookupCache;
+
+	// statistics, reset every level
+	int64			m_nStringBytes;
+	int64			m_nBlockBytes;
+	int64			m_nLookups;
+	int64			m_nProbes;		// slots looked at past the first on every lookup
 };
 
+const char CGameStringPool::s_pTombstone[] = "";
+
+//-----------------------------------------------------------------------------
+// Purpose: Prints how full the pool is, how well the hash spreads and how long
+//			a lookup takes right now.
+//-----------------------------------------------------------------------------
+void CGameStringPool::DumpStats()
+{
+	int nDisplaced = 0;
+	int nLongestProbe = 0;
+	CUtlVector< char > copies;
+	CUtlVector< int > offsets;
+	for ( int i = 0; i <= m_nMask; i++ )
+	{
+		const GameString_t &entry = m_pEntries[i];
+		if ( !IsLive( entry ) )
+			continue;
+
+		int nProbe = ( i - (int)( entry.m_nHash & m_nMask ) ) & m_nMask;
+		if ( nProbe )
+		{
+			++nDisplaced;
+		}
+		nLongestProbe = MAX( nLongestProbe, nProbe );
+
+		// look up copies, like the keyvalues that get pooled, not the pooled pointers
+		offsets.AddToTail( copies.AddMultipleToTail( entry.m_nLen + 1, entry.m_pString ) );
+	}
+
+	int64 nLookups = m_nLookups;
+	int64 nProbes = m_nProbes;
+
+	double flNanoseconds = 0.0;
+	if ( offsets.Count() )
+	{
+		const int nReps = MAX( 1, 100000 / offsets.Count() );
+		CFastTimer timer;
+		timer.Start();
+		for ( int nRep = 0; nRep < nReps; nRep++ )
+		{
+			FOR_EACH_VEC( offsets, i )
+			{
+				Find( &copies[offsets[i]] );
+			}
+		}
+		timer.End();
+		flNanoseconds = timer.GetDuration().GetSeconds() * 1e9 / ( (double)nReps * offsets.Count() );
+	}
+
+	// the timing lookups shouldn't count
+	m_nLookups = nLookups;
+	m_nProbes = nProbes;
+
+	Msg( "Game string pool: %d strings, %d removed awaiting purge, %d slots (%.0f%% full)\n",
+		m_nCount, m_DeferredDeleteList.Count(), m_nMask + 1, 100.0 * ( m_nCount + m_nTombstones ) / ( m_nMask + 1 ) );
+	Msg( "  %lld bytes of strings in %d blocks of %lld bytes\n", m_nStringBytes, m_Blocks.Count(), m_nBlockBytes );
+	Msg( "  %d strings out of their home slot, longest probe %d\n", nDisplaced, nLongestProbe );
+	Msg( "  %lld lookups this level, %.2f extra slots per lookup\n", m_nLookups, m_nLookups ? (double)m_nProbes / m_nLookups : 0.0 );
+	Msg( "  %.1f ns per lookup\n", flNanoseconds );
+}
+
 static CGameStringPool g_GameStringPool;
 
 //-----------------------------------------------------------------------------
@@ -137,12 +471,12 @@ void PurgeDeferredPooledStrings()
 //------------------------------------------------------------------------------
 // Purpose: 
 //------------------------------------------------------------------------------
-void CC_DumpGameStringTable( void )
+void CC_DumpGameStringTable( const CCommand &args )
 {
 	if ( !UTIL_IsCommandIssuedByServerAdmin() )
 		return;
 
-	g_GameStringPool.Dump();
+	g_GameStringPool.Dump( args.ArgC() < 2 || Q_stricmp( args[1], "stats" ) );
 }
-static ConCommand dumpgamestringtable("dumpgamestringtable", CC_DumpGameStringTable, "Dump the contents of the game string table to the console.", FCVAR_CHEAT);
+static ConCommand dumpgamestringtable("dumpgamestringtable", CC_DumpGameStringTable, "Dump the contents of the game string table and its statistics to the console. 'dumpgamestringtable stats' prints just the statistics.", FCVAR_CHEAT);
 #endif
@@ -214,6 +214,7 @@ void CPropData::LevelShutdownPostEntity( void )
 void CPropData::ParsePropDataFile( void )
 {
 	m_pKVPropData = new KeyValues( "PropDatafile" );
+	m_pKVPropData->UsesArena( true );		// read only, and freed all at once at level shutdown
 	if ( !m_pKVPropData->LoadFromFile( filesystem, "scripts/propdata.txt" ) )
 	{
 		m_pKVPropData->deleteThis();
@@ -249,6 +249,7 @@ typedef void (CBaseEntity::*inputfunc_t)(inputdata_t &data);
 
 struct datamap_t;
 struct typedescription_t;
+struct inputdispatch_t;
 
 enum
 {
@@ -305,6 +306,9 @@ struct datamap_t
 	bool				packed_offsets_computed;
 	int					packed_size;
 
+	// inputs of this map and its bases by name, built by the server on first use
+	inputdispatch_t		*inputDispatch;
+
 #if defined( _DEBUG )
 	bool				bValidityChecked;
 #endif // _DEBUG
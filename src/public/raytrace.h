@@ -41,6 +41,24 @@ public:
 
 };
 
+// 8 rays, traced as one packet by Trace8Rays when the cpu supports AVX2 and as two 4-ray packets
+// otherwise. Stored as a pair of FourRays so that this header doesn't need the AVX types.
+class EightRays
+{
+public:
+	FourRays m_Rays[2];										// rays 0-3 and 4-7
+
+	// returns the direction sign mask shared by all 8 rays, or -1 if they can't be traced as one
+	// bundle.
+	int CalculateDirectionSignMask(void) const
+	{
+		int msk=m_Rays[0].CalculateDirectionSignMask();
+		if (msk!=m_Rays[1].CalculateDirectionSignMask())
+			return -1;
+		return msk;
+	}
+};
+
 /// The format a triangle is stored in for intersections. size of this structure is important.
 /// This structure can be in one of two forms. Before the ray tracing environment is set up, the
 /// ProjectedEdgeEquations hold the coordinates of the 3 vertices, for facilitating bounding box
@@ -209,6 +227,12 @@ struct RayTracingResult
 };
 
 
+struct RayTracingResult8
+{
+	RayTracingResult m_Results[2];							// results for rays 0-3 and 4-7
+};
+
+
 class RayTraceLight
 {
 public:
@@ -217,6 +241,10 @@ public:
 };
 
 
+// bump whenever SetupAccelerationStructure changes the tree it builds from the same triangles,
+// so that ray-trace caches saved by the old builder (tracecache.cpp) get rebuilt
+#define RAYTRACE_KDTREE_BUILDER_VERSION 1
+
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
@@ -228,6 +256,21 @@ enum RayTraceLightingMode_t {
 };
 
 
+// filled in by SetupAccelerationStructure for reporting (vrad -rtbuildstats)
+struct RayTraceBuildStats_t
+{
+	float m_flBuildTime;									// seconds spent building the kd-tree
+	int m_nBuildThreads;									// threads used for subtree builds
+	int m_nNodes;											// total nodes, including leaves
+	int m_nLeaves;
+	int m_nEmptyLeaves;
+	int m_nMaxDepth;
+	int m_nTriangleRefs;									// entries in TriangleIndexList
+	float m_flExpectedCost;									// SAH cost of the tree, in the same
+															// units as COST_OF_TRAVERSAL
+};
+
+
 class RayStream
 {
 	friend class RayTracingEnvironment;
@@ -268,11 +311,16 @@ public:
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
 
+	int m_nBuildThreads;									//< threads for the kd-tree build. 0=#cpus
+	RayTraceBuildStats_t m_BuildStats;						//< filled in by SetupAccelerationStructure
+
 public:
 	RayTracingEnvironment() : OptimizedTriangleList( 1024 )
 	{
 		BackgroundColor.DuplicateVector(Vector(1,0,0));		// red
 		Flags=0;
+		m_nBuildThreads=0;
+		memset(&m_BuildStats,0,sizeof(m_BuildStats));
 	}
 
 
@@ -294,9 +342,20 @@ public:
 										const Vector &color);
 
 
-	// SetupAccelerationStructure to prepare for tracing
+	// SetupAccelerationStructure to prepare for tracing. Builds the kd-tree with a binned
+	// surface area heuristic, farming subtrees out to m_nBuildThreads threads.
 	void SetupAccelerationStructure(void);
 
+	// walks the finished tree and fills in the node counts and SAH cost in m_BuildStats
+	void CalculateTreeStatistics(void);
+
+	// persisting the acceleration structure (tracecache.cpp). hash the triangles after they
+	// have all been added, then either load a tree built from the same triangles or build one
+	// and save it.
+	uint32 CalculateGeometryHash(void);
+	bool LoadAccelerationStructure(const char *pFileName, uint32 nGeometryHash);
+	bool SaveAccelerationStructure(const char *pFileName, uint32 nGeometryHash);
+
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
@@ -310,6 +369,20 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// 8 ray version of the above (raytrace_avx2.cpp). Uses a single 8-wide traversal when AVX2
+	// tracing is enabled and all 8 rays share a direction sign mask, and otherwise falls back to
+	// Trace4Rays on each half. TMin and TMax hold 2 entries, one per half. The transparent
+	// triangle callbacks, if passed, are an array of 2, one for each half.
+	void Trace8Rays(const EightRays &rays, const fltx4 *pTMin, const fltx4 *pTMax,
+					RayTracingResult8 *rslt_out,
+					int32 skip_id=-1, ITransparentTriangleCallback * const *ppCallbacks = NULL);
+
+	// AVX2 support is detected the first time it's asked for. Tracing with it can be switched off
+	// to compare against the SSE path.
+	static bool IsAVX2Supported(void);
+	static bool IsAVX2TracingEnabled(void);
+	static void EnableAVX2Tracing(bool bEnable);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -345,17 +418,6 @@ public:
 	int MakeLeafNode(int first_tri, int last_tri);
 
 
-	float CalculateCostsOfSplit(
-		int split_plane,int32 const *tri_list,int ntris,
-		Vector MinBound,Vector MaxBound, float &split_value,
-		int &nleft, int &nright, int &nboth);
-		
-	void RefineNode(int node_number,int32 const *tri_list,int ntris,
-						 Vector MinBound,Vector MaxBound, int depth);
-	
-	void CalculateTriangleListBounds(int32 const *tris,int ntris,
-									 Vector &minout, Vector &maxout);
-
 	void AddInfinitePointLight(Vector position,				// light center
 							   Vector intensity);			// rgb amount
 
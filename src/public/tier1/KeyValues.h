@@ -39,6 +39,7 @@ class CUtlBuffer;
 class Color;
 typedef void * FileHandle_t;
 class CKeyValuesGrowableStringTable;
+class CKeyValuesChildIndex;
 
 //-----------------------------------------------------------------------------
 // Purpose: Simple recursive data access class
@@ -120,6 +121,12 @@ public:
 	// File access. Set UsesEscapeSequences true, if resource file/buffer uses Escape Sequences (eg \n, \t)
 	void UsesEscapeSequences(bool state); // default false
 	void UsesConditionals(bool state); // default true
+	// Set UsesArena true to allocate the keys and strings parsed into this key from one block that it
+	// owns and frees with it. Parsed keys must not outlive this key or be handed to other modules.
+	void UsesArena(bool state); // default false
+	// Set UsesChildIndex true to index the children of keys with many of them, so finding and appending
+	// subkeys doesn't walk the whole list. The tree must only be edited through this module's KeyValues.
+	void UsesChildIndex(bool state); // default false
 	bool LoadFromFile( IBaseFileSystem *filesystem, const char *resourceName, const char *pathID = NULL, bool refreshCache = false );
 	bool SaveToFile( IBaseFileSystem *filesystem, const char *resourceName, const char *pathID = NULL, bool sortKeys = false, bool bAllowEmptyString = false, bool bCacheResult = false );
 
@@ -292,6 +299,8 @@ private:
 	void WriteConvertedString( IBaseFileSystem *filesystem, FileHandle_t f, CUtlBuffer *pBuf, const char *pszString );
 	
 	void RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &buf );
+	KeyValues *CreateArenaKeyUsingKnownLastChild( const char *keyName, KeyValues *pLastChild );
+	void FreeArena();
 
 	// For handling #include "filename"
 	void AppendIncludedKeys( CUtlVector< KeyValues * >& includedKeys );
@@ -312,6 +321,15 @@ private:
 	void FreeAllocatedValue();
 	void AllocateValueBlock(int size);
 
+	// Hashed child lookup for keys with many children, see KeyValues.cpp
+	KeyValues *FindChild( int keySymbol, KeyValues **ppLastChild ) const;
+	CKeyValuesChildIndex *GetChildIndex( bool bRebuildIfStale ) const;
+	CKeyValuesChildIndex *BuildChildIndex() const;
+	void AddToChildIndex( KeyValues *pSubkey );
+	void RemoveFromChildIndex( KeyValues *pSubkey, KeyValues *pPrevSubkey );
+	void FreeChildIndex();
+	void ChildIndexKeyChanged();
+
 	int m_iKeyName;	// keyname is a symbol defined in KeyValuesSystem
 
 	// These are needed out of the union because the API returns string pointers
@@ -330,7 +348,7 @@ private:
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
 	char	   m_bEvaluateConditionals; // true, if while parsing this KeyValue, conditionals blocks are evaluated (default true)
-	char	   unused[1];
+	char	   m_nInternalFlags; // KV_ flags from KeyValues.cpp, in what used to be a padding byte
 
 	KeyValues *m_pPeer;	// pointer to next key in list
 	KeyValues *m_pSub;	// pointer to Start of a new sub key list
@@ -17,6 +17,14 @@ void CRC32_ProcessBuffer( CRC32_t *pulCRC, const void *p, int len );
 void CRC32_Final( CRC32_t *pulCRC );
 CRC32_t	CRC32_GetTableEntry( unsigned int slot );
 
+// The implementations CRC32_ProcessBuffer chooses between, exposed for testing
+// and benchmarks. They all give identical results. CRC32_ProcessBuffer_PCLMUL
+// must only be called when CRC32_HasPCLMUL() says the cpu supports it.
+void CRC32_ProcessBuffer_Bytewise( CRC32_t *pulCRC, const void *p, int len );
+void CRC32_ProcessBuffer_Slice8( CRC32_t *pulCRC, const void *p, int len );
+void CRC32_ProcessBuffer_PCLMUL( CRC32_t *pulCRC, const void *p, int len );
+bool CRC32_HasPCLMUL();
+
 inline CRC32_t CRC32_ProcessSingleBuffer( const void *p, int len )
 {
 	CRC32_t crc;
@@ -0,0 +1,120 @@
+//========= Copyright Valve Corporation, All rights reserved. =================//
+//
+// Purpose: Flat, read-only KeyValues images. A KeyValues tree is written once
+//			as an array of fixed size key records plus a string pool, all found
+//			by offset, so the image can be memory mapped and queried in place.
+//			Nothing is decoded up front; a lookup only reads the records and
+//			strings it visits.
+//
+//=============================================================================//
+
+#ifndef KEYVALUESIMAGE_H
+#define KEYVALUESIMAGE_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "KeyValues.h"
+#include "Color.h"
+
+class CUtlBuffer;
+class CKeyValuesImage;
+struct KeyValuesImageKey_t;
+
+/// Writes pKeyValues and its peers as an image. Pointer values are written as TYPE_NONE
+/// and wide strings as UTF-8 strings.
+bool WriteKeyValuesImage( KeyValues *pKeyValues, CUtlBuffer &buf );
+
+//-----------------------------------------------------------------------------
+// A key in an image. Small and cheap to copy; only valid while the image
+// it came from is open. Mirrors the read side of KeyValues.
+//-----------------------------------------------------------------------------
+class KeyValuesView
+{
+public:
+	KeyValuesView() : m_pImage( NULL ), m_nKey( 0 ) {}
+
+	bool IsValid() const { return m_pImage != NULL; }
+
+	const char *GetName() const;
+	KeyValues::types_t GetDataType( const char *keyName = NULL ) const;
+
+	// Case insensitive, and takes the same "a/b/c" paths as KeyValues::FindKey
+	KeyValuesView FindKey( const char *keyName ) const;
+
+	// Iteration, same as in KeyValues. The invalid view ends the list.
+	KeyValuesView GetFirstSubKey() const;
+	KeyValuesView GetNextKey() const;
+	KeyValuesView GetFirstTrueSubKey() const;
+	KeyValuesView GetNextTrueSubKey() const;
+	KeyValuesView GetFirstValue() const;
+	KeyValuesView GetNextValue() const;
+
+	int GetInt( const char *keyName = NULL, int defaultValue = 0 ) const;
+	uint64 GetUint64( const char *keyName = NULL, uint64 defaultValue = 0 ) const;
+	float GetFloat( const char *keyName = NULL, float defaultValue = 0.0f ) const;
+	const char *GetString( const char *keyName = NULL, const char *defaultValue = "" ) const;
+	bool GetBool( const char *keyName = NULL, bool defaultValue = false ) const { return GetInt( keyName, defaultValue ? 1 : 0 ) ? true : false; }
+	Color GetColor( const char *keyName = NULL ) const;
+	bool IsEmpty( const char *keyName = NULL ) const;
+
+	// Builds heap KeyValues for this key and everything below it
+	KeyValues *MakeKeyValues() const;
+
+private:
+	friend class CKeyValuesImage;
+	KeyValuesView( const CKeyValuesImage *pImage, int nKey ) : m_pImage( pImage ), m_nKey( nKey ) {}
+
+	const KeyValuesImageKey_t &Key() const;
+
+	const CKeyValuesImage *m_pImage;
+	int m_nKey;
+};
+
+//-----------------------------------------------------------------------------
+// An open image
+//-----------------------------------------------------------------------------
+class CKeyValuesImage
+{
+public:
+	CKeyValuesImage();
+	~CKeyValuesImage();
+
+	// Maps a file read-only. Pages are only loaded as lookups touch them.
+	bool MapFile( const char *pFullPath );
+
+	// Uses an image that's already in memory, for instance one read through the
+	// filesystem out of a pack file. The memory must outlive this.
+	bool Attach( const void *pData, int nSize );
+
+	void Close();
+
+	bool IsOpen() const { return m_pBase != NULL; }
+
+	// The first top level key, GetNextKey walks the rest
+	KeyValuesView GetRoot() const;
+
+private:
+	friend class KeyValuesView;
+
+	bool Validate();
+	const KeyValuesImageKey_t &GetKey( int nKey ) const;
+	const char *GetString( int nOffset ) const;
+
+	const byte *m_pBase;
+	int m_nSize;
+	const KeyValuesImageKey_t *m_pKeys;
+	int m_nKeys;
+	const char *m_pStrings;
+	int m_nStringBytes;
+
+	// set when we mapped the file ourselves
+	void *m_pMapping;
+#ifdef _WIN32
+	void *m_hFile;
+	void *m_hMapping;
+#endif
+};
+
+#endif // KEYVALUESIMAGE_H
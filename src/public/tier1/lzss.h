@@ -32,6 +32,15 @@ public:
 	//unsigned int	Uncompress( unsigned char *pInput, CUtlBuffer &buf );
 	unsigned int	SafeUncompress( const unsigned char *pInput, unsigned int inputlen, unsigned char *pOutput, unsigned int unBufSize );
 
+	// The original greedy compressor and bit at a time decoder. Same format, kept
+	// to check and benchmark the ones above against.
+	unsigned char*	CompressNoAllocGreedy( const unsigned char *pInput, int inputlen, unsigned char *pOutput, unsigned int *pOutputSize );
+	unsigned int	UncompressSimple( const unsigned char *pInput, unsigned char *pOutput );
+
+	// Threads CompressNoAlloc may use on inputs bigger than one block. 1, the default,
+	// never starts any, 0 uses one per logical processor. The output is the same either way.
+	void			SetMaxThreads( int nThreads ) { m_nMaxThreads = nThreads; }
+
 	static bool			IsCompressed( const unsigned char *pInput );
 	static unsigned int	GetActualSize( const unsigned char *pInput );
 
@@ -58,12 +67,14 @@ private:
 	lzss_list_t		*m_pHashTable;	
 	lzss_node_t		*m_pHashTarget;
 	int             m_nWindowSize;
+	int				m_nMaxThreads;
 
 };
 
 FORCEINLINE CLZSS::CLZSS( int nWindowSize )
 {
 	m_nWindowSize = nWindowSize;
+	m_nMaxThreads = 1;
 }
 #endif
 
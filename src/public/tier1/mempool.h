@@ -106,24 +106,79 @@ protected:
 
 
 //-----------------------------------------------------------------------------
-// 
+// Thread safe pool. Threads are spread over a fixed number of caches of free
+// blocks, each with its own lock, which is rarely contended, and only touch
+// shared state to swap whole batches with a lock-free list; the underlying
+// pool (and its lock) is only used to make new batches. A thread that exits
+// leaves its cache, at most two batches, to the next thread given that cache.
 //-----------------------------------------------------------------------------
+struct MemoryPoolMTStats_t
+{
+	int64	m_nHits;			// allocations served from the calling thread's cache
+	int64	m_nMisses;			// allocations that had to fetch a batch
+	int64	m_nCacheSpills;		// blocks that overflowed a thread's cache and went back to the shared list,
+								// mostly blocks allocated on one thread and freed on another
+	int		m_nThreadCaches;	// caches that have been used
+};
+
 class CMemoryPoolMT : public CUtlMemoryPool
 {
 public:
-	CMemoryPoolMT(int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL) : CUtlMemoryPool( blockSize, numElements, growMode, pszAllocOwner) {}
+	CMemoryPoolMT( int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL, int nAlignment = 0 );
+	~CMemoryPoolMT();
+
+	void*		Alloc()	{ return Alloc( m_BlockSize ); }
+	void*		Alloc( size_t amount );
+	void*		AllocZero()	{ return AllocZero( m_BlockSize ); }
+	void*		AllocZero( size_t amount );
+	void		Free(void *pMem);
 
+	// Frees everything. Blocks that are handed out become invalid, so nothing
+	// else may be using the pool.
+	void		Clear();
 
-	void*		Alloc()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc(); }
-	void*		Alloc( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc( amount ); }
-	void*		AllocZero()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero(); }	
-	void*		AllocZero( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero( amount ); }
-	void		Free(void *pMem) { AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
+	// Blocks currently handed out
+	int			Count() const;
+
+	void		GetStats( MemoryPoolMTStats_t &stats ) const;
 
-	// Frees everything
-	void		Clear() { AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Clear(); }
 private:
-	CThreadFastMutex m_mutex; // @TODO: Rework to use tslist (toml 7/6/2007)
+	enum
+	{
+		BATCH_SIZE = 32,				// blocks moved between a thread and the shared list at once
+		THREAD_CACHES = 16,
+	};
+
+	// Free blocks, linked through their first pointer
+	struct TSLIST_NODE_ALIGN Batch_t : public TSLNodeBase_t
+	{
+		void	*m_pBlocks;
+		int		m_nBlocks;
+	} TSLIST_NODE_ALIGN_POST;
+
+	struct ThreadCache_t
+	{
+		mutable CThreadFastMutex m_mutex;	// guards this cache, taken before CMemoryPoolMT::m_mutex
+		void			*m_pBlocks;
+		int				m_nBlocks;
+		int64			m_nAllocs;
+		int64			m_nFrees;
+		int64			m_nHits;
+		int64			m_nMisses;
+		int64			m_nCacheSpills;
+		byte			m_Pad[64];			// keeps caches used by different threads off each other's cache lines
+	};
+
+	ThreadCache_t &GetThreadCache();
+	void		Refill( ThreadCache_t &cache );
+	void		Spill( ThreadCache_t &cache );
+	void		PushBatch( void *pBlocks, int nBlocks );
+	void		ReturnAllToPool();
+
+	CThreadFastMutex m_mutex;			// guards CUtlMemoryPool
+	CTSListBase		m_FullBatches;
+	CTSListBase		m_FreeBatches;		// Batch_t's with no blocks, for reuse
+	ThreadCache_t	m_ThreadCaches[THREAD_CACHES];
 };
 
 
@@ -23,6 +23,7 @@
 //-----------------------------------------------------------------------------
 class CUtlSymbolTable;
 class CUtlSymbolTableMT;
+class CUtlSymbolTableSharded;
 
 
 //-----------------------------------------------------------------------------
@@ -67,10 +68,10 @@ protected:
 	static void Initialize();
 	
 	// returns the current symbol table
-	static CUtlSymbolTableMT* CurrTable();
+	static CUtlSymbolTableSharded* CurrTable();
 		
 	// The standard global symbol table
-	static CUtlSymbolTableMT* s_pSymbolTable; 
+	static CUtlSymbolTableSharded* s_pSymbolTable; 
 
 	static bool s_bAllowStaticSymbolTable;
 
@@ -216,6 +217,98 @@ private:
 #endif
 };
 
+//-----------------------------------------------------------------------------
+// CUtlSymbolTableSharded:
+// description:
+//    A symbol table that can be used from any number of threads at once,
+//    without the single lock CUtlSymbolTableMT takes for every call.
+//    Strings are hashed into one of SHARD_COUNT shards, each an open addressed
+//    table of symbol ids. Find() and String() never take a lock; AddString()
+//    only locks the shard the string hashes to, and only when it's new.
+//    Symbols are never removed, so a pointer returned by String() stays good
+//    until the table is destroyed or RemoveAll() is called.
+//-----------------------------------------------------------------------------
+
+class CUtlSymbolTableSharded
+{
+public:
+	CUtlSymbolTableSharded( int growSize = 0, int initSize = 32, bool caseInsensitive = false );
+	~CUtlSymbolTableSharded();
+
+	// Finds and/or creates a symbol based on the string
+	CUtlSymbol AddString( const char* pString );
+
+	// Finds the symbol for pString
+	CUtlSymbol Find( const char* pString ) const;
+
+	// Look up the string associated with a particular symbol
+	const char* String( CUtlSymbol id ) const;
+
+	inline bool HasElement( const char* pStr ) const
+	{
+		return Find( pStr ) != UTL_INVAL_SYMBOL;
+	}
+
+	int GetNumStrings( void ) const
+	{
+		return m_nSymbols;
+	}
+
+	// Remove all symbols in the table. Not safe while other threads use the table.
+	void RemoveAll();
+
+private:
+	enum
+	{
+		SHARD_COUNT = 16,
+		SHARD_BITS = 4,
+		PAGE_SIZE = 256,
+		PAGE_BITS = 8,
+		PAGE_COUNT = 65536 / PAGE_SIZE,
+	};
+
+	// Each entry is the top 16 bits of the string's hash over its symbol id, ~0 if empty
+	struct HashTable_t
+	{
+		uint32 m_nMask;
+		uint32 m_Entries[1];
+	};
+
+	struct Shard_t
+	{
+		CThreadFastMutex m_mutex;
+		HashTable_t * volatile m_pTable;
+		int m_nCount;
+
+		// tables this shard has outgrown, a reader may still be looking at one
+		CUtlVector< HashTable_t * > m_RetiredTables;
+
+		// string storage
+		CUtlVector< char * > m_StringBlocks;
+		int m_nBlockUsed;
+		int m_nBlockSize;
+
+		byte m_Pad[64];
+	};
+
+	unsigned HashSymbolString( const char *pString ) const;
+	int Compare( const char *pString1, const char *pString2 ) const;
+	UtlSymId_t FindInTable( const HashTable_t *pTable, const char *pString, unsigned nHash ) const;
+	static HashTable_t *AllocTable( int nSize );
+	void GrowShard( Shard_t &shard );
+	const char *CopyString( Shard_t &shard, const char *pString );
+	void SetString( UtlSymId_t id, const char *pString );
+
+	Shard_t m_Shards[SHARD_COUNT];
+
+	// symbol id -> string, in pages of PAGE_SIZE allocated as ids are handed out
+	const char ** volatile m_pPages[PAGE_COUNT];
+
+	CInterlockedInt m_nSymbols;
+	int m_nInitShardSize;
+	bool m_bInsensitive;
+};
+
 
 
 //-----------------------------------------------------------------------------
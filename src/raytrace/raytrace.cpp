@@ -5,6 +5,7 @@
 #include <filesystem_tools.h>
 #include <cmdlib.h>
 #include <stdio.h>
+#include "tier0/threadtools.h"
 
 static bool SameSign(float a, float b)
 {
@@ -604,25 +605,7 @@ int RayTracingEnvironment::MakeLeafNode(int first_tri, int last_tri)
 }
 
 
-void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int ntris,
-														Vector &minout, Vector &maxout)
-{
-	minout = Vector( 1.0e23, 1.0e23, 1.0e23);
-	maxout = Vector( -1.0e23, -1.0e23, -1.0e23);
-	for(int i=0; i<ntris; i++)
-	{
-		CacheOptimizedTriangle const &tri=OptimizedTriangleList[tris[i]];
-		for(int v=0; v<3; v++)
-			for(int c=0; c<3; c++)
-			{
-				minout[c]=min(minout[c],tri.Vertex(v)[c]);
-							  maxout[c]=max(maxout[c],tri.Vertex(v)[c]);
-			}
-	}
-}
-
-
-// Both the "quick" and regular kd tree building algorithms here use the "surface area heuristic":
+// The kd tree builder uses the "surface area heuristic":
 // the relative probability of hitting the "left" subvolume (Vl) from a split is equal to that
 // subvolume's surface area divided by its parent's surface area (Vp) : P(Vl | V)=SA(Vl)/SA(Vp).
 // The same holds for the right subvolume, Vp. Nl is the number of triangles in the left volume,
@@ -636,254 +619,471 @@ void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int nt
 //  This both provides a metric to minimize when computing how and where to split, and also a
 //  termination criterion.
 //
-// the "quick" method just splits down the middle, while the slow method splits at the best
-// discontinuity of the cost formula. The quick method splits along the longest axis ; the 
-// regular algorithm tries all 3 to find which one results in the minimum cost
-// 
-// both methods use the additional optimization of "growing" empty nodes - if the split results in
-// one side being devoid of triangles, the empty side is "grown" as much as possible.
-//
 
 #define COST_OF_TRAVERSAL 75								// approximate #operations
 #define COST_OF_INTERSECTION 167							// approximate #operations
 
 
-float RayTracingEnvironment::CalculateCostsOfSplit(
-	int split_plane,int32 const *tri_list,int ntris,
-	Vector MinBound,Vector MaxBound, float &split_value,
-	int &nleft, int &nright, int &nboth)
+//-----------------------------------------------------------------------------
+// Binned SAH kd-tree builder.
+//
+// The original builder tried every (sampled) triangle vertex as a split candidate and reclassified
+// the whole triangle list for each one, which is O(n^2) per node and only ran on one thread.
+// This builder instead drops the triangle extents into a fixed number of bins per axis and
+// evaluates the SAH at every bin boundary with a single sweep, plus the two planes that cut away
+// empty space. Once the top of the tree has been split into enough independent subtrees, those
+// subtrees are built in parallel into private node/index lists and then spliced into
+// OptimizedKDTree, so the output is exactly the node format Trace4Rays expects.
+//-----------------------------------------------------------------------------
+
+#define KDBUILD_NUM_BINS 32
+#define KDBUILD_TASKS_PER_THREAD 8							// subtrees handed out per thread
+#define KDBUILD_MIN_TASK_TRIS 1024							// don't bother farming out less
+
+struct KDBuildTriBounds_t
 {
-	// determine the costs of splitting on a given axis, and label triangles with respect to
-	// that axis by storing the value in coordselect0. It will also return the number of
-	// tris in the left, right, and nboth groups, in order to facilitate memory
-	nleft=nboth=nright=0;
-	
-	// now, label each triangle. Since we have not converted the triangles into
-	// intersection fromat yet, we can use the CoordSelect0 field of each as a temp.
-	nleft=0;
-	nright=0;
-	nboth=0;
-	float min_coord=1.0e23,max_coord=-1.0e23;
-
-	for(int t=0;t<ntris;t++)
+	Vector m_Mins;
+	Vector m_Maxs;
+};
+
+// same result as CacheOptimizedTriangle::ClassifyAgainstAxisSplit, from the cached bounds
+static inline int ClassifyTriangle( const KDBuildTriBounds_t &tb, int split_plane, float split_value )
+{
+	if ( tb.m_Mins[split_plane] >= split_value )
+		return PLANECHECK_POSITIVE;
+	if ( tb.m_Maxs[split_plane] <= split_value )
+		return PLANECHECK_NEGATIVE;
+	if ( tb.m_Mins[split_plane] == tb.m_Maxs[split_plane] )
+		return PLANECHECK_POSITIVE;
+	return PLANECHECK_STRADDLING;
+}
+
+struct KDBuildTask_t
+{
+	int m_nNode;											// placeholder node in the main tree
+	int m_nDepth;
+	Vector m_Mins;
+	Vector m_Maxs;
+	CUtlVector<int32> m_Tris;
+
+	// output, with node 0 being the subtree root and all indices local
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;
+	CUtlVector<int32> m_TriangleIndices;
+};
+
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder( const KDBuildTriBounds_t *pTriBounds, CUtlVector<CacheOptimizedKDNode> &nodes,
+					CUtlVector<int32> &triangleIndices )
+		: m_pTriBounds( pTriBounds ), m_Nodes( nodes ), m_TriangleIndices( triangleIndices )
 	{
-		CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-		// determine max and min coordinate values for later optimization
-		for(int v=0;v<3;v++)
+		m_pDeferredTasks = NULL;
+		m_nDeferBelow = 0;
+	}
+
+	// subtrees with fewer than nDeferBelow triangles are queued instead of built
+	void DeferSubtrees( CUtlVector<KDBuildTask_t *> *pTasks, int nDeferBelow )
+	{
+		m_pDeferredTasks = pTasks;
+		m_nDeferBelow = nDeferBelow;
+	}
+
+	void BuildNode( int nNode, int32 const *pTris, int nTris, const Vector &MinBound,
+					const Vector &MaxBound, int nDepth );
+
+private:
+	void MakeLeaf( int nNode, int32 const *pTris, int nTris );
+	bool FindBestSplit( int32 const *pTris, int nTris, const Vector &MinBound,
+						const Vector &MaxBound, int &nAxisOut, float &flSplitOut, float &flCostOut );
+
+	const KDBuildTriBounds_t *m_pTriBounds;
+	CUtlVector<CacheOptimizedKDNode> &m_Nodes;
+	CUtlVector<int32> &m_TriangleIndices;
+	CUtlVector<KDBuildTask_t *> *m_pDeferredTasks;
+	int m_nDeferBelow;
+};
+
+
+void CKDTreeBuilder::MakeLeaf( int nNode, int32 const *pTris, int nTris )
+{
+	m_Nodes[nNode].Children = KDNODE_STATE_LEAF + ( m_TriangleIndices.Count() << 2 );
+	m_Nodes[nNode].SetNumberOfTrianglesInLeafNode( nTris );
+	m_TriangleIndices.AddMultipleToTail( nTris, pTris );
+}
+
+
+bool CKDTreeBuilder::FindBestSplit( int32 const *pTris, int nTris, const Vector &MinBound,
+									const Vector &MaxBound, int &nAxisOut, float &flSplitOut,
+									float &flCostOut )
+{
+	float ISA = BoxSurfaceArea( MinBound, MaxBound );
+	if ( ISA <= 0 )
+		return false;
+	ISA = 1.0 / ISA;
+
+	bool bFound = false;
+	flCostOut = 1.0e23;
+	Vector vecDim = MaxBound - MinBound;
+
+	for ( int axis = 0; axis < 3; axis++ )
+	{
+		float flExtent = vecDim[axis];
+		if ( flExtent <= 0 )
+			continue;
+
+		// the two dimensions of the split plane don't change along this axis, so the surface
+		// area of each side is linear in the split position
+		int a1 = ( axis + 1 ) % 3;
+		int a2 = ( axis + 2 ) % 3;
+		float flCapArea = 2.0 * vecDim[a1] * vecDim[a2];
+		float flSideScale = 2.0 * ( vecDim[a1] + vecDim[a2] );
+
+		int nStart[KDBUILD_NUM_BINS];
+		int nEnd[KDBUILD_NUM_BINS];
+		memset( nStart, 0, sizeof( nStart ) );
+		memset( nEnd, 0, sizeof( nEnd ) );
+
+		float flBinScale = KDBUILD_NUM_BINS / flExtent;
+		float flLo = MaxBound[axis];
+		float flHi = MinBound[axis];
+		for ( int t = 0; t < nTris; t++ )
 		{
-			min_coord = min( min_coord, tri.Vertex(v)[split_plane] );
-			max_coord = max( max_coord, tri.Vertex(v)[split_plane] );
+			const KDBuildTriBounds_t &tb = m_pTriBounds[pTris[t]];
+			float flMin = MAX( tb.m_Mins[axis], MinBound[axis] );
+			float flMax = MIN( tb.m_Maxs[axis], MaxBound[axis] );
+			flLo = MIN( flLo, flMin );
+			flHi = MAX( flHi, flMax );
+			int nMinBin = MIN( KDBUILD_NUM_BINS - 1, MAX( 0, (int) ( ( flMin - MinBound[axis] ) * flBinScale ) ) );
+			int nMaxBin = MIN( KDBUILD_NUM_BINS - 1, MAX( 0, (int) ( ( flMax - MinBound[axis] ) * flBinScale ) ) );
+			nStart[nMinBin]++;
+			nEnd[nMaxBin]++;
 		}
-		switch(tri.ClassifyAgainstAxisSplit(split_plane,split_value))
-		{
-			case PLANECHECK_NEGATIVE:
-				nleft++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_NEGATIVE;
-				break;
 
-			case PLANECHECK_POSITIVE:
-				nright++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_POSITIVE;
-				break;
+		// cutting off empty space on either side is almost always worthwhile, and the exact
+		// positions aren't on bin boundaries
+		if ( flLo > MinBound[axis] )
+		{
+			float flCost = COST_OF_TRAVERSAL + COST_OF_INTERSECTION * ISA * nTris *
+				( flCapArea + flSideScale * ( MaxBound[axis] - flLo ) );
+			if ( flCost < flCostOut )
+			{
+				flCostOut = flCost;
+				nAxisOut = axis;
+				flSplitOut = flLo;
+				bFound = true;
+			}
+		}
+		if ( flHi < MaxBound[axis] )
+		{
+			float flCost = COST_OF_TRAVERSAL + COST_OF_INTERSECTION * ISA * nTris *
+				( flCapArea + flSideScale * ( flHi - MinBound[axis] ) );
+			if ( flCost < flCostOut )
+			{
+				flCostOut = flCost;
+				nAxisOut = axis;
+				flSplitOut = flHi;
+				bFound = true;
+			}
+		}
 
-			case PLANECHECK_STRADDLING:
-				nboth++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_STRADDLING;
-				break;
+		// sweep the bin boundaries. a triangle is on the left of boundary b if it starts in a
+		// bin below b, and on the right if it ends in bin b or above.
+		int nLeft = 0;
+		int nRight = nTris;
+		for ( int b = 1; b < KDBUILD_NUM_BINS; b++ )
+		{
+			nLeft += nStart[b - 1];
+			nRight -= nEnd[b - 1];
+			float flSplit = MinBound[axis] + b * ( flExtent / KDBUILD_NUM_BINS );
+			if ( ( flSplit <= flLo ) || ( flSplit >= flHi ) )
+				continue;									// covered by the empty space cuts
+			float SA_L = flCapArea + flSideScale * ( flSplit - MinBound[axis] );
+			float SA_R = flCapArea + flSideScale * ( MaxBound[axis] - flSplit );
+			float flCost = COST_OF_TRAVERSAL + COST_OF_INTERSECTION * ISA *
+				( SA_L * nLeft + SA_R * nRight );
+			if ( flCost < flCostOut )
+			{
+				flCostOut = flCost;
+				nAxisOut = axis;
+				flSplitOut = flSplit;
+				bFound = true;
+			}
 		}
 	}
-	// now, if the split resulted in one half being empty, "grow" the empty half
-	if (nleft && (nboth==0) && (nright==0))
-		split_value=max_coord;
-	if (nright && (nboth==0) && (nleft==0))
-		split_value=min_coord;
-
-	// now, perform surface area/cost check to determine whether this split was worth it
-	Vector LeftMins=MinBound;
-	Vector LeftMaxes=MaxBound;
-	Vector RightMins=MinBound;
-	Vector RightMaxes=MaxBound;
-	LeftMaxes[split_plane]=split_value;
-	RightMins[split_plane]=split_value;
-	float SA_L=BoxSurfaceArea(LeftMins,LeftMaxes);
-	float SA_R=BoxSurfaceArea(RightMins,RightMaxes);
-	float ISA=1.0/BoxSurfaceArea(MinBound,MaxBound);
-	float cost_of_split=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
-		(SA_L*ISA*(nleft))+(SA_R*ISA*(nright)));
-	return cost_of_split;
+	return bFound;
 }
 
 
-#define NEVER_SPLIT 0
-
-void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int ntris,
-									   Vector MinBound,Vector MaxBound, int depth)
+void CKDTreeBuilder::BuildNode( int nNode, int32 const *pTris, int nTris, const Vector &MinBound,
+								const Vector &MaxBound, int nDepth )
 {
-	if (ntris<3)											// never split empty lists
+	if ( m_pDeferredTasks && ( nTris < m_nDeferBelow ) )
 	{
-		// no point in continuing
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
-
-#ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
-#endif
-
-		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
+		KDBuildTask_t *pTask = new KDBuildTask_t;
+		pTask->m_nNode = nNode;
+		pTask->m_nDepth = nDepth;
+		pTask->m_Mins = MinBound;
+		pTask->m_Maxs = MaxBound;
+		pTask->m_Tris.CopyArray( pTris, nTris );
+		m_pDeferredTasks->AddToTail( pTask );
 		return;
 	}
 
-	float best_cost=1.0e23;
-	int best_nleft=0,best_nright=0,best_nboth=0;
-	float best_splitvalue=0;
-	int split_plane=0;
+	int nAxis = 0;
+	float flSplit = 0;
+	float flCost = 0;
+	if ( ( nTris < 3 ) || ( nDepth > MAX_TREE_DEPTH ) ||
+		 !FindBestSplit( pTris, nTris, MinBound, MaxBound, nAxis, flSplit, flCost ) ||
+		 ( flCost >= COST_OF_INTERSECTION * nTris ) )
+	{
+		MakeLeaf( nNode, pTris, nTris );
+		return;
+	}
 
-	int tri_skip=1+(ntris/10);								// don't try all trinagles as split
-															// points when there are a lot of them
-	for(int axis=0;axis<3;axis++)
+	// left triangles go at the start of the list, right ones at the end, and straddling ones in between so that both children can
+	// share them.
+	int nLeft = 0, nRight = 0, nBoth = 0;
+	for ( int t = 0; t < nTris; t++ )
 	{
-		for(int ts=-1;ts<ntris;ts+=tri_skip)
+		switch( ClassifyTriangle( m_pTriBounds[pTris[t]], nAxis, flSplit ) )
 		{
-			for(int tv=0;tv<3;tv++)
-			{
-				int trial_nleft,trial_nright,trial_nboth;
-				float trial_splitvalue;
-				if (ts==-1)
-					trial_splitvalue=0.5*(MinBound[axis]+MaxBound[axis]);
-				else
-				{
-					// else, split at the triangle vertex if possible
-					CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[ts]];
-					trial_splitvalue = tri.Vertex(tv)[axis];
-					if ((trial_splitvalue>MaxBound[axis]) || (trial_splitvalue<MinBound[axis]))
-						continue;							// don't try this vertex - not inside
-					
-				}
-//				printf("ts=%d tv=%d tp=%f\n",ts,tv,trial_splitvalue);
-				float trial_cost=
-					CalculateCostsOfSplit(axis,tri_list,ntris,MinBound,MaxBound,trial_splitvalue,
-										  trial_nleft,trial_nright, trial_nboth);
-// 				printf("try %d cost=%f nl=%d nr=%d nb=%d sp=%f\n",axis,trial_cost,trial_nleft,trial_nright, trial_nboth,
-// 					   trial_splitvalue);
-				if (trial_cost<best_cost)
-				{
-					split_plane=axis;
-					best_cost=trial_cost;
-					best_nleft=trial_nleft;
-					best_nright=trial_nright;
-					best_nboth=trial_nboth;
-					best_splitvalue=trial_splitvalue;
-					// save away the axis classification of each triangle
-					for(int t=0 ; t < ntris; t++)
-					{
-						CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-						tri.m_Data.m_GeometryData.m_nTmpData1 = tri.m_Data.m_GeometryData.m_nTmpData0;
-					}
-				}
-				if (ts==-1)
-					break;
-			}
+			case PLANECHECK_NEGATIVE:
+				nLeft++;
+				break;
+			case PLANECHECK_POSITIVE:
+				nRight++;
+				break;
+			default:
+				nBoth++;
+				break;
 		}
-
 	}
-	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
-	if ( (cost_of_no_split<=best_cost) || NEVER_SPLIT || (depth>MAX_TREE_DEPTH))
+	if ( nBoth == nTris )
 	{
-		// no benefit to splitting. just make this a leaf node
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
-#ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
-#endif
-		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
+		// no progress possible
+		MakeLeaf( nNode, pTris, nTris );
+		return;
 	}
-	else
+
+	CUtlVector<int32> newTris;
+	newTris.SetCount( nTris );
+	int nLeftOut = 0, nRightOut = 0, nBothOut = 0;
+	for ( int t = 0; t < nTris; t++ )
 	{
-// 		printf("best split was %d at %f (mid=%f,n=%d, sk=%d)\n",split_plane,best_splitvalue,
-// 			   0.5*(MinBound[split_plane]+MaxBound[split_plane]),ntris,tri_skip);
-		// its worth splitting!
-		// we will achieve the splitting without sorting by using a selection algorithm.
-		int32 *new_triangle_list;
-		new_triangle_list=new int32[ntris];
-
-		// now, perform surface area/cost check to determine whether this split was worth it
-		Vector LeftMins=MinBound;
-		Vector LeftMaxes=MaxBound;
-		Vector RightMins=MinBound;
-		Vector RightMaxes=MaxBound;
-		LeftMaxes[split_plane]=best_splitvalue;
-		RightMins[split_plane]=best_splitvalue;
-		
-		int n_left_output=0;
-		int n_both_output=0;
-		int n_right_output=0;
-		for(int t=0;t<ntris;t++)
+		switch( ClassifyTriangle( m_pTriBounds[pTris[t]], nAxis, flSplit ) )
 		{
-			CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-			switch( tri.m_Data.m_GeometryData.m_nTmpData1 )
-			{
-				case PLANECHECK_NEGATIVE:
-//					printf("%d goes left\n",t);
-					new_triangle_list[n_left_output++]=tri_list[t];
-					break;
-				case PLANECHECK_POSITIVE:
-					n_right_output++;
-//					printf("%d goes right\n",t);
-					new_triangle_list[ntris-n_right_output]=tri_list[t];
-					break;
-				case PLANECHECK_STRADDLING:
-//					printf("%d goes both\n",t);
-					new_triangle_list[best_nleft+n_both_output]=tri_list[t];
-					n_both_output++;
-					break;
-
-					
-			}
+			case PLANECHECK_NEGATIVE:
+				newTris[nLeftOut++] = pTris[t];
+				break;
+			case PLANECHECK_POSITIVE:
+				newTris[nTris - ( ++nRightOut )] = pTris[t];
+				break;
+			default:
+				newTris[nLeft + ( nBothOut++ )] = pTris[t];
+				break;
 		}
-		int left_child=OptimizedKDTree.Count();
-		int right_child=left_child+1;
-// 		printf("node %d split on axis %d at %f, nl=%d nr=%d nb=%d lc=%d rc=%d\n",node_number,
-// 			   split_plane,best_splitvalue,best_nleft,best_nright,best_nboth,
-// 			   left_child,right_child);
-		OptimizedKDTree[node_number].Children=split_plane+(left_child<<2);
-		OptimizedKDTree[node_number].SplittingPlaneValue=best_splitvalue;
+	}
+
+	Vector LeftMaxes = MaxBound;
+	Vector RightMins = MinBound;
+	LeftMaxes[nAxis] = flSplit;
+	RightMins[nAxis] = flSplit;
+
+	int nLeftChild = m_Nodes.Count();
+	m_Nodes[nNode].Children = nAxis + ( nLeftChild << 2 );
+	m_Nodes[nNode].SplittingPlaneValue = flSplit;
 #ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
+	m_Nodes[nNode].vecMins = MinBound;
+	m_Nodes[nNode].vecMaxs = MaxBound;
 #endif
-		CacheOptimizedKDNode newnode;
-		OptimizedKDTree.AddToTail(newnode);
-		OptimizedKDTree.AddToTail(newnode);
-		// now, recurse!
-		if ( (ntris<20) && ((best_nleft==0) || (best_nright==0)) )
-			depth+=100;
-		RefineNode(left_child,new_triangle_list,best_nleft+best_nboth,LeftMins,LeftMaxes,depth+1);
-		RefineNode(right_child,new_triangle_list+best_nleft,best_nright+best_nboth,
-				   RightMins,RightMaxes,depth+1);
-		delete[] new_triangle_list;
-	}	
+	CacheOptimizedKDNode newnode;
+	m_Nodes.AddToTail( newnode );
+	m_Nodes.AddToTail( newnode );
+
+	// as the original builder did, don't keep chopping empty space off small nodes
+	if ( ( nTris < 20 ) && ( ( nLeft == 0 ) || ( nRight == 0 ) ) )
+		nDepth += 100;
+	BuildNode( nLeftChild, newTris.Base(), nLeft + nBoth, MinBound, LeftMaxes, nDepth + 1 );
+	BuildNode( nLeftChild + 1, newTris.Base() + nLeft, nRight + nBoth, RightMins, MaxBound, nDepth + 1 );
+}
+
+
+struct KDBuildThreadContext_t
+{
+	const KDBuildTriBounds_t *m_pTriBounds;
+	CUtlVector<KDBuildTask_t *> *m_pTasks;
+	int32 volatile m_nNextTask;
+};
+
+static uintp KDBuildThreadFn( void *pParam )
+{
+	KDBuildThreadContext_t *pCtx = (KDBuildThreadContext_t *) pParam;
+	for (;;)
+	{
+		int nTask = ThreadInterlockedIncrement( &pCtx->m_nNextTask ) - 1;
+		if ( nTask >= pCtx->m_pTasks->Count() )
+			break;
+		KDBuildTask_t *pTask = (*pCtx->m_pTasks)[nTask];
+		CacheOptimizedKDNode root{};
+		pTask->m_Nodes.AddToTail( root );
+		CKDTreeBuilder builder( pCtx->m_pTriBounds, pTask->m_Nodes, pTask->m_TriangleIndices );
+		builder.BuildNode( 0, pTask->m_Tris.Base(), pTask->m_Tris.Count(), pTask->m_Mins,
+						   pTask->m_Maxs, pTask->m_nDepth );
+	}
+	return 0;
+}
+
+static int KDBuildTaskSortFn( KDBuildTask_t * const *a, KDBuildTask_t * const *b )
+{
+	// biggest first, so that the last few tasks don't leave threads idle
+	return (*b)->m_Tris.Count() - (*a)->m_Tris.Count();
 }
 
 
 void RayTracingEnvironment::SetupAccelerationStructure(void)
 {
+	double flStartTime = Plat_FloatTime();
+
+	int nTris = OptimizedTriangleList.Count();
+	int nThreads = m_nBuildThreads;
+	if ( nThreads <= 0 )
+		nThreads = GetCPUInformation()->m_nLogicalProcessors;
+	nThreads = MAX( 1, nThreads );
+
+	CUtlVector<KDBuildTriBounds_t> triBounds;
+	triBounds.SetCount( nTris );
+	CUtlVector<int32> rootTris;
+	rootTris.SetCount( nTris );
+	m_MinBound = Vector( 1.0e23, 1.0e23, 1.0e23 );
+	m_MaxBound = Vector( -1.0e23, -1.0e23, -1.0e23 );
+	for ( int t = 0; t < nTris; t++ )
+	{
+		CacheOptimizedTriangle const &tri = OptimizedTriangleList[t];
+		KDBuildTriBounds_t &tb = triBounds[t];
+		tb.m_Mins = tri.Vertex( 0 );
+		tb.m_Maxs = tri.Vertex( 0 );
+		for ( int v = 1; v < 3; v++ )
+		{
+			VectorMin( tb.m_Mins, tri.Vertex( v ), tb.m_Mins );
+			VectorMax( tb.m_Maxs, tri.Vertex( v ), tb.m_Maxs );
+		}
+		VectorMin( m_MinBound, tb.m_Mins, m_MinBound );
+		VectorMax( m_MaxBound, tb.m_Maxs, m_MaxBound );
+		rootTris[t] = t;
+	}
+
 	CacheOptimizedKDNode root{};
-	OptimizedKDTree.AddToTail(root);
-	int32 *root_triangle_list=new int32[OptimizedTriangleList.Count()];
-	for(int t=0;t<OptimizedTriangleList.Count();t++)
-		root_triangle_list[t]=t;
-	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
-								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
-	delete[] root_triangle_list;
+	OptimizedKDTree.AddToTail( root );
+
+	// build the top of the tree here, and queue the subtrees below it
+	CUtlVector<KDBuildTask_t *> tasks;
+	CKDTreeBuilder builder( triBounds.Base(), OptimizedKDTree, TriangleIndexList );
+	int nDeferBelow = nTris / ( nThreads * KDBUILD_TASKS_PER_THREAD );
+	if ( ( nThreads > 1 ) && ( nDeferBelow >= KDBUILD_MIN_TASK_TRIS ) )
+		builder.DeferSubtrees( &tasks, nDeferBelow );
+	builder.BuildNode( 0, rootTris.Base(), nTris, m_MinBound, m_MaxBound, 0 );
+
+	if ( tasks.Count() )
+	{
+		tasks.Sort( KDBuildTaskSortFn );
+
+		KDBuildThreadContext_t ctx;
+		ctx.m_pTriBounds = triBounds.Base();
+		ctx.m_pTasks = &tasks;
+		ctx.m_nNextTask = 0;
+
+		int nWorkers = MIN( nThreads, tasks.Count() );
+		CUtlVector<ThreadHandle_t> threads;
+		for ( int i = 1; i < nWorkers; i++ )
+			threads.AddToTail( CreateSimpleThread( KDBuildThreadFn, &ctx ) );
+		KDBuildThreadFn( &ctx );
+		FOR_EACH_VEC( threads, i )
+		{
+			ThreadJoin( threads[i] );
+			ReleaseThreadHandle( threads[i] );
+		}
+
+		// splice the subtrees in. the subtree root replaces its placeholder and the rest is
+		// appended, so children stay adjacent.
+		FOR_EACH_VEC( tasks, i )
+		{
+			KDBuildTask_t *pTask = tasks[i];
+			int nNodeBase = OptimizedKDTree.Count() - 1;	// local node 1 lands here+1
+			int nTriBase = TriangleIndexList.Count();
+			FOR_EACH_VEC( pTask->m_Nodes, n )
+			{
+				CacheOptimizedKDNode node = pTask->m_Nodes[n];
+				if ( node.NodeType() == KDNODE_STATE_LEAF )
+					node.Children = KDNODE_STATE_LEAF + ( ( node.TriangleIndexStart() + nTriBase ) << 2 );
+				else
+					node.Children = node.NodeType() + ( ( node.LeftChild() + nNodeBase ) << 2 );
+				if ( n == 0 )
+					OptimizedKDTree[pTask->m_nNode] = node;
+				else
+					OptimizedKDTree.AddToTail( node );
+			}
+			TriangleIndexList.AddMultipleToTail( pTask->m_TriangleIndices.Count(),
+												 pTask->m_TriangleIndices.Base() );
+			delete pTask;
+		}
+	}
 
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
 		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
+
+	m_BuildStats.m_flBuildTime = Plat_FloatTime() - flStartTime;
+	m_BuildStats.m_nBuildThreads = tasks.Count() ? MIN( nThreads, tasks.Count() ) : 1;
+	CalculateTreeStatistics();
+}
+
+
+static void AccumulateTreeStatistics( RayTracingEnvironment &env, int nNode, Vector MinBound,
+									  Vector MaxBound, int nDepth, double &flCost )
+{
+	RayTraceBuildStats_t &stats = env.m_BuildStats;
+	CacheOptimizedKDNode const &node = env.OptimizedKDTree[nNode];
+	float flArea = BoxSurfaceArea( MinBound, MaxBound );
+	stats.m_nNodes++;
+	stats.m_nMaxDepth = MAX( stats.m_nMaxDepth, nDepth );
+	if ( node.NodeType() == KDNODE_STATE_LEAF )
+	{
+		int nLeafTris = node.NumberOfTrianglesInLeaf();
+		stats.m_nLeaves++;
+		if ( !nLeafTris )
+			stats.m_nEmptyLeaves++;
+		flCost += COST_OF_INTERSECTION * flArea * nLeafTris;
+		return;
+	}
+	flCost += COST_OF_TRAVERSAL * flArea;
+	Vector LeftMaxes = MaxBound;
+	Vector RightMins = MinBound;
+	LeftMaxes[node.NodeType()] = node.SplittingPlaneValue;
+	RightMins[node.NodeType()] = node.SplittingPlaneValue;
+	AccumulateTreeStatistics( env, node.LeftChild(), MinBound, LeftMaxes, nDepth + 1, flCost );
+	AccumulateTreeStatistics( env, node.RightChild(), RightMins, MaxBound, nDepth + 1, flCost );
+}
+
+
+void RayTracingEnvironment::CalculateTreeStatistics(void)
+{
+	m_BuildStats.m_nNodes = 0;
+	m_BuildStats.m_nLeaves = 0;
+	m_BuildStats.m_nEmptyLeaves = 0;
+	m_BuildStats.m_nMaxDepth = 0;
+	m_BuildStats.m_nTriangleRefs = TriangleIndexList.Count();
+	m_BuildStats.m_flExpectedCost = 0;
+	if ( !OptimizedKDTree.Count() )
+		return;
+
+	// the expected cost of a random ray is the sum over all nodes of the node's cost weighted
+	// by the probability of a ray entering it, SA(node)/SA(root)
+	double flCost = 0;
+	AccumulateTreeStatistics( *this, 0, m_MinBound, m_MaxBound, 0, flCost );
+	float flRootArea = BoxSurfaceArea( m_MinBound, m_MaxBound );
+	if ( flRootArea > 0 )
+		m_BuildStats.m_flExpectedCost = flCost / flRootArea;
 }
 
 
@@ -0,0 +1,382 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: 8-wide ray packet tracing using AVX2.
+//
+//			Trace8RaysAVX2 is a straight translation of the 4-wide Trace4Rays to
+//			256 bit registers, and does the same arithmetic in the same order so that
+//			each lane gets bit-identical results to the SSE path. The AVX functions
+//			are compiled for AVX2 individually, and only called after cpuid says the
+//			cpu and OS support it, so the rest of the library still runs anywhere.
+//
+//=============================================================================//
+
+#include "raytrace.h"
+#include <immintrin.h>
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#if defined( __GNUC__ )
+#define RAYTRACE_AVX2 __attribute__(( target( "avx2" ) ))
+#else
+#define RAYTRACE_AVX2										// msvc allows the intrinsics anywhere
+#endif
+
+#define MAILBOX_HASH_SIZE 256
+#define NODE_STACK_LEN_8 128								// tree depth is capped well below this
+
+
+//-----------------------------------------------------------------------------
+// cpu detection
+//-----------------------------------------------------------------------------
+static void CPUID( int nLeaf, int nSubLeaf, int regs[4] )
+{
+#ifdef _WIN32
+	__cpuidex( regs, nLeaf, nSubLeaf );
+#else
+	unsigned int a, b, c, d;
+	__cpuid_count( nLeaf, nSubLeaf, a, b, c, d );
+	regs[0] = a; regs[1] = b; regs[2] = c; regs[3] = d;
+#endif
+}
+
+static uint64 XGETBV0( void )
+{
+#ifdef _WIN32
+	return _xgetbv( 0 );
+#else
+	unsigned int lo, hi;
+	__asm__ __volatile__( "xgetbv" : "=a"( lo ), "=d"( hi ) : "c"( 0 ) );
+	return ( (uint64) hi << 32 ) | lo;
+#endif
+}
+
+static bool CheckAVX2Support( void )
+{
+	int regs[4];
+	CPUID( 0, 0, regs );
+	if ( regs[0] < 7 )
+		return false;
+
+	// AVX, and the OS saving the ymm registers on context switches
+	CPUID( 1, 0, regs );
+	const int OSXSAVE = 1 << 27;
+	const int AVX = 1 << 28;
+	if ( ( regs[2] & ( OSXSAVE | AVX ) ) != ( OSXSAVE | AVX ) )
+		return false;
+	if ( ( XGETBV0() & 6 ) != 6 )
+		return false;
+
+	CPUID( 7, 0, regs );
+	const int AVX2 = 1 << 5;
+	return ( regs[1] & AVX2 ) != 0;
+}
+
+static int s_nAVX2Supported = -1;
+static bool s_bAVX2TracingEnabled = true;
+
+bool RayTracingEnvironment::IsAVX2Supported( void )
+{
+	if ( s_nAVX2Supported < 0 )
+		s_nAVX2Supported = CheckAVX2Support() ? 1 : 0;
+	return s_nAVX2Supported != 0;
+}
+
+bool RayTracingEnvironment::IsAVX2TracingEnabled( void )
+{
+	return s_bAVX2TracingEnabled && IsAVX2Supported();
+}
+
+void RayTracingEnvironment::EnableAVX2Tracing( bool bEnable )
+{
+	s_bAVX2TracingEnabled = bEnable;
+}
+
+
+//-----------------------------------------------------------------------------
+// 8-wide traversal
+//-----------------------------------------------------------------------------
+struct NodeToVisit8
+{
+	CacheOptimizedKDNode const *node;
+	__m256 TMin;
+	__m256 TMax;
+};
+
+RAYTRACE_AVX2 static FORCEINLINE __m256 Combine( const fltx4 &lo, const fltx4 &hi )
+{
+	return _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), hi, 1 );
+}
+
+RAYTRACE_AVX2 static FORCEINLINE fltx4 LowHalf( const __m256 &v )
+{
+	return _mm256_castps256_ps128( v );
+}
+
+RAYTRACE_AVX2 static FORCEINLINE fltx4 HighHalf( const __m256 &v )
+{
+	return _mm256_extractf128_ps( v, 1 );
+}
+
+RAYTRACE_AVX2 static FORCEINLINE bool IsAnyNegative8( const __m256 &v )
+{
+	return _mm256_movemask_ps( v ) != 0;
+}
+
+RAYTRACE_AVX2 static FORCEINLINE __m256 Select8( const __m256 &mask, const __m256 &a, const __m256 &b )
+{
+	// a where mask is set, else b
+	return _mm256_or_ps( _mm256_and_ps( a, mask ), _mm256_andnot_ps( mask, b ) );
+}
+
+RAYTRACE_AVX2 static void StoreResults8( RayTracingResult8 *rslt_out, const __m256 &HitIds,
+										 const __m256 &HitDistance, const __m256 *pNormal )
+{
+	for ( int h = 0; h < 2; h++ )
+	{
+		RayTracingResult &rslt = rslt_out->m_Results[h];
+		StoreAlignedSIMD( (float *) rslt.HitIds, h ? HighHalf( HitIds ) : LowHalf( HitIds ) );
+		rslt.HitDistance = h ? HighHalf( HitDistance ) : LowHalf( HitDistance );
+		rslt.surface_normal.x = h ? HighHalf( pNormal[0] ) : LowHalf( pNormal[0] );
+		rslt.surface_normal.y = h ? HighHalf( pNormal[1] ) : LowHalf( pNormal[1] );
+		rslt.surface_normal.z = h ? HighHalf( pNormal[2] ) : LowHalf( pNormal[2] );
+	}
+}
+
+RAYTRACE_AVX2 static void Trace8RaysAVX2( RayTracingEnvironment &env, const EightRays &rays,
+										  const fltx4 *pTMin, const fltx4 *pTMax, int DirectionSignMask,
+										  RayTracingResult8 *rslt_out, int32 skip_id,
+										  ITransparentTriangleCallback * const *ppCallbacks )
+{
+	const FourRays &r0 = rays.m_Rays[0];
+	const FourRays &r1 = rays.m_Rays[1];
+	r0.Check();
+	r1.Check();
+
+	__m256 origin[3], direction[3], OneOverRayDir[3];
+	FourVectors recip0 = r0.direction;
+	FourVectors recip1 = r1.direction;
+	recip0.MakeReciprocalSaturate();
+	recip1.MakeReciprocalSaturate();
+	for ( int c = 0; c < 3; c++ )
+	{
+		origin[c] = Combine( r0.origin[c], r1.origin[c] );
+		direction[c] = Combine( r0.direction[c], r1.direction[c] );
+		OneOverRayDir[c] = Combine( recip0[c], recip1[c] );
+	}
+
+	const __m256 Eight_Ones = _mm256_set1_ps( 1.0f );
+	const __m256 Eight_Epsilons = _mm256_set1_ps( 1.0e-10f );
+	const __m256 Eight_NegativeEpsilons = _mm256_set1_ps( -1.0e-10f );
+
+	__m256 HitIds = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+	__m256 HitDistance = _mm256_set1_ps( 1.0e23f );
+	__m256 SurfaceNormal[3];
+	SurfaceNormal[0] = SurfaceNormal[1] = SurfaceNormal[2] = _mm256_setzero_ps();
+
+	__m256 TMin = Combine( pTMin[0], pTMin[1] );
+	__m256 TMax = Combine( pTMax[0], pTMax[1] );
+
+	// now, clip rays against bounding box
+	for ( int c = 0; c < 3; c++ )
+	{
+		__m256 isect_min_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( env.m_MinBound[c] ), origin[c] ), OneOverRayDir[c] );
+		__m256 isect_max_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( env.m_MaxBound[c] ), origin[c] ), OneOverRayDir[c] );
+		TMin = _mm256_max_ps( TMin, _mm256_min_ps( isect_min_t, isect_max_t ) );
+		TMax = _mm256_min_ps( TMax, _mm256_max_ps( isect_min_t, isect_max_t ) );
+	}
+	__m256 active = _mm256_cmp_ps( TMin, TMax, _CMP_LE_OQ );
+	if ( !IsAnyNegative8( active ) )
+	{
+		StoreResults8( rslt_out, HitIds, HitDistance, SurfaceNormal );
+		return;												// missed bounding box
+	}
+
+	int32 mailboxids[MAILBOX_HASH_SIZE];					// used to avoid redundant triangle tests
+	memset( mailboxids, 0xff, sizeof( mailboxids ) );
+
+	int front_idx[3], back_idx[3];							// based on ray direction, whether to
+															// visit left or right node first
+	for ( int c = 0; c < 3; c++ )
+	{
+		back_idx[c] = ( DirectionSignMask & ( 1 << c ) ) ? 0 : 1;
+		front_idx[c] = 1 - back_idx[c];
+	}
+
+	NodeToVisit8 NodeQueue[NODE_STACK_LEN_8];
+	CacheOptimizedKDNode const *CurNode = &( env.OptimizedKDTree[0] );
+	NodeToVisit8 *stack_ptr = &NodeQueue[NODE_STACK_LEN_8];
+	for (;;)
+	{
+		while ( CurNode->NodeType() != KDNODE_STATE_LEAF )	// traverse until next leaf
+		{
+			int split_plane_number = CurNode->NodeType();
+			CacheOptimizedKDNode const *FrontChild = &( env.OptimizedKDTree[CurNode->LeftChild()] );
+
+			__m256 dist_to_sep_plane =						// dist=(split-org)/dir
+				_mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( CurNode->SplittingPlaneValue ),
+											  origin[split_plane_number] ),
+							   OneOverRayDir[split_plane_number] );
+			active = _mm256_cmp_ps( TMin, TMax, _CMP_LE_OQ );
+
+			__m256 hits_front = _mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMin, _CMP_GE_OQ ) );
+			if ( !IsAnyNegative8( hits_front ) )
+			{
+				// missed the front. only traverse back
+				CurNode = FrontChild + back_idx[split_plane_number];
+				TMin = _mm256_max_ps( TMin, dist_to_sep_plane );
+			}
+			else
+			{
+				__m256 hits_back = _mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMax, _CMP_LE_OQ ) );
+				if ( !IsAnyNegative8( hits_back ) )
+				{
+					// missed the back - only need to traverse front node
+					CurNode = FrontChild + front_idx[split_plane_number];
+					TMax = _mm256_min_ps( TMax, dist_to_sep_plane );
+				}
+				else
+				{
+					// at least some rays hit both nodes. must push far, traverse near
+					Assert( stack_ptr > NodeQueue );
+					--stack_ptr;
+					stack_ptr->node = FrontChild + back_idx[split_plane_number];
+					stack_ptr->TMin = _mm256_max_ps( TMin, dist_to_sep_plane );
+					stack_ptr->TMax = TMax;
+					CurNode = FrontChild + front_idx[split_plane_number];
+					TMax = _mm256_min_ps( TMax, dist_to_sep_plane );
+				}
+			}
+		}
+
+		// hit a leaf! must do intersection check
+		int ntris = CurNode->NumberOfTrianglesInLeaf();
+		if ( ntris )
+		{
+			int32 const *tlist = &( env.TriangleIndexList[CurNode->TriangleIndexStart()] );
+			do
+			{
+				int tnum = *( tlist++ );
+				int mbox_slot = tnum & ( MAILBOX_HASH_SIZE - 1 );
+				TriIntersectData_t const *tri = &( env.OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( ( mailboxids[mbox_slot] == tnum ) || ( tri->m_nTriangleID == skip_id ) )
+					continue;
+				mailboxids[mbox_slot] = tnum;
+
+				// compute plane intersection
+				__m256 N[3];
+				N[0] = _mm256_set1_ps( tri->m_flNx );
+				N[1] = _mm256_set1_ps( tri->m_flNy );
+				N[2] = _mm256_set1_ps( tri->m_flNz );
+
+				__m256 DDotN = _mm256_mul_ps( direction[0], N[0] );
+				DDotN = _mm256_add_ps( _mm256_mul_ps( direction[1], N[1] ), DDotN );
+				DDotN = _mm256_add_ps( _mm256_mul_ps( direction[2], N[2] ), DDotN );
+
+				// mask off zero or near zero (ray parallel to surface)
+				__m256 did_hit = _mm256_or_ps( _mm256_cmp_ps( DDotN, Eight_Epsilons, _CMP_GT_OQ ),
+											   _mm256_cmp_ps( DDotN, Eight_NegativeEpsilons, _CMP_LT_OQ ) );
+
+				__m256 ODotN = _mm256_mul_ps( origin[0], N[0] );
+				ODotN = _mm256_add_ps( _mm256_mul_ps( origin[1], N[1] ), ODotN );
+				ODotN = _mm256_add_ps( _mm256_mul_ps( origin[2], N[2] ), ODotN );
+				__m256 numerator = _mm256_sub_ps( _mm256_set1_ps( tri->m_flD ), ODotN );
+
+				__m256 isect_t = _mm256_div_ps( numerator, DDotN );
+				did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, Eight_Epsilons, _CMP_GT_OQ ) );
+				did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, HitDistance, _CMP_LT_OQ ) );
+
+				if ( !IsAnyNegative8( did_hit ) )
+					continue;
+
+				// now, check 3 edges
+				__m256 hitc1 = _mm256_add_ps( origin[tri->m_nCoordSelect0],
+											  _mm256_mul_ps( isect_t, direction[tri->m_nCoordSelect0] ) );
+				__m256 hitc2 = _mm256_add_ps( origin[tri->m_nCoordSelect1],
+											  _mm256_mul_ps( isect_t, direction[tri->m_nCoordSelect1] ) );
+
+				// do barycentric coordinate check
+				__m256 B0 = _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+				B0 = _mm256_add_ps( B0, _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+				B0 = _mm256_add_ps( B0, _mm256_set1_ps( tri->m_ProjectedEdgeEquations[2] ) );
+				did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B0, Eight_Epsilons, _CMP_GE_OQ ) );
+
+				__m256 B1 = _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+				B1 = _mm256_add_ps( B1, _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[4] ), hitc2 ) );
+				B1 = _mm256_add_ps( B1, _mm256_set1_ps( tri->m_ProjectedEdgeEquations[5] ) );
+				did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B1, Eight_Epsilons, _CMP_GE_OQ ) );
+
+				__m256 B2 = _mm256_add_ps( B1, B0 );
+				did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B2, Eight_Ones, _CMP_LE_OQ ) );
+
+				if ( !IsAnyNegative8( did_hit ) )
+					continue;
+
+				// transparent triangles go to the callback for the half that hit them, with the
+				// barycentric coordinates in the same 1, 2, 0 order Trace4Rays uses
+				if ( ( tri->m_nFlags & FCACHETRI_TRANSPARENT ) && ppCallbacks )
+				{
+					__m256 b2 = _mm256_sub_ps( Eight_Ones, B2 );
+					fltx4 hitHalf[2] = { LowHalf( did_hit ), HighHalf( did_hit ) };
+					for ( int h = 0; h < 2; h++ )
+					{
+						if ( !ppCallbacks[h] || !IsAnyNegative( hitHalf[h] ) )
+							continue;
+						fltx4 b0h = h ? HighHalf( B1 ) : LowHalf( B1 );
+						fltx4 b1h = h ? HighHalf( b2 ) : LowHalf( b2 );
+						fltx4 b2h = h ? HighHalf( B0 ) : LowHalf( B0 );
+						if ( ppCallbacks[h]->VisitTriangle_ShouldContinue( *tri, rays.m_Rays[h], &hitHalf[h],
+																		   &b0h, &b1h, &b2h, tnum ) )
+						{
+							hitHalf[h] = Four_Zeros;
+						}
+					}
+					did_hit = Combine( hitHalf[0], hitHalf[1] );
+				}
+
+				// now, set the hit_id and closest_hit fields for any enabled rays
+				HitIds = Select8( did_hit, _mm256_castsi256_ps( _mm256_set1_epi32( tnum ) ), HitIds );
+				HitDistance = Select8( did_hit, isect_t, HitDistance );
+				for ( int c = 0; c < 3; c++ )
+					SurfaceNormal[c] = Select8( did_hit, N[c], SurfaceNormal[c] );
+			} while ( --ntris );
+
+			// now, check if all rays have terminated
+			__m256 raydone = _mm256_cmp_ps( TMax, HitDistance, _CMP_LE_OQ );
+			if ( !IsAnyNegative8( raydone ) )
+				break;
+		}
+
+		if ( stack_ptr == &NodeQueue[NODE_STACK_LEN_8] )
+			break;
+
+		// pop stack!
+		CurNode = stack_ptr->node;
+		TMin = stack_ptr->TMin;
+		TMax = stack_ptr->TMax;
+		stack_ptr++;
+	}
+
+	StoreResults8( rslt_out, HitIds, HitDistance, SurfaceNormal );
+}
+
+
+void RayTracingEnvironment::Trace8Rays( const EightRays &rays, const fltx4 *pTMin, const fltx4 *pTMax,
+										RayTracingResult8 *rslt_out,
+										int32 skip_id, ITransparentTriangleCallback * const *ppCallbacks )
+{
+	int msk = rays.CalculateDirectionSignMask();
+	if ( ( msk != -1 ) && IsAVX2TracingEnabled() )
+	{
+		Trace8RaysAVX2( *this, rays, pTMin, pTMax, msk, rslt_out, skip_id, ppCallbacks );
+		return;
+	}
+
+	for ( int h = 0; h < 2; h++ )
+	{
+		Trace4Rays( rays.m_Rays[h], pTMin[h], pTMax[h], &rslt_out->m_Results[h], skip_id,
+					ppCallbacks ? ppCallbacks[h] : NULL );
+	}
+}
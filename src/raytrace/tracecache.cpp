@@ -0,0 +1,253 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Saving and loading a built RayTracingEnvironment, so that tools which
+//			are re-run on unchanged geometry can skip SetupAccelerationStructure.
+//
+//			The file is laid out flat: a fixed header followed by the intersection
+//			format triangles, the kd-tree nodes and the triangle index list, each
+//			starting on a 16 byte boundary. Loading reads each array straight into
+//			the environment's vectors with a single read.
+//
+//=============================================================================//
+
+#include "raytrace.h"
+#include <filesystem_tools.h>
+#include <cmdlib.h>
+#include "tier1/checksum_crc.h"
+
+#define RAYTRACE_CACHE_ID		(('F'<<24)+('C'<<16)+('T'<<8)+'R')
+#define RAYTRACE_CACHE_VERSION	2
+
+struct RayTraceCacheHeader_t
+{
+	int32 m_nId;
+	int32 m_nVersion;
+	int32 m_nBuilderVersion;								// RAYTRACE_KDTREE_BUILDER_VERSION
+	uint32 m_nGeometryHash;									// from CalculateGeometryHash
+	int32 m_nTriangleSize;									// sizeof(CacheOptimizedTriangle)
+	int32 m_nNodeSize;										// sizeof(CacheOptimizedKDNode)
+	int32 m_nTriangles;
+	int32 m_nNodes;
+	int32 m_nTriangleIndices;
+	int32 m_nTriangleOffset;								// file offsets of the three arrays
+	int32 m_nNodeOffset;
+	int32 m_nTriangleIndexOffset;
+	float m_MinBound[3];
+	float m_MaxBound[3];
+};
+
+static int AlignCacheOffset( int nOffset )
+{
+	return ( nOffset + 15 ) & ~15;
+}
+
+// true if an array of nCount elements of nSize bytes at nOffset lies in the file after the header
+static bool IsCacheArrayInFile( int32 nOffset, int32 nCount, int32 nSize, int64 nFileSize )
+{
+	if ( nOffset < (int32)sizeof( RayTraceCacheHeader_t ) || nCount < 0 )
+		return false;
+
+	return (int64)nOffset + (int64)nCount * nSize <= nFileSize;
+}
+
+// reads an array at nOffset, failing if the file doesn't hold all of it
+static bool ReadCacheArray( FileHandle_t fp, int32 nOffset, void *pDest, int nBytes )
+{
+	g_pFileSystem->Seek( fp, nOffset, FILESYSTEM_SEEK_HEAD );
+	return g_pFileSystem->Read( pDest, nBytes, fp ) == nBytes;
+}
+
+// true if every node's children and every leaf's triangles are in range. Children
+// always come after their parent, which also means the tree can't loop.
+static bool IsCachedTreeValid( const CUtlVector<CacheOptimizedKDNode> &nodes, const CUtlVector<int32> &triangleIndices, int nTriangles )
+{
+	for ( int i = 0; i < nodes.Count(); i++ )
+	{
+		const CacheOptimizedKDNode &node = nodes[i];
+		if ( node.NodeType() == KDNODE_STATE_LEAF )
+		{
+			int nStart = node.TriangleIndexStart();
+			int nLeafTris = node.NumberOfTrianglesInLeaf();
+			if ( nStart < 0 || nLeafTris < 0 || nLeafTris > triangleIndices.Count() - nStart )
+				return false;
+		}
+		else
+		{
+			int nLeft = node.LeftChild();
+			if ( nLeft <= i || nLeft >= nodes.Count() - 1 )
+				return false;
+		}
+	}
+
+	for ( int i = 0; i < triangleIndices.Count(); i++ )
+	{
+		if ( triangleIndices[i] < 0 || triangleIndices[i] >= nTriangles )
+			return false;
+	}
+
+	return true;
+}
+
+static void WritePadding( FileHandle_t fp, int nCurrent, int nTarget )
+{
+	static const char zeros[16] = { 0 };
+	if ( nTarget > nCurrent )
+		g_pFileSystem->Write( zeros, nTarget - nCurrent, fp );
+}
+
+
+//-----------------------------------------------------------------------------
+// Hashes the triangle soup passed to AddTriangle. Must be called before
+// SetupAccelerationStructure, while the triangles are still in geometry format.
+// Everything that affects the shadow casters (world brushes, displacements,
+// static props and the options that filter them) ends up in this data, so the
+// hash changes whenever the cached tree would be stale.
+//-----------------------------------------------------------------------------
+uint32 RayTracingEnvironment::CalculateGeometryHash( void )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	int nTris = OptimizedTriangleList.Count();
+	CRC32_ProcessBuffer( &crc, &nTris, sizeof( nTris ) );
+	for ( int i = 0; i < nTris; i++ )
+	{
+		// hash the fields individually; the builder scratch bytes are never initialized
+		TriGeometryData_t const &tri = OptimizedTriangleList[i].m_Data.m_GeometryData;
+		CRC32_ProcessBuffer( &crc, &tri.m_nTriangleID, sizeof( tri.m_nTriangleID ) );
+		CRC32_ProcessBuffer( &crc, tri.m_VertexCoordData, sizeof( tri.m_VertexCoordData ) );
+		CRC32_ProcessBuffer( &crc, &tri.m_nFlags, sizeof( tri.m_nFlags ) );
+	}
+
+	CRC32_Final( &crc );
+	return crc;
+}
+
+
+//-----------------------------------------------------------------------------
+// Writes the tree built by SetupAccelerationStructure.
+//-----------------------------------------------------------------------------
+bool RayTracingEnvironment::SaveAccelerationStructure( const char *pFileName, uint32 nGeometryHash )
+{
+	FileHandle_t fp = g_pFileSystem->Open( pFileName, "wb" );
+	if ( !fp )
+	{
+		Warning( "Couldn't write ray-trace cache %s\n", pFileName );
+		return false;
+	}
+
+	RayTraceCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nId = RAYTRACE_CACHE_ID;
+	header.m_nVersion = RAYTRACE_CACHE_VERSION;
+	header.m_nBuilderVersion = RAYTRACE_KDTREE_BUILDER_VERSION;
+	header.m_nGeometryHash = nGeometryHash;
+	header.m_nTriangleSize = sizeof( CacheOptimizedTriangle );
+	header.m_nNodeSize = sizeof( CacheOptimizedKDNode );
+	header.m_nTriangles = OptimizedTriangleList.Count();
+	header.m_nNodes = OptimizedKDTree.Count();
+	header.m_nTriangleIndices = TriangleIndexList.Count();
+	header.m_nTriangleOffset = AlignCacheOffset( sizeof( header ) );
+	header.m_nNodeOffset = AlignCacheOffset( header.m_nTriangleOffset + header.m_nTriangles * header.m_nTriangleSize );
+	header.m_nTriangleIndexOffset = AlignCacheOffset( header.m_nNodeOffset + header.m_nNodes * header.m_nNodeSize );
+	for ( int i = 0; i < 3; i++ )
+	{
+		header.m_MinBound[i] = m_MinBound[i];
+		header.m_MaxBound[i] = m_MaxBound[i];
+	}
+
+	g_pFileSystem->Write( &header, sizeof( header ), fp );
+	WritePadding( fp, sizeof( header ), header.m_nTriangleOffset );
+
+	// the triangle list is block allocated, so it has to go out one at a time
+	for ( int i = 0; i < header.m_nTriangles; i++ )
+		g_pFileSystem->Write( &OptimizedTriangleList[i], sizeof( CacheOptimizedTriangle ), fp );
+	WritePadding( fp, header.m_nTriangleOffset + header.m_nTriangles * header.m_nTriangleSize, header.m_nNodeOffset );
+
+	g_pFileSystem->Write( OptimizedKDTree.Base(), header.m_nNodes * header.m_nNodeSize, fp );
+	WritePadding( fp, header.m_nNodeOffset + header.m_nNodes * header.m_nNodeSize, header.m_nTriangleIndexOffset );
+
+	g_pFileSystem->Write( TriangleIndexList.Base(), header.m_nTriangleIndices * sizeof( int32 ), fp );
+	g_pFileSystem->Close( fp );
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Replaces SetupAccelerationStructure when a cache built from the same geometry
+// exists. The triangles must already have been added (their colors and materials
+// aren't cached); on success they are in intersection format and the tree is
+// ready to trace. Returns false, leaving the environment untouched, if the file
+// is missing or stale.
+//-----------------------------------------------------------------------------
+bool RayTracingEnvironment::LoadAccelerationStructure( const char *pFileName, uint32 nGeometryHash )
+{
+	if ( !g_pFileSystem->FileExists( pFileName ) )
+		return false;
+
+	FileHandle_t fp = g_pFileSystem->Open( pFileName, "rb" );
+	if ( !fp )
+		return false;
+
+	double flStartTime = Plat_FloatTime();
+
+	RayTraceCacheHeader_t header;
+	int nFileSize = g_pFileSystem->Size( fp );
+	if ( ( g_pFileSystem->Read( &header, sizeof( header ), fp ) != sizeof( header ) ) ||
+		 ( header.m_nId != RAYTRACE_CACHE_ID ) ||
+		 ( header.m_nVersion != RAYTRACE_CACHE_VERSION ) ||
+		 ( header.m_nBuilderVersion != RAYTRACE_KDTREE_BUILDER_VERSION ) ||
+		 ( header.m_nGeometryHash != nGeometryHash ) ||
+		 ( header.m_nTriangleSize != sizeof( CacheOptimizedTriangle ) ) ||
+		 ( header.m_nNodeSize != sizeof( CacheOptimizedKDNode ) ) ||
+		 ( header.m_nTriangles != OptimizedTriangleList.Count() ) ||
+		 ( header.m_nNodes <= 0 ) ||
+		 // a truncated or corrupt file mustn't get as far as sizing the vectors from it
+		 !IsCacheArrayInFile( header.m_nTriangleOffset, header.m_nTriangles, header.m_nTriangleSize, nFileSize ) ||
+		 !IsCacheArrayInFile( header.m_nNodeOffset, header.m_nNodes, header.m_nNodeSize, nFileSize ) ||
+		 !IsCacheArrayInFile( header.m_nTriangleIndexOffset, header.m_nTriangleIndices, sizeof( int32 ), nFileSize ) )
+	{
+		g_pFileSystem->Close( fp );
+		return false;
+	}
+
+	CUtlVector<CacheOptimizedTriangle> triangles;
+	CUtlVector<CacheOptimizedKDNode> nodes;
+	CUtlVector<int32> triangleIndices;
+	triangles.SetCount( header.m_nTriangles );
+	nodes.SetCount( header.m_nNodes );
+	triangleIndices.SetCount( header.m_nTriangleIndices );
+	bool bRead = ReadCacheArray( fp, header.m_nTriangleOffset, triangles.Base(), header.m_nTriangles * header.m_nTriangleSize ) &&
+		ReadCacheArray( fp, header.m_nNodeOffset, nodes.Base(), header.m_nNodes * header.m_nNodeSize ) &&
+		ReadCacheArray( fp, header.m_nTriangleIndexOffset, triangleIndices.Base(), header.m_nTriangleIndices * sizeof( int32 ) );
+	g_pFileSystem->Close( fp );
+
+	// a damaged file has to be rebuilt rather than crash the tracer
+	if ( !bRead || !IsCachedTreeValid( nodes, triangleIndices, header.m_nTriangles ) )
+	{
+		Warning( "Ray-trace cache %s is damaged, rebuilding\n", pFileName );
+		return false;
+	}
+
+	// cheap sanity check that the triangles are the ones we were handed, in the same order
+	for ( int i = 0; i < header.m_nTriangles; i++ )
+	{
+		if ( triangles[i].m_Data.m_IntersectData.m_nTriangleID !=
+			 OptimizedTriangleList[i].m_Data.m_GeometryData.m_nTriangleID )
+		{
+			return false;
+		}
+	}
+
+	OptimizedKDTree.Swap( nodes );
+	TriangleIndexList.Swap( triangleIndices );
+	for ( int i = 0; i < header.m_nTriangles; i++ )
+		OptimizedTriangleList[i] = triangles[i];
+	m_MinBound.Init( header.m_MinBound[0], header.m_MinBound[1], header.m_MinBound[2] );
+	m_MaxBound.Init( header.m_MaxBound[0], header.m_MaxBound[1], header.m_MaxBound[2] );
+
+	m_BuildStats.m_flBuildTime = Plat_FloatTime() - flStartTime;
+	m_BuildStats.m_nBuildThreads = 0;
+	CalculateTreeStatistics();
+	return true;
+}
@@ -26,6 +26,8 @@
 #include "tier0/mem.h"
 #include "utlbuffer.h"
 #include "utlhash.h"
+#include "utlhashtable.h"
+#include "memstack.h"
 #include "utlvector.h"
 #include "utlqueue.h"
 #include "UtlSortVector.h"
@@ -443,6 +445,548 @@ KeyValues::KeyValues( const char *setName, const char *firstKey, int firstValue,
 	SetInt( secondKey, secondValue );
 }
 
+//-----------------------------------------------------------------------------
+// Child index
+//
+// Children are a singly linked list, so FindKey and appending to the end of the
+// list are linear in the number of children, and building or reading a key with
+// thousands of children is quadratic. In a tree that opts in with
+// UsesChildIndex( true ), once a walk over a key's children gets past
+// KEYVALUES_CHILD_INDEX_THRESHOLD the key gets an index: a hash from key name
+// symbol to the first child with that name, plus the first and last child and
+// how many there are.
+//
+// KeyValues are passed between modules built against this header, so the
+// index can't be a new member. It's kept in a table on the side, keyed by the
+// parent, and a flag in the parent (in what used to be a padding byte) says it
+// has one. The functions here that add and remove children keep the index up to
+// date. Renaming a child or relinking it with SetNextKey can't be seen from the
+// parent, so indexed children are flagged and a second table maps them back to
+// their parent, whose index is then rebuilt on its next use.
+//
+// Other modules have their own copy of this code, which knows nothing about the
+// index, so a tree that opts in must only be edited from this module. Using an
+// index checks that its first and last child are still the ends of the list,
+// and debug builds also count the children.
+//
+// Both tables are split into shards by key address, each with its own lock, so
+// trees on different threads rarely touch the same lock. A parent's shard may be
+// locked while a child's is taken, never the other way around.
+//-----------------------------------------------------------------------------
+#define KEYVALUES_CHILD_INDEX_THRESHOLD	32
+#define KEYVALUES_CHILD_INDEX_SHARDS	32
+
+enum
+{
+	KV_CHILDINDEX_HAS_INDEX = 0x01,		// this key has an entry in the child index table
+	KV_CHILDINDEX_IN_INDEX	= 0x02,		// this key is in its parent's index
+	KV_ARENA_USES			= 0x04,		// UsesArena( true )
+	KV_ARENA_HAS			= 0x08,		// this key has an entry in the arena table
+	KV_ARENA_KEY			= 0x10,		// this key was allocated from an arena
+	KV_ARENA_VALUE			= 0x20,		// m_sValue was allocated from an arena
+	KV_CHILDINDEX_USES		= 0x40,		// UsesChildIndex( true )
+};
+
+class CKeyValuesChildIndex
+{
+public:
+	CUtlHashtable< int, KeyValues * > m_FirstChild;		// name symbol -> first child with that name
+	KeyValues *m_pFirstChild;
+	KeyValues *m_pLastChild;
+	int m_nChildren;
+	bool m_bStale;										// a child was renamed or relinked, rebuild before use
+};
+
+struct KeyValuesChildIndexShard_t
+{
+	CThreadFastMutex m_Mutex;
+	CUtlHashtable< const void *, CKeyValuesChildIndex * > m_Indices;	// by parent
+	CUtlHashtable< const void *, const void * > m_Parents;			// by indexed child
+};
+
+// Made on first use, as KeyValues in other statics can be built before this file's
+// statics, and never freed, as they can be destroyed after them
+static KeyValuesChildIndexShard_t * volatile s_pChildIndexShards = NULL;
+
+static KeyValuesChildIndexShard_t &ChildIndexShard( const void *pKey, bool bParents )
+{
+	KeyValuesChildIndexShard_t *pShards = s_pChildIndexShards;
+	if ( !pShards )
+	{
+		// two threads can get here at once; the one that loses frees its shards
+		pShards = new KeyValuesChildIndexShard_t[ KEYVALUES_CHILD_INDEX_SHARDS * 2 ];
+		KeyValuesChildIndexShard_t *pExisting = (KeyValuesChildIndexShard_t *)ThreadInterlockedCompareExchangePointer( (void * volatile *)&s_pChildIndexShards, pShards, NULL );
+		if ( pExisting )
+		{
+			delete [] pShards;
+			pShards = pExisting;
+		}
+	}
+
+	uintp nHash = (uintp)pKey >> 4;
+	nHash ^= nHash >> 7;
+	return pShards[ ( nHash % KEYVALUES_CHILD_INDEX_SHARDS ) + ( bParents ? KEYVALUES_CHILD_INDEX_SHARDS : 0 ) ];
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Records which parent an indexed child belongs to, or forgets it
+//			(pParent NULL). Takes the child's shard lock.
+//-----------------------------------------------------------------------------
+static void SetChildIndexParent( KeyValues *pChild, const KeyValues *pParent )
+{
+	KeyValuesChildIndexShard_t &shard = ChildIndexShard( pChild, true );
+	AUTO_LOCK( shard.m_Mutex );
+	UtlHashHandle_t h = shard.m_Parents.Find( pChild );
+	if ( pParent )
+	{
+		if ( h == shard.m_Parents.InvalidHandle() )
+		{
+			shard.m_Parents.Insert( pChild, pParent );
+		}
+		else
+		{
+			shard.m_Parents[h] = pParent;
+		}
+	}
+	else if ( h != shard.m_Parents.InvalidHandle() )
+	{
+		shard.m_Parents.RemoveByHandle( h );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Opts this key, and keys created under it, in or out of child indexing
+//-----------------------------------------------------------------------------
+void KeyValues::UsesChildIndex( bool state )
+{
+	if ( state )
+	{
+		m_nInternalFlags |= KV_CHILDINDEX_USES;
+	}
+	else
+	{
+		FreeChildIndex();
+		m_nInternalFlags &= ~KV_CHILDINDEX_USES;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the key's index without checking it. The key's shard lock
+//			must be held.
+//-----------------------------------------------------------------------------
+static CKeyValuesChildIndex *LookupChildIndex( const KeyValues *pKey )
+{
+	KeyValuesChildIndexShard_t &shard = ChildIndexShard( pKey, false );
+	UtlHashHandle_t h = shard.m_Indices.Find( pKey );
+	return ( h != shard.m_Indices.InvalidHandle() ) ? shard.m_Indices[h] : NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns this key's index, or NULL if it's out of date (or it has
+//			none). With bRebuildIfStale it rebuilds it instead of returning NULL.
+//			This key's shard lock must be held.
+//-----------------------------------------------------------------------------
+CKeyValuesChildIndex *KeyValues::GetChildIndex( bool bRebuildIfStale ) const
+{
+	CKeyValuesChildIndex *pIndex = LookupChildIndex( this );
+	if ( pIndex && !pIndex->m_bStale )
+	{
+		// the stale flag has to be checked first, the last child may have been unlinked and freed
+		if ( pIndex->m_pFirstChild == m_pSub && 
+			 ( pIndex->m_pLastChild ? ( pIndex->m_pLastChild->m_pPeer == NULL ) : ( m_pSub == NULL ) ) )
+		{
+#ifdef _DEBUG
+			int nChildren = 0;
+			for ( KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+			{
+				nChildren++;
+			}
+			AssertMsg( nChildren == pIndex->m_nChildren, "KeyValues child index is out of date, was the tree edited from another module?" );
+			if ( nChildren == pIndex->m_nChildren )
+#endif
+			return pIndex;
+		}
+
+		pIndex->m_bStale = true;
+	}
+
+	return bRebuildIfStale ? BuildChildIndex() : NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: (Re)builds the index of this key's children.
+//			This key's shard lock must be held.
+//-----------------------------------------------------------------------------
+CKeyValuesChildIndex *KeyValues::BuildChildIndex() const
+{
+	KeyValuesChildIndexShard_t &shard = ChildIndexShard( this, false );
+	UtlHashHandle_t h = shard.m_Indices.Find( this );
+	if ( h == shard.m_Indices.InvalidHandle() )
+	{
+		h = shard.m_Indices.Insert( this, new CKeyValuesChildIndex );
+	}
+
+	CKeyValuesChildIndex *pIndex = shard.m_Indices[h];
+	pIndex->m_FirstChild.RemoveAll();
+	pIndex->m_pFirstChild = m_pSub;
+	pIndex->m_pLastChild = NULL;
+	pIndex->m_nChildren = 0;
+	pIndex->m_bStale = false;
+	for ( KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		// Insert keeps the existing entry, so duplicate names map to the first one
+		pIndex->m_FirstChild.Insert( dat->m_iKeyName, dat );
+		if ( !( dat->m_nInternalFlags & KV_CHILDINDEX_IN_INDEX ) )
+		{
+			dat->m_nInternalFlags |= KV_CHILDINDEX_IN_INDEX;
+			SetChildIndexParent( dat, this );
+		}
+		pIndex->m_pLastChild = dat;
+		pIndex->m_nChildren++;
+	}
+
+	const_cast< KeyValues * >( this )->m_nInternalFlags |= KV_CHILDINDEX_HAS_INDEX;
+	return pIndex;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds the first child with the given name symbol. If ppLastChild is
+//			passed and no child is found, it's set to the last child.
+//-----------------------------------------------------------------------------
+KeyValues *KeyValues::FindChild( int keySymbol, KeyValues **ppLastChild ) const
+{
+	if ( m_nInternalFlags & KV_CHILDINDEX_HAS_INDEX )
+	{
+		AUTO_LOCK( ChildIndexShard( this, false ).m_Mutex );
+		CKeyValuesChildIndex *pIndex = GetChildIndex( true );
+		UtlHashHandle_t h = pIndex->m_FirstChild.Find( keySymbol );
+		if ( h != pIndex->m_FirstChild.InvalidHandle() )
+			return pIndex->m_FirstChild[h];
+
+		if ( ppLastChild )
+		{
+			*ppLastChild = pIndex->m_pLastChild;
+		}
+		return NULL;
+	}
+
+	int nChildren = 0;
+	KeyValues *lastItem = NULL;
+	KeyValues *dat;
+	for ( dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		if ( dat->m_iKeyName == keySymbol )
+			break;
+
+		lastItem = dat;
+		nChildren++;
+	}
+
+	if ( nChildren > KEYVALUES_CHILD_INDEX_THRESHOLD && ( m_nInternalFlags & KV_CHILDINDEX_USES ) )
+	{
+		AUTO_LOCK( ChildIndexShard( this, false ).m_Mutex );
+		BuildChildIndex();
+	}
+
+	if ( ppLastChild && !dat )
+	{
+		*ppLastChild = lastItem;
+	}
+	return dat;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds a child that has just been linked onto the end of the list
+//-----------------------------------------------------------------------------
+void KeyValues::AddToChildIndex( KeyValues *pSubkey )
+{
+	if ( !( m_nInternalFlags & KV_CHILDINDEX_HAS_INDEX ) )
+		return;
+
+	AUTO_LOCK( ChildIndexShard( this, false ).m_Mutex );
+	CKeyValuesChildIndex *pIndex = LookupChildIndex( this );
+	if ( !pIndex || pIndex->m_bStale )
+		return;
+
+	// the list has already been extended, so check against what it was before
+	bool bWasLast = pIndex->m_pLastChild ? ( pIndex->m_pFirstChild == m_pSub && pIndex->m_pLastChild->m_pPeer == pSubkey ) : ( m_pSub == pSubkey );
+	if ( !bWasLast || pSubkey->m_pPeer != NULL )
+	{
+		pIndex->m_bStale = true;
+		return;
+	}
+
+	pIndex->m_FirstChild.Insert( pSubkey->m_iKeyName, pSubkey );
+	if ( !pIndex->m_pFirstChild )
+	{
+		pIndex->m_pFirstChild = pSubkey;
+	}
+	pIndex->m_pLastChild = pSubkey;
+	pIndex->m_nChildren++;
+	pSubkey->m_nInternalFlags |= KV_CHILDINDEX_IN_INDEX;
+	SetChildIndexParent( pSubkey, this );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Takes a child out of the index. Called just before it's unlinked
+//			from the list.
+//-----------------------------------------------------------------------------
+void KeyValues::RemoveFromChildIndex( KeyValues *pSubkey, KeyValues *pPrevSubkey )
+{
+	if ( pSubkey->m_nInternalFlags & KV_CHILDINDEX_IN_INDEX )
+	{
+		pSubkey->m_nInternalFlags &= ~KV_CHILDINDEX_IN_INDEX;
+		SetChildIndexParent( pSubkey, NULL );
+	}
+
+	if ( !( m_nInternalFlags & KV_CHILDINDEX_HAS_INDEX ) )
+		return;
+
+	AUTO_LOCK( ChildIndexShard( this, false ).m_Mutex );
+	CKeyValuesChildIndex *pIndex = GetChildIndex( false );
+	if ( !pIndex )
+		return;
+
+	UtlHashHandle_t h = pIndex->m_FirstChild.Find( pSubkey->m_iKeyName );
+	if ( h != pIndex->m_FirstChild.InvalidHandle() && pIndex->m_FirstChild[h] == pSubkey )
+	{
+		// the next child with the same name, if any, becomes the first one
+		KeyValues *pNext = pSubkey->m_pPeer;
+		while ( pNext && pNext->m_iKeyName != pSubkey->m_iKeyName )
+		{
+			pNext = pNext->m_pPeer;
+		}
+
+		if ( pNext )
+		{
+			pIndex->m_FirstChild[h] = pNext;
+		}
+		else
+		{
+			pIndex->m_FirstChild.RemoveByHandle( h );
+		}
+	}
+
+	if ( pIndex->m_pFirstChild == pSubkey )
+	{
+		pIndex->m_pFirstChild = pSubkey->m_pPeer;
+	}
+	if ( pIndex->m_pLastChild == pSubkey )
+	{
+		pIndex->m_pLastChild = pPrevSubkey;
+	}
+	pIndex->m_nChildren--;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Drops this key's index; called whenever its child list is replaced
+//-----------------------------------------------------------------------------
+void KeyValues::FreeChildIndex()
+{
+	if ( !( m_nInternalFlags & KV_CHILDINDEX_HAS_INDEX ) )
+		return;
+
+	{
+		KeyValuesChildIndexShard_t &shard = ChildIndexShard( this, false );
+		AUTO_LOCK( shard.m_Mutex );
+		UtlHashHandle_t h = shard.m_Indices.Find( this );
+		if ( h != shard.m_Indices.InvalidHandle() )
+		{
+			delete shard.m_Indices[h];
+			shard.m_Indices.RemoveByHandle( h );
+		}
+	}
+	m_nInternalFlags &= ~KV_CHILDINDEX_HAS_INDEX;
+
+	for ( KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		if ( dat->m_nInternalFlags & KV_CHILDINDEX_IN_INDEX )
+		{
+			dat->m_nInternalFlags &= ~KV_CHILDINDEX_IN_INDEX;
+			SetChildIndexParent( dat, NULL );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: An indexed child was renamed or relinked, so its parent's index is
+//			out of date
+//-----------------------------------------------------------------------------
+void KeyValues::ChildIndexKeyChanged()
+{
+	m_nInternalFlags &= ~KV_CHILDINDEX_IN_INDEX;
+
+	const void *pParent = NULL;
+	{
+		KeyValuesChildIndexShard_t &shard = ChildIndexShard( this, true );
+		AUTO_LOCK( shard.m_Mutex );
+		UtlHashHandle_t h = shard.m_Parents.Find( this );
+		if ( h == shard.m_Parents.InvalidHandle() )
+			return;
+
+		pParent = shard.m_Parents[h];
+		shard.m_Parents.RemoveByHandle( h );
+	}
+
+	KeyValuesChildIndexShard_t &shard = ChildIndexShard( pParent, false );
+	AUTO_LOCK( shard.m_Mutex );
+	UtlHashHandle_t h = shard.m_Indices.Find( pParent );
+	if ( h != shard.m_Indices.InvalidHandle() )
+	{
+		shard.m_Indices[h]->m_bStale = true;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Arenas
+//
+// Parsing a text file allocates every key and every string value separately.
+// A key with UsesArena( true ) instead has LoadFromBuffer allocate the keys and
+// values it parses from a list of CMemoryStack blocks owned by that key, which
+// all go away with it. Arena keys are flagged; deleteThis only destructs them,
+// and FreeAllocatedValue leaves arena strings alone, so they can still be
+// edited, removed and mixed with heap keys. But an arena key can't outlive the
+// key that owns its arena, and code in other modules, which has its own copy
+// of this file, would free it to the heap.
+//
+// The arena to parse into is only set while g_KVMutex is held by LoadFromBuffer.
+//-----------------------------------------------------------------------------
+#define KEYVALUES_ARENA_MIN_BLOCK	( 16 * 1024 )
+#define KEYVALUES_ARENA_ALIGNMENT	8
+
+class CKeyValuesArena
+{
+public:
+	CKeyValuesArena() : m_nNextBlockSize( KEYVALUES_ARENA_MIN_BLOCK ) {}
+	~CKeyValuesArena() { m_Blocks.PurgeAndDeleteElements(); }
+
+	void *Alloc( unsigned nBytes );
+
+	CUtlVector< CMemoryStack * > m_Blocks;
+	unsigned m_nNextBlockSize;
+};
+
+void *CKeyValuesArena::Alloc( unsigned nBytes )
+{
+	nBytes = AlignValue( MAX( nBytes, 1u ), KEYVALUES_ARENA_ALIGNMENT );
+
+	// CMemoryStack can't grow past its max size outside of windows, so check first and start a new block
+	CMemoryStack *pBlock = m_Blocks.Count() ? m_Blocks.Tail() : NULL;
+	if ( !pBlock || (unsigned)( pBlock->GetUsed() ) + nBytes > (unsigned)pBlock->GetMaxSize() )
+	{
+		unsigned nBlockSize = MAX( m_nNextBlockSize, nBytes );
+		m_nNextBlockSize = nBlockSize * 2;
+
+		pBlock = new CMemoryStack;
+		if ( !pBlock->Init( nBlockSize, 0, 0, KEYVALUES_ARENA_ALIGNMENT ) )
+		{
+			delete pBlock;
+			return NULL;
+		}
+		m_Blocks.AddToTail( pBlock );
+	}
+
+	return pBlock->Alloc( nBytes );
+}
+
+typedef CUtlHashtable< const void *, CKeyValuesArena * > CKeyValuesArenaTable;
+
+static CThreadFastMutex s_ArenaMutex;
+static CKeyValuesArena *s_pParseArena = NULL;
+
+static CKeyValuesArenaTable *s_pArenaTable = NULL;
+
+// Call with s_ArenaMutex held. Made on first use and never freed, like the child index shards
+static CKeyValuesArenaTable &ArenaTable()
+{
+	if ( !s_pArenaTable )
+	{
+		s_pArenaTable = new CKeyValuesArenaTable;
+	}
+	return *s_pArenaTable;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Creates a parsed key in the current parse arena
+//-----------------------------------------------------------------------------
+KeyValues *KeyValues::CreateArenaKeyUsingKnownLastChild( const char *keyName, KeyValues *pLastChild )
+{
+	void *pMem = s_pParseArena->Alloc( sizeof( KeyValues ) );
+	if ( !pMem )
+		return CreateKeyUsingKnownLastChild( keyName, pLastChild );
+
+	KeyValues *dat = Construct( (KeyValues *)pMem, keyName );
+	dat->m_nInternalFlags |= KV_ARENA_KEY;
+
+	dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // use same format as parent does
+	dat->UsesConditionals( m_bEvaluateConditionals != 0 );
+	dat->UsesChildIndex( ( m_nInternalFlags & KV_CHILDINDEX_USES ) != 0 );
+	dat->UsesArena( true );
+
+	AddSubkeyUsingKnownLastChild( dat, pLastChild );
+	return dat;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees the arena this key owns. Everything allocated from it must
+//			have been destructed already.
+//-----------------------------------------------------------------------------
+void KeyValues::FreeArena()
+{
+	if ( !( m_nInternalFlags & KV_ARENA_HAS ) )
+		return;
+
+	AUTO_LOCK( s_ArenaMutex );
+	CKeyValuesArenaTable &table = ArenaTable();
+	UtlHashHandle_t h = table.Find( this );
+	if ( h != table.InvalidHandle() )
+	{
+		Assert( table[h] != s_pParseArena );
+		delete table[h];
+		table.RemoveByHandle( h );
+	}
+	m_nInternalFlags &= ~KV_ARENA_HAS;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees the string values, unless they're in an arena
+//-----------------------------------------------------------------------------
+void KeyValues::FreeAllocatedValue()
+{
+	if ( m_nInternalFlags & KV_ARENA_VALUE )
+	{
+		m_nInternalFlags &= ~KV_ARENA_VALUE;
+	}
+	else
+	{
+		delete [] m_sValue;
+	}
+	m_sValue = NULL;
+
+	delete [] m_wsValue;
+	m_wsValue = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Allocates m_sValue for the parser, from the parse arena if there is one
+//-----------------------------------------------------------------------------
+void KeyValues::AllocateValueBlock( int size )
+{
+	FreeAllocatedValue();
+
+	if ( s_pParseArena )
+	{
+		m_sValue = (char *)s_pParseArena->Alloc( size );
+		if ( m_sValue )
+		{
+			m_nInternalFlags |= KV_ARENA_VALUE;
+			return;
+		}
+	}
+
+	m_sValue = new char[size];
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Initialize member variables
 //-----------------------------------------------------------------------------
@@ -462,8 +1006,7 @@ void KeyValues::Init()
 	m_bHasEscapeSequences = false;
 	m_bEvaluateConditionals = true;
 
-	// for future proof
-	memset( unused, 0, sizeof(unused) );
+	m_nInternalFlags = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -481,26 +1024,28 @@ KeyValues::~KeyValues()
 //-----------------------------------------------------------------------------
 void KeyValues::RemoveEverything()
 {
+	FreeChildIndex();
+
 	KeyValues *dat;
 	KeyValues *datNext = NULL;
 	for ( dat = m_pSub; dat != NULL; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
 	for ( dat = m_pPeer; dat && dat != this; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
-	delete [] m_sValue;
-	m_sValue = NULL;
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	FreeAllocatedValue();
+
+	// after the subkeys, which may be in it
+	FreeArena();
 }
 
 //-----------------------------------------------------------------------------
@@ -639,6 +1184,21 @@ void KeyValues::UsesConditionals(bool state)
 	m_bEvaluateConditionals = state;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: 
+//-----------------------------------------------------------------------------
+void KeyValues::UsesArena(bool state)
+{
+	if ( state )
+	{
+		m_nInternalFlags |= KV_ARENA_USES;
+	}
+	else
+	{
+		m_nInternalFlags &= ~KV_ARENA_USES;
+	}
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: Load keyValues from disk
@@ -967,13 +1527,7 @@ void KeyValues::SaveKeyToFile( KeyValues *dat, IBaseFileSystem *filesystem, File
 //-----------------------------------------------------------------------------
 KeyValues *KeyValues::FindKey(int keySymbol) const
 {
-	for (KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
-	{
-		if (dat->m_iKeyName == keySymbol)
-			return dat;
-	}
-
-	return NULL;
+	return FindChild( keySymbol, NULL );
 }
 
 //-----------------------------------------------------------------------------
@@ -1009,19 +1563,9 @@ KeyValues *KeyValues::FindKey(const char *keyName, bool bCreate)
 		return NULL;
 	}
 
+	// find the searchStr in the current peer list, recording the last item (for if we need to append to the end of the list)
 	KeyValues *lastItem = NULL;
-	KeyValues *dat;
-	// find the searchStr in the current peer list
-	for (dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
-	{
-		lastItem = dat;	// record the last item looked at (for if we need to append to the end of the list)
-
-		// symbol compare
-		if (dat->m_iKeyName == iSearchStr)
-		{
-			break;
-		}
-	}
+	KeyValues *dat = FindChild( iSearchStr, &lastItem );
 
 	if ( !dat && m_pChain )
 	{
@@ -1039,6 +1583,7 @@ KeyValues *KeyValues::FindKey(const char *keyName, bool bCreate)
 
 			dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 );	// use same format as parent
 			dat->UsesConditionals( m_bEvaluateConditionals != 0 );
+			dat->UsesChildIndex( ( m_nInternalFlags & KV_CHILDINDEX_USES ) != 0 );
 
 			// insert new key at end of list
 			if (lastItem)
@@ -1050,6 +1595,7 @@ KeyValues *KeyValues::FindKey(const char *keyName, bool bCreate)
 				m_pSub = dat;
 			}
 			dat->m_pPeer = NULL;
+			AddToChildIndex( dat );
 
 			// a key graduates to be a submsg as soon as it's m_pSub is set
 			// this should be the only place m_pSub is set
@@ -1118,6 +1664,7 @@ KeyValues* KeyValues::CreateKeyUsingKnownLastChild( const char *keyName, KeyValu
 
 	dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // use same format as parent does
 	dat->UsesConditionals( m_bEvaluateConditionals != 0 );
+	dat->UsesChildIndex( ( m_nInternalFlags & KV_CHILDINDEX_USES ) != 0 );
 	
 	// add into subkey list
 	AddSubkeyUsingKnownLastChild( dat, pLastChild );
@@ -1153,8 +1700,11 @@ void KeyValues::AddSubkeyUsingKnownLastChild( KeyValues *pSubkey, KeyValues *pLa
 //			Assert( pTempDat == pLastChild );
 //		#endif
 
-		pLastChild->SetNextKey( pSubkey );
+		// not SetNextKey, which would invalidate the child indices
+		pLastChild->m_pPeer = pSubkey;
 	}
+
+	AddToChildIndex( pSubkey );
 }
 
 
@@ -1168,20 +1718,7 @@ void KeyValues::AddSubKey( KeyValues *pSubkey )
 	Assert( pSubkey->m_pPeer == NULL );
 
 	// add into subkey list
-	if ( m_pSub == NULL )
-	{
-		m_pSub = pSubkey;
-	}
-	else
-	{
-		KeyValues *pTempDat = m_pSub;
-		while ( pTempDat->GetNextKey() != NULL )
-		{
-			pTempDat = pTempDat->GetNextKey();
-		}
-
-		pTempDat->SetNextKey( pSubkey );
-	}
+	AddSubkeyUsingKnownLastChild( pSubkey, FindLastSubKey() );
 }
 
 
@@ -1197,9 +1734,10 @@ void KeyValues::RemoveSubKey(KeyValues *subKey)
 	// check the list pointer
 	if (m_pSub == subKey)
 	{
+		RemoveFromChildIndex( subKey, NULL );
 		m_pSub = subKey->m_pPeer;
 	}
-	else
+	else if (m_pSub)
 	{
 		// look through the list
 		KeyValues *kv = m_pSub;
@@ -1207,6 +1745,7 @@ void KeyValues::RemoveSubKey(KeyValues *subKey)
 		{
 			if (kv->m_pPeer == subKey)
 			{
+				RemoveFromChildIndex( subKey, kv );
 				kv->m_pPeer = subKey->m_pPeer;
 				break;
 			}
@@ -1230,10 +1769,26 @@ KeyValues *KeyValues::FindLastSubKey()
 	if ( m_pSub == NULL )
 		return NULL;
 
+	if ( m_nInternalFlags & KV_CHILDINDEX_HAS_INDEX )
+	{
+		AUTO_LOCK( ChildIndexShard( this, false ).m_Mutex );
+		return GetChildIndex( true )->m_pLastChild;
+	}
+
 	// Scan for the last one
+	int nChildren = 1;
 	KeyValues *pLastChild = m_pSub;
 	while ( pLastChild->m_pPeer )
+	{
 		pLastChild = pLastChild->m_pPeer;
+		nChildren++;
+	}
+
+	if ( nChildren > KEYVALUES_CHILD_INDEX_THRESHOLD && ( m_nInternalFlags & KV_CHILDINDEX_USES ) )
+	{
+		AUTO_LOCK( ChildIndexShard( this, false ).m_Mutex );
+		BuildChildIndex();
+	}
 	return pLastChild;
 }
 
@@ -1242,6 +1797,10 @@ KeyValues *KeyValues::FindLastSubKey()
 //-----------------------------------------------------------------------------
 void KeyValues::SetNextKey( KeyValues *pDat )
 {
+	if ( m_nInternalFlags & KV_CHILDINDEX_IN_INDEX )
+	{
+		ChildIndexKeyChanged();
+	}
 	m_pPeer = pDat;
 }
 
@@ -1595,11 +2154,8 @@ void KeyValues::SetColor( const char *keyName, Color value)
 
 void KeyValues::SetStringValue( char const *strValue )
 {
-	// delete the old value
-	delete [] m_sValue;
-	// make sure we're not storing the WSTRING  - as we're converting over to STRING
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+	FreeAllocatedValue();
 
 	if (!strValue)
 	{
@@ -1629,11 +2185,8 @@ void KeyValues::SetString( const char *keyName, const char *value )
 			return;
 		}
 
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1658,11 +2211,8 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 	KeyValues *dat = FindKey( keyName, true );
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_wsValue;
-		// make sure we're not storing the STRING  - as we're converting over to WSTRING
-		delete [] dat->m_sValue;
-		dat->m_sValue = NULL;
+		// delete the old value, and make sure we're not storing the STRING - as we're converting over to WSTRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1702,11 +2252,8 @@ void KeyValues::SetUint64( const char *keyName, uint64 value )
 
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		dat->m_sValue = new char[sizeof(uint64)];
 		*((uint64 *)dat->m_sValue) = value;
@@ -1730,6 +2277,10 @@ void KeyValues::SetFloat( const char *keyName, float value )
 
 void KeyValues::SetName( const char * setName )
 {
+	if ( m_nInternalFlags & KV_CHILDINDEX_IN_INDEX )
+	{
+		ChildIndexKeyChanged();
+	}
 	m_iKeyName = s_pfGetSymbolForString( setName, true );
 }
 
@@ -1766,6 +2317,9 @@ void KeyValues::CopyKeyValuesFromRecursive( const KeyValues& rootSrc )
 	char tmp[256];
 	KeyValues* localDst = NULL;
 
+	// our child list gets replaced
+	FreeChildIndex();
+
 	CUtlQueue<CopyStruct> nodeQ;
 	nodeQ.Insert({ this, &rootSrc });
 
@@ -1784,12 +2338,14 @@ void KeyValues::CopyKeyValuesFromRecursive( const KeyValues& rootSrc )
 			// Add children to the queue to process later. 
 			if (cs.src->m_pSub) {
 				cs.dst->m_pSub = localDst = new KeyValues( NULL );
+				localDst->UsesChildIndex( ( m_nInternalFlags & KV_CHILDINDEX_USES ) != 0 );
 				nodeQ.Insert({ localDst, cs.src->m_pSub });
 			}
 
 			// Process siblings until we hit the end of the line. 
 			if (cs.src->m_pPeer) {
 				cs.dst->m_pPeer = new KeyValues( NULL );
+				cs.dst->m_pPeer->UsesChildIndex( ( m_nInternalFlags & KV_CHILDINDEX_USES ) != 0 );
 			}
 			else {
 				cs.dst->m_pPeer = NULL;
@@ -1876,8 +2432,15 @@ void KeyValues::CopyKeyValue( const KeyValues& src, size_t tmpBufferSizeB, char*
 
 KeyValues& KeyValues::operator=( const KeyValues& src )
 {
+	if ( m_nInternalFlags & KV_CHILDINDEX_IN_INDEX )
+	{
+		ChildIndexKeyChanged();	// our name is about to change
+	}
+
+	int nKeepFlags = m_nInternalFlags & ( KV_ARENA_KEY | KV_CHILDINDEX_USES );	// our own memory still belongs to the arena, and we keep our options
 	RemoveEverything();
 	Init();	// reset all values
+	m_nInternalFlags |= nKeepFlags;
 	CopyKeyValuesFromRecursive( src );
 	return *this;
 }
@@ -1890,6 +2453,7 @@ void KeyValues::CopySubkeys( KeyValues *pParent ) const
 {
 	// recursively copy subkeys
 	// Also maintain ordering....
+	pParent->FreeChildIndex();
 	KeyValues *pPrev = NULL;
 	for ( KeyValues *sub = m_pSub; sub != NULL; sub = sub->m_pPeer )
 	{
@@ -1920,6 +2484,7 @@ KeyValues *KeyValues::MakeCopy( void ) const
 
 	newKeyValue->UsesEscapeSequences( m_bHasEscapeSequences != 0 );
 	newKeyValue->UsesConditionals( m_bEvaluateConditionals != 0 );
+	newKeyValue->UsesChildIndex( ( m_nInternalFlags & KV_CHILDINDEX_USES ) != 0 );
 
 	// copy data
 	newKeyValue->m_iDataType = m_iDataType;
@@ -2017,7 +2582,11 @@ bool KeyValues::IsEmpty(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::Clear( void )
 {
-	delete m_pSub;
+	FreeChildIndex();
+	if ( m_pSub )
+	{
+		m_pSub->deleteThis();
+	}
 	m_pSub = NULL;
 	m_iDataType = TYPE_NONE;
 }
@@ -2039,6 +2608,13 @@ KeyValues::types_t KeyValues::GetDataType(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::deleteThis()
 {
+	if ( m_nInternalFlags & KV_ARENA_KEY )
+	{
+		// the memory goes when the arena does
+		this->~KeyValues();
+		return;
+	}
+
 	delete this;
 }
 
@@ -2111,6 +2687,8 @@ void KeyValues::ParseIncludedKeys( char const *resourceName, const char *filetoi
 
 	newKV->UsesEscapeSequences( m_bHasEscapeSequences != 0 );	// use same format as parent
 	newKV->UsesConditionals( m_bEvaluateConditionals != 0 );
+	newKV->UsesChildIndex( ( m_nInternalFlags & KV_CHILDINDEX_USES ) != 0 );
+	newKV->UsesArena( ( m_nInternalFlags & KV_ARENA_USES ) != 0 );
 
 	if ( newKV->LoadFromFile( pFileSystem, fullpath, pPathID ) )
 	{
@@ -2259,6 +2837,26 @@ static CThreadFastMutex g_KVMutex;
 bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBaseFileSystem* pFileSystem, const char *pPathID )
 {
 	AUTO_LOCK( g_KVMutex );
+
+	// parse into our arena; saved because #include and #base load other files from in here
+	CKeyValuesArena *pSaveParseArena = s_pParseArena;
+	s_pParseArena = NULL;
+	if ( m_nInternalFlags & KV_ARENA_USES )
+	{
+		AUTO_LOCK( s_ArenaMutex );
+		CKeyValuesArenaTable &table = ArenaTable();
+		UtlHashHandle_t h = table.Find( this );
+		if ( h == table.InvalidHandle() )
+		{
+			// text is a good guess at the size of what it parses to
+			CKeyValuesArena *pArena = new CKeyValuesArena;
+			pArena->m_nNextBlockSize = MAX( (unsigned)buf.TellMaxPut(), (unsigned)KEYVALUES_ARENA_MIN_BLOCK );
+			h = table.Insert( this, pArena );
+		}
+		s_pParseArena = table[h];
+		m_nInternalFlags |= KV_ARENA_HAS;
+	}
+
 	KeyValues *pPreviousKey = NULL;
 	KeyValues *pCurrentKey = this;
 	CUtlVector< KeyValues * > includedKeys;
@@ -2315,6 +2913,7 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 
 			pCurrentKey->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // same format has parent use
 			pCurrentKey->UsesConditionals( m_bEvaluateConditionals != 0 );
+			pCurrentKey->UsesChildIndex( ( m_nInternalFlags & KV_CHILDINDEX_USES ) != 0 );
 
 			if ( pPreviousKey )
 			{
@@ -2386,6 +2985,8 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 
 	g_KeyValuesErrorStack.SetFilename( "" );	
 
+	s_pParseArena = pSaveParseArena;
+
 	return true;
 }
 
@@ -2466,7 +3067,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 
 		// Always create the key; note that this could potentially
 		// cause some duplication, but that's what we want sometimes
-		KeyValues *dat = CreateKeyUsingKnownLastChild( name, pLastChild );
+		KeyValues *dat = s_pParseArena ? CreateArenaKeyUsingKnownLastChild( name, pLastChild ) : CreateKeyUsingKnownLastChild( name, pLastChild );
 
 		errorKey.Reset( dat->GetNameSymbol() );
 
@@ -2508,11 +3109,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 				break;
 			}
 			
-			if (dat->m_sValue)
-			{
-				delete[] dat->m_sValue;
-				dat->m_sValue = NULL;
-			}
+			dat->FreeAllocatedValue();
 
 			int len = Q_strlen( value );
 
@@ -2552,7 +3149,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 							digit -= 'A' - ( '9' + 1 );
 					retVal = ( retVal * 16 ) + ( digit - '0' );
 				}
-				dat->m_sValue = new char[sizeof(uint64)];
+				dat->AllocateValueBlock( sizeof(uint64) );
 				*((uint64 *)dat->m_sValue) = retVal;
 				dat->m_iDataType = TYPE_UINT64;
 			}
@@ -2574,7 +3171,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 			if (dat->m_iDataType == TYPE_STRING)
 			{
 				// copy in the string information
-				dat->m_sValue = new char[len+1];
+				dat->AllocateValueBlock( len+1 );
 				Q_memcpy( dat->m_sValue, value, len+1 );
 			}
 
@@ -2600,6 +3197,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 		else
 		{
 			//this->RemoveSubKey( dat );
+			RemoveFromChildIndex( dat, pLastChild );
 			if ( pLastChild == NULL )
 			{
 				Assert( m_pSub == dat );
@@ -2726,8 +3324,15 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 	if ( !buffer.IsValid() ) // must be valid, no overflows etc
 		return false;
 
+	if ( m_nInternalFlags & KV_CHILDINDEX_IN_INDEX )
+	{
+		ChildIndexKeyChanged();	// our name and peers are about to change
+	}
+
+	int nKeepFlags = m_nInternalFlags & ( KV_ARENA_KEY | KV_CHILDINDEX_USES );	// our own memory still belongs to the arena, and we keep our options
 	RemoveEverything(); // remove current content
 	Init();	// reset
+	m_nInternalFlags |= nKeepFlags;
 	
 	if ( nStackDepth > 100 )
 	{
@@ -2758,6 +3363,7 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 		case TYPE_NONE:
 			{
 				dat->m_pSub = new KeyValues("");
+				dat->m_pSub->UsesChildIndex( ( m_nInternalFlags & KV_CHILDINDEX_USES ) != 0 );
 				if ( !dat->m_pSub->ReadAsBinary( buffer, nStackDepth + 1 ) )
 					return false;
 				break;
@@ -2833,6 +3439,7 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 		// new peer follows
 		dat->m_pPeer = new KeyValues("");
 		dat = dat->m_pPeer;
+		dat->UsesChildIndex( ( m_nInternalFlags & KV_CHILDINDEX_USES ) != 0 );
 	}
 
 	return buffer.IsValid();
@@ -7,6 +7,20 @@
 #include "basetypes.h"
 #include "commonmacros.h"
 #include "checksum_crc.h"
+#include "processor_detect.h"
+#include "tier0/threadtools.h"
+
+#if defined( PLATFORM_INTEL ) && !defined( _X360 )
+#define CRC32_HAS_PCLMUL
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#if defined( __GNUC__ )
+#define CRC32_PCLMUL_TARGET __attribute__(( target( "sse2,pclmul" ) ))
+#else
+#define CRC32_PCLMUL_TARGET								// msvc allows the intrinsics anywhere
+#endif
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -98,7 +112,7 @@ CRC32_t	CRC32_GetTableEntry( unsigned int slot )
 	return pulCRCTable[(unsigned char)slot];
 }
 
-void CRC32_ProcessBuffer(CRC32_t *pulCRC, const void *pBuffer, int nBuffer)
+void CRC32_ProcessBuffer_Bytewise(CRC32_t *pulCRC, const void *pBuffer, int nBuffer)
 {
 	CRC32_t ulCrc = *pulCRC;
 	unsigned char *pb = (unsigned char *)pBuffer;
@@ -178,3 +192,221 @@ JustAfew:
     nBuffer &= 7;
     goto JustAfew;
 }
+
+
+//-----------------------------------------------------------------------------
+// Slicing by 8. s_CRCTable8[k][i] is the crc of byte i followed by k zero
+// bytes, so eight bytes can be looked up independently and xor'd together
+// instead of going through the table one byte after another.
+//-----------------------------------------------------------------------------
+static CRC32_t s_CRCTable8[8][NUM_BYTES];
+
+static void CRC32_BuildSlice8Tables()
+{
+	for ( int i = 0; i < NUM_BYTES; i++ )
+	{
+		CRC32_t crc = pulCRCTable[i];
+		s_CRCTable8[0][i] = crc;
+		for ( int k = 1; k < 8; k++ )
+		{
+			crc = pulCRCTable[(unsigned char)crc] ^ (crc >> 8);
+			s_CRCTable8[k][i] = crc;
+		}
+	}
+}
+
+static void CRC32_Slice8(CRC32_t *pulCRC, const void *pBuffer, int nBuffer)
+{
+	CRC32_t ulCrc = *pulCRC;
+	const unsigned char *pb = (const unsigned char *)pBuffer;
+
+	// bytes up to a 4 byte boundary
+	while ( nBuffer > 0 && ( (uintp)pb & 3 ) )
+	{
+		ulCrc = pulCRCTable[*pb++ ^ (unsigned char)ulCrc] ^ (ulCrc >> 8);
+		nBuffer--;
+	}
+
+	while ( nBuffer >= 8 )
+	{
+		CRC32_t one = LittleLong( *(const CRC32_t *)pb ) ^ ulCrc;
+		CRC32_t two = LittleLong( *(const CRC32_t *)(pb + 4) );
+		ulCrc = s_CRCTable8[7][one & 0xff] ^
+				s_CRCTable8[6][(one >> 8) & 0xff] ^
+				s_CRCTable8[5][(one >> 16) & 0xff] ^
+				s_CRCTable8[4][one >> 24] ^
+				s_CRCTable8[3][two & 0xff] ^
+				s_CRCTable8[2][(two >> 8) & 0xff] ^
+				s_CRCTable8[1][(two >> 16) & 0xff] ^
+				s_CRCTable8[0][two >> 24];
+		pb += 8;
+		nBuffer -= 8;
+	}
+
+	while ( nBuffer-- > 0 )
+	{
+		ulCrc = pulCRCTable[*pb++ ^ (unsigned char)ulCrc] ^ (ulCrc >> 8);
+	}
+
+	*pulCRC = ulCrc;
+}
+
+
+#ifdef CRC32_HAS_PCLMUL
+
+//-----------------------------------------------------------------------------
+// Carry-less multiply folding, from Intel's "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction". Four 128 bit lanes are folded
+// forward 64 bytes at a time, folded down into one lane, then reduced to
+// 32 bits with a Barrett reduction. The constants are x^n mod P for the
+// bit-reflected CRC-32 polynomial.
+//-----------------------------------------------------------------------------
+static const uint64 s_CRCFold512[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL };	// x^(4*128+32), x^(4*128-32)
+static const uint64 s_CRCFold128[2] = { 0x01751997d0ULL, 0x00ccaa009eULL };	// x^(128+32), x^(128-32)
+static const uint64 s_CRCFold64[2] = { 0x0163cd6124ULL, 0 };					// x^64
+static const uint64 s_CRCBarrett[2] = { 0x01db710641ULL, 0x01f7011641ULL };	// P, floor( x^64 / P )
+
+CRC32_PCLMUL_TARGET static CRC32_t CRC32_FoldBlocks( CRC32_t ulCrc, const unsigned char *pb, int nBuffer )
+{
+	// nBuffer is a multiple of 16 and at least 64
+	__m128i x1 = _mm_loadu_si128( (const __m128i *)( pb + 0x00 ) );
+	__m128i x2 = _mm_loadu_si128( (const __m128i *)( pb + 0x10 ) );
+	__m128i x3 = _mm_loadu_si128( (const __m128i *)( pb + 0x20 ) );
+	__m128i x4 = _mm_loadu_si128( (const __m128i *)( pb + 0x30 ) );
+	x1 = _mm_xor_si128( x1, _mm_cvtsi32_si128( (int)ulCrc ) );
+	pb += 64;
+	nBuffer -= 64;
+
+	__m128i k = _mm_loadu_si128( (const __m128i *)s_CRCFold512 );
+	while ( nBuffer >= 64 )
+	{
+		__m128i x5 = _mm_clmulepi64_si128( x1, k, 0x00 );
+		__m128i x6 = _mm_clmulepi64_si128( x2, k, 0x00 );
+		__m128i x7 = _mm_clmulepi64_si128( x3, k, 0x00 );
+		__m128i x8 = _mm_clmulepi64_si128( x4, k, 0x00 );
+		x1 = _mm_clmulepi64_si128( x1, k, 0x11 );
+		x2 = _mm_clmulepi64_si128( x2, k, 0x11 );
+		x3 = _mm_clmulepi64_si128( x3, k, 0x11 );
+		x4 = _mm_clmulepi64_si128( x4, k, 0x11 );
+		x1 = _mm_xor_si128( _mm_xor_si128( x1, x5 ), _mm_loadu_si128( (const __m128i *)( pb + 0x00 ) ) );
+		x2 = _mm_xor_si128( _mm_xor_si128( x2, x6 ), _mm_loadu_si128( (const __m128i *)( pb + 0x10 ) ) );
+		x3 = _mm_xor_si128( _mm_xor_si128( x3, x7 ), _mm_loadu_si128( (const __m128i *)( pb + 0x20 ) ) );
+		x4 = _mm_xor_si128( _mm_xor_si128( x4, x8 ), _mm_loadu_si128( (const __m128i *)( pb + 0x30 ) ) );
+		pb += 64;
+		nBuffer -= 64;
+	}
+
+	// four lanes down to one
+	k = _mm_loadu_si128( (const __m128i *)s_CRCFold128 );
+	__m128i x5 = _mm_clmulepi64_si128( x1, k, 0x00 );
+	x1 = _mm_clmulepi64_si128( x1, k, 0x11 );
+	x1 = _mm_xor_si128( _mm_xor_si128( x1, x2 ), x5 );
+	x5 = _mm_clmulepi64_si128( x1, k, 0x00 );
+	x1 = _mm_clmulepi64_si128( x1, k, 0x11 );
+	x1 = _mm_xor_si128( _mm_xor_si128( x1, x3 ), x5 );
+	x5 = _mm_clmulepi64_si128( x1, k, 0x00 );
+	x1 = _mm_clmulepi64_si128( x1, k, 0x11 );
+	x1 = _mm_xor_si128( _mm_xor_si128( x1, x4 ), x5 );
+
+	while ( nBuffer >= 16 )
+	{
+		x5 = _mm_clmulepi64_si128( x1, k, 0x00 );
+		x1 = _mm_clmulepi64_si128( x1, k, 0x11 );
+		x1 = _mm_xor_si128( _mm_xor_si128( x1, _mm_loadu_si128( (const __m128i *)pb ) ), x5 );
+		pb += 16;
+		nBuffer -= 16;
+	}
+
+	// 128 bits down to 64
+	const __m128i mask32 = _mm_setr_epi32( ~0, 0, ~0, 0 );
+	x2 = _mm_clmulepi64_si128( x1, k, 0x10 );
+	x1 = _mm_xor_si128( _mm_srli_si128( x1, 8 ), x2 );
+	k = _mm_loadu_si128( (const __m128i *)s_CRCFold64 );
+	x2 = _mm_srli_si128( x1, 4 );
+	x1 = _mm_clmulepi64_si128( _mm_and_si128( x1, mask32 ), k, 0x00 );
+	x1 = _mm_xor_si128( x1, x2 );
+
+	// Barrett reduction to 32
+	k = _mm_loadu_si128( (const __m128i *)s_CRCBarrett );
+	x2 = _mm_clmulepi64_si128( _mm_and_si128( x1, mask32 ), k, 0x10 );
+	x2 = _mm_clmulepi64_si128( _mm_and_si128( x2, mask32 ), k, 0x00 );
+	x1 = _mm_xor_si128( x1, x2 );
+
+	return (CRC32_t)_mm_cvtsi128_si32( _mm_srli_si128( x1, 4 ) );
+}
+
+static void CRC32_PCLMUL(CRC32_t *pulCRC, const void *pBuffer, int nBuffer)
+{
+	const unsigned char *pb = (const unsigned char *)pBuffer;
+	if ( nBuffer >= 64 )
+	{
+		int nFolded = nBuffer & ~15;
+		*pulCRC = CRC32_FoldBlocks( *pulCRC, pb, nFolded );
+		pb += nFolded;
+		nBuffer -= nFolded;
+	}
+
+	CRC32_Slice8( pulCRC, pb, nBuffer );
+}
+
+#endif // CRC32_HAS_PCLMUL
+
+
+//-----------------------------------------------------------------------------
+// Picks an implementation the first time through. The tables are filled in
+// before the pointer is published, and racing callers just fill them twice.
+//-----------------------------------------------------------------------------
+typedef void (*CRC32ProcessBufferFn_t)( CRC32_t *pulCRC, const void *pBuffer, int nBuffer );
+
+static void CRC32_Select( CRC32_t *pulCRC, const void *pBuffer, int nBuffer );
+static CRC32ProcessBufferFn_t volatile s_pfnCRC32ProcessBuffer = CRC32_Select;
+
+static void CRC32_Setup()
+{
+	if ( s_pfnCRC32ProcessBuffer != CRC32_Select )
+		return;
+
+	CRC32_BuildSlice8Tables();
+	ThreadMemoryBarrier();
+#ifdef CRC32_HAS_PCLMUL
+	s_pfnCRC32ProcessBuffer = CRC32_HasPCLMUL() ? CRC32_PCLMUL : CRC32_Slice8;
+#else
+	s_pfnCRC32ProcessBuffer = CRC32_Slice8;
+#endif
+}
+
+static void CRC32_Select( CRC32_t *pulCRC, const void *pBuffer, int nBuffer )
+{
+	CRC32_Setup();
+	s_pfnCRC32ProcessBuffer( pulCRC, pBuffer, nBuffer );
+}
+
+bool CRC32_HasPCLMUL()
+{
+#ifdef CRC32_HAS_PCLMUL
+	return CheckPCLMULQDQTechnology();
+#else
+	return false;
+#endif
+}
+
+void CRC32_ProcessBuffer(CRC32_t *pulCRC, const void *pBuffer, int nBuffer)
+{
+	s_pfnCRC32ProcessBuffer( pulCRC, pBuffer, nBuffer );
+}
+
+void CRC32_ProcessBuffer_Slice8(CRC32_t *pulCRC, const void *pBuffer, int nBuffer)
+{
+	CRC32_Setup();
+	CRC32_Slice8( pulCRC, pBuffer, nBuffer );
+}
+
+void CRC32_ProcessBuffer_PCLMUL(CRC32_t *pulCRC, const void *pBuffer, int nBuffer)
+{
+	CRC32_Setup();
+#ifdef CRC32_HAS_PCLMUL
+	CRC32_PCLMUL( pulCRC, pBuffer, nBuffer );
+#else
+	CRC32_Slice8( pulCRC, pBuffer, nBuffer );
+#endif
+}
@@ -0,0 +1,638 @@
+//========= Copyright Valve Corporation, All rights reserved. =================//
+//
+// Purpose: Flat, read-only KeyValues images, see keyvaluesimage.h
+//
+//			The image is a header, an array of key records and a string pool.
+//			Keys are stored breadth first, so the children of a key are one
+//			contiguous run of records and a key only needs the index of its
+//			first child and a count. Names carry a caseless hash so lookups
+//			compare strings only on a hash match. Offsets and counts are
+//			bounds checked as they're followed, so a damaged file can give wrong
+//			answers but can't read outside the image. Little endian only.
+//
+//=============================================================================//
+
+#if defined( _WIN32 ) && !defined( _X360 )
+#include <windows.h>
+#elif defined( POSIX )
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "keyvaluesimage.h"
+#include "utlbuffer.h"
+#include "utlvector.h"
+#include "utldict.h"
+#include "generichash.h"
+#include "strtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define KEYVALUES_IMAGE_ID			(('I'<<24)+('V'<<16)+('K'<<8)+'F')
+#define KEYVALUES_IMAGE_VERSION		3
+
+struct KeyValuesImageHeader_t
+{
+	int32 m_nId;
+	int32 m_nVersion;
+	int32 m_nKeySize;							// sizeof(KeyValuesImageKey_t)
+	int32 m_nKeys;
+	int32 m_nRoots;								// top level keys, the first m_nRoots records
+	int32 m_nKeyOffset;							// file offsets of the two arrays
+	int32 m_nStringOffset;
+	int32 m_nStringBytes;
+};
+
+enum
+{
+	KVIMAGE_LAST_PEER = 0x01,					// no GetNextKey
+};
+
+struct KeyValuesImageKey_t
+{
+	uint32 m_nNameHash;							// HashStringCaseless of the name
+	int32 m_nName;								// string pool offsets
+	int32 m_nString;							// value as text, -1 if GetString returns the default
+	int32 m_nFirstChild;
+	int32 m_nChildren;
+	uint8 m_nType;								// KeyValues::types_t
+	uint8 m_nFlags;
+	uint16 m_nUnused;
+	union
+	{
+		int32 m_iValue;
+		float m_flValue;
+		uint64 m_ulValue;
+		unsigned char m_Color[4];
+	};
+};
+
+//-----------------------------------------------------------------------------
+// Writing
+//-----------------------------------------------------------------------------
+class CKeyValuesImageStrings
+{
+public:
+	CKeyValuesImageStrings() : m_Offsets( k_eDictCompareTypeCaseSensitive ) {}
+
+	int Add( const char *pString )
+	{
+		int i = m_Offsets.Find( pString );
+		if ( i != m_Offsets.InvalidIndex() )
+			return m_Offsets[i];
+
+		int nOffset = m_Pool.Count();
+		m_Pool.AddMultipleToTail( V_strlen( pString ) + 1, pString );
+		m_Offsets.Insert( pString, nOffset );
+		return nOffset;
+	}
+
+	CUtlVector< char > m_Pool;
+	CUtlDict< int, int > m_Offsets;
+};
+
+static void FillImageValue( KeyValues *pKey, KeyValuesImageKey_t &key, CKeyValuesImageStrings &strings )
+{
+	char buf[64];
+
+	// read the raw values; KeyValues::GetString would convert the key to a string
+	key.m_nType = pKey->GetDataType();
+	key.m_nString = -1;
+	key.m_ulValue = 0;
+	switch ( pKey->GetDataType() )
+	{
+	case KeyValues::TYPE_STRING:
+		key.m_nString = strings.Add( pKey->GetString() );
+		break;
+	case KeyValues::TYPE_WSTRING:
+		{
+			char wideBuf[512];
+			Q_UnicodeToUTF8( pKey->GetWString(), wideBuf, sizeof( wideBuf ) );
+			key.m_nType = KeyValues::TYPE_STRING;
+			key.m_nString = strings.Add( wideBuf );
+		}
+		break;
+	case KeyValues::TYPE_INT:
+		key.m_iValue = pKey->GetInt();
+		Q_snprintf( buf, sizeof( buf ), "%d", key.m_iValue );
+		key.m_nString = strings.Add( buf );
+		break;
+	case KeyValues::TYPE_FLOAT:
+		key.m_flValue = pKey->GetFloat();
+		Q_snprintf( buf, sizeof( buf ), "%f", key.m_flValue );
+		key.m_nString = strings.Add( buf );
+		break;
+	case KeyValues::TYPE_UINT64:
+		key.m_ulValue = pKey->GetUint64();
+		Q_snprintf( buf, sizeof( buf ), "%lld", key.m_ulValue );
+		key.m_nString = strings.Add( buf );
+		break;
+	case KeyValues::TYPE_COLOR:
+		{
+			// no string; KeyValues::GetString returns the default for colours
+			Color color = pKey->GetColor();
+			for ( int i = 0; i < 4; i++ )
+			{
+				key.m_Color[i] = color[i];
+			}
+		}
+		break;
+	default:
+		// TYPE_NONE, and pointers, which mean nothing outside this process
+		key.m_nType = KeyValues::TYPE_NONE;
+		break;
+	}
+}
+
+bool WriteKeyValuesImage( KeyValues *pKeyValues, CUtlBuffer &buf )
+{
+	if ( !pKeyValues )
+		return false;
+
+	// lay the keys out breadth first, so that siblings are contiguous
+	CUtlVector< KeyValues * > order;
+	for ( KeyValues *pRoot = pKeyValues; pRoot; pRoot = pRoot->GetNextKey() )
+	{
+		order.AddToTail( pRoot );
+	}
+	int nRoots = order.Count();
+
+	// order grows as the children of each key are queued up
+	CUtlVector< uint8 > flags;
+	flags.SetCount( nRoots );
+	memset( flags.Base(), 0, nRoots );
+	flags[ nRoots - 1 ] = KVIMAGE_LAST_PEER;
+
+	CKeyValuesImageStrings strings;
+	CUtlVector< KeyValuesImageKey_t > keys;
+	keys.EnsureCapacity( nRoots );
+	for ( int i = 0; i < order.Count(); i++ )
+	{
+		KeyValues *pKey = order[i];
+
+		KeyValuesImageKey_t &key = keys[ keys.AddToTail() ];
+		memset( &key, 0, sizeof( key ) );
+		key.m_nNameHash = HashStringCaseless( pKey->GetName() );
+		key.m_nName = strings.Add( pKey->GetName() );
+		key.m_nFlags = flags[i];
+		FillImageValue( pKey, key, strings );
+
+		int nFirstChild = order.Count();
+		for ( KeyValues *pChild = pKey->GetFirstSubKey(); pChild; pChild = pChild->GetNextKey() )
+		{
+			order.AddToTail( pChild );
+			flags.AddToTail( 0 );
+		}
+
+		key.m_nChildren = order.Count() - nFirstChild;
+		if ( key.m_nChildren )
+		{
+			key.m_nFirstChild = nFirstChild;
+			flags.Tail() = KVIMAGE_LAST_PEER;
+		}
+	}
+
+	KeyValuesImageHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nId = KEYVALUES_IMAGE_ID;
+	header.m_nVersion = KEYVALUES_IMAGE_VERSION;
+	header.m_nKeySize = sizeof( KeyValuesImageKey_t );
+	header.m_nKeys = keys.Count();
+	header.m_nRoots = nRoots;
+	header.m_nKeyOffset = sizeof( header );
+	header.m_nStringOffset = header.m_nKeyOffset + keys.Count() * sizeof( KeyValuesImageKey_t );
+	header.m_nStringBytes = strings.m_Pool.Count();
+
+	buf.Put( &header, sizeof( header ) );
+	buf.Put( keys.Base(), keys.Count() * sizeof( KeyValuesImageKey_t ) );
+	buf.Put( strings.m_Pool.Base(), strings.m_Pool.Count() );
+	return buf.IsValid();
+}
+
+//-----------------------------------------------------------------------------
+// CKeyValuesImage
+//-----------------------------------------------------------------------------
+CKeyValuesImage::CKeyValuesImage()
+{
+	m_pMapping = NULL;
+#ifdef _WIN32
+	m_hFile = NULL;
+	m_hMapping = NULL;
+#endif
+	m_pBase = NULL;
+	Close();
+}
+
+CKeyValuesImage::~CKeyValuesImage()
+{
+	Close();
+}
+
+void CKeyValuesImage::Close()
+{
+	if ( m_pMapping )
+	{
+#if defined( _WIN32 ) && !defined( _X360 )
+		UnmapViewOfFile( m_pMapping );
+		CloseHandle( (HANDLE)m_hMapping );
+		CloseHandle( (HANDLE)m_hFile );
+		m_hMapping = NULL;
+		m_hFile = NULL;
+#elif defined( POSIX )
+		munmap( m_pMapping, m_nSize );
+#endif
+		m_pMapping = NULL;
+	}
+
+	m_pBase = NULL;
+	m_nSize = 0;
+	m_pKeys = NULL;
+	m_nKeys = 0;
+	m_pStrings = NULL;
+	m_nStringBytes = 0;
+}
+
+bool CKeyValuesImage::MapFile( const char *pFullPath )
+{
+	Close();
+
+#if defined( _WIN32 ) && !defined( _X360 )
+	HANDLE hFile = CreateFileA( pFullPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+		return false;
+
+	DWORD nSize = GetFileSize( hFile, NULL );
+	HANDLE hMapping = ( nSize != INVALID_FILE_SIZE && nSize > 0 ) ? CreateFileMappingA( hFile, NULL, PAGE_READONLY, 0, 0, NULL ) : NULL;
+	void *pView = hMapping ? MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+	if ( !pView )
+	{
+		if ( hMapping )
+		{
+			CloseHandle( hMapping );
+		}
+		CloseHandle( hFile );
+		return false;
+	}
+
+	m_hFile = hFile;
+	m_hMapping = hMapping;
+#elif defined( POSIX )
+	int fd = open( pFullPath, O_RDONLY );
+	if ( fd < 0 )
+		return false;
+
+	struct stat st;
+	void *pView = NULL;
+	if ( fstat( fd, &st ) == 0 && st.st_size > 0 )
+	{
+		pView = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if ( pView == MAP_FAILED )
+		{
+			pView = NULL;
+		}
+	}
+
+	// the mapping holds its own reference to the file
+	close( fd );
+	if ( !pView )
+		return false;
+
+	int nSize = (int)st.st_size;
+#else
+	return false;
+#endif
+
+	m_pMapping = pView;
+	m_pBase = (const byte *)pView;
+	m_nSize = (int)nSize;
+	if ( !Validate() )
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool CKeyValuesImage::Attach( const void *pData, int nSize )
+{
+	Close();
+
+	m_pBase = (const byte *)pData;
+	m_nSize = nSize;
+	if ( !pData || !Validate() )
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks the header. Only reads the header and the last string byte;
+//			everything else is checked as it's used.
+//-----------------------------------------------------------------------------
+bool CKeyValuesImage::Validate()
+{
+	if ( m_nSize < (int)sizeof( KeyValuesImageHeader_t ) )
+		return false;
+
+	const KeyValuesImageHeader_t *pHeader = (const KeyValuesImageHeader_t *)m_pBase;
+	if ( pHeader->m_nId != KEYVALUES_IMAGE_ID ||
+		 pHeader->m_nVersion != KEYVALUES_IMAGE_VERSION ||
+		 pHeader->m_nKeySize != sizeof( KeyValuesImageKey_t ) ||
+		 pHeader->m_nKeys <= 0 || pHeader->m_nRoots <= 0 || pHeader->m_nRoots > pHeader->m_nKeys ||
+		 pHeader->m_nKeyOffset < (int)sizeof( KeyValuesImageHeader_t ) || ( pHeader->m_nKeyOffset & 7 ) ||
+		 pHeader->m_nKeys > ( m_nSize - pHeader->m_nKeyOffset ) / (int)sizeof( KeyValuesImageKey_t ) ||
+		 pHeader->m_nStringOffset < pHeader->m_nKeyOffset + pHeader->m_nKeys * (int)sizeof( KeyValuesImageKey_t ) ||
+		 pHeader->m_nStringBytes <= 0 || pHeader->m_nStringBytes > m_nSize - pHeader->m_nStringOffset )
+	{
+		return false;
+	}
+
+	m_pKeys = (const KeyValuesImageKey_t *)( m_pBase + pHeader->m_nKeyOffset );
+	m_nKeys = pHeader->m_nKeys;
+	m_pStrings = (const char *)( m_pBase + pHeader->m_nStringOffset );
+	m_nStringBytes = pHeader->m_nStringBytes;
+
+	// so that any offset into the pool is a terminated string
+	return m_pStrings[ m_nStringBytes - 1 ] == 0;
+}
+
+KeyValuesView CKeyValuesImage::GetRoot() const
+{
+	return m_pBase ? KeyValuesView( this, 0 ) : KeyValuesView();
+}
+
+const KeyValuesImageKey_t &CKeyValuesImage::GetKey( int nKey ) const
+{
+	Assert( nKey >= 0 && nKey < m_nKeys );
+	return m_pKeys[nKey];
+}
+
+const char *CKeyValuesImage::GetString( int nOffset ) const
+{
+	return ( nOffset >= 0 && nOffset < m_nStringBytes ) ? m_pStrings + nOffset : NULL;
+}
+
+//-----------------------------------------------------------------------------
+// KeyValuesView
+//-----------------------------------------------------------------------------
+const KeyValuesImageKey_t &KeyValuesView::Key() const
+{
+	return m_pImage->GetKey( m_nKey );
+}
+
+const char *KeyValuesView::GetName() const
+{
+	if ( !m_pImage )
+		return "";
+
+	const char *pName = m_pImage->GetString( Key().m_nName );
+	return pName ? pName : "";
+}
+
+KeyValues::types_t KeyValuesView::GetDataType( const char *keyName ) const
+{
+	KeyValuesView dat = FindKey( keyName );
+	return dat.IsValid() ? (KeyValues::types_t)dat.Key().m_nType : KeyValues::TYPE_NONE;
+}
+
+KeyValuesView KeyValuesView::FindKey( const char *keyName ) const
+{
+	if ( !m_pImage || !keyName || !keyName[0] )
+		return *this;
+
+	// look for '/' characters deliminating sub fields
+	char szBuf[256];
+	const char *subStr = strchr( keyName, '/' );
+	const char *searchStr = keyName;
+	if ( subStr )
+	{
+		int size = MIN( (int)( subStr - keyName + 1 ), (int)V_ARRAYSIZE( szBuf ) );
+		V_strncpy( szBuf, keyName, size );
+		searchStr = szBuf;
+	}
+
+	uint32 nHash = HashStringCaseless( searchStr );
+	for ( KeyValuesView dat = GetFirstSubKey(); dat.IsValid(); dat = dat.GetNextKey() )
+	{
+		if ( dat.Key().m_nNameHash == nHash && !V_stricmp( dat.GetName(), searchStr ) )
+			return subStr ? dat.FindKey( subStr + 1 ) : dat;
+	}
+
+	return KeyValuesView();
+}
+
+KeyValuesView KeyValuesView::GetFirstSubKey() const
+{
+	if ( !m_pImage )
+		return KeyValuesView();
+
+	const KeyValuesImageKey_t &key = Key();
+	if ( key.m_nChildren <= 0 || key.m_nFirstChild <= m_nKey || key.m_nFirstChild > m_pImage->m_nKeys - key.m_nChildren )
+		return KeyValuesView();
+
+	return KeyValuesView( m_pImage, key.m_nFirstChild );
+}
+
+KeyValuesView KeyValuesView::GetNextKey() const
+{
+	if ( !m_pImage || ( Key().m_nFlags & KVIMAGE_LAST_PEER ) || m_nKey + 1 >= m_pImage->m_nKeys )
+		return KeyValuesView();
+
+	return KeyValuesView( m_pImage, m_nKey + 1 );
+}
+
+KeyValuesView KeyValuesView::GetFirstTrueSubKey() const
+{
+	KeyValuesView ret = GetFirstSubKey();
+	while ( ret.IsValid() && ret.Key().m_nType != KeyValues::TYPE_NONE )
+	{
+		ret = ret.GetNextKey();
+	}
+	return ret;
+}
+
+KeyValuesView KeyValuesView::GetNextTrueSubKey() const
+{
+	KeyValuesView ret = GetNextKey();
+	while ( ret.IsValid() && ret.Key().m_nType != KeyValues::TYPE_NONE )
+	{
+		ret = ret.GetNextKey();
+	}
+	return ret;
+}
+
+KeyValuesView KeyValuesView::GetFirstValue() const
+{
+	KeyValuesView ret = GetFirstSubKey();
+	while ( ret.IsValid() && ret.Key().m_nType == KeyValues::TYPE_NONE )
+	{
+		ret = ret.GetNextKey();
+	}
+	return ret;
+}
+
+KeyValuesView KeyValuesView::GetNextValue() const
+{
+	KeyValuesView ret = GetNextKey();
+	while ( ret.IsValid() && ret.Key().m_nType == KeyValues::TYPE_NONE )
+	{
+		ret = ret.GetNextKey();
+	}
+	return ret;
+}
+
+//-----------------------------------------------------------------------------
+// The getters convert between types the same way KeyValues does
+//-----------------------------------------------------------------------------
+int KeyValuesView::GetInt( const char *keyName, int defaultValue ) const
+{
+	KeyValuesView dat = FindKey( keyName );
+	if ( !dat.IsValid() )
+		return defaultValue;
+
+	const KeyValuesImageKey_t &key = dat.Key();
+	switch ( key.m_nType )
+	{
+	case KeyValues::TYPE_STRING:
+		return atoi( dat.GetString() );
+	case KeyValues::TYPE_FLOAT:
+		return (int)key.m_flValue;
+	case KeyValues::TYPE_UINT64:
+		// can't convert, since it would lose data
+		Assert( 0 );
+		return 0;
+	case KeyValues::TYPE_INT:
+	default:
+		return key.m_iValue;
+	}
+}
+
+uint64 KeyValuesView::GetUint64( const char *keyName, uint64 defaultValue ) const
+{
+	KeyValuesView dat = FindKey( keyName );
+	if ( !dat.IsValid() )
+		return defaultValue;
+
+	const KeyValuesImageKey_t &key = dat.Key();
+	switch ( key.m_nType )
+	{
+	case KeyValues::TYPE_STRING:
+		return (uint64)Q_atoi64( dat.GetString() );
+	case KeyValues::TYPE_FLOAT:
+		return (int)key.m_flValue;
+	case KeyValues::TYPE_UINT64:
+		return key.m_ulValue;
+	case KeyValues::TYPE_INT:
+	default:
+		return key.m_iValue;
+	}
+}
+
+float KeyValuesView::GetFloat( const char *keyName, float defaultValue ) const
+{
+	KeyValuesView dat = FindKey( keyName );
+	if ( !dat.IsValid() )
+		return defaultValue;
+
+	const KeyValuesImageKey_t &key = dat.Key();
+	switch ( key.m_nType )
+	{
+	case KeyValues::TYPE_STRING:
+		return (float)atof( dat.GetString() );
+	case KeyValues::TYPE_FLOAT:
+		return key.m_flValue;
+	case KeyValues::TYPE_INT:
+		return (float)key.m_iValue;
+	case KeyValues::TYPE_UINT64:
+		return (float)key.m_ulValue;
+	default:
+		return 0.0f;
+	}
+}
+
+const char *KeyValuesView::GetString( const char *keyName, const char *defaultValue ) const
+{
+	KeyValuesView dat = FindKey( keyName );
+	if ( !dat.IsValid() )
+		return defaultValue;
+
+	// numbers were written out as text too
+	const char *pString = m_pImage->GetString( dat.Key().m_nString );
+	return pString ? pString : defaultValue;
+}
+
+Color KeyValuesView::GetColor( const char *keyName ) const
+{
+	Color color( 0, 0, 0, 0 );
+	KeyValuesView dat = FindKey( keyName );
+	if ( !dat.IsValid() )
+		return color;
+
+	const KeyValuesImageKey_t &key = dat.Key();
+	if ( key.m_nType == KeyValues::TYPE_COLOR )
+	{
+		color.SetColor( key.m_Color[0], key.m_Color[1], key.m_Color[2], key.m_Color[3] );
+	}
+	else if ( key.m_nType == KeyValues::TYPE_FLOAT )
+	{
+		color[0] = key.m_flValue;
+	}
+	else if ( key.m_nType == KeyValues::TYPE_INT )
+	{
+		color[0] = key.m_iValue;
+	}
+	else if ( key.m_nType == KeyValues::TYPE_STRING )
+	{
+		// parse the colors out of the string
+		float a = 0.0f, b = 0.0f, c = 0.0f, d = 0.0f;
+		sscanf( dat.GetString(), "%f %f %f %f", &a, &b, &c, &d );
+		color.SetColor( (unsigned char)a, (unsigned char)b, (unsigned char)c, (unsigned char)d );
+	}
+	return color;
+}
+
+bool KeyValuesView::IsEmpty( const char *keyName ) const
+{
+	KeyValuesView dat = FindKey( keyName );
+	if ( !dat.IsValid() )
+		return true;
+
+	return dat.Key().m_nType == KeyValues::TYPE_NONE && dat.Key().m_nChildren == 0;
+}
+
+KeyValues *KeyValuesView::MakeKeyValues() const
+{
+	if ( !m_pImage )
+		return NULL;
+
+	KeyValues *pKV = new KeyValues( GetName() );
+	const KeyValuesImageKey_t &key = Key();
+	switch ( key.m_nType )
+	{
+	case KeyValues::TYPE_STRING:
+		pKV->SetString( NULL, GetString() );
+		break;
+	case KeyValues::TYPE_INT:
+		pKV->SetInt( NULL, key.m_iValue );
+		break;
+	case KeyValues::TYPE_FLOAT:
+		pKV->SetFloat( NULL, key.m_flValue );
+		break;
+	case KeyValues::TYPE_UINT64:
+		pKV->SetUint64( NULL, key.m_ulValue );
+		break;
+	case KeyValues::TYPE_COLOR:
+		pKV->SetColor( NULL, GetColor() );
+		break;
+	}
+
+	for ( KeyValuesView sub = GetFirstSubKey(); sub.IsValid(); sub = sub.GetNextKey() )
+	{
+		pKV->AddSubKey( sub.MakeKeyValues() );
+	}
+	return pKV;
+}
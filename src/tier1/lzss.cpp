@@ -11,6 +11,8 @@
 #include "tier0/etwprof.h"
 #include "tier1/lzss.h"
 #include "tier1/utlbuffer.h"
+#include "tier1/utlvector.h"
+#include "tier0/threadtools.h"
 
 #define LZSS_LOOKSHIFT		4
 #define LZSS_LOOKAHEAD		( 1 << LZSS_LOOKSHIFT )
@@ -86,14 +88,13 @@ void CLZSS::BuildHash( const unsigned char *pData )
 	pList->pStart = pTarget;
 }
 
-unsigned char *CLZSS::CompressNoAlloc( const unsigned char *pInput, int inputLength, unsigned char *pOutputBuf, unsigned int *pOutputSize )
+unsigned char *CLZSS::CompressNoAllocGreedy( const unsigned char *pInput, int inputLength, unsigned char *pOutputBuf, unsigned int *pOutputSize )
 {
 	if ( inputLength <= sizeof( lzss_header_t ) + 8 )
 	{
 		return NULL;
 	}
-	VPROF( "CLZSS::CompressNoAlloc" );
-	ETWMark1I("CompressNoAlloc", inputLength );
+	VPROF( "CLZSS::CompressNoAllocGreedy" );
 
 	// create the compression work buffers, small enough (~64K) for stack
 	m_pHashTable = (lzss_list_t *)stackalloc( 256 * sizeof( lzss_list_t ) );
@@ -212,6 +213,302 @@ unsigned char *CLZSS::CompressNoAlloc( const unsigned char *pInput, int inputLen
 	return pStart;
 }
 
+//-----------------------------------------------------------------------------
+// Block compressor. The input is cut into fixed size blocks that are parsed
+// independently, so they can go to different threads. A block still matches
+// against the window before it, since all of the input is in memory, and the
+// decoder just sees one stream. Blocks never depend on how many threads ran,
+// so the output doesn't either.
+//
+// Every position gets its longest match from the first LZSS_MAX_CHAIN hash
+// chain entries for its next three bytes. Any shorter length at the same
+// offset is a valid match too, so a backwards pass picking the cheapest way
+// to the end of the block, with a literal costing 9 bits and a match 17,
+// gives the smallest output for those matches.
+//-----------------------------------------------------------------------------
+#define LZSS_MIN_MATCH		3
+#define LZSS_MAX_OFFSET		( 1 << ( 16 - LZSS_LOOKSHIFT ) )
+#define LZSS_HASH_BITS		15
+#define LZSS_HASH_SIZE		( 1 << LZSS_HASH_BITS )
+#define LZSS_MAX_CHAIN		512		// candidates tried per position
+#define LZSS_BLOCK_SIZE		( 256 * 1024 )
+#define LZSS_LITERAL_BITS	9
+#define LZSS_MATCH_BITS		17
+
+struct LZSSBlock_t
+{
+	int				m_nStart;
+	int				m_nEnd;
+	int				m_nTokens;
+	int				m_nPayload;
+	unsigned char	*m_pFlags;		// one per token, 1 for a match
+	unsigned char	*m_pPayload;	// the literal byte or two match bytes of each token
+};
+
+struct LZSSCompressContext_t
+{
+	const unsigned char	*m_pInput;
+	int					m_nInputLength;
+	int					m_nWindowSize;
+	LZSSBlock_t			*m_pBlocks;
+	int					m_nBlocks;
+	CInterlockedInt		m_nNextBlock;
+};
+
+static FORCEINLINE unsigned int LZSSHash( const unsigned char *p )
+{
+	return ( ( p[0] << 16 | p[1] << 8 | p[2] ) * 2654435761u ) >> ( 32 - LZSS_HASH_BITS );
+}
+
+static void LZSSCompressBlock( const LZSSCompressContext_t &ctx, LZSSBlock_t &block, int *pHead, int *pPrev )
+{
+	const unsigned char *pInput = ctx.m_pInput;
+	int nWindowMask = ctx.m_nWindowSize - 1;
+	int nMaxDistance = MIN( ctx.m_nWindowSize, LZSS_MAX_OFFSET ) - 1;
+	int nLastHashed = ctx.m_nInputLength - LZSS_MIN_MATCH;
+	int nBlockLength = block.m_nEnd - block.m_nStart;
+
+	// prime the chains with the window before the block
+	memset( pHead, 0xff, LZSS_HASH_SIZE * sizeof( int ) );
+	for ( int i = MAX( block.m_nStart - nMaxDistance, 0 ); i < block.m_nStart && i <= nLastHashed; i++ )
+	{
+		unsigned int h = LZSSHash( pInput + i );
+		pPrev[i & nWindowMask] = pHead[h];
+		pHead[h] = i;
+	}
+
+	unsigned char *pLength = (unsigned char *)malloc( nBlockLength );
+	unsigned short *pDistance = (unsigned short *)malloc( nBlockLength * sizeof( unsigned short ) );
+	int *pCost = (int *)malloc( ( nBlockLength + 1 ) * sizeof( int ) );
+
+	for ( int i = block.m_nStart; i < block.m_nEnd; i++ )
+	{
+		int nBest = 0, nBestDistance = 0;
+		if ( i <= nLastHashed )
+		{
+			const unsigned char *pLookAhead = pInput + i;
+			int nMaxLength = MIN( LZSS_LOOKAHEAD, block.m_nEnd - i );
+			unsigned int h = LZSSHash( pLookAhead );
+			int nChain = LZSS_MAX_CHAIN;
+			for ( int nCandidate = pHead[h]; nCandidate >= 0 && i - nCandidate <= nMaxDistance && nChain--; )
+			{
+				const unsigned char *pMatch = pInput + nCandidate;
+				if ( nBest < nMaxLength && pMatch[nBest] == pLookAhead[nBest] )
+				{
+					int nLength = 0;
+					while ( nLength < nMaxLength && pMatch[nLength] == pLookAhead[nLength] )
+					{
+						nLength++;
+					}
+					if ( nLength > nBest )
+					{
+						nBest = nLength;
+						nBestDistance = i - nCandidate;
+						if ( nBest == nMaxLength )
+							break;
+					}
+				}
+
+				int nNext = pPrev[nCandidate & nWindowMask];
+				if ( nNext >= nCandidate )
+					break;
+				nCandidate = nNext;
+			}
+
+			pPrev[i & nWindowMask] = pHead[h];
+			pHead[h] = i;
+		}
+
+		pLength[i - block.m_nStart] = ( nBest >= LZSS_MIN_MATCH ) ? nBest : 0;
+		pDistance[i - block.m_nStart] = nBestDistance;
+	}
+
+	// cheapest encoding of everything from each position to the end of the block,
+	// pLength ends up holding the length of the token to use there, or 1 for a literal
+	pCost[nBlockLength] = 0;
+	for ( int i = nBlockLength - 1; i >= 0; i-- )
+	{
+		int nCost = pCost[i + 1] + LZSS_LITERAL_BITS;
+		int nChoice = 1;
+		for ( int nLength = LZSS_MIN_MATCH; nLength <= pLength[i]; nLength++ )
+		{
+			int nMatchCost = pCost[i + nLength] + LZSS_MATCH_BITS;
+			if ( nMatchCost <= nCost )
+			{
+				nCost = nMatchCost;
+				nChoice = nLength;
+			}
+		}
+		pCost[i] = nCost;
+		pLength[i] = nChoice;
+	}
+
+	block.m_pFlags = (unsigned char *)malloc( nBlockLength );
+	block.m_pPayload = (unsigned char *)malloc( nBlockLength );
+	block.m_nTokens = 0;
+	block.m_nPayload = 0;
+	for ( int i = 0; i < nBlockLength; )
+	{
+		int nLength = pLength[i];
+		if ( nLength >= LZSS_MIN_MATCH )
+		{
+			int nOffset = pDistance[i] - 1;
+			block.m_pFlags[block.m_nTokens++] = 1;
+			block.m_pPayload[block.m_nPayload++] = ( nOffset >> LZSS_LOOKSHIFT );
+			block.m_pPayload[block.m_nPayload++] = ( nOffset << LZSS_LOOKSHIFT ) | ( nLength - 1 );
+		}
+		else
+		{
+			block.m_pFlags[block.m_nTokens++] = 0;
+			block.m_pPayload[block.m_nPayload++] = pInput[block.m_nStart + i];
+		}
+		i += nLength;
+	}
+
+	free( pLength );
+	free( pDistance );
+	free( pCost );
+}
+
+static uintp LZSSCompressThreadFn( void *pParam )
+{
+	LZSSCompressContext_t *pCtx = (LZSSCompressContext_t *)pParam;
+	int *pHead = (int *)malloc( LZSS_HASH_SIZE * sizeof( int ) );
+	int *pPrev = (int *)malloc( pCtx->m_nWindowSize * sizeof( int ) );
+	for ( ;; )
+	{
+		int nBlock = ++pCtx->m_nNextBlock - 1;
+		if ( nBlock >= pCtx->m_nBlocks )
+			break;
+		LZSSCompressBlock( *pCtx, pCtx->m_pBlocks[nBlock], pHead, pPrev );
+	}
+	free( pHead );
+	free( pPrev );
+	return 0;
+}
+
+unsigned char *CLZSS::CompressNoAlloc( const unsigned char *pInput, int inputLength, unsigned char *pOutputBuf, unsigned int *pOutputSize )
+{
+	if ( inputLength <= sizeof( lzss_header_t ) + 8 )
+	{
+		return NULL;
+	}
+	VPROF( "CLZSS::CompressNoAlloc" );
+	ETWMark1I("CompressNoAlloc", inputLength );
+
+	LZSSCompressContext_t ctx;
+	ctx.m_pInput = pInput;
+	ctx.m_nInputLength = inputLength;
+	ctx.m_nWindowSize = m_nWindowSize;
+	ctx.m_nBlocks = ( inputLength + LZSS_BLOCK_SIZE - 1 ) / LZSS_BLOCK_SIZE;
+	CUtlVector< LZSSBlock_t > blocks;
+	blocks.SetCount( ctx.m_nBlocks );
+	ctx.m_pBlocks = blocks.Base();
+	ctx.m_nNextBlock = 0;
+	for ( int i = 0; i < ctx.m_nBlocks; i++ )
+	{
+		ctx.m_pBlocks[i].m_nStart = i * LZSS_BLOCK_SIZE;
+		ctx.m_pBlocks[i].m_nEnd = MIN( ( i + 1 ) * LZSS_BLOCK_SIZE, inputLength );
+	}
+
+	int nThreads = m_nMaxThreads;
+	if ( nThreads <= 0 )
+	{
+		nThreads = GetCPUInformation()->m_nLogicalProcessors;
+	}
+	nThreads = MAX( MIN( nThreads, ctx.m_nBlocks ), 1 );
+
+	CUtlVector< ThreadHandle_t > threads;
+	for ( int i = 1; i < nThreads; i++ )
+	{
+		threads.AddToTail( CreateSimpleThread( LZSSCompressThreadFn, &ctx ) );
+	}
+	LZSSCompressThreadFn( &ctx );
+	FOR_EACH_VEC( threads, i )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+
+	// prevent compression failure (inflation), leave enough to allow dribble eof bytes
+	int nTokens = 0, nPayload = 0;
+	for ( int i = 0; i < ctx.m_nBlocks; i++ )
+	{
+		nTokens += ctx.m_pBlocks[i].m_nTokens;
+		nPayload += ctx.m_pBlocks[i].m_nPayload;
+	}
+	int nCompressedSize = sizeof( lzss_header_t ) + ( nTokens + 8 ) / 8 + nPayload + 2;
+	bool bFits = ( nCompressedSize <= inputLength - 8 );
+
+	unsigned char *pStart = pOutputBuf;
+	unsigned char *pOutput = pStart + sizeof( lzss_header_t );
+	unsigned char *pCmdByte = NULL;
+	int putCmdByte = 0;
+	for ( int i = 0; i < ctx.m_nBlocks; i++ )
+	{
+		LZSSBlock_t &block = ctx.m_pBlocks[i];
+		if ( bFits )
+		{
+			const unsigned char *pPayload = block.m_pPayload;
+			for ( int j = 0; j < block.m_nTokens; j++ )
+			{
+				if ( !putCmdByte )
+				{
+					pCmdByte = pOutput++;
+					*pCmdByte = 0;
+				}
+				putCmdByte = ( putCmdByte + 1 ) & 0x07;
+
+				if ( block.m_pFlags[j] )
+				{
+					*pCmdByte = ( *pCmdByte >> 1 ) | 0x80;
+					*pOutput++ = *pPayload++;
+					*pOutput++ = *pPayload++;
+				}
+				else
+				{
+					*pCmdByte = ( *pCmdByte >> 1 );
+					*pOutput++ = *pPayload++;
+				}
+			}
+		}
+		free( block.m_pFlags );
+		free( block.m_pPayload );
+	}
+
+	if ( !bFits )
+	{
+		// compression is worse, abandon
+		return NULL;
+	}
+
+	// set the header
+	lzss_header_t *pHeader = (lzss_header_t *)pStart;
+	pHeader->id = LZSS_ID;
+	pHeader->actualSize = LittleLong( inputLength );
+
+	if ( !putCmdByte )
+	{
+		pCmdByte = pOutput++;
+		*pCmdByte = 0x01;
+	}
+	else
+	{
+		*pCmdByte = ( ( *pCmdByte >> 1 ) | 0x80 ) >> ( 7 - putCmdByte );
+	}
+
+	*pOutput++ = 0;
+	*pOutput++ = 0;
+
+	Assert( pOutput - pStart == nCompressedSize );
+	if ( pOutputSize )
+	{
+		*pOutputSize = pOutput - pStart;
+	}
+
+	return pStart;
+}
+
 //-----------------------------------------------------------------------------
 // Compress an input buffer. Caller must free output compressed buffer.
 // Returns NULL if compression failed (i.e. compression yielded worse results)
@@ -294,6 +591,32 @@ unsigned int CLZSS::Uncompress( unsigned char *pInput, CUtlBuffer &buf )
 }
 */
 
+//-----------------------------------------------------------------------------
+// Copies a match. When the output has room for a whole lookahead past this
+// point and the source is at least 8 bytes back, it copies 16 bytes in two
+// words, whatever count is. The extra bytes are inside the output and get
+// overwritten by the tokens that follow.
+//-----------------------------------------------------------------------------
+static FORCEINLINE void LZSSCopyMatch( unsigned char *pOutput, const unsigned char *pSource, int count, bool bRoom )
+{
+	if ( bRoom && pOutput - pSource >= 8 )
+	{
+		memcpy( pOutput, pSource, 8 );
+		memcpy( pOutput + 8, pSource + 8, 8 );
+	}
+	else if ( pOutput - pSource == 1 )
+	{
+		memset( pOutput, *pSource, count );
+	}
+	else
+	{
+		for ( int i=0; i<count; i++ )
+		{
+			*pOutput++ = *pSource++;
+		}
+	}
+}
+
 unsigned int CLZSS::SafeUncompress( const unsigned char *pInput, unsigned int inputlen, unsigned char *pOutput, unsigned int unBufSize )
 {
 	if ( inputlen <= sizeof( lzss_header_t ) )
@@ -344,6 +667,17 @@ unsigned int CLZSS::SafeUncompress( const unsigned char *pInput, unsigned int in
 		{
 			SAFE_UNCOMPRESS_INPUT_VALIDATE_READABLE_AND_DECREMENT_REMAINING_LENGTH();
 			cmdByte = *pInput++; // length decremented just above ^
+
+			// eight literals in a row
+			if ( !cmdByte && inputlen >= 8 && totalBytes + 8 <= actualSize )
+			{
+				memcpy( pOutput, pInput, 8 );
+				pOutput += 8;
+				pInput += 8;
+				inputlen -= 8;
+				totalBytes += 8;
+				continue;
+			}
 		}
 		getCmdByte = ( getCmdByte + 1 ) & 0x07;
 
@@ -379,10 +713,8 @@ unsigned int CLZSS::SafeUncompress( const unsigned char *pInput, unsigned int in
 				return 0;
 			}
 
-			for ( int i=0; i<count; i++ )
-			{
-				*pOutput++ = *pSource++;
-			}
+			LZSSCopyMatch( pOutput, pSource, count, totalBytes + LZSS_LOOKAHEAD <= actualSize );
+			pOutput += count;
 			totalBytes += count;
 		} 
 		else 
@@ -410,10 +742,9 @@ unsigned int CLZSS::SafeUncompress( const unsigned char *pInput, unsigned int in
 }
 
 //-----------------------------------------------------------------------------
-// Uncompress a buffer, Returns the uncompressed size. Caller must provide an
-// adequate sized output buffer or memory corruption will occur.
+// The original decoder, one flag bit and one byte at a time.
 //-----------------------------------------------------------------------------
-unsigned int CLZSS::Uncompress( const unsigned char *pInput, unsigned char *pOutput )
+unsigned int CLZSS::UncompressSimple( const unsigned char *pInput, unsigned char *pOutput )
 {
 	unsigned int totalBytes = 0;
 	int cmdByte = 0;
@@ -470,4 +801,66 @@ unsigned int CLZSS::Uncompress( const unsigned char *pInput, unsigned char *pOut
 	return totalBytes;
 }
 
+//-----------------------------------------------------------------------------
+// Uncompress a buffer, Returns the uncompressed size. Caller must provide an
+// adequate sized output buffer or memory corruption will occur.
+//-----------------------------------------------------------------------------
+unsigned int CLZSS::Uncompress( const unsigned char *pInput, unsigned char *pOutput )
+{
+	unsigned int actualSize = GetActualSize( pInput );
+	if ( !actualSize )
+	{
+		// unrecognized
+		return 0;
+	}
+
+	pInput += sizeof( lzss_header_t );
 
+	unsigned char *pStart = pOutput;
+	unsigned char *pEnd = pOutput + actualSize;
+
+	for ( ;; )
+	{
+		int cmdByte = *pInput++;
+
+		// eight literals in a row
+		if ( !cmdByte && pEnd - pOutput >= 8 )
+		{
+			memcpy( pOutput, pInput, 8 );
+			pOutput += 8;
+			pInput += 8;
+			continue;
+		}
+
+		for ( int getCmdByte = 0; getCmdByte < 8; getCmdByte++ )
+		{
+			if ( cmdByte & 0x01 )
+			{
+				int position = *pInput++ << LZSS_LOOKSHIFT;
+				position |= ( *pInput >> LZSS_LOOKSHIFT );
+				int count = ( *pInput++ & 0x0F ) + 1;
+				if ( count == 1 ) 
+				{
+					goto done;
+				}
+				LZSSCopyMatch( pOutput, pOutput - position - 1, count, pEnd - pOutput >= LZSS_LOOKAHEAD );
+				pOutput += count;
+			} 
+			else 
+			{
+				*pOutput++ = *pInput++;
+			}
+			cmdByte = cmdByte >> 1;
+		}
+	}
+
+done:
+	if ( (unsigned int)( pOutput - pStart ) != actualSize )
+	{
+		// unexpected failure
+		Assert( 0 );
+		return 0;
+	}
+
+	return actualSize;
+}
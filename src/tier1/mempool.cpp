@@ -310,3 +310,301 @@ void CUtlMemoryPool::Free( void *memBlock )
 }
 
 
+
+//-----------------------------------------------------------------------------
+// CMemoryPoolMT
+//-----------------------------------------------------------------------------
+// Each thread's cache in every CMemoryPoolMT, plus one; 0 until the thread first
+// uses a pool. One thread local for all pools, handed out round robin.
+//
+// Pools can be used by other files' static constructors before this file's have
+// run, so nothing here may need one. Compiler thread locals are zero from the
+// start; CThreadLocalInt allocates its slot in its constructor, so where that is
+// what we have it is made the first time a pool asks for it, and never freed.
+static int32 volatile s_nThreadCachesAssigned;
+
+#ifdef PLAT_COMPILER_SUPPORTED_THREADLOCALS
+static CTHREADLOCALINT s_nThreadCache;
+
+static inline int GetThreadCacheSlot()
+{
+	return s_nThreadCache;
+}
+
+static inline void SetThreadCacheSlot( int nCache )
+{
+	s_nThreadCache = nCache;
+}
+#else
+static CThreadLocalInt<int> * volatile s_pThreadCache;
+
+static CThreadLocalInt<int> &ThreadCacheSlot()
+{
+	CThreadLocalInt<int> *pSlot = s_pThreadCache;
+	if ( !pSlot )
+	{
+		// two threads can get here at once; the one that loses frees its slot
+		pSlot = new CThreadLocalInt<int>;
+		CThreadLocalInt<int> *pExisting = (CThreadLocalInt<int> *)ThreadInterlockedCompareExchangePointer( (void * volatile *)&s_pThreadCache, pSlot, NULL );
+		if ( pExisting )
+		{
+			delete pSlot;
+			pSlot = pExisting;
+		}
+	}
+	return *pSlot;
+}
+
+static inline int GetThreadCacheSlot()
+{
+	return ThreadCacheSlot();
+}
+
+static inline void SetThreadCacheSlot( int nCache )
+{
+	ThreadCacheSlot() = nCache;
+}
+#endif
+
+CMemoryPoolMT::CMemoryPoolMT( int blockSize, int numElements, int growMode, const char *pszAllocOwner, int nAlignment ) :
+	CUtlMemoryPool( blockSize, numElements, growMode, pszAllocOwner, nAlignment )
+{
+	for ( int i = 0; i < THREAD_CACHES; i++ )
+	{
+		ThreadCache_t &cache = m_ThreadCaches[i];
+		cache.m_pBlocks = NULL;
+		cache.m_nBlocks = 0;
+		cache.m_nAllocs = cache.m_nFrees = 0;
+		cache.m_nHits = cache.m_nMisses = cache.m_nCacheSpills = 0;
+	}
+}
+
+CMemoryPoolMT::~CMemoryPoolMT()
+{
+	// hand every cached block back so the base class only reports real leaks
+	ReturnAllToPool();
+
+	while ( Batch_t *pBatch = (Batch_t *)m_FreeBatches.Pop() )
+	{
+		MemAlloc_FreeAligned( pBatch );
+	}
+}
+
+CMemoryPoolMT::ThreadCache_t &CMemoryPoolMT::GetThreadCache()
+{
+	int nCache = GetThreadCacheSlot();
+	if ( !nCache )
+	{
+		nCache = ( (uint32)ThreadInterlockedIncrement( &s_nThreadCachesAssigned ) % THREAD_CACHES ) + 1;
+		SetThreadCacheSlot( nCache );
+	}
+	return m_ThreadCaches[ nCache - 1 ];
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Gives an empty cache a batch, from the shared list if there is one,
+//			otherwise straight out of the underlying pool.
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::Refill( ThreadCache_t &cache )
+{
+	Assert( !cache.m_nBlocks );
+
+	Batch_t *pBatch = (Batch_t *)m_FullBatches.Pop();
+	if ( pBatch )
+	{
+		cache.m_pBlocks = pBatch->m_pBlocks;
+		cache.m_nBlocks = pBatch->m_nBlocks;
+		m_FreeBatches.Push( pBatch );
+		return;
+	}
+
+	AUTO_LOCK( m_mutex );
+	void *pBlocks = NULL;
+	int nBlocks = 0;
+	while ( nBlocks < BATCH_SIZE )
+	{
+		void *pBlock = CUtlMemoryPool::Alloc( m_BlockSize );
+		if ( !pBlock )
+			break;
+		*((void**)pBlock) = pBlocks;
+		pBlocks = pBlock;
+		nBlocks++;
+	}
+	cache.m_pBlocks = pBlocks;
+	cache.m_nBlocks = nBlocks;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Called when a cache holds two batches. Keeps the most recently freed
+//			one, which is the most likely to still be in the cpu cache.
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::Spill( ThreadCache_t &cache )
+{
+	void *pLastKept = cache.m_pBlocks;
+	for ( int i = 1; i < BATCH_SIZE; i++ )
+	{
+		pLastKept = *((void**)pLastKept);
+	}
+
+	void *pSpill = *((void**)pLastKept);
+	*((void**)pLastKept) = NULL;
+
+	int nSpill = cache.m_nBlocks - BATCH_SIZE;
+	PushBatch( pSpill, nSpill );
+	cache.m_nBlocks = BATCH_SIZE;
+	cache.m_nCacheSpills += nSpill;
+}
+
+void CMemoryPoolMT::PushBatch( void *pBlocks, int nBlocks )
+{
+	Batch_t *pBatch = (Batch_t *)m_FreeBatches.Pop();
+	if ( !pBatch )
+	{
+		MEM_ALLOC_CREDIT_( m_pszAllocOwner );
+		pBatch = (Batch_t *)MemAlloc_AllocAligned( sizeof( Batch_t ), TSLIST_NODE_ALIGNMENT );
+	}
+	pBatch->m_pBlocks = pBlocks;
+	pBatch->m_nBlocks = nBlocks;
+	m_FullBatches.Push( pBatch );
+}
+
+void *CMemoryPoolMT::Alloc( size_t amount )
+{
+	if ( amount > (unsigned int)m_BlockSize )
+		return NULL;
+
+	ThreadCache_t &cache = GetThreadCache();
+	AUTO_LOCK( cache.m_mutex );
+	if ( cache.m_nBlocks )
+	{
+		cache.m_nHits++;
+	}
+	else
+	{
+		cache.m_nMisses++;
+		Refill( cache );
+		if ( !cache.m_nBlocks )
+			return NULL;
+	}
+
+	void *pBlock = cache.m_pBlocks;
+	cache.m_pBlocks = *((void**)pBlock);
+	cache.m_nBlocks--;
+	cache.m_nAllocs++;
+	return pBlock;
+}
+
+void *CMemoryPoolMT::AllocZero( size_t amount )
+{
+	void *mem = Alloc( amount );
+	if ( mem )
+	{
+		memset( mem, 0x00, amount );
+	}
+	return mem;
+}
+
+void CMemoryPoolMT::Free( void *pMem )
+{
+	if ( !pMem )
+		return;  // trying to delete NULL pointer, ignore
+
+#ifdef _DEBUG	
+	// invalidate the memory
+	memset( pMem, 0xDD, m_BlockSize );
+#endif
+
+	ThreadCache_t &cache = GetThreadCache();
+	AUTO_LOCK( cache.m_mutex );
+	*((void**)pMem) = cache.m_pBlocks;
+	cache.m_pBlocks = pMem;
+	cache.m_nBlocks++;
+	cache.m_nFrees++;
+
+	if ( cache.m_nBlocks >= 2 * BATCH_SIZE )
+	{
+		Spill( cache );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Puts every cached and batched block back in the underlying pool.
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::ReturnAllToPool()
+{
+	for ( int i = 0; i < THREAD_CACHES; i++ )
+	{
+		ThreadCache_t &cache = m_ThreadCaches[i];
+		AUTO_LOCK( cache.m_mutex );
+		AUTO_LOCK( m_mutex );
+		while ( cache.m_pBlocks )
+		{
+			void *pNext = *((void**)cache.m_pBlocks);
+			CUtlMemoryPool::Free( cache.m_pBlocks );
+			cache.m_pBlocks = pNext;
+		}
+		cache.m_nBlocks = 0;
+	}
+
+	AUTO_LOCK( m_mutex );
+	while ( Batch_t *pBatch = (Batch_t *)m_FullBatches.Pop() )
+	{
+		void *pBlock = pBatch->m_pBlocks;
+		while ( pBlock )
+		{
+			void *pNext = *((void**)pBlock);
+			CUtlMemoryPool::Free( pBlock );
+			pBlock = pNext;
+		}
+		m_FreeBatches.Push( pBatch );
+	}
+}
+
+void CMemoryPoolMT::Clear()
+{
+	for ( int i = 0; i < THREAD_CACHES; i++ )
+	{
+		ThreadCache_t &cache = m_ThreadCaches[i];
+		AUTO_LOCK( cache.m_mutex );
+		cache.m_pBlocks = NULL;
+		cache.m_nBlocks = 0;
+		cache.m_nAllocs = cache.m_nFrees = 0;
+	}
+
+	AUTO_LOCK( m_mutex );
+	while ( Batch_t *pBatch = (Batch_t *)m_FullBatches.Pop() )
+	{
+		m_FreeBatches.Push( pBatch );
+	}
+
+	CUtlMemoryPool::Clear();
+}
+
+int CMemoryPoolMT::Count() const
+{
+	int64 nCount = 0;
+	for ( int i = 0; i < THREAD_CACHES; i++ )
+	{
+		const ThreadCache_t &cache = m_ThreadCaches[i];
+		AUTO_LOCK( cache.m_mutex );
+		nCount += cache.m_nAllocs - cache.m_nFrees;
+	}
+	return (int)nCount;
+}
+
+void CMemoryPoolMT::GetStats( MemoryPoolMTStats_t &stats ) const
+{
+	memset( &stats, 0, sizeof( stats ) );
+	for ( int i = 0; i < THREAD_CACHES; i++ )
+	{
+		const ThreadCache_t &cache = m_ThreadCaches[i];
+		AUTO_LOCK( cache.m_mutex );
+		stats.m_nHits += cache.m_nHits;
+		stats.m_nMisses += cache.m_nMisses;
+		stats.m_nCacheSpills += cache.m_nCacheSpills;
+		if ( cache.m_nAllocs || cache.m_nFrees )
+		{
+			stats.m_nThreadCaches++;
+		}
+	}
+}
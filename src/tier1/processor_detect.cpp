@@ -272,3 +272,20 @@ bool Check3DNowTechnology(void)
 #pragma optimize( "", on )
 
 #endif // _WIN32
+
+#if defined( _WIN32 ) && !defined( _X360 )
+
+#include <intrin.h>
+
+bool CheckPCLMULQDQTechnology(void)
+{
+	int regs[4];
+	__cpuid( regs, 1 );
+	return ( regs[2] & 0x2 ) != 0;		// bit 1 of ecx is set for PCLMULQDQ
+}
+
+#else
+
+bool CheckPCLMULQDQTechnology(void) { return false; }
+
+#endif
@@ -71,3 +71,25 @@ bool Check3DNowTechnology(void)
 }
 
 #endif
+
+#if defined( __i386__ ) || defined( __x86_64__ )
+
+#include <cpuid.h>
+
+bool CheckPCLMULQDQTechnology(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if ( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) )
+        return false;
+
+    return ( ecx & 0x2 ) != 0;		// bit 1 of ecx is set for PCLMULQDQ
+}
+
+#else
+
+bool CheckPCLMULQDQTechnology(void)
+{
+    return false;
+}
+
+#endif
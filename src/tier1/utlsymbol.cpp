@@ -15,6 +15,7 @@
 #include "stringpool.h"
 #include "utlhashtable.h"
 #include "utlstring.h"
+#include "generichash.h"
 
 // Ensure that everybody has the right compiler version installed. The version
 // number can be obtained by looking at the compiler output when you type 'cl'
@@ -44,7 +45,7 @@
 // globals
 //-----------------------------------------------------------------------------
 
-CUtlSymbolTableMT* CUtlSymbol::s_pSymbolTable = 0; 
+CUtlSymbolTableSharded* CUtlSymbol::s_pSymbolTable = 0; 
 bool CUtlSymbol::s_bAllowStaticSymbolTable = true;
 
 
@@ -63,7 +64,7 @@ void CUtlSymbol::Initialize()
 	static bool symbolsInitialized = false;
 	if (!symbolsInitialized)
 	{
-		s_pSymbolTable = new CUtlSymbolTableMT;
+		s_pSymbolTable = new CUtlSymbolTableSharded;
 		symbolsInitialized = true;
 	}
 }
@@ -83,7 +84,7 @@ public:
 
 static CCleanupUtlSymbolTable g_CleanupSymbolTable;
 
-CUtlSymbolTableMT* CUtlSymbol::CurrTable()
+CUtlSymbolTableSharded* CUtlSymbol::CurrTable()
 {
 	Initialize();
 	return s_pSymbolTable; 
@@ -288,6 +289,261 @@ void CUtlSymbolTable::RemoveAll()
 }
 
 
+//-----------------------------------------------------------------------------
+// CUtlSymbolTableSharded
+//-----------------------------------------------------------------------------
+
+#define SYMBOL_HASH_EMPTY	0xFFFFFFFF
+
+CUtlSymbolTableSharded::CUtlSymbolTableSharded( int growSize, int initSize, bool caseInsensitive ) :
+	m_bInsensitive( caseInsensitive )
+{
+	// growSize means nothing to a hash table, initSize is spread over the shards
+	m_nInitShardSize = 16;
+	while ( m_nInitShardSize * SHARD_COUNT < initSize * 2 )
+	{
+		m_nInitShardSize *= 2;
+	}
+
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		Shard_t &shard = m_Shards[i];
+		shard.m_pTable = AllocTable( m_nInitShardSize );
+		shard.m_nCount = 0;
+		shard.m_nBlockUsed = 0;
+		shard.m_nBlockSize = 0;
+	}
+
+	memset( (void *)m_pPages, 0, sizeof( m_pPages ) );
+	m_nSymbols = 0;
+}
+
+CUtlSymbolTableSharded::~CUtlSymbolTableSharded()
+{
+	RemoveAll();
+
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		free( m_Shards[i].m_pTable );
+	}
+}
+
+CUtlSymbolTableSharded::HashTable_t *CUtlSymbolTableSharded::AllocTable( int nSize )
+{
+	HashTable_t *pTable = (HashTable_t *)malloc( sizeof( HashTable_t ) + ( nSize - 1 ) * sizeof( uint32 ) );
+	pTable->m_nMask = nSize - 1;
+	memset( pTable->m_Entries, 0xFF, nSize * sizeof( uint32 ) );
+	return pTable;
+}
+
+inline unsigned CUtlSymbolTableSharded::HashSymbolString( const char *pString ) const
+{
+	return m_bInsensitive ? HashStringCaseless( pString ) : HashString( pString );
+}
+
+inline int CUtlSymbolTableSharded::Compare( const char *pString1, const char *pString2 ) const
+{
+	return m_bInsensitive ? V_stricmp( pString1, pString2 ) : V_strcmp( pString1, pString2 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Probes one shard's table. Safe without the shard's lock, an entry
+//			only ever goes from empty to its final value.
+//-----------------------------------------------------------------------------
+UtlSymId_t CUtlSymbolTableSharded::FindInTable( const HashTable_t *pTable, const char *pString, unsigned nHash ) const
+{
+	uint32 nTag = nHash >> 16;
+	uint32 nMask = pTable->m_nMask;
+	for ( uint32 i = ( nHash >> SHARD_BITS ) & nMask; ; i = ( i + 1 ) & nMask )
+	{
+		uint32 nEntry = *(volatile const uint32 *)&pTable->m_Entries[i];
+		if ( nEntry == SYMBOL_HASH_EMPTY )
+			return UTL_INVAL_SYMBOL;
+
+		UtlSymId_t id = (UtlSymId_t)( nEntry & 0xFFFF );
+		if ( ( nEntry >> 16 ) == nTag && !Compare( String( id ), pString ) )
+			return id;
+	}
+}
+
+CUtlSymbol CUtlSymbolTableSharded::Find( const char* pString ) const
+{
+	if ( !pString )
+		return CUtlSymbol();
+
+	unsigned nHash = HashSymbolString( pString );
+	const Shard_t &shard = m_Shards[nHash & ( SHARD_COUNT - 1 )];
+	return CUtlSymbol( FindInTable( shard.m_pTable, pString, nHash ) );
+}
+
+const char* CUtlSymbolTableSharded::String( CUtlSymbol id ) const
+{
+	if ( !id.IsValid() )
+		return "";
+
+	const char **pPage = m_pPages[(UtlSymId_t)id >> PAGE_BITS];
+	Assert( pPage );
+	return pPage ? pPage[(UtlSymId_t)id & ( PAGE_SIZE - 1 )] : "";
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Copies a string into the shard's storage. Called with the shard locked.
+//-----------------------------------------------------------------------------
+const char *CUtlSymbolTableSharded::CopyString( Shard_t &shard, const char *pString )
+{
+	int len = V_strlen( pString ) + 1;
+	if ( shard.m_nBlockUsed + len > shard.m_nBlockSize )
+	{
+		shard.m_nBlockSize = max( len, MIN_STRING_POOL_SIZE );
+		shard.m_nBlockUsed = 0;
+		shard.m_StringBlocks.AddToTail( (char *)malloc( shard.m_nBlockSize ) );
+	}
+
+	char *pCopy = shard.m_StringBlocks.Tail() + shard.m_nBlockUsed;
+	memcpy( pCopy, pString, len );
+	shard.m_nBlockUsed += len;
+	return pCopy;
+}
+
+void CUtlSymbolTableSharded::SetString( UtlSymId_t id, const char *pString )
+{
+	int nPage = id >> PAGE_BITS;
+	const char **pPage = m_pPages[nPage];
+	if ( !pPage )
+	{
+		// Ids from different shards share pages, whoever gets here first wins
+		const char **pNewPage = (const char **)calloc( PAGE_SIZE, sizeof( const char * ) );
+		pPage = (const char **)ThreadInterlockedCompareExchangePointer( (void * volatile *)&m_pPages[nPage], (void *)pNewPage, NULL );
+		if ( pPage )
+		{
+			free( pNewPage );
+		}
+		else
+		{
+			pPage = pNewPage;
+		}
+	}
+	pPage[id & ( PAGE_SIZE - 1 )] = pString;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Doubles a shard's table. Readers may still be probing the old one,
+//			so it's kept until RemoveAll().
+//-----------------------------------------------------------------------------
+void CUtlSymbolTableSharded::GrowShard( Shard_t &shard )
+{
+	HashTable_t *pOldTable = shard.m_pTable;
+	HashTable_t *pNewTable = AllocTable( ( pOldTable->m_nMask + 1 ) * 2 );
+
+	for ( uint32 i = 0; i <= pOldTable->m_nMask; i++ )
+	{
+		uint32 nEntry = pOldTable->m_Entries[i];
+		if ( nEntry == SYMBOL_HASH_EMPTY )
+			continue;
+
+		unsigned nHash = HashSymbolString( String( (UtlSymId_t)( nEntry & 0xFFFF ) ) );
+		uint32 j = ( nHash >> SHARD_BITS ) & pNewTable->m_nMask;
+		while ( pNewTable->m_Entries[j] != SYMBOL_HASH_EMPTY )
+		{
+			j = ( j + 1 ) & pNewTable->m_nMask;
+		}
+		pNewTable->m_Entries[j] = nEntry;
+	}
+
+	ThreadMemoryBarrier();
+	shard.m_pTable = pNewTable;
+	shard.m_RetiredTables.AddToTail( pOldTable );
+}
+
+//-----------------------------------------------------------------------------
+// Finds and/or creates a symbol based on the string
+//-----------------------------------------------------------------------------
+
+CUtlSymbol CUtlSymbolTableSharded::AddString( const char* pString )
+{
+	if ( !pString )
+		return CUtlSymbol( UTL_INVAL_SYMBOL );
+
+	unsigned nHash = HashSymbolString( pString );
+	Shard_t &shard = m_Shards[nHash & ( SHARD_COUNT - 1 )];
+
+	UtlSymId_t id = FindInTable( shard.m_pTable, pString, nHash );
+	if ( id != UTL_INVAL_SYMBOL )
+		return CUtlSymbol( id );
+
+	AUTO_LOCK( shard.m_mutex );
+
+	// someone may have added it while we waited
+	id = FindInTable( shard.m_pTable, pString, nHash );
+	if ( id != UTL_INVAL_SYMBOL )
+		return CUtlSymbol( id );
+
+	int nId = ++m_nSymbols - 1;
+	if ( nId >= UTL_INVAL_SYMBOL )
+	{
+		AssertMsg( false, "CUtlSymbolTableSharded is out of symbols\n" );
+		--m_nSymbols;
+		return CUtlSymbol( UTL_INVAL_SYMBOL );
+	}
+	id = (UtlSymId_t)nId;
+	SetString( id, CopyString( shard, pString ) );
+
+	if ( ( shard.m_nCount + 1 ) * 2 > (int)shard.m_pTable->m_nMask + 1 )
+	{
+		GrowShard( shard );
+	}
+
+	HashTable_t *pTable = shard.m_pTable;
+	uint32 i = ( nHash >> SHARD_BITS ) & pTable->m_nMask;
+	while ( pTable->m_Entries[i] != SYMBOL_HASH_EMPTY )
+	{
+		i = ( i + 1 ) & pTable->m_nMask;
+	}
+
+	// the string has to be visible before the entry that leads readers to it
+	ThreadMemoryBarrier();
+	*(volatile uint32 *)&pTable->m_Entries[i] = ( ( nHash >> 16 ) << 16 ) | id;
+	shard.m_nCount++;
+
+	return CUtlSymbol( id );
+}
+
+//-----------------------------------------------------------------------------
+// Remove all symbols in the table.
+//-----------------------------------------------------------------------------
+
+void CUtlSymbolTableSharded::RemoveAll()
+{
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		Shard_t &shard = m_Shards[i];
+		for ( int j = 0; j < shard.m_RetiredTables.Count(); j++ )
+		{
+			free( shard.m_RetiredTables[j] );
+		}
+		shard.m_RetiredTables.Purge();
+
+		for ( int j = 0; j < shard.m_StringBlocks.Count(); j++ )
+		{
+			free( shard.m_StringBlocks[j] );
+		}
+		shard.m_StringBlocks.Purge();
+		shard.m_nBlockUsed = 0;
+		shard.m_nBlockSize = 0;
+
+		memset( shard.m_pTable->m_Entries, 0xFF, ( shard.m_pTable->m_nMask + 1 ) * sizeof( uint32 ) );
+		shard.m_nCount = 0;
+	}
+
+	for ( int i = 0; i < PAGE_COUNT; i++ )
+	{
+		free( (void *)m_pPages[i] );
+		m_pPages[i] = NULL;
+	}
+	m_nSymbols = 0;
+}
+
+
 
 class CUtlFilenameSymbolTable::HashTable : public CUtlStableHashtable<CUtlConstString>
 {
@@ -18,8 +18,8 @@
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier0/threadtools.h"
 
-#define	MAX_THREADS	16
 
 
 class CRunThreadsData
@@ -30,19 +30,195 @@ public:
 	RunThreadsFn m_Fn;
 };
 
-CRunThreadsData g_RunThreadsData[MAX_THREADS];
+CRunThreadsData g_RunThreadsData[MAX_TOOL_THREADS];
 
 
-int		dispatch;
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
+bool g_bNumaPinThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+HANDLE g_ThreadHandles[MAX_TOOL_THREADS];
 
 
+/*
+===================================================================
+
+WORK STEALING DISPATCH
+
+The work items [0, workcount) are cut into chunks that are dealt
+round-robin into one deque per thread, so between them the threads
+still walk the items in roughly ascending order (vvis sorts its portals
+so that the cheap ones finish first and speed up the rest).
+
+A thread pops chunks off the front of its own deque, hands the items
+out one at a time, and once its deque runs dry steals single chunks
+off the back of the other deques. Each deque is just a [head, tail)
+range packed into one 64 bit word and moved with a CAS, so nothing
+here takes ThreadLock.
+
+===================================================================
+*/
+
+// Chunks handed to each thread up front, more means finer load balancing
+#define WORK_CHUNKS_PER_THREAD	32
+
+struct ALIGN128 CWorkDeque
+{
+	// Shared: local chunk indices [low 32 bits, high 32 bits) still queued
+	int64 volatile	m_Range;
+
+	// Owner only: items left in the chunk currently being worked on
+	int				m_iNextItem;
+	int				m_iEndItem;
+} ALIGN128_POST;
+
+// One more than there are threads, the last slot is for anyone else who calls GetThreadWork
+static CWorkDeque		g_WorkDeques[MAX_TOOL_THREADS+1];
+
+// The last slot can have any number of callers, so its chunk is a [low 32 bits, high 32 bits)
+// item range claimed with a CAS instead of m_iNextItem/m_iEndItem. A tail of
+// WORK_RANGE_REFILLING means one of them is fetching the next chunk.
+#define WORK_RANGE_REFILLING	0xFFFFFFFF
+static int64 volatile	g_SharedWorkRange;
+static int				g_nWorkDeques;
+static int				g_nWorkChunkSize;
+static int32 volatile	g_nWorkDispatched;
+
+// 1-based index of the RunThreads worker this is, 0 on any other thread
+static CTHREADLOCALINT	g_iWorkerThread;
+
+
+static inline int64 PackWorkRange( uint32 nHead, uint32 nTail )
+{
+	return (int64)( ( (uint64)nTail << 32 ) | nHead );
+}
+
+static void InitWorkDeques( int nThreads, int nWorkItems )
+{
+	g_nWorkDeques = MIN( MAX( nThreads, 1 ), MAX_TOOL_THREADS );
+	g_nWorkChunkSize = MAX( nWorkItems / ( g_nWorkDeques * WORK_CHUNKS_PER_THREAD ), 1 );
+	g_nWorkDispatched = 0;
+
+	int nChunks = ( nWorkItems + g_nWorkChunkSize - 1 ) / g_nWorkChunkSize;
+	for ( int i=0; i <= g_nWorkDeques; i++ )
+	{
+		int nOwned = 0;
+		if ( i < g_nWorkDeques && i < nChunks )
+		{
+			nOwned = ( nChunks - i + g_nWorkDeques - 1 ) / g_nWorkDeques;
+		}
+
+		g_WorkDeques[i].m_Range = PackWorkRange( 0, nOwned );
+		g_WorkDeques[i].m_iNextItem = 0;
+		g_WorkDeques[i].m_iEndItem = 0;
+	}
+
+	g_SharedWorkRange = PackWorkRange( 0, 0 );
+}
+
+// Returns a chunk index, or -1 if the deque is empty
+static int PopWorkChunk( int iDeque, bool bFromBack )
+{
+	CWorkDeque &deque = g_WorkDeques[iDeque];
+	for (;;)
+	{
+		int64 range = deque.m_Range;
+		uint32 nHead = (uint32)( (uint64)range & 0xFFFFFFFF );
+		uint32 nTail = (uint32)( (uint64)range >> 32 );
+		if ( nHead >= nTail )
+			return -1;
+
+		uint32 iLocal;
+		int64 newRange;
+		if ( bFromBack )
+		{
+			iLocal = nTail - 1;
+			newRange = PackWorkRange( nHead, nTail - 1 );
+		}
+		else
+		{
+			iLocal = nHead;
+			newRange = PackWorkRange( nHead + 1, nTail );
+		}
+
+		if ( ThreadInterlockedAssignIf64( &deque.m_Range, newRange, range ) )
+			return iDeque + (int)iLocal * g_nWorkDeques;
+
+		ThreadPause();
+	}
+}
+
+static int GrabWorkChunk( int iThread )
+{
+	if ( iThread < g_nWorkDeques )
+	{
+		int iChunk = PopWorkChunk( iThread, false );
+		if ( iChunk != -1 )
+			return iChunk;
+	}
+
+	for ( int i=1; i <= g_nWorkDeques; i++ )
+	{
+		int iChunk = PopWorkChunk( ( iThread + i ) % g_nWorkDeques, true );
+		if ( iChunk != -1 )
+			return iChunk;
+	}
+
+	return -1;
+}
+
+
+// Hands out the items of the last slot's chunk to whichever non worker threads ask
+static int GetSharedThreadWork( void )
+{
+	for (;;)
+	{
+		int64 range = g_SharedWorkRange;
+		uint32 nNext = (uint32)( (uint64)range & 0xFFFFFFFF );
+		uint32 nEnd = (uint32)( (uint64)range >> 32 );
+
+		if ( nEnd == WORK_RANGE_REFILLING )
+		{
+			ThreadPause();
+			continue;
+		}
+
+		if ( nNext < nEnd )
+		{
+			if ( ThreadInterlockedAssignIf64( &g_SharedWorkRange, PackWorkRange( nNext + 1, nEnd ), range ) )
+				return (int)nNext;
+
+			ThreadPause();
+			continue;
+		}
+
+		// Empty, whoever marks it first fetches the next chunk while the rest wait
+		if ( !ThreadInterlockedAssignIf64( &g_SharedWorkRange, PackWorkRange( 0, WORK_RANGE_REFILLING ), range ) )
+		{
+			ThreadPause();
+			continue;
+		}
+
+		int iChunk = GrabWorkChunk( g_nWorkDeques );
+		if ( iChunk == -1 )
+		{
+			g_SharedWorkRange = PackWorkRange( 0, 0 );
+			return -1;
+		}
+
+		int iFirst = iChunk * g_nWorkChunkSize;
+		int iEnd = MIN( iFirst + g_nWorkChunkSize, workcount );
+		ThreadInterlockedExchangeAdd( &g_nWorkDispatched, iEnd - iFirst );
+
+		ThreadMemoryBarrier();
+		g_SharedWorkRange = PackWorkRange( iFirst + 1, iEnd );
+		return iFirst;
+	}
+}
+
 
 /*
 =============
@@ -52,23 +228,27 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
-
-	ThreadLock ();
-
-	if (dispatch == workcount)
+	int iThread = (int)g_iWorkerThread - 1;
+	if ( iThread < 0 || iThread >= g_nWorkDeques )
 	{
-		ThreadUnlock ();
-		return -1;
+		return GetSharedThreadWork();
 	}
 
-	UpdatePacifier( (float)dispatch / workcount );
+	CWorkDeque &deque = g_WorkDeques[iThread];
+	if ( deque.m_iNextItem >= deque.m_iEndItem )
+	{
+		int iChunk = GrabWorkChunk( iThread );
+		if ( iChunk == -1 )
+			return -1;
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+		deque.m_iNextItem = iChunk * g_nWorkChunkSize;
+		deque.m_iEndItem = MIN( deque.m_iNextItem + g_nWorkChunkSize, workcount );
 
-	return r;
+		// Only read by the pacifier, so one add per chunk is plenty
+		ThreadInterlockedExchangeAdd( &g_nWorkDispatched, deque.m_iEndItem - deque.m_iNextItem );
+	}
+
+	return deque.m_iNextItem++;
 }
 
 
@@ -130,16 +310,20 @@ void SetLowPriority()
 
 void ThreadSetDefault (void)
 {
-	SYSTEM_INFO info;
-
 	if (numthreads == -1)	// not set manually
 	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		// Counts every processor group, GetSystemInfo only sees the one we started in
+		numthreads = (int)GetActiveProcessorCount( ALL_PROCESSOR_GROUPS );
+		if (numthreads < 1)
 			numthreads = 1;
 	}
 
+	if (numthreads > MAX_TOOL_THREADS)
+	{
+		Warning ("Clamping %i threads to %i\n", numthreads, MAX_TOOL_THREADS);
+		numthreads = MAX_TOOL_THREADS;
+	}
+
 	Msg ("%i threads\n", numthreads);
 }
 
@@ -169,11 +353,47 @@ void ThreadUnlock (void)
 DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	g_iWorkerThread = pData->m_iThread + 1;
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
 	return 0;
 }
 
 
+// Windows keeps every thread in the processor group the process started in
+// unless told otherwise, which caps us at 64 cores. Spread the threads over
+// all groups, or with -numa pin each one to a NUMA node in turn.
+static void SetThreadProcessorAffinity( HANDLE hThread, int iThread )
+{
+	GROUP_AFFINITY affinity;
+	memset( &affinity, 0, sizeof( affinity ) );
+
+	if ( g_bNumaPinThreads )
+	{
+		ULONG nHighestNode = 0;
+		if ( GetNumaHighestNodeNumber( &nHighestNode ) && nHighestNode > 0 )
+		{
+			USHORT iNode = (USHORT)( iThread % ( nHighestNode + 1 ) );
+			if ( GetNumaNodeProcessorMaskEx( iNode, &affinity ) && affinity.Mask != 0 )
+			{
+				SetThreadGroupAffinity( hThread, &affinity, NULL );
+				return;
+			}
+		}
+	}
+
+	WORD nGroups = GetActiveProcessorGroupCount();
+	if ( nGroups > 1 )
+	{
+		WORD iGroup = (WORD)( iThread % nGroups );
+		DWORD nProcessors = GetActiveProcessorCount( iGroup );
+
+		affinity.Group = iGroup;
+		affinity.Mask = ( nProcessors >= sizeof( KAFFINITY ) * 8 ) ? ~(KAFFINITY)0 : ( ( (KAFFINITY)1 << nProcessors ) - 1 );
+		SetThreadGroupAffinity( hThread, &affinity, NULL );
+	}
+}
+
+
 void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePriority )
 {
 	Assert( numthreads > 0 );
@@ -194,9 +414,11 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		   0,		// DWORD cbStack,
 		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
 		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
+		   CREATE_SUSPENDED,	// DWORD fdwCreate,
 		   &dwDummy );
 
+		SetThreadProcessorAffinity( g_ThreadHandles[i], i );
+
 		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
 		{
 			if( g_bLowPriorityThreads )
@@ -206,13 +428,29 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		{
 			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
 		}
+
+		ResumeThread( g_ThreadHandles[i] );
 	}
 }
 
 
+// WaitForMultipleObjects only takes MAXIMUM_WAIT_OBJECTS handles at a time.
+// Returns false if the threads are still running after dwMilliseconds.
+static bool WaitForRunThreads( DWORD dwMilliseconds )
+{
+	for ( int i=0; i < numthreads; i += MAXIMUM_WAIT_OBJECTS )
+	{
+		DWORD nHandles = (DWORD)MIN( numthreads - i, MAXIMUM_WAIT_OBJECTS );
+		if ( WaitForMultipleObjects( nHandles, &g_ThreadHandles[i], TRUE, dwMilliseconds ) == WAIT_TIMEOUT )
+			return false;
+	}
+	return true;
+}
+
+
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
+	WaitForRunThreads( INFINITE );
 	for ( int i=0; i < numthreads; i++ )
 		CloseHandle( g_ThreadHandles[i] );
 
@@ -230,7 +468,6 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	int		start, end;
 
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
 	StartPacifier("");
 	pacifier = showpacifier;
@@ -241,8 +478,20 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	return;
 #endif
 
+	if (numthreads == -1)
+		ThreadSetDefault ();
+
+	InitWorkDeques( numthreads, workcnt );
 	
 	RunThreads_Start( fn, pUserData );
+
+	// The workers never touch the pacifier, the main thread polls their progress instead
+	while ( !WaitForRunThreads( 100 ) )
+	{
+		if ( workcount > 0 )
+			UpdatePacifier( (float)g_nWorkDispatched / workcount );
+	}
+
 	RunThreads_End();
 
 
@@ -253,5 +502,3 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 		printf (" (%i)\n", end-start);
 	}
 }
-
-
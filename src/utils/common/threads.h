@@ -17,8 +17,9 @@
 
 
 // Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
-// large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
+// large so THREADINDEX_MAIN can be used from the main thread. This only
+// sizes those arrays, ThreadSetDefault uses every processor up to it.
+#define MAX_TOOL_THREADS	256
 #define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
 
 
@@ -27,6 +28,9 @@ extern	int		numthreads;
 // If set to true, then all the threads that are created are low priority.
 extern bool	g_bLowPriorityThreads;
 
+// If set to true, worker threads are pinned round-robin to NUMA nodes (-numa).
+extern bool	g_bNumaPinThreads;
+
 typedef void (*ThreadWorkerFn)( int iThread, int iWorkItem );
 typedef void (*RunThreadsFn)( int iThread, void *pUserData );
 
@@ -0,0 +1,141 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Converts a KeyValues text file into a flat image that the game can
+//			memory map with CKeyValuesImage.
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include "tier1/KeyValues.h"
+#include "tier1/keyvaluesimage.h"
+#include "tier1/utlbuffer.h"
+#include "tier2/tier2.h"
+#include "filesystem.h"
+
+void Usage( void )
+{
+	printf( "Usage: kvimage input.txt [output.kvi]\n" );
+	exit( -1 );
+}
+
+static void DeleteKeyList( KeyValues *pKey )
+{
+	while ( pKey )
+	{
+		KeyValues *pNext = pKey->GetNextKey();
+		pKey->SetNextKey( NULL );
+		pKey->deleteThis();
+		pKey = pNext;
+	}
+}
+
+static int CountKeys( KeyValues *pKey )
+{
+	int nKeys = 0;
+	for ( ; pKey; pKey = pKey->GetNextKey() )
+	{
+		nKeys += 1 + CountKeys( pKey->GetFirstSubKey() );
+	}
+	return nKeys;
+}
+
+static void SaveAsText( KeyValues *pKey, CUtlBuffer &buf )
+{
+	for ( ; pKey; pKey = pKey->GetNextKey() )
+	{
+		pKey->RecursiveSaveToFile( buf, 0 );
+	}
+}
+
+int main( int argc, char **argv )
+{
+	if ( argc != 2 && argc != 3 )
+	{
+		Usage();
+	}
+
+	InitDefaultFileSystem();
+
+	char pOutFileName[MAX_PATH];
+	if ( argc == 3 )
+	{
+		Q_strncpy( pOutFileName, argv[2], sizeof( pOutFileName ) );
+	}
+	else
+	{
+		Q_strncpy( pOutFileName, argv[1], sizeof( pOutFileName ) );
+		Q_SetExtension( pOutFileName, ".kvi", sizeof( pOutFileName ) );
+	}
+
+	CUtlBuffer textBuf;
+	if ( !g_pFullFileSystem->ReadFile( argv[1], NULL, textBuf ) )
+	{
+		fprintf( stderr, "%s not found\n", argv[1] );
+		return -1;
+	}
+	textBuf.PutChar( 0 );
+
+	KeyValues *pKeyValues = new KeyValues( argv[1] );
+	if ( !pKeyValues->LoadFromBuffer( argv[1], (const char *)textBuf.Base(), g_pFullFileSystem ) )
+	{
+		fprintf( stderr, "Unable to parse %s\n", argv[1] );
+		pKeyValues->deleteThis();
+		return -1;
+	}
+
+	CUtlBuffer imageBuf;
+	if ( !WriteKeyValuesImage( pKeyValues, imageBuf ) )
+	{
+		fprintf( stderr, "Unable to build an image of %s\n", argv[1] );
+		pKeyValues->deleteThis();
+		return -1;
+	}
+
+	// read the image back and make sure it holds the same tree
+	CKeyValuesImage image;
+	bool bMatches = image.Attach( imageBuf.Base(), imageBuf.TellPut() );
+	if ( bMatches )
+	{
+		KeyValues *pFirst = NULL, *pLast = NULL;
+		for ( KeyValuesView view = image.GetRoot(); view.IsValid(); view = view.GetNextKey() )
+		{
+			KeyValues *pKey = view.MakeKeyValues();
+			if ( pLast )
+			{
+				pLast->SetNextKey( pKey );
+			}
+			else
+			{
+				pFirst = pKey;
+			}
+			pLast = pKey;
+		}
+
+		CUtlBuffer before( 0, 0, CUtlBuffer::TEXT_BUFFER );
+		CUtlBuffer after( 0, 0, CUtlBuffer::TEXT_BUFFER );
+		SaveAsText( pKeyValues, before );
+		SaveAsText( pFirst, after );
+		bMatches = before.TellPut() == after.TellPut() && !V_memcmp( before.Base(), after.Base(), before.TellPut() );
+
+		DeleteKeyList( pFirst );
+	}
+	image.Close();
+
+	int nKeys = CountKeys( pKeyValues );
+	DeleteKeyList( pKeyValues );
+
+	if ( !bMatches )
+	{
+		fprintf( stderr, "Image of %s doesn't read back the same, not writing it\n", argv[1] );
+		return -1;
+	}
+
+	if ( !g_pFullFileSystem->WriteFile( pOutFileName, NULL, imageBuf ) )
+	{
+		fprintf( stderr, "Unable to write %s\n", pOutFileName );
+		return -1;
+	}
+
+	printf( "%s: %d keys, %d bytes of text, %d bytes of image\n", pOutFileName, nKeys, textBuf.TellPut() - 1, imageBuf.TellPut() );
+	return 0;
+}
@@ -0,0 +1,152 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: tier1bench crc, checks that the CRC32 implementations agree and
+//			times them on small keys and on multi-megabyte buffers.
+//
+//=============================================================================
+
+#include <stdlib.h>
+#include "checksum_crc.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+#include "vstdlib/random.h"
+#include "tier0/fasttimer.h"
+#include "tier1bench.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+typedef void (*CRCBenchmarkFn_t)( CRC32_t *pulCRC, const void *p, int len );
+
+struct CRCBenchmarkImpl_t
+{
+	const char *m_pName;
+	CRCBenchmarkFn_t m_pfn;
+};
+
+static CRC32_t CRCBenchmark_Single( CRCBenchmarkFn_t pfn, const void *p, int len )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	pfn( &crc, p, len );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Every length up to a few hundred bytes, at every alignment, then
+//			some long ones fed through in two pieces.
+//-----------------------------------------------------------------------------
+static bool CRCBenchmark_Verify( const CUtlVector< CRCBenchmarkImpl_t > &impls, const byte *pData, int nDataSize )
+{
+	for ( int nLen = 0; nLen < 300; nLen++ )
+	{
+		for ( int nOffset = 0; nOffset < 16; nOffset++ )
+		{
+			CRC32_t expected = CRCBenchmark_Single( CRC32_ProcessBuffer_Bytewise, pData + nOffset, nLen );
+			for ( int i = 0; i < impls.Count(); i++ )
+			{
+				if ( CRCBenchmark_Single( impls[i].m_pfn, pData + nOffset, nLen ) != expected )
+				{
+					Warning( "crc: %s is wrong for %d bytes at offset %d\n", impls[i].m_pName, nLen, nOffset );
+					return false;
+				}
+			}
+		}
+	}
+
+	for ( int nTest = 0; nTest < 32; nTest++ )
+	{
+		int nLen = RandomInt( 0, nDataSize - 16 );
+		int nOffset = RandomInt( 0, 15 );
+		int nSplit = RandomInt( 0, nLen );
+		CRC32_t expected = CRCBenchmark_Single( CRC32_ProcessBuffer_Bytewise, pData + nOffset, nLen );
+		for ( int i = 0; i < impls.Count(); i++ )
+		{
+			CRC32_t crc;
+			CRC32_Init( &crc );
+			impls[i].m_pfn( &crc, pData + nOffset, nSplit );
+			impls[i].m_pfn( &crc, pData + nOffset + nSplit, nLen - nSplit );
+			CRC32_Final( &crc );
+			if ( crc != expected )
+			{
+				Warning( "crc: %s is wrong for %d bytes split at %d\n", impls[i].m_pName, nLen, nSplit );
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static void CRCBenchmark_Time( const CUtlVector< CRCBenchmarkImpl_t > &impls, const byte *pData, int nLen, int nTotalBytes )
+{
+	int nReps = MAX( nTotalBytes / nLen, 1 );
+
+	char szLabel[32];
+	if ( nLen >= 1024 * 1024 )
+	{
+		Q_snprintf( szLabel, sizeof( szLabel ), "%d MB", nLen / ( 1024 * 1024 ) );
+	}
+	else
+	{
+		Q_snprintf( szLabel, sizeof( szLabel ), "%d bytes", nLen );
+	}
+	Msg( "%-10s", szLabel );
+
+	for ( int i = 0; i < impls.Count(); i++ )
+	{
+		CRC32_t crc = 0;
+		CFastTimer timer;
+		timer.Start();
+		for ( int nRep = 0; nRep < nReps; nRep++ )
+		{
+			impls[i].m_pfn( &crc, pData, nLen );
+		}
+		timer.End();
+
+		double flSeconds = MAX( timer.GetDuration().GetSeconds(), 1e-9 );
+		Msg( "  %8s %8.0f MB/s", impls[i].m_pName, (double)nLen * nReps / flSeconds / ( 1024.0 * 1024.0 ) );
+	}
+	Msg( "\n" );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks and times the CRC32 implementations. Optional argument is
+//			the number of MB to hash per test.
+//-----------------------------------------------------------------------------
+int CRCBenchmark( int argc, char **argv )
+{
+	int nTotalBytes = ( ( argc > 0 ) ? MAX( atoi( argv[0] ), 1 ) : 256 ) * 1024 * 1024;
+
+	CUtlVector< CRCBenchmarkImpl_t > impls;
+	CRCBenchmarkImpl_t bytewise = { "bytewise", CRC32_ProcessBuffer_Bytewise };
+	CRCBenchmarkImpl_t slice8 = { "slice8", CRC32_ProcessBuffer_Slice8 };
+	CRCBenchmarkImpl_t pclmul = { "pclmul", CRC32_ProcessBuffer_PCLMUL };
+	impls.AddToTail( bytewise );
+	impls.AddToTail( slice8 );
+	if ( CRC32_HasPCLMUL() )
+	{
+		impls.AddToTail( pclmul );
+	}
+
+	const int nDataSize = 16 * 1024 * 1024 + 16;
+	CUtlVector< byte > data;
+	data.SetCount( nDataSize );
+	for ( int i = 0; i < nDataSize; i++ )
+	{
+		data[i] = (byte)RandomInt( 0, 255 );
+	}
+
+	if ( !CRCBenchmark_Verify( impls, data.Base(), nDataSize ) )
+		return -1;
+
+	Msg( "crc: results match, pclmul %s, %d MB per test\n", CRC32_HasPCLMUL() ? "available" : "not available", nTotalBytes / ( 1024 * 1024 ) );
+
+	static const int s_Lengths[] = { 8, 16, 64, 256, 4 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+	for ( int i = 0; i < ARRAYSIZE( s_Lengths ); i++ )
+	{
+		CRCBenchmark_Time( impls, data.Base(), s_Lengths[i], nTotalBytes );
+	}
+	return 0;
+}
@@ -0,0 +1,194 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: tier1bench kv, compares parsing a game's scripts/ and resource/
+//			files into heap allocated KeyValues and into KeyValues arenas.
+//
+//=============================================================================
+
+#include <stdlib.h>
+#include "tier1/KeyValues.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/utlstring.h"
+#include "tier1/utlvector.h"
+#include "tier2/tier2.h"
+#include "filesystem.h"
+#include "tier0/memalloc.h"
+#include "tier0/fasttimer.h"
+#include "tier1bench.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// files under scripts/ with their own formats, which the KeyValues parser only reports errors for
+static const char *s_pKVBenchmarkSkip[] =
+{
+	"hudanimations",
+	"bot_names",
+};
+
+struct KVBenchmarkFile_t
+{
+	CUtlString m_Name;
+	CUtlBuffer m_Text;
+};
+
+// localization files are UTF-16 and go through the localize system instead
+static bool KVBenchmark_IsUnicode( const CUtlBuffer &buf )
+{
+	const unsigned char *pText = (const unsigned char *)buf.Base();
+	return buf.TellPut() >= 2 && pText[0] == 0xFF && pText[1] == 0xFE;
+}
+
+static void KVBenchmark_AddFiles( const char *pDir, CUtlVector< KVBenchmarkFile_t * > &files )
+{
+	char szWildcard[MAX_PATH];
+	Q_snprintf( szWildcard, sizeof( szWildcard ), "%s/*", pDir );
+
+	CUtlVector< CUtlString > subDirs;
+	FileFindHandle_t hFind;
+	for ( const char *pName = g_pFullFileSystem->FindFirstEx( szWildcard, NULL, &hFind ); pName; pName = g_pFullFileSystem->FindNext( hFind ) )
+	{
+		if ( pName[0] == '.' )
+			continue;
+
+		char szPath[MAX_PATH];
+		Q_snprintf( szPath, sizeof( szPath ), "%s/%s", pDir, pName );
+		if ( g_pFullFileSystem->FindIsDirectory( hFind ) )
+		{
+			subDirs.AddToTail( szPath );
+			continue;
+		}
+
+		const char *pExt = Q_GetFileExtension( pName );
+		if ( !pExt || ( Q_stricmp( pExt, "txt" ) && Q_stricmp( pExt, "res" ) && Q_stricmp( pExt, "vdf" ) ) )
+			continue;
+
+		bool bSkip = false;
+		for ( int i = 0; i < ARRAYSIZE( s_pKVBenchmarkSkip ); i++ )
+		{
+			bSkip = bSkip || !Q_strnicmp( pName, s_pKVBenchmarkSkip[i], Q_strlen( s_pKVBenchmarkSkip[i] ) );
+		}
+		if ( bSkip )
+			continue;
+
+		KVBenchmarkFile_t *pFile = new KVBenchmarkFile_t;
+		pFile->m_Name = szPath;
+		if ( g_pFullFileSystem->ReadFile( szPath, NULL, pFile->m_Text ) && !KVBenchmark_IsUnicode( pFile->m_Text ) )
+		{
+			pFile->m_Text.PutChar( 0 );
+			files.AddToTail( pFile );
+		}
+		else
+		{
+			delete pFile;
+		}
+	}
+	g_pFullFileSystem->FindClose( hFind );
+
+	for ( int i = 0; i < subDirs.Count(); i++ )
+	{
+		KVBenchmark_AddFiles( subDirs[i], files );
+	}
+}
+
+static void KVBenchmark_CountKeys( KeyValues *pKey, int &nKeys, int &nStrings )
+{
+	for ( KeyValues *pSub = pKey->GetFirstSubKey(); pSub; pSub = pSub->GetNextKey() )
+	{
+		nKeys++;
+		if ( pSub->GetDataType() == KeyValues::TYPE_STRING || pSub->GetDataType() == KeyValues::TYPE_UINT64 )
+		{
+			nStrings++;
+		}
+		KVBenchmark_CountKeys( pSub, nKeys, nStrings );
+	}
+}
+
+static size_t KVBenchmark_UsedMemory()
+{
+	size_t nUsed = 0, nFree = 0;
+	g_pMemAlloc->GlobalMemoryStatus( &nUsed, &nFree );
+	return nUsed;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads every file once per pass, keeping all the trees alive until
+//			the end of the pass so the memory they hold can be measured.
+//-----------------------------------------------------------------------------
+static void KVBenchmark_Run( const char *pLabel, CUtlVector< KVBenchmarkFile_t * > &files, int nPasses, bool bArena )
+{
+	double flLoadTime = 0.0, flFreeTime = 0.0;
+	size_t nHeld = 0;
+	int nKeys = 0, nStrings = 0;
+
+	CUtlVector< KeyValues * > trees;
+	trees.EnsureCapacity( files.Count() );
+	for ( int nPass = 0; nPass < nPasses; nPass++ )
+	{
+		size_t nUsedBefore = KVBenchmark_UsedMemory();
+
+		CFastTimer timer;
+		timer.Start();
+		for ( int i = 0; i < files.Count(); i++ )
+		{
+			KeyValues *pKV = new KeyValues( "tier1bench" );
+			pKV->UsesArena( bArena );
+			pKV->LoadFromBuffer( files[i]->m_Name, (const char *)files[i]->m_Text.Base(), g_pFullFileSystem );
+			trees.AddToTail( pKV );
+		}
+		timer.End();
+		flLoadTime += timer.GetDuration().GetMillisecondsF();
+
+		size_t nUsedAfter = KVBenchmark_UsedMemory();
+		nHeld = MAX( nHeld, nUsedAfter > nUsedBefore ? nUsedAfter - nUsedBefore : 0 );
+
+		if ( nPass == 0 )
+		{
+			for ( int i = 0; i < trees.Count(); i++ )
+			{
+				KVBenchmark_CountKeys( trees[i], nKeys, nStrings );
+			}
+		}
+
+		timer.Start();
+		for ( int i = 0; i < trees.Count(); i++ )
+		{
+			trees[i]->deleteThis();
+		}
+		timer.End();
+		flFreeTime += timer.GetDuration().GetMillisecondsF();
+		trees.RemoveAll();
+	}
+
+	Msg( "%-6s load %8.2f ms  free %8.2f ms  heap held %7u KB  (%d keys, %d string values)\n",
+		pLabel, flLoadTime / nPasses, flFreeTime / nPasses, (unsigned)( nHeld / 1024 ), nKeys, nStrings );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Times parsing scripts/ and resource/ under the current directory into
+//			KeyValues, with and without arenas. Optional argument is the number
+//			of passes.
+//-----------------------------------------------------------------------------
+int KVBenchmark( int argc, char **argv )
+{
+	int nPasses = ( argc > 0 ) ? MAX( atoi( argv[0] ), 1 ) : 5;
+
+	CUtlVector< KVBenchmarkFile_t * > files;
+	KVBenchmark_AddFiles( "scripts", files );
+	KVBenchmark_AddFiles( "resource", files );
+
+	int nBytes = 0;
+	for ( int i = 0; i < files.Count(); i++ )
+	{
+		nBytes += files[i]->m_Text.TellPut();
+	}
+	Msg( "kv: %d files, %d KB of text, %d passes\n", files.Count(), nBytes / 1024, nPasses );
+
+	// one pass first so both runs start with the file cache and key symbol table warm
+	KVBenchmark_Run( "warmup", files, 1, false );
+	KVBenchmark_Run( "heap", files, nPasses, false );
+	KVBenchmark_Run( "arena", files, nPasses, true );
+
+	files.PurgeAndDeleteElements();
+	return 0;
+}
@@ -0,0 +1,135 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: tier1bench lzss, compares the block compressor and wide copy
+//			decoder in CLZSS against the original greedy/bitwise versions.
+//
+//=============================================================================
+
+#include <stdlib.h>
+#include "tier1/strtools.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/lzss.h"
+#include "tier1/utlvector.h"
+#include "tier2/tier2.h"
+#include "filesystem.h"
+#include "tier0/fasttimer.h"
+#include "tier1bench.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+enum LZSSBenchmarkDecoder_t
+{
+	LZSS_DECODE_SIMPLE,
+	LZSS_DECODE_FAST,
+	LZSS_DECODE_SAFE,
+	LZSS_DECODE_COUNT
+};
+
+static const char *s_pLZSSDecoderNames[LZSS_DECODE_COUNT] = { "simple", "fast", "safe" };
+
+static double LZSSBenchmark_MBPerSec( int nBytes, int nReps, const CFastTimer &timer )
+{
+	double flSeconds = MAX( timer.GetDuration().GetSeconds(), 1e-9 );
+	return (double)nBytes * nReps / flSeconds / ( 1024.0 * 1024.0 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Compresses with one of the compressors, then decodes the result with
+//			each decoder and checks it comes back the same.
+//-----------------------------------------------------------------------------
+static void LZSSBenchmark_Run( const char *pLabel, const CUtlBuffer &data, int nThreads, bool bGreedy, int nReps )
+{
+	const unsigned char *pInput = (const unsigned char *)data.Base();
+	int nInput = data.TellPut();
+
+	CLZSS lzss;
+	lzss.SetMaxThreads( nThreads );
+
+	CUtlVector< unsigned char > compressed;
+	compressed.SetCount( nInput );
+	unsigned int nCompressed = 0;
+	bool bCompressed = false;
+
+	CFastTimer timer;
+	timer.Start();
+	for ( int i = 0; i < nReps; i++ )
+	{
+		if ( bGreedy )
+		{
+			bCompressed = lzss.CompressNoAllocGreedy( pInput, nInput, compressed.Base(), &nCompressed ) != NULL;
+		}
+		else
+		{
+			bCompressed = lzss.CompressNoAlloc( pInput, nInput, compressed.Base(), &nCompressed ) != NULL;
+		}
+	}
+	timer.End();
+
+	if ( !bCompressed )
+	{
+		Msg( "%-14s doesn't compress\n", pLabel );
+		return;
+	}
+
+	Msg( "%-14s %9u bytes (%5.1f%%)  compress %7.1f MB/s  decode", pLabel, nCompressed, 100.0 * nCompressed / nInput,
+		LZSSBenchmark_MBPerSec( nInput, nReps, timer ) );
+
+	CUtlVector< unsigned char > output;
+	output.SetCount( nInput );
+	for ( int nDecoder = 0; nDecoder < LZSS_DECODE_COUNT; nDecoder++ )
+	{
+		unsigned int nOutput = 0;
+		memset( output.Base(), 0, nInput );
+		timer.Start();
+		for ( int i = 0; i < nReps; i++ )
+		{
+			switch ( nDecoder )
+			{
+			case LZSS_DECODE_SIMPLE:	nOutput = lzss.UncompressSimple( compressed.Base(), output.Base() ); break;
+			case LZSS_DECODE_FAST:		nOutput = lzss.Uncompress( compressed.Base(), output.Base() ); break;
+			case LZSS_DECODE_SAFE:		nOutput = lzss.SafeUncompress( compressed.Base(), nCompressed, output.Base(), nInput ); break;
+			}
+		}
+		timer.End();
+
+		if ( nOutput != (unsigned int)nInput || V_memcmp( output.Base(), pInput, nInput ) )
+		{
+			Msg( "  %s FAILED", s_pLZSSDecoderNames[nDecoder] );
+		}
+		else
+		{
+			Msg( "  %s %7.1f MB/s", s_pLZSSDecoderNames[nDecoder], LZSSBenchmark_MBPerSec( nInput, nReps, timer ) );
+		}
+	}
+	Msg( "\n" );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Times the LZSS compressors and decoders on a file, a map's bsp for
+//			example. Arguments are <file> [repetitions].
+//-----------------------------------------------------------------------------
+int LZSSBenchmark( int argc, char **argv )
+{
+	if ( argc < 1 )
+	{
+		Warning( "lzss: no file given\n" );
+		return -1;
+	}
+
+	const char *pFileName = argv[0];
+	int nReps = ( argc > 1 ) ? MAX( atoi( argv[1] ), 1 ) : 1;
+
+	CUtlBuffer data;
+	if ( !g_pFullFileSystem->ReadFile( pFileName, NULL, data ) )
+	{
+		Warning( "lzss: couldn't read %s\n", pFileName );
+		return -1;
+	}
+
+	Msg( "lzss: %s, %d bytes, %d repetitions\n", pFileName, data.TellPut(), nReps );
+	LZSSBenchmark_Run( "greedy", data, 1, true, nReps );
+	LZSSBenchmark_Run( "block", data, 1, false, nReps );
+	LZSSBenchmark_Run( "block threads", data, 0, false, nReps );
+	return 0;
+}
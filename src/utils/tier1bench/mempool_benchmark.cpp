@@ -0,0 +1,153 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: tier1bench mempool, measures CMemoryPoolMT under contention against
+//			a CUtlMemoryPool behind a single mutex, which is what it used to be.
+//
+//=============================================================================
+
+#include <stdlib.h>
+#include "tier0/threadtools.h"
+#include "tier0/fasttimer.h"
+#include "tier1/mempool.h"
+#include "tier1/utlvector.h"
+#include "tier1bench.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define MEMPOOL_BENCHMARK_BLOCK_SIZE	48
+#define MEMPOOL_BENCHMARK_LIVE			64		// blocks each thread keeps around
+#define MEMPOOL_BENCHMARK_HANDOFF		256		// slots blocks are passed between threads through
+
+class CMemoryPoolLocked : public CUtlMemoryPool
+{
+public:
+	CMemoryPoolLocked( int blockSize, int numElements ) : CUtlMemoryPool( blockSize, numElements ) {}
+
+	void *Alloc()			{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc(); }
+	void Free( void *pMem )	{ AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
+
+private:
+	CThreadFastMutex m_mutex;
+};
+
+template < class POOL >
+struct MemPoolBenchmarkContext_t
+{
+	POOL			*m_pPool;
+	int				m_nOps;
+	bool			m_bHandoff;		// free half the blocks on another thread
+	void * volatile	m_pHandoff[MEMPOOL_BENCHMARK_HANDOFF];
+};
+
+template < class POOL >
+static uintp MemPoolBenchmarkThreadFn( void *pParam )
+{
+	MemPoolBenchmarkContext_t< POOL > *pCtx = (MemPoolBenchmarkContext_t< POOL > *)pParam;
+	POOL *pPool = pCtx->m_pPool;
+
+	void *live[MEMPOOL_BENCHMARK_LIVE];
+	for ( int i = 0; i < MEMPOOL_BENCHMARK_LIVE; i++ )
+	{
+		live[i] = pPool->Alloc();
+	}
+
+	uint32 nSeed = (uint32)ThreadGetCurrentId() * 2654435761u;
+	for ( int i = 0; i < pCtx->m_nOps; i++ )
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		int nSlot = ( nSeed >> 8 ) % MEMPOOL_BENCHMARK_LIVE;
+		void *pOld = live[nSlot];
+
+		// either free the block here, or swap it into a shared slot and free whatever
+		// another thread left there
+		if ( pCtx->m_bHandoff && ( nSeed & 0x80000000 ) )
+		{
+			pOld = ThreadInterlockedExchangePointer( &pCtx->m_pHandoff[( nSeed >> 16 ) % MEMPOOL_BENCHMARK_HANDOFF], pOld );
+		}
+		if ( pOld )
+		{
+			pPool->Free( pOld );
+		}
+
+		live[nSlot] = pPool->Alloc();
+		*(int *)live[nSlot] = i;
+	}
+
+	for ( int i = 0; i < MEMPOOL_BENCHMARK_LIVE; i++ )
+	{
+		pPool->Free( live[i] );
+	}
+	return 0;
+}
+
+template < class POOL >
+static double MemPoolBenchmark_Run( POOL &pool, int nThreads, int nOps, bool bHandoff )
+{
+	MemPoolBenchmarkContext_t< POOL > ctx;
+	ctx.m_pPool = &pool;
+	ctx.m_nOps = nOps;
+	ctx.m_bHandoff = bHandoff;
+	memset( (void *)ctx.m_pHandoff, 0, sizeof( ctx.m_pHandoff ) );
+
+	CFastTimer timer;
+	timer.Start();
+	CUtlVector< ThreadHandle_t > threads;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		threads.AddToTail( CreateSimpleThread( MemPoolBenchmarkThreadFn< POOL >, &ctx ) );
+	}
+	FOR_EACH_VEC( threads, i )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+	timer.End();
+
+	for ( int i = 0; i < MEMPOOL_BENCHMARK_HANDOFF; i++ )
+	{
+		if ( ctx.m_pHandoff[i] )
+		{
+			pool.Free( ctx.m_pHandoff[i] );
+		}
+	}
+
+	// millions of alloc/free pairs per second
+	double flSeconds = MAX( timer.GetDuration().GetSeconds(), 1e-9 );
+	return (double)nThreads * nOps / flSeconds / 1000000.0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Compares CMemoryPoolMT against a mutex locked pool. Arguments are
+//			[max threads] [operations per thread].
+//-----------------------------------------------------------------------------
+int MemPoolBenchmark( int argc, char **argv )
+{
+	int nMaxThreads = ( argc > 0 ) ? atoi( argv[0] ) : GetCPUInformation()->m_nLogicalProcessors;
+	nMaxThreads = MAX( nMaxThreads, 1 );
+	int nOps = ( argc > 1 ) ? MAX( atoi( argv[1] ), 1 ) : 1000000;
+
+	Msg( "mempool: %d byte blocks, %d ops per thread, M alloc/free per second\n", MEMPOOL_BENCHMARK_BLOCK_SIZE, nOps );
+	Msg( "threads     locked       cached   locked+handoff     cached+handoff   hits     misses  cache spills\n" );
+	for ( int nThreads = 1; ; nThreads = MIN( nThreads * 2, nMaxThreads ) )
+	{
+		CMemoryPoolLocked locked( MEMPOOL_BENCHMARK_BLOCK_SIZE, 256 );
+		CMemoryPoolLocked lockedHandoff( MEMPOOL_BENCHMARK_BLOCK_SIZE, 256 );
+		CMemoryPoolMT cached( MEMPOOL_BENCHMARK_BLOCK_SIZE, 256 );
+		CMemoryPoolMT cachedHandoff( MEMPOOL_BENCHMARK_BLOCK_SIZE, 256 );
+
+		double flLocked = MemPoolBenchmark_Run( locked, nThreads, nOps, false );
+		double flCached = MemPoolBenchmark_Run( cached, nThreads, nOps, false );
+		double flLockedHandoff = MemPoolBenchmark_Run( lockedHandoff, nThreads, nOps, true );
+		double flCachedHandoff = MemPoolBenchmark_Run( cachedHandoff, nThreads, nOps, true );
+
+		MemoryPoolMTStats_t stats;
+		cachedHandoff.GetStats( stats );
+		Msg( "%7d  %9.1f  %11.1f  %15.1f  %17.1f  %9lld  %9lld  %12lld\n", nThreads, flLocked, flCached, flLockedHandoff, flCachedHandoff,
+			stats.m_nHits, stats.m_nMisses, stats.m_nCacheSpills );
+
+		if ( nThreads == nMaxThreads )
+			break;
+	}
+	return 0;
+}
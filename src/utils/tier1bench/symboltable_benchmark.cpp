@@ -0,0 +1,171 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: tier1bench symbols, hammers CUtlSymbolTableSharded with a mix of
+//			lookups and inserts from several threads, against CUtlSymbolTableMT,
+//			which is a CUtlSymbolTable behind a read/write lock.
+//
+//=============================================================================
+
+#include <stdlib.h>
+#include "tier0/threadtools.h"
+#include "tier0/fasttimer.h"
+#include "tier1/strtools.h"
+#include "tier1/utlstring.h"
+#include "tier1/utlsymbol.h"
+#include "tier1/utlvector.h"
+#include "tier1bench.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define SYMBOL_BENCHMARK_PRELOAD	16384	// strings in the table before the threads start
+#define SYMBOL_BENCHMARK_NEW		32768	// strings the threads may add
+
+template < class TABLE >
+struct SymbolBenchmarkContext_t
+{
+	TABLE			*m_pTable;
+	const CUtlVector< CUtlString > *m_pStrings;
+	int				m_nOps;
+	int				m_nInsertPercent;
+	CInterlockedInt	m_nErrors;
+};
+
+template < class TABLE >
+static uintp SymbolBenchmarkThreadFn( void *pParam )
+{
+	SymbolBenchmarkContext_t< TABLE > *pCtx = (SymbolBenchmarkContext_t< TABLE > *)pParam;
+	TABLE *pTable = pCtx->m_pTable;
+	const CUtlVector< CUtlString > &strings = *pCtx->m_pStrings;
+
+	uint32 nSeed = (uint32)ThreadGetCurrentId() * 2654435761u;
+	for ( int i = 0; i < pCtx->m_nOps; i++ )
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		if ( (int)( ( nSeed >> 8 ) % 100 ) < pCtx->m_nInsertPercent )
+		{
+			const char *pString = strings[SYMBOL_BENCHMARK_PRELOAD + ( nSeed >> 12 ) % SYMBOL_BENCHMARK_NEW].Get();
+			CUtlSymbol sym = pTable->AddString( pString );
+			if ( V_strcmp( pTable->String( sym ), pString ) )
+			{
+				++pCtx->m_nErrors;
+			}
+		}
+		else
+		{
+			const char *pString = strings[( nSeed >> 12 ) % SYMBOL_BENCHMARK_PRELOAD].Get();
+			CUtlSymbol sym = pTable->Find( pString );
+			if ( !sym.IsValid() || V_strcmp( pTable->String( sym ), pString ) )
+			{
+				++pCtx->m_nErrors;
+			}
+		}
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns millions of operations per second, or -1 if any thread
+//			got a wrong answer.
+//-----------------------------------------------------------------------------
+template < class TABLE >
+static double SymbolBenchmark_Run( const CUtlVector< CUtlString > &strings, int nThreads, int nOps, int nInsertPercent )
+{
+	TABLE table;
+	for ( int i = 0; i < SYMBOL_BENCHMARK_PRELOAD; i++ )
+	{
+		table.AddString( strings[i].Get() );
+	}
+
+	SymbolBenchmarkContext_t< TABLE > ctx;
+	ctx.m_pTable = &table;
+	ctx.m_pStrings = &strings;
+	ctx.m_nOps = nOps;
+	ctx.m_nInsertPercent = nInsertPercent;
+	ctx.m_nErrors = 0;
+
+	CFastTimer timer;
+	timer.Start();
+	CUtlVector< ThreadHandle_t > threads;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		threads.AddToTail( CreateSimpleThread( SymbolBenchmarkThreadFn< TABLE >, &ctx ) );
+	}
+	FOR_EACH_VEC( threads, i )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+	timer.End();
+
+	// every string that went in has to come back out as the same, distinct symbol
+	CUtlVector< bool > used;
+	used.SetCount( 65536 );
+	FOR_EACH_VEC( used, i )
+	{
+		used[i] = false;
+	}
+	FOR_EACH_VEC( strings, i )
+	{
+		CUtlSymbol sym = table.Find( strings[i].Get() );
+		if ( !sym.IsValid() )
+		{
+			if ( i < SYMBOL_BENCHMARK_PRELOAD )
+			{
+				++ctx.m_nErrors;
+			}
+			continue;
+		}
+		if ( used[sym] || V_strcmp( table.String( sym ), strings[i].Get() ) )
+		{
+			++ctx.m_nErrors;
+		}
+		used[sym] = true;
+	}
+
+	if ( ctx.m_nErrors )
+		return -1.0;
+
+	double flSeconds = MAX( timer.GetDuration().GetSeconds(), 1e-9 );
+	return (double)nThreads * nOps / flSeconds / 1000000.0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Compares CUtlSymbolTableSharded against CUtlSymbolTableMT. Arguments
+//			are [max threads] [operations per thread] [insert percent].
+//-----------------------------------------------------------------------------
+int SymbolTableBenchmark( int argc, char **argv )
+{
+	int nMaxThreads = ( argc > 0 ) ? atoi( argv[0] ) : GetCPUInformation()->m_nLogicalProcessors;
+	nMaxThreads = MAX( nMaxThreads, 1 );
+	int nOps = ( argc > 1 ) ? MAX( atoi( argv[1] ), 1 ) : 1000000;
+	int nInsertPercent = ( argc > 2 ) ? clamp( atoi( argv[2] ), 0, 100 ) : 5;
+
+	CUtlVector< CUtlString > strings;
+	strings.SetCount( SYMBOL_BENCHMARK_PRELOAD + SYMBOL_BENCHMARK_NEW );
+	FOR_EACH_VEC( strings, i )
+	{
+		char szString[64];
+		Q_snprintf( szString, sizeof( szString ), "models/props_benchmark/symbol_%05d_%x.mdl", i, i * 2654435761u );
+		strings[i] = szString;
+	}
+
+	Msg( "symbols: %d preloaded strings, %d ops per thread, %d%% inserts, M ops per second\n", SYMBOL_BENCHMARK_PRELOAD, nOps, nInsertPercent );
+	Msg( "threads     locked     sharded\n" );
+	for ( int nThreads = 1; ; nThreads = MIN( nThreads * 2, nMaxThreads ) )
+	{
+		double flLocked = SymbolBenchmark_Run< CUtlSymbolTableMT >( strings, nThreads, nOps, nInsertPercent );
+		double flSharded = SymbolBenchmark_Run< CUtlSymbolTableSharded >( strings, nThreads, nOps, nInsertPercent );
+		if ( flLocked < 0.0 || flSharded < 0.0 )
+		{
+			Warning( "symbols: %s table returned a wrong symbol with %d threads\n", ( flSharded < 0.0 ) ? "sharded" : "locked", nThreads );
+			return -1;
+		}
+
+		Msg( "%7d  %9.1f  %10.1f\n", nThreads, flLocked, flSharded );
+
+		if ( nThreads == nMaxThreads )
+			break;
+	}
+	return 0;
+}
@@ -0,0 +1,58 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Runs the tier1 benchmarks. These used to be server console
+//			commands, but they only exercise tier1 so they don't need to
+//			ship in every mod's server.
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include "tier1/strtools.h"
+#include "tier2/tier2.h"
+#include "tier1bench.h"
+
+struct Tier1Benchmark_t
+{
+	const char *m_pName;
+	int (*m_pfnRun)( int argc, char **argv );
+	const char *m_pArgs;
+};
+
+static const Tier1Benchmark_t s_Benchmarks[] =
+{
+	{ "crc",		CRCBenchmark,			"[MB per test]" },
+	{ "kv",			KVBenchmark,			"[passes]  (run from a game directory, parses scripts/ and resource/)" },
+	{ "lzss",		LZSSBenchmark,			"<file> [repetitions]" },
+	{ "mempool",	MemPoolBenchmark,		"[max threads] [operations per thread]" },
+	{ "symbols",	SymbolTableBenchmark,	"[max threads] [operations per thread] [insert percent]" },
+};
+
+void Usage( void )
+{
+	printf( "Usage: tier1bench <benchmark> [arguments]\n" );
+	for ( int i = 0; i < ARRAYSIZE( s_Benchmarks ); i++ )
+	{
+		printf( "  %-12s %s\n", s_Benchmarks[i].m_pName, s_Benchmarks[i].m_pArgs );
+	}
+	exit( -1 );
+}
+
+int main( int argc, char **argv )
+{
+	if ( argc < 2 )
+	{
+		Usage();
+	}
+
+	for ( int i = 0; i < ARRAYSIZE( s_Benchmarks ); i++ )
+	{
+		if ( !Q_stricmp( argv[1], s_Benchmarks[i].m_pName ) )
+		{
+			InitDefaultFileSystem();
+			return s_Benchmarks[i].m_pfnRun( argc - 2, argv + 2 );
+		}
+	}
+
+	Usage();
+	return -1;
+}
@@ -0,0 +1,20 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Benchmarks for the tier1 containers, allocators and codecs
+//
+//===========================================================================//
+
+#ifndef TIER1BENCH_H
+#define TIER1BENCH_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+// Each benchmark is passed the arguments after its name and returns the exit code
+int CRCBenchmark( int argc, char **argv );
+int KVBenchmark( int argc, char **argv );
+int LZSSBenchmark( int argc, char **argv );
+int MemPoolBenchmark( int argc, char **argv );
+int SymbolTableBenchmark( int argc, char **argv );
+
+#endif // TIER1BENCH_H
@@ -1092,6 +1092,10 @@ int RunVBSP( int argc, char **argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-numa" ) )
+		{
+			g_bNumaPinThreads = true;
+		}
 		else if( !Q_stricmp( argv[i], "-lightifmissing" ) )
 		{
 			g_bLightIfMissing = true;
@@ -1183,6 +1187,7 @@ int RunVBSP( int argc, char **argv )
 			"                what affects visibility.\n"
 			"  -nowater    : Get rid of water brushes.\n"
 			"  -low        : Run as an idle-priority process.\n"
+			"  -numa       : Pin worker threads round-robin to NUMA nodes.\n"
 			"  -embed <directory>  : Use <directory> as an additional search path for assets\n"
 			"                        and embed all assets in this directory into the compiled\n"
 			"                        map\n"
@@ -16,6 +16,7 @@
 #include "messbuf.h"
 #include "vmpi.h"
 #include "vmpi_distribute_work.h"
+#include "vrad_dispcoll.h"
 
 static TableVector g_BoxDirections[6] = 
 {
@@ -89,28 +90,28 @@ float Engine_WorldLightDistanceFalloff( const dworldlight_t *wl, const Vector& d
 }
 
 
-void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
+static void AddEmitSurfaceLightGroup( const Vector &vStart, const FourVectors &vStart4, const int *pLights, int nLights, Vector lightBoxColor[6] )
 {
-	fltx4 fractionVisible;
+	// Can these lights see the point? Unused lanes repeat the last light.
+	FourVectors wlOrigin4;
+	for ( int i = 0; i < 4; i++ )
+	{
+		const Vector &vOrigin = dworldlights[pLights[MIN( i, nLights - 1 )]].origin;
+		wlOrigin4.X( i ) = vOrigin.x;
+		wlOrigin4.Y( i ) = vOrigin.y;
+		wlOrigin4.Z( i ) = vOrigin.z;
+	}
 
-	FourVectors vStart4, wlOrigin4;
-	vStart4.DuplicateVector ( vStart );
+	fltx4 fractionVisible;
+	TestLine ( vStart4, wlOrigin4, &fractionVisible );
+	int visibleMask = TestSignSIMD ( CmpGtSIMD ( fractionVisible, Four_Zeros ) );
 
-	for ( int iLight=0; iLight < *pNumworldlights; iLight++ )
+	for ( int iLane = 0; iLane < nLights; iLane++ )
 	{
-		dworldlight_t *wl = &dworldlights[iLight];
-
-		// Should this light even go in the ambient cubes?
-		if ( !( wl->flags & DWL_FLAGS_INAMBIENTCUBE ) )
+		if ( !( visibleMask & ( 1 << iLane ) ) )
 			continue;
 
-		Assert( wl->type == emit_surface );
-
-		// Can this light see the point?
-		wlOrigin4.DuplicateVector ( wl->origin );
-		TestLine ( vStart4, wlOrigin4, &fractionVisible );
-		if ( !TestSignSIMD ( CmpGtSIMD ( fractionVisible, Four_Zeros ) ) )
-			continue;
+		dworldlight_t *wl = &dworldlights[pLights[iLane]];
 
 		// Add this light's contribution.
 		Vector vDelta = wl->origin - vStart;
@@ -120,7 +121,7 @@ void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
 		VectorNormalize( vDeltaNorm );
 		float flAngleScale = Engine_WorldLightAngle( wl, wl->normal, vDeltaNorm, vDeltaNorm );
 
-		float ratio = flDistanceScale * flAngleScale * SubFloat ( fractionVisible, 0 );
+		float ratio = flDistanceScale * flAngleScale * SubFloat ( fractionVisible, iLane );
 		if ( ratio == 0 )
 			continue;
 
@@ -132,51 +133,210 @@ void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
 				lightBoxColor[i] += wl->intensity * (t * ratio);
 			}
 		}
-	}	
+	}
 }
 
 
-void ComputeAmbientFromSphericalSamples( int iThread, const Vector &vStart, Vector lightBoxColor[6] )
+void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
 {
-	// Figure out the color that rays hit when shot out from this position.
-	Vector radcolor[NUMVERTEXNORMALS];
-	float tanTheta = tan(VERTEXNORMAL_CONE_INNER_ANGLE);
+	FourVectors vStart4;
+	vStart4.DuplicateVector ( vStart );
+
+	// Visibility is tested for four lights at a time
+	int lights[4];
+	int nLights = 0;
+	for ( int iLight=0; iLight < *pNumworldlights; iLight++ )
+	{
+		dworldlight_t *wl = &dworldlights[iLight];
+
+		// Should this light even go in the ambient cubes?
+		if ( !( wl->flags & DWL_FLAGS_INAMBIENTCUBE ) )
+			continue;
+
+		Assert( wl->type == emit_surface );
+
+		lights[nLights++] = iLight;
+		if ( nLights == 4 )
+		{
+			AddEmitSurfaceLightGroup( vStart, vStart4, lights, nLights, lightBoxColor );
+			nLights = 0;
+		}
+	}
+
+	if ( nLights )
+	{
+		AddEmitSurfaceLightGroup( vStart, vStart4, lights, nLights, lightBoxColor );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The ambient rays look for lightmapped surfaces by walking the bsp, which is
+// slow and one ray at a time. Instead they are first traced as packets through
+// g_RtEnv, and the walk starts just short of the g_RtEnv hit: every opaque
+// surface is in g_RtEnv, so nothing the walk could find is closer than that.
+// Water, glass and other non-opaque brushes aren't, so the leaves and
+// displacements made of them go in this environment as boxes, and a ray that
+// reaches one before its g_RtEnv hit walks the whole bsp as it used to.
+//-----------------------------------------------------------------------------
+#define AMBIENT_RAY_HIT_BACKOFF		1.0f		// world units to back off from a g_RtEnv hit
+
+#define NON_OPAQUE_VISIBLE_CONTENTS	( CONTENTS_WINDOW | CONTENTS_GRATE | CONTENTS_SLIME | CONTENTS_WATER | CONTENTS_TRANSLUCENT )
+
+static RayTracingEnvironment s_NonOpaqueVolumes;
+static bool s_bHasNonOpaqueVolumes = false;
+
+static void BuildNonOpaqueVolumes()
+{
+	Vector vColor( 1, 1, 1 );
+	Vector vBloat( 1, 1, 1 );
+	int nVolumes = 0;
+
+	for ( int i = 0; i < numleafs; i++ )
+	{
+		int contents = dleafs[i].contents;
+		if ( !( contents & NON_OPAQUE_VISIBLE_CONTENTS ) || ( contents & MASK_OPAQUE ) )
+			continue;
+
+		Vector mins, maxs;
+		for ( int j = 0; j < 3; j++ )
+		{
+			mins[j] = dleafs[i].mins[j];
+			maxs[j] = dleafs[i].maxs[j];
+		}
+		s_NonOpaqueVolumes.AddAxisAlignedRectangularSolid( TRACE_ID_OPAQUE, mins - vBloat, maxs + vBloat, vColor );
+		++nVolumes;
+	}
+
+	for ( int i = 0; i < dmodels[0].numfaces; i++ )
+	{
+		int ndxFace = dmodels[0].firstface + i;
+		if ( g_pFaces[ndxFace].dispinfo == -1 )
+			continue;
+
+		CVRADDispColl *pDispTree = NULL;
+		StaticDispMgr()->GetDispSurf( ndxFace, &pDispTree );
+		if ( !pDispTree || ( pDispTree->GetContents() & MASK_OPAQUE ) )
+			continue;
+
+		Vector mins, maxs;
+		pDispTree->GetBounds( mins, maxs );
+		s_NonOpaqueVolumes.AddAxisAlignedRectangularSolid( TRACE_ID_OPAQUE, mins - vBloat, maxs + vBloat, vColor );
+		++nVolumes;
+	}
+
+	s_bHasNonOpaqueVolumes = ( nVolumes != 0 );
+	if ( s_bHasNonOpaqueVolumes )
+	{
+		s_NonOpaqueVolumes.SetupAccelerationStructure();
+	}
+}
+
 
+//-----------------------------------------------------------------------------
+// Computes the ambient cubes (six colors each) for a set of sample positions
+// at once. All of the sample rays go into one RayStream, which packs them four
+// at a time by direction octant; since the rays are added one direction at a
+// time across every sample, the packets are nearly parallel rays from nearby
+// points.
+//-----------------------------------------------------------------------------
+void ComputeAmbientFromSphericalSamples( int iThread, const Vector *pStarts, int nSamples, Vector *pLightBoxColors )
+{
+	float flRayLength = COORD_EXTENT * 1.74;
+	int nRays = nSamples * NUMVERTEXNORMALS;
+
+	CUtlVector<RayTracingSingleResult> hits;
+	CUtlVector<RayTracingSingleResult> volumeHits;
+	hits.SetCount( nRays );
+	if ( s_bHasNonOpaqueVolumes )
+	{
+		volumeHits.SetCount( nRays );
+	}
+
+	RayStream stream;
+	RayStream volumeStream;
 	for ( int i = 0; i < NUMVERTEXNORMALS; i++ )
 	{
-		Vector vEnd = vStart + g_anorms[i] * (COORD_EXTENT * 1.74);
+		for ( int iSample = 0; iSample < nSamples; iSample++ )
+		{
+			int iRay = i * nSamples + iSample;
+			Vector vEnd = pStarts[iSample] + g_anorms[i] * flRayLength;
+			g_RtEnv.AddToRayStream( stream, pStarts[iSample], vEnd, &hits[iRay] );
+			if ( s_bHasNonOpaqueVolumes )
+			{
+				s_NonOpaqueVolumes.AddToRayStream( volumeStream, pStarts[iSample], vEnd, &volumeHits[iRay] );
+			}
+		}
+	}
+	g_RtEnv.FinishRayStream( stream );
+	if ( s_bHasNonOpaqueVolumes )
+	{
+		s_NonOpaqueVolumes.FinishRayStream( volumeStream );
+	}
+
+	// Figure out the color that rays hit when shot out from each position.
+	float tanTheta = tan(VERTEXNORMAL_CONE_INNER_ANGLE);
+	CUtlVector<Vector> radcolor;
+	radcolor.SetCount( nRays );
+	for ( int iRay = 0; iRay < nRays; iRay++ )
+	{
+		int i = iRay / nSamples;
+		const Vector &vStart = pStarts[iRay % nSamples];
+		Vector vEnd = vStart + g_anorms[i] * flRayLength;
+
+		// Skip the part of the ray that can't contain a surface
+		const RayTracingSingleResult &hit = hits[iRay];
+		float flStartFrac = 0.0f;
+		if ( hit.HitID != -1 && hit.HitDistance < hit.ray_length )
+		{
+			float flSkip = hit.HitDistance - AMBIENT_RAY_HIT_BACKOFF;
+			if ( s_bHasNonOpaqueVolumes )
+			{
+				const RayTracingSingleResult &volumeHit = volumeHits[iRay];
+				if ( volumeHit.HitID != -1 && volumeHit.HitDistance < hit.HitDistance + AMBIENT_RAY_HIT_BACKOFF )
+				{
+					flSkip = 0.0f;
+				}
+			}
+			flStartFrac = MAX( flSkip, 0.0f ) / hit.ray_length;
+		}
 
 		// Now that we've got a ray, see what surface we've hit
 		Vector lightStyleColors[MAX_LIGHTSTYLES];
 		lightStyleColors[0].Init();	// We only care about light style 0 here.
-		CalcRayAmbientLighting( iThread, vStart, vEnd, tanTheta, lightStyleColors );
-	
-		radcolor[i] = lightStyleColors[0];
+		CalcRayAmbientLighting( iThread, vStart, vEnd, tanTheta, lightStyleColors, flStartFrac );
+
+		radcolor[iRay] = lightStyleColors[0];
 	}
 
-	// accumulate samples into radiant box
-	for ( int j = 6; --j >= 0; )
+	for ( int iSample = 0; iSample < nSamples; iSample++ )
 	{
-		float t = 0;
-
-		lightBoxColor[j].Init();
+		Vector *lightBoxColor = &pLightBoxColors[iSample * 6];
 
-		for (int i = 0; i < NUMVERTEXNORMALS; i++)
+		// accumulate samples into radiant box
+		for ( int j = 6; --j >= 0; )
 		{
-			float c = DotProduct( g_anorms[i], g_BoxDirections[j] );
-			if (c > 0)
+			float t = 0;
+
+			lightBoxColor[j].Init();
+
+			for (int i = 0; i < NUMVERTEXNORMALS; i++)
 			{
-				t += c;
-				lightBoxColor[j] += radcolor[i] * c;
+				float c = DotProduct( g_anorms[i], g_BoxDirections[j] );
+				if (c > 0)
+				{
+					t += c;
+					lightBoxColor[j] += radcolor[i * nSamples + iSample] * c;
+				}
 			}
+			
+			lightBoxColor[j] *= 1/t;
 		}
-		
-		lightBoxColor[j] *= 1/t;
-	}
 
-	// Now add direct light from the emit_surface lights. These go in the ambient cube because
-	// there are a ton of them and they are often so dim that they get filtered out by r_worldlightmin.
-	AddEmitSurfaceLights( vStart, lightBoxColor );
+		// Now add direct light from the emit_surface lights. These go in the ambient cube because
+		// there are a ton of them and they are often so dim that they get filtered out by r_worldlightmin.
+		AddEmitSurfaceLights( pStarts[iSample], lightBoxColor );
+	}
 }
 
 
@@ -550,15 +710,21 @@ void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t>
 		// NOTE: We copy the nearest non-solid leaf sample pointers into this leaf at the end
 		return;
 	}
-	Vector cube[6];
+	// place all of the candidate samples, then light them together
+	CUtlVector<Vector> samplePositions;
+	CUtlVector<Vector> cubes;
+	samplePositions.SetCount( sampleCount );
+	cubes.SetCount( sampleCount * 6 );
+	for ( int i = 0; i < sampleCount; i++ )
+	{
+		sampler.GenerateLeafSamplePosition( leafID, leafPlanes, samplePositions[i] );
+	}
+	ComputeAmbientFromSphericalSamples( iThread, samplePositions.Base(), sampleCount, cubes.Base() );
+
 	for ( int i = 0; i < sampleCount; i++ )
 	{
-		// compute each candidate sample and add to the list
-		Vector samplePosition;
-		sampler.GenerateLeafSamplePosition( leafID, leafPlanes, samplePosition );
-		ComputeAmbientFromSphericalSamples( iThread, samplePosition, cube );
 		// note this will remove the least valuable sample once the limit is reached
-		AddSampleToList( list, samplePosition, cube );
+		AddSampleToList( list, samplePositions[i], &cubes[i * 6] );
 	}
 
 	// remove any samples that can be reconstructed with the remaining data
@@ -643,6 +809,8 @@ void ComputePerLeafAmbientLighting()
 
 	g_LeafAmbientSamples.SetCount(numleafs);
 
+	BuildNonOpaqueVolumes();
+
 #ifdef MPI
 	if ( g_bUseMPI )
 	{
@@ -1703,26 +1703,42 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 
 	DirectionalSampler_t sampler;
 
-	for ( int d = 0; d < nsamples; d++ )
-	{
-		// determine visibility of skylight
-		// serach back to see if we can hit a sky brush
-		Vector delta;
-		VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, delta );
-		if ( d )
-		{
-			// jitter light source location
-			Vector ofs = sampler.NextValue();
-			ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
-			delta += ofs;
+	// the jittered samples all point nearly the same way, so trace them in pairs as 8 ray packets
+	for ( int d = 0; d < nsamples; d += 2 )
+	{
+		int nBatch = MIN( 2, nsamples - d );
+		FourVectors start4[2];
+		FourVectors delta4[2];
+		for ( int b = 0; b < nBatch; b++ )
+		{
+			// determine visibility of skylight
+			// serach back to see if we can hit a sky brush
+			Vector delta;
+			VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, delta );
+			if ( d + b )
+			{
+				// jitter light source location
+				Vector ofs = sampler.NextValue();
+				ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
+				delta += ofs;
+			}
+			start4[b] = pos;
+			delta4[b].DuplicateVector ( delta );
+			delta4[b] += pos;
 		}
-		FourVectors delta4;
-		delta4.DuplicateVector ( delta );
-		delta4 += pos;
 
-		TestLine_DoesHitSky ( pos, delta4, &fractionVisible, true, static_prop_index_to_ignore );
-
-		totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible );
+		if ( nBatch == 2 )
+		{
+			fltx4 batchFractionVisible[2];
+			TestLine_DoesHitSky8 ( start4, delta4, batchFractionVisible, true, static_prop_index_to_ignore );
+			totalFractionVisible = AddSIMD ( totalFractionVisible, batchFractionVisible[0] );
+			totalFractionVisible = AddSIMD ( totalFractionVisible, batchFractionVisible[1] );
+		}
+		else
+		{
+			TestLine_DoesHitSky ( pos, delta4[0], &fractionVisible, true, static_prop_index_to_ignore );
+			totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible );
+		}
 	}
 
 	fltx4 seeAmount = MulSIMD ( totalFractionVisible, ReplicateX4 ( 1.0f / nsamples ) );
@@ -1762,6 +1778,17 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 		possibleHitCount[i] = Four_Zeros;
 	}
 
+	struct PendingSkySample_t
+	{
+		bool m_bValid;
+		FourVectors m_Start;
+		FourVectors m_Stop;
+		fltx4 m_Dots[NUM_BUMP_VECTS+1];
+	};
+	PendingSkySample_t pendingSamples[8];
+	for ( int i = 0; i < 8; i++ )
+		pendingSamples[i].m_bValid = false;
+
 	DirectionalSampler_t sampler;
 	int nsky_samples = NUMVERTEXNORMALS;
 	if (do_fast || force_fast )
@@ -1809,14 +1836,49 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 		offset *= -flEpsilon;
 		surfacePos -= offset;
 
-		fltx4 fractionVisible = Four_Ones;
-		TestLine_DoesHitSky( surfacePos, delta, &fractionVisible, true, static_prop_index_to_ignore );
+		// hold on to this direction until another one heading into the same octant comes
+		// along, so that the two can be traced as one 8 ray packet
+		Vector dir = anorm.Vec( 0 );
+		int nOctant = ( dir.x < 0 ? 1 : 0 ) | ( dir.y < 0 ? 2 : 0 ) | ( dir.z < 0 ? 4 : 0 );
+		PendingSkySample_t &pending = pendingSamples[nOctant];
+		if ( !pending.m_bValid )
+		{
+			pending.m_bValid = true;
+			pending.m_Start = surfacePos;
+			pending.m_Stop = delta;
+			for ( int i = 0; i < normalCount; i++ )
+				pending.m_Dots[i] = dots[i];
+			continue;
+		}
+		pending.m_bValid = false;
+
+		FourVectors start4[2] = { pending.m_Start, surfacePos };
+		FourVectors stop4[2] = { pending.m_Stop, delta };
+		fltx4 fractionVisible[2];
+		TestLine_DoesHitSky8( start4, stop4, fractionVisible, true, static_prop_index_to_ignore );
 		for ( int i = 0; i < normalCount; i++ )
 		{
-			fltx4 addedAmount = MulSIMD( fractionVisible, dots[i] );
+			fltx4 addedAmount = MulSIMD( fractionVisible[0], pending.m_Dots[i] );
+			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+			addedAmount = MulSIMD( fractionVisible[1], dots[i] );
 			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
 		}
+	}
 
+	// trace whatever didn't find a partner
+	for ( int nOctant = 0; nOctant < 8; nOctant++ )
+	{
+		PendingSkySample_t &pending = pendingSamples[nOctant];
+		if ( !pending.m_bValid )
+			continue;
+
+		fltx4 fractionVisible = Four_Ones;
+		TestLine_DoesHitSky( pending.m_Start, pending.m_Stop, &fractionVisible, true, static_prop_index_to_ignore );
+		for ( int i = 0; i < normalCount; i++ )
+		{
+			fltx4 addedAmount = MulSIMD( fractionVisible, pending.m_Dots[i] );
+			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+		}
 	}
 
 	out.m_flFalloff = Four_Ones;
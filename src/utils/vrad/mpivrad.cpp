@@ -292,13 +292,15 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		pBuf->read(&patchnum, sizeof(patchnum));
 		
 		CPatch * patch = &g_Patches[patchnum];
-		int numtransfers;
+		int numtransfers, transferbytes;
 		pBuf->read( &numtransfers, sizeof(numtransfers) );
+		pBuf->read( &transferbytes, sizeof(transferbytes) );
 		patch->numtransfers = numtransfers;
+		patch->transferbytes = transferbytes;
 		if (numtransfers) 
 		{
-			patch->transfers = new transfer_t[numtransfers];
-			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
+			patch->transfers = AllocTransfers( transferbytes );
+			pBuf->read(patch->transfers, transferbytes);
 		}
 		
 		total_transfer += numtransfers;
@@ -333,7 +335,8 @@ void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 		++pData->m_nPatchesInCluster;
 		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
 		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		pData->m_pVisLeafsMB->write(&patch->transferbytes, sizeof(patch->transferbytes));
+		pData->m_pVisLeafsMB->write( patch->transfers, patch->transferbytes );
 	}
 }
 
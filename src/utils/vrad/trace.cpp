@@ -13,6 +13,7 @@
 #include "trace.h"
 #include "Cmodel.h"
 #include "mathlib/vmatrix.h"
+#include "vstdlib/random.h"
 
 
 //=============================================================================
@@ -349,25 +350,14 @@ void DM_ClipBoxToBrush( CToolTrace *trace, const Vector& mins, const Vector& max
 	}
 }
 
-void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
-	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+//-----------------------------------------------------------------------------
+// Turns the result of tracing 4 rays from start towards stop into the fraction of
+// each that reaches the sky, recursing into the 3D skyboxes for rays that do.
+//-----------------------------------------------------------------------------
+static fltx4 SkyFractionVisible( FourVectors const& start, FourVectors const& stop, fltx4 len,
+	RayTracingResult const &rt_result, CCoverageCountTexture &coverageCallback, bool canRecurse,
+	int static_prop_to_skip, bool bDoDebug )
 {
-	FourRays myrays;
-	myrays.origin = start;
-	myrays.direction = stop;
-	myrays.direction -= myrays.origin;
-	fltx4 len = myrays.direction.length();
-	myrays.direction *= ReciprocalSIMD( len );
-	RayTracingResult rt_result;
-	CCoverageCountTexture coverageCallback;
-
-	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
-
-	if ( bDoDebug )
-	{
-		WriteTrace( "trace.txt", myrays, rt_result );
-	}
-
 	float aOcclusion[4];
 	for ( int i = 0; i < 4; i++ )
 	{
@@ -414,9 +404,10 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 						skystop = dir;
 						skystop *= MAX_TRACE_LENGTH;
 						skystop += skystart;
-						TestLine_DoesHitSky ( skystart, skystop, pFractionVisible, false, static_prop_to_skip, bDoDebug );
+						fltx4 skyFractionVisible;
+						TestLine_DoesHitSky ( skystart, skystop, &skyFractionVisible, false, static_prop_to_skip, bDoDebug );
 						occlusion = AddSIMD ( occlusion, Four_Ones );
-						occlusion = SubSIMD ( occlusion, *pFractionVisible );
+						occlusion = SubSIMD ( occlusion, skyFractionVisible );
 					}
 				}
 			}
@@ -425,9 +416,156 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 
 	occlusion = MaxSIMD( occlusion, Four_Zeros );
 	occlusion = MinSIMD( occlusion, Four_Ones );
-	*pFractionVisible = SubSIMD( Four_Ones, occlusion );
+	return SubSIMD( Four_Ones, occlusion );
+}
+
+void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+{
+	FourRays myrays;
+	myrays.origin = start;
+	myrays.direction = stop;
+	myrays.direction -= myrays.origin;
+	fltx4 len = myrays.direction.length();
+	myrays.direction *= ReciprocalSIMD( len );
+	RayTracingResult rt_result;
+	CCoverageCountTexture coverageCallback;
+
+	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
+
+	if ( bDoDebug )
+	{
+		WriteTrace( "trace.txt", myrays, rt_result );
+	}
+
+	*pFractionVisible = SkyFractionVisible( start, stop, len, rt_result, coverageCallback, canRecurse,
+		static_prop_to_skip, bDoDebug );
 }
 
+//-----------------------------------------------------------------------------
+// Two sets of 4 lines at once, traced as one 8 ray packet. When both sets head
+// into the same octant this uses the AVX2 tracer if the cpu has it.
+//-----------------------------------------------------------------------------
+void TestLine_DoesHitSky8( FourVectors const *pStart, FourVectors const *pStop,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip )
+{
+	EightRays myrays;
+	fltx4 len[2];
+	for ( int h = 0; h < 2; h++ )
+	{
+		FourRays &rays = myrays.m_Rays[h];
+		rays.origin = pStart[h];
+		rays.direction = pStop[h];
+		rays.direction -= rays.origin;
+		len[h] = rays.direction.length();
+		rays.direction *= ReciprocalSIMD( len[h] );
+	}
+	fltx4 tmin[2] = { Four_Zeros, Four_Zeros };
+
+	RayTracingResult8 rt_result;
+	CCoverageCountTexture coverageCallback[2];
+	ITransparentTriangleCallback *pCallbacks[2] = { &coverageCallback[0], &coverageCallback[1] };
+
+	g_RtEnv.Trace8Rays( myrays, tmin, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip,
+		g_bTextureShadows ? pCallbacks : NULL );
+
+	for ( int h = 0; h < 2; h++ )
+	{
+		pFractionVisible[h] = SkyFractionVisible( pStart[h], pStop[h], len[h], rt_result.m_Results[h],
+			coverageCallback[h], canRecurse, static_prop_to_skip, false );
+	}
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Times the SSE and AVX2 tracers against the map's triangle soup (vrad -rtbench).
+// Packets are 8 rays from nearby origins in nearly the same direction, like the
+// ones the sky and sun sampling produce, scattered over the world bounds.
+//-----------------------------------------------------------------------------
+void RayTraceBenchmark( int nPackets )
+{
+	CUniformRandomStream random;
+	random.SetSeed( 1 );
+
+	CUtlVector<EightRays> packets;
+	packets.SetCount( nPackets );
+	Vector vecSize = g_RtEnv.m_MaxBound - g_RtEnv.m_MinBound;
+	for ( int p = 0; p < nPackets; p++ )
+	{
+		Vector origin( g_RtEnv.m_MinBound.x + random.RandomFloat( 0, vecSize.x ),
+			g_RtEnv.m_MinBound.y + random.RandomFloat( 0, vecSize.y ),
+			g_RtEnv.m_MinBound.z + random.RandomFloat( 0, vecSize.z ) );
+		Vector dir( random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ) );
+		VectorNormalize( dir );
+		for ( int h = 0; h < 2; h++ )
+		{
+			FourRays &rays = packets[p].m_Rays[h];
+			for ( int i = 0; i < 4; i++ )
+			{
+				Vector rayOrigin = origin + Vector( random.RandomFloat( -16, 16 ),
+					random.RandomFloat( -16, 16 ), random.RandomFloat( -16, 16 ) );
+				Vector rayDir;
+				for ( int c = 0; c < 3; c++ )
+				{
+					// jitter, keeping every ray in the same octant
+					rayDir[c] = dir[c] + random.RandomFloat( -0.02f, 0.02f );
+					rayDir[c] = ( dir[c] < 0 ) ? -fabs( rayDir[c] ) : fabs( rayDir[c] );
+				}
+				VectorNormalize( rayDir );
+				rays.origin.X( i ) = rayOrigin.x;
+				rays.origin.Y( i ) = rayOrigin.y;
+				rays.origin.Z( i ) = rayOrigin.z;
+				rays.direction.X( i ) = rayDir.x;
+				rays.direction.Y( i ) = rayDir.y;
+				rays.direction.Z( i ) = rayDir.z;
+			}
+		}
+	}
+
+	fltx4 tmin[2] = { Four_Zeros, Four_Zeros };
+	fltx4 tmax[2] = { ReplicateX4( MAX_TRACE_LENGTH ), ReplicateX4( MAX_TRACE_LENGTH ) };
+	CUtlVector<RayTracingResult8> results[2];
+	double flRaysPerSecond[2] = { 0, 0 };
+	bool bWasEnabled = RayTracingEnvironment::IsAVX2TracingEnabled();
+	int nPaths = RayTracingEnvironment::IsAVX2Supported() ? 2 : 1;
+
+	Msg( "Ray-trace benchmark: %d triangles, %d rays per path\n", g_RtEnv.OptimizedTriangleList.Count(), nPackets * 8 );
+	for ( int nPath = 0; nPath < nPaths; nPath++ )
+	{
+		RayTracingEnvironment::EnableAVX2Tracing( nPath != 0 );
+		results[nPath].SetCount( nPackets );
+		double flStart = Plat_FloatTime();
+		for ( int p = 0; p < nPackets; p++ )
+			g_RtEnv.Trace8Rays( packets[p], tmin, tmax, &results[nPath][p] );
+		double flElapsed = MAX( Plat_FloatTime() - flStart, 1.0e-6 );
+		flRaysPerSecond[nPath] = nPackets * 8 / flElapsed;
+		Msg( "  %-5s: %.2f seconds, %.0f rays/sec\n", nPath ? "AVX2" : "SSE", flElapsed, flRaysPerSecond[nPath] );
+	}
+	RayTracingEnvironment::EnableAVX2Tracing( bWasEnabled );
+
+	if ( nPaths == 1 )
+	{
+		Msg( "  AVX2 : not supported by this cpu\n" );
+		return;
+	}
+
+	int nMismatches = 0;
+	for ( int p = 0; p < nPackets; p++ )
+	{
+		for ( int h = 0; h < 2; h++ )
+		{
+			RayTracingResult const &a = results[0][p].m_Results[h];
+			RayTracingResult const &b = results[1][p].m_Results[h];
+			for ( int i = 0; i < 4; i++ )
+			{
+				if ( a.HitIds[i] != b.HitIds[i] || SubFloat( a.HitDistance, i ) != SubFloat( b.HitDistance, i ) )
+					nMismatches++;
+			}
+		}
+	}
+	Msg( "  speedup %.2fx, %d mismatched rays\n", flRaysPerSecond[1] / flRaysPerSecond[0], nMismatches );
+}
 
 
 //-----------------------------------------------------------------------------
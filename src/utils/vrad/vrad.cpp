@@ -57,6 +57,9 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bRtBuildStats = false;
+bool		g_bRtCache = false;
+int			g_nRtBenchPackets = 0;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -80,6 +83,7 @@ char		level_lights[MAX_PATH] = "";
 
 char		vismatfile[_MAX_PATH] = "";
 char		incrementfile[_MAX_PATH] = "";
+char		rtcachefile[_MAX_PATH] = "";
 
 IIncremental *g_pIncremental = 0;
 bool		g_bInterrupt = false;	// Wsed with background lighting in WC. Tells VRAD
@@ -1199,11 +1203,62 @@ void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: The packed transfer lists are carved out of large blocks instead of
+//			being allocated per patch. They live until the process exits.
+//-----------------------------------------------------------------------------
+#define TRANSFER_BLOCK_SIZE		(4*1024*1024)
+
+static CUtlVector<byte*> s_TransferBlocks;
+static int s_nTransferBlockUsed = TRANSFER_BLOCK_SIZE;
+int64 total_transfer_bytes;
+
+byte *AllocTransfers( int nBytes )
+{
+	byte *pTransfers;
+
+	ThreadLock ();
+	if ( nBytes > TRANSFER_BLOCK_SIZE / 4 )
+	{
+		// big lists get a block of their own so they don't waste the rest of the current one
+		pTransfers = (byte *)malloc( nBytes );
+		if ( pTransfers )
+			s_TransferBlocks.AddToHead( pTransfers );
+	}
+	else
+	{
+		if ( s_nTransferBlockUsed + nBytes > TRANSFER_BLOCK_SIZE )
+		{
+			s_TransferBlocks.AddToTail( (byte *)malloc( TRANSFER_BLOCK_SIZE ) );
+			s_nTransferBlockUsed = 0;
+		}
+		pTransfers = s_TransferBlocks.Tail();
+		if ( pTransfers )
+		{
+			pTransfers += s_nTransferBlockUsed;
+			s_nTransferBlockUsed += nBytes;
+		}
+	}
+	total_transfer_bytes += nBytes;
+	ThreadUnlock ();
+
+	if ( !pTransfers )
+		Error ("Memory allocation failure");
+	return pTransfers;
+}
+
+
+static int CompareTransferPatch( const void *a, const void *b )
+{
+	return ((const transfer_t *)a)->patch - ((const transfer_t *)b)->patch;
+}
+
+
 void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 {
 	int		j;
 	float	total;
-	transfer_t	*t, *t2;
+	transfer_t	*t2;
 	total = 0;
 
 	if( ndxPatch == g_Patches.InvalidIndex() )
@@ -1218,11 +1273,6 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 			max_transfer = patch->numtransfers;
 		}
 
-
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
-
 		// get total transfer energy
 		t2 = all_transfers;
 
@@ -1238,13 +1288,41 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else	
 			total = 1.0f/M_PI;
 
-		t = patch->transfers;
+		// sorted lists delta code well and GatherLight walks the patches in memory order
+		qsort( all_transfers, patch->numtransfers, sizeof( transfer_t ), CompareTransferPatch );
+
+		int nBytes = 0;
+		int prevPatch = 0;
+		t2 = all_transfers;
+		for (j=0 ; j<patch->numtransfers ; j++, t2++)
+		{
+			unsigned int delta = t2->patch - prevPatch;
+			prevPatch = t2->patch;
+			nBytes += 3;
+			while ( delta >= 0x80 )
+			{
+				nBytes++;
+				delta >>= 7;
+			}
+		}
+
+		patch->transferbytes = nBytes;
+		patch->transfers = AllocTransfers( nBytes );
+
+		// carry the quantization error along so the list still sums to the same energy
+		float carry = 0.0f;
+		byte *pOut = patch->transfers;
+		prevPatch = 0;
 		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+		for (j=0 ; j<patch->numtransfers ; j++, t2++)
 		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
+			float flTransfer = t2->transfer*total + carry;
+			pOut = EncodeTransfer( pOut, t2->patch - prevPatch, flTransfer );
+			carry = flTransfer - DequantizeTransfer( QuantizeTransfer( flTransfer ) );
+			prevPatch = t2->patch;
 		}
+		Assert( pOut == patch->transfers + nBytes );
+
 		if (patch->numtransfers > max_transfer)
 		{
 			max_transfer = patch->numtransfers;
@@ -1535,7 +1613,7 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
-	transfer_t	*trans;
+	const byte	*trans;
 	int			num;
 	CPatch		*patch;
 	Vector		sum, v;
@@ -1589,9 +1667,12 @@ void GatherLight (int threadnum, void *pUserData)
 			}
 
 			float dot;
-			for (k=0 ; k<num ; k++, trans++)
+			int ndxPatch2 = 0;
+			float transfer;
+			for (k=0 ; k<num ; k++)
 			{
-				CPatch *patch2 = &g_Patches[trans->patch];
+				trans = DecodeTransfer( trans, ndxPatch2, transfer );
+				CPatch *patch2 = &g_Patches[ndxPatch2];
 
 				// get vector to other patch
 				VectorSubtract (patch2->origin, patch->origin, delta);
@@ -1599,11 +1680,11 @@ void GatherLight (int threadnum, void *pUserData)
 				// find light emitted from other patch
 				for(i=0; i<3; i++)
 				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
+					v[i] = emitlight[ndxPatch2][i] * patch2->reflectivity[i];
 				}
 				// remove normal already factored into transfer steradian
 				float scale = 1.0f / DotProduct (delta, patch->normal);
-				VectorScale( v, trans->transfer * scale, v );
+				VectorScale( v, transfer * scale, v );
 				
 				Vector bumpTransfer;
 				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
@@ -1626,13 +1707,16 @@ void GatherLight (int threadnum, void *pUserData)
 		else
 		{
 			VectorFill( sum, 0 );
-			for (k=0 ; k<num ; k++, trans++)
+			int ndxPatch2 = 0;
+			float transfer;
+			for (k=0 ; k<num ; k++)
 			{
+				trans = DecodeTransfer( trans, ndxPatch2, transfer );
 				for(i=0; i<3; i++)
 				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					v[i] = emitlight[ndxPatch2][i] * g_Patches[ndxPatch2].reflectivity[i];
 				}
-				VectorScale( v, trans->transfer, v );
+				VectorScale( v, transfer, v );
 				VectorAdd( sum, v, sum );
 			}
 			VectorCopy( sum, addlight[j].light[0] );
@@ -1932,7 +2016,8 @@ void MakeAllScales (void)
 
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf ("transfer lists: %5.1f megs\n"
+	qprintf ("transfer lists: %5.1f megs (%5.1f megs unpacked)\n"
+		, (float)total_transfer_bytes / (1024*1024)
 		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
 }
 
@@ -2188,6 +2273,8 @@ void VRAD_LoadBSP( char const *pFilename )
 
 	strcpy(incrementfile, source);
 	Q_DefaultExtension(incrementfile, ".r0", sizeof(incrementfile));
+	strcpy(rtcachefile, source);
+	Q_DefaultExtension(rtcachefile, ".rtcache", sizeof(rtcachefile));
 	Q_DefaultExtension(source, ".bsp", sizeof( source ));
 
 	Msg( "Loading %s\n", source );
@@ -2282,12 +2369,44 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
-	// Build acceleration structure
-	printf ( "Setting up ray-trace acceleration structure... ");
+	// Build acceleration structure, or reload the one built last time if the shadow
+	// casting geometry hasn't changed
+	bool bUseRtCache = g_bRtCache;
+#ifdef MPI
+	if ( g_bUseMPI )
+		bUseRtCache = false;
+#endif
+	uint32 nGeometryHash = bUseRtCache ? g_RtEnv.CalculateGeometryHash() : 0;
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
-	float end = Plat_FloatTime();
-	printf ( "Done (%.2f seconds)\n", end-start );
+	if ( bUseRtCache && g_RtEnv.LoadAccelerationStructure( rtcachefile, nGeometryHash ) )
+	{
+		printf ( "Loaded ray-trace acceleration structure from %s (%.2f seconds)\n", rtcachefile, Plat_FloatTime()-start );
+	}
+	else
+	{
+		printf ( "Setting up ray-trace acceleration structure... ");
+		g_RtEnv.m_nBuildThreads = numthreads;
+		g_RtEnv.SetupAccelerationStructure();
+		float end = Plat_FloatTime();
+		printf ( "Done (%.2f seconds)\n", end-start );
+
+		if ( bUseRtCache )
+			g_RtEnv.SaveAccelerationStructure( rtcachefile, nGeometryHash );
+	}
+
+	if ( g_bRtBuildStats )
+	{
+		const RayTraceBuildStats_t &stats = g_RtEnv.m_BuildStats;
+		Msg( "kd-tree build: %.3f seconds on %d thread(s)\n", stats.m_flBuildTime, stats.m_nBuildThreads );
+		Msg( "  triangles  : %d (%d references, %.2f per triangle)\n", g_RtEnv.OptimizedTriangleList.Count(),
+			stats.m_nTriangleRefs, stats.m_nTriangleRefs / (float)MAX( 1, g_RtEnv.OptimizedTriangleList.Count() ) );
+		Msg( "  nodes      : %d (%d leaves, %d empty), max depth %d\n", stats.m_nNodes, stats.m_nLeaves,
+			stats.m_nEmptyLeaves, stats.m_nMaxDepth );
+		Msg( "  SAH cost   : %.1f per ray\n", stats.m_flExpectedCost );
+	}
+
+	if ( g_nRtBenchPackets > 0 )
+		RayTraceBenchmark( g_nRtBenchPackets );
 
 #if 0  // To test only k-d build
 	exit(0);
@@ -2432,6 +2551,24 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpRtEnv = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-rtbuildstats" ) )
+		{
+			g_bRtBuildStats = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtcache" ) )
+		{
+			g_bRtCache = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtbench" ) )
+		{
+			g_nRtBenchPackets = 125000;
+			if ( i + 1 < argc && isdigit( argv[i + 1][0] ) )
+				g_nRtBenchPackets = MAX( 1, atoi( argv[++i] ) / 8 );
+		}
+		else if ( !Q_stricmp( argv[i], "-noavx2" ) )
+		{
+			RayTracingEnvironment::EnableAVX2Tracing( false );
+		}
 		else if ( !Q_stricmp( argv[i], "-LargeDispSampleRadius" ) )
 		{
 			g_bLargeDispSampleRadius = true;
@@ -2565,6 +2702,10 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-numa" ) )
+		{
+			g_bNumaPinThreads = true;
+		}
 		else if( !Q_stricmp( argv[i], "-loghash" ) )
 		{
 			g_bLogHashData = true;
@@ -2823,6 +2964,7 @@ void PrintUsage( int argc, char **argv )
 		"  -final          : High quality processing. equivalent to -extrasky 16.\n"
 		"  -extrasky n     : trace N times as many rays for indirect light and sky ambient.\n"
 		"  -low            : Run as an idle-priority process.\n"
+		"  -numa           : Pin worker threads round-robin to NUMA nodes.\n"
 #ifdef MPI
 		"  -mpi            : Use VMPI to distribute computations.\n"
 #endif
@@ -2836,6 +2978,11 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -rtbuildstats   : Report ray-trace kd-tree build time, node count and SAH cost.\n"
+		"  -rtcache        : Save the ray-trace kd-tree to <mapname>.rtcache and reuse it\n"
+		"                    on later runs while the shadow casting geometry is unchanged.\n"
+		"  -rtbench [rays] : Time the SSE and AVX2 ray tracers on this map (default 1M rays).\n"
+		"  -noavx2         : Trace with 4-wide SSE even if the cpu supports AVX2.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
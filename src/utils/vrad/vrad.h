@@ -112,6 +112,59 @@ struct transfer_t
 	float	transfer;
 };
 
+// MakeScales stores each patch's transfers sorted by patch index and packed into a
+// byte stream: the delta from the previous patch index as a 7 bit varint, then the
+// transfer as the top 16 bits of its float (sign bit dropped, 8 bits of mantissa).
+// A typical transfer takes 3 or 4 bytes instead of sizeof(transfer_t).
+inline unsigned short QuantizeTransfer( float flTransfer )
+{
+	if ( flTransfer <= 0.0f )
+		return 0;
+	unsigned int bits = *(unsigned int *)&flTransfer;
+	bits += 1 << 14;	// round to nearest
+	return (unsigned short)( bits >> 15 );
+}
+
+inline float DequantizeTransfer( unsigned short nTransfer )
+{
+	unsigned int bits = (unsigned int)nTransfer << 15;
+	return *(float *)&bits;
+}
+
+inline byte *EncodeTransfer( byte *pOut, int nPatchDelta, float flTransfer )
+{
+	unsigned int delta = nPatchDelta;
+	while ( delta >= 0x80 )
+	{
+		*pOut++ = (byte)( delta | 0x80 );
+		delta >>= 7;
+	}
+	*pOut++ = (byte)delta;
+
+	unsigned short nTransfer = QuantizeTransfer( flTransfer );
+	*pOut++ = (byte)( nTransfer & 0xff );
+	*pOut++ = (byte)( nTransfer >> 8 );
+	return pOut;
+}
+
+// Advances nPatch to the next patch in the list and returns its transfer
+inline const byte *DecodeTransfer( const byte *pIn, int &nPatch, float &flTransfer )
+{
+	unsigned int delta = 0;
+	int shift = 0;
+	byte b;
+	do
+	{
+		b = *pIn++;
+		delta |= (unsigned int)( b & 0x7f ) << shift;
+		shift += 7;
+	} while ( b & 0x80 );
+	nPatch += delta;
+
+	flTransfer = DequantizeTransfer( (unsigned short)( pIn[0] | ( pIn[1] << 8 ) ) );
+	return pIn + 2;
+}
+
 
 struct LightingValue_t
 {
@@ -237,7 +290,8 @@ struct CPatch
 //	struct		patch_s		*nextclusterchild;		// next terminal child in cluster
 
 	int			numtransfers;
-	transfer_t	*transfers;
+	int			transferbytes;			// size of the packed transfer list
+	byte		*transfers;				// see EncodeTransfer
 
 	short		indices[3];				// displacement use these for subdivision
 };
@@ -390,6 +444,13 @@ void TestLine( FourVectors const& start, FourVectors const& stop, fltx4 *pFracti
 void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1, bool bDoDebug = false );
 
+// same as above for two sets of 4 lines at once, using the 8-wide tracer when it can
+void TestLine_DoesHitSky8( FourVectors const *pStart, FourVectors const *pStop,
+                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1 );
+
+// times the SSE and AVX2 ray tracers on the loaded map
+void RayTraceBenchmark( int nPackets );
+
 // converts any marked brush entities to triangles for shadow casting
 void ExtractBrushEntityShadowCasters ( void );
 void AddBrushesForRayTrace ( void );
@@ -400,6 +461,7 @@ void GetPhongNormal( int facenum, Vector const& spot, Vector& phongnormal );
 int LightForString( char *pLight, Vector& intensity );
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers );
 void MakeScales( int ndxPatch, transfer_t *all_transfers );
+byte *AllocTransfers( int nBytes );
 
 // Run startup code like initialize mathlib.
 void VRAD_Init();
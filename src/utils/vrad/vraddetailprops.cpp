@@ -576,10 +576,12 @@ bool CastRayInLeaf( int iThread, const Vector &start, const Vector &end, int lea
 // Computes ambient lighting along a specified ray.  
 // Ray represents a cone, tanTheta is the tan of the inner cone angle
 //-----------------------------------------------------------------------------
-void CalcRayAmbientLighting( int iThread, const Vector &vStart, const Vector &vEnd, float tanTheta, Vector color[MAX_LIGHTSTYLES] )
+void CalcRayAmbientLighting( int iThread, const Vector &vStart, const Vector &vEnd, float tanTheta, Vector color[MAX_LIGHTSTYLES], float flStartFrac )
 {
+	Vector vDelta = vEnd - vStart;
+
 	Ray_t ray;
-	ray.Init( vStart, vEnd, vec3_origin, vec3_origin );
+	ray.Init( vStart + vDelta * flStartFrac, vEnd, vec3_origin, vec3_origin );
 
 	directlight_t *pSkyLight = FindAmbientSkyLight();
 
@@ -588,7 +590,7 @@ void CalcRayAmbientLighting( int iThread, const Vector &vStart, const Vector &vE
 		return;
 
 	// compute the approximate radius of a circle centered around the intersection point
-	float dist = ray.m_Delta.Length() * tanTheta * surfEnum.m_HitFrac;
+	float dist = vDelta.Length() * tanTheta * ( flStartFrac + ( 1.0f - flStartFrac ) * surfEnum.m_HitFrac );
 
 	// until 20" we use the point sample, then blend in the average until we're covering 40"
 	// This is attempting to model the ray as a cone - in the ideal case we'd simply sample all
@@ -23,7 +23,9 @@ void CalcRayAmbientLighting(
 	const Vector &vStart,
 	const Vector &vEnd,
 	float tanTheta,			// tangent of the inner angle of the cone
-	Vector color[MAX_LIGHTSTYLES]	// The color contribution from each lightstyle.
+	Vector color[MAX_LIGHTSTYLES],	// The color contribution from each lightstyle.
+	float flStartFrac = 0.0f	// Only look for surfaces past this fraction of the ray, for callers
+							// that already know nothing can be hit before it
 	);
 
 bool CastRayInLeaf( int iThread, const Vector &start, const Vector &end, int leafIndex, float *pFraction, Vector *pNormal );
@@ -7,6 +7,8 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include "threads.h"
+#include "mathlib/ssemath.h"
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
@@ -72,42 +74,92 @@ void CheckStack (leaf_t *leaf, threaddata_t *thread)
 }
 
 
-winding_t *AllocStackWinding (pstack_t *stack)
+static windingarena_t	g_WindingArenas[MAX_TOOL_THREADS+1];
+
+winding_t *AllocStackWinding (threaddata_t *thread)
 {
-	int		i;
+	windingarena_t	*arena = thread->arena;
+	int				index = arena->top++;
+	int				block = index / WINDING_ARENA_BLOCK;
 
-	for (i=0 ; i<3 ; i++)
+	if (block == arena->blocks.Count())
 	{
-		if (stack->freewindings[i])
-		{
-			stack->freewindings[i] = 0;
-			return &stack->windings[i];
-		}
+		arena->blocks.AddToTail( (winding_t *)malloc( WINDING_ARENA_BLOCK * sizeof(winding_t) ) );
 	}
 
-	Error ("Out of memory. AllocStackWinding: failed");
+	thread->lastwinding = &arena->blocks[block][index % WINDING_ARENA_BLOCK];
+	return thread->lastwinding;
+}
+
+/*
+==============
+SIMD windings
+
+Winding points transposed four at a time so a whole winding can be tested
+against a plane with fltx4 ops. The unused lanes of the last group repeat the
+last point and are masked off by ClassifySIMDWinding.
+==============
+*/
+struct simdwinding_t
+{
+	int			numpoints;
+	int			numgroups;
+	FourVectors	points[(MAX_POINTS_ON_WINDING+3)/4];
+};
+
+static void LoadSIMDWinding (const winding_t *w, simdwinding_t *out)
+{
+	int		i, j, last;
 
-	return NULL;
+	last = w->numpoints - 1;
+	out->numpoints = w->numpoints;
+	out->numgroups = (w->numpoints + 3) >> 2;
+	for (i=0, j=0 ; i<out->numgroups ; i++, j+=4)
+	{
+		out->points[i].LoadAndSwizzle (w->points[j], w->points[MIN(j+1, last)],
+			w->points[MIN(j+2, last)], w->points[MIN(j+3, last)]);
+	}
 }
 
-void FreeStackWinding (winding_t *w, pstack_t *stack)
+// Sets a bit in front for each point more than ON_VIS_EPSILON in front of the
+// plane and in back for each point more than ON_VIS_EPSILON behind it.
+// If dists is non-NULL it gets the point distances, padded to a multiple of 4.
+static void ClassifySIMDWinding (const simdwinding_t *w, const plane_t *plane, uint64 &front, uint64 &back, vec_t *dists)
 {
 	int		i;
+	fltx4	nx, ny, nz, dist, epsilon, negepsilon, d;
 
-	i = w - stack->windings;
+	nx = ReplicateX4 (plane->normal[0]);
+	ny = ReplicateX4 (plane->normal[1]);
+	nz = ReplicateX4 (plane->normal[2]);
+	dist = ReplicateX4 (plane->dist);
+	epsilon = ReplicateX4 (ON_VIS_EPSILON);
+	negepsilon = ReplicateX4 (-ON_VIS_EPSILON);
 
-	if (i<0 || i>2)
-		return;		// not from local
+	front = back = 0;
+	for (i=0 ; i<w->numgroups ; i++)
+	{
+		const FourVectors &p = w->points[i];
+		d = AddSIMD (AddSIMD (MulSIMD (p.x, nx), MulSIMD (p.y, ny)), MulSIMD (p.z, nz));
+		d = SubSIMD (d, dist);
+		if (dists)
+			StoreUnalignedSIMD (dists + i*4, d);
+		front |= (uint64)TestSignSIMD (CmpGtSIMD (d, epsilon)) << (i*4);
+		back |= (uint64)TestSignSIMD (CmpLtSIMD (d, negepsilon)) << (i*4);
+	}
 
-	if (stack->freewindings[i])
-		Error ("FreeStackWinding: allready free");
-	stack->freewindings[i] = 1;
+	uint64 valid = (w->numpoints >= 64) ? ~(uint64)0 : (((uint64)1 << w->numpoints) - 1);
+	front &= valid;
+	back &= valid;
 }
 
 /*
 ==============
 ChopWinding
 
+The result comes from the thread's winding arena. If in was the last winding
+allocated at this recursion level it is reused, since nothing else can be
+pointing at it.
 ==============
 */
 
@@ -115,48 +167,43 @@ ChopWinding
 #pragma warning (disable:4701)
 #endif
 
-winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
+winding_t	*ChopWinding (winding_t *in, threaddata_t *thread, plane_t *split)
 {
-	vec_t	dists[128];
-	int		sides[128];
-	int		counts[3];
+	vec_t	dists[MAX_POINTS_ON_WINDING+4];
+	int		sides[MAX_POINTS_ON_WINDING+4];
+	uint64	front, back;
 	vec_t	dot;
 	int		i, j;
 	Vector	mid;
 	winding_t	*neww;
-
-	counts[0] = counts[1] = counts[2] = 0;
+	winding_t	chopped;
+	simdwinding_t	simd;
 
 // determine sides for each point
+	LoadSIMDWinding (in, &simd);
+	ClassifySIMDWinding (&simd, split, front, back, dists);
+
+	if (!back)
+		return in;		// completely on front side
+	
+	if (!front)
+		return NULL;
+
 	for (i=0 ; i<in->numpoints ; i++)
 	{
-		dot = DotProduct (in->points[i], split->normal);
-		dot -= split->dist;
-		dists[i] = dot;
-		if (dot > ON_VIS_EPSILON)
+		uint64 bit = (uint64)1 << i;
+		if (front & bit)
 			sides[i] = SIDE_FRONT;
-		else if (dot < -ON_VIS_EPSILON)
+		else if (back & bit)
 			sides[i] = SIDE_BACK;
 		else
-		{
 			sides[i] = SIDE_ON;
-		}
-		counts[sides[i]]++;
-	}
-
-	if (!counts[1])
-		return in;		// completely on front side
-	
-	if (!counts[0])
-	{
-		FreeStackWinding (in, stack);
-		return NULL;
 	}
 
 	sides[i] = sides[0];
 	dists[i] = dists[0];
 	
-	neww = AllocStackWinding (stack);
+	neww = &chopped;
 
 	neww->numpoints = 0;
 
@@ -166,7 +213,6 @@ winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 
 		if (neww->numpoints == MAX_POINTS_ON_FIXED_WINDING)
 		{
-			FreeStackWinding (neww, stack);
 			return in;		// can't chop -- fall back to original
 		}
 
@@ -188,7 +234,6 @@ winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 			
 		if (neww->numpoints == MAX_POINTS_ON_FIXED_WINDING)
 		{
-			FreeStackWinding (neww, stack);
 			return in;		// can't chop -- fall back to original
 		}
 
@@ -210,8 +255,15 @@ winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 		neww->numpoints++;
 	}
 	
-// free the original winding
-	FreeStackWinding (in, stack);
+// the result was built on the stack, move it into the arena
+	if (in == thread->lastwinding)
+		neww = in;
+	else
+		neww = AllocStackWinding (thread);
+
+	neww->original = false;
+	neww->numpoints = chopped.numpoints;
+	memcpy (neww->points, chopped.points, chopped.numpoints * sizeof(Vector));
 	
 	return neww;
 }
@@ -234,137 +286,140 @@ If target is totally clipped away, that portal can not be seen through.
 Normal clip keeps target on the same side as pass, which is correct if the
 order goes source, pass, target.  If the order goes pass, source, target then
 flipclip should be set.
+
+The candidates from one source edge are built and tested four pass points at
+a time, one plane per SIMD lane, and the planes that survive clip the target
+in the same order the point-by-point version found them.
 ==============
 */
-winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *target, bool flipclip, pstack_t *stack)
+winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *target, bool flipclip, threaddata_t *thread)
 {
-	int			i, j, k, l;
+	int			i, j, k, l, lane;
+	int			valid, front, skip;
 	plane_t		plane;
-	Vector		v1, v2;
-	float		d;
-	vec_t		length;
-	int			counts[3];
-	bool		fliptest;
+	Vector		edge;
+	FourVectors	v1, v2, normal;
+	fltx4		length, dist, d, pos, neg, flip, settled;
+	fltx4		epsilon, negepsilon;
+	simdwinding_t	simdpass;
+	FourVectors	sourcepoints[MAX_POINTS_ON_WINDING];
+	FourVectors	passpoints[MAX_POINTS_ON_WINDING];
+
+	epsilon = ReplicateX4 (ON_VIS_EPSILON);
+	negepsilon = ReplicateX4 (-ON_VIS_EPSILON);
+
+	LoadSIMDWinding (pass, &simdpass);
+	for (k=0 ; k<source->numpoints ; k++)
+		sourcepoints[k].DuplicateVector (source->points[k]);
+	for (k=0 ; k<pass->numpoints ; k++)
+		passpoints[k].DuplicateVector (pass->points[k]);
 
 // check all combinations	
 	for (i=0 ; i<source->numpoints ; i++)
 	{
 		l = (i+1)%source->numpoints;
-		VectorSubtract (source->points[l] , source->points[i], v1);
+		VectorSubtract (source->points[l] , source->points[i], edge);
+		v1.DuplicateVector (edge);
 
 	// fing a vertex of pass that makes a plane that puts all of the
 	// vertexes of pass on the front side and all of the vertexes of
 	// source on the back side
-		for (j=0 ; j<pass->numpoints ; j++)
+		for (j=0 ; j<pass->numpoints ; j+=4)
 		{
-			VectorSubtract (pass->points[j], source->points[i], v2);
+			v2 = simdpass.points[j>>2];
+			v2 -= sourcepoints[i];
+
+			normal.x = SubSIMD (MulSIMD (v1.y, v2.z), MulSIMD (v1.z, v2.y));
+			normal.y = SubSIMD (MulSIMD (v1.z, v2.x), MulSIMD (v1.x, v2.z));
+			normal.z = SubSIMD (MulSIMD (v1.x, v2.y), MulSIMD (v1.y, v2.x));
 
-			plane.normal[0] = v1[1]*v2[2] - v1[2]*v2[1];
-			plane.normal[1] = v1[2]*v2[0] - v1[0]*v2[2];
-			plane.normal[2] = v1[0]*v2[1] - v1[1]*v2[0];
-			
 		// if points don't make a valid plane, skip it
 
-			length = plane.normal[0] * plane.normal[0]
-			+ plane.normal[1] * plane.normal[1]
-			+ plane.normal[2] * plane.normal[2];
-			
-			if (length < ON_VIS_EPSILON)
+			length = normal * normal;
+			valid = TestSignSIMD (CmpGeSIMD (length, epsilon)) & ((1 << MIN(4, pass->numpoints - j)) - 1);
+			if (!valid)
 				continue;
 
-			length = 1/sqrt(length);
-			
-			plane.normal[0] *= length;
-			plane.normal[1] *= length;
-			plane.normal[2] *= length;
-
-			plane.dist = DotProduct (pass->points[j], plane.normal);
+		// normalize with the scalar 1/sqrt, so the planes round exactly as they always have
+			for (lane=0 ; lane<4 ; lane++)
+			{
+				vec_t	lanelength = SubFloat (length, lane);
+				SubFloat (length, lane) = (valid & (1 << lane)) ? 1/sqrt(lanelength) : 0;
+			}
+			normal *= length;
+			dist = simdpass.points[j>>2] * normal;
 
 		//
 		// find out which side of the generated seperating plane has the
-		// source portal
+		// source portal: the first source point off the plane decides
 		//
-#if 1
-			fliptest = false;
+			settled = flip = Four_Zeros;
 			for (k=0 ; k<source->numpoints ; k++)
 			{
 				if (k == i || k == l)
 					continue;
-				d = DotProduct (source->points[k], plane.normal) - plane.dist;
-				if (d < -ON_VIS_EPSILON)
-				{	// source is on the negative side, so we want all
-					// pass and target on the positive side
-					fliptest = false;
-					break;
-				}
-				else if (d > ON_VIS_EPSILON)
-				{	// source is on the positive side, so we want all
-					// pass and target on the negative side
-					fliptest = true;
+				d = SubSIMD (sourcepoints[k] * normal, dist);
+				pos = CmpGtSIMD (d, epsilon);
+				neg = CmpLtSIMD (d, negepsilon);
+				flip = OrSIMD (flip, AndNotSIMD (settled, pos));
+				settled = OrSIMD (settled, OrSIMD (pos, neg));
+				if ((TestSignSIMD (settled) & valid) == valid)
 					break;
-				}
 			}
-			if (k == source->numpoints)
-				continue;		// planar with source portal
-#else
-			fliptest = flipclip;
-#endif
+			valid &= TestSignSIMD (settled);		// drop planes planar with source portal
+			if (!valid)
+				continue;
+
 		//
 		// flip the normal if the source portal is backwards
 		//
-			if (fliptest)
-			{
-				VectorSubtract (vec3_origin, plane.normal, plane.normal);
-				plane.dist = -plane.dist;
-			}
-#if 1
+			normal.x = MaskedAssign (flip, NegSIMD (normal.x), normal.x);
+			normal.y = MaskedAssign (flip, NegSIMD (normal.y), normal.y);
+			normal.z = MaskedAssign (flip, NegSIMD (normal.z), normal.z);
+			dist = MaskedAssign (flip, NegSIMD (dist), dist);
+
 		//
 		// if all of the pass portal points are now on the positive side,
 		// this is the seperating plane
 		//
-			counts[0] = counts[1] = counts[2] = 0;
-			for (k=0 ; k<pass->numpoints ; k++)
+			front = 0;
+			for (k=0 ; k<pass->numpoints && valid ; k++)
 			{
-				if (k==j)
-					continue;
-				d = DotProduct (pass->points[k], plane.normal) - plane.dist;
-				if (d < -ON_VIS_EPSILON)
-					break;
-				else if (d > ON_VIS_EPSILON)
-					counts[0]++;
-				else
-					counts[2]++;
+				// a plane's own pass point is on it by construction
+				skip = (k >= j && k < j+4) ? ~(1 << (k-j)) : ~0;
+				d = SubSIMD (passpoints[k] * normal, dist);
+				valid &= ~(TestSignSIMD (CmpLtSIMD (d, negepsilon)) & skip);
+				front |= TestSignSIMD (CmpGtSIMD (d, epsilon)) & skip;
 			}
-			if (k != pass->numpoints)
-				continue;	// points on negative side, not a seperating plane
-				
-			if (!counts[0])
-				continue;	// planar with seperating plane
-#else
-			k = (j+1)%pass->numpoints;
-			d = DotProduct (pass->points[k], plane.normal) - plane.dist;
-			if (d < -ON_VIS_EPSILON)
+			valid &= front;		// drop points on negative side and planar with seperating plane
+			if (!valid)
 				continue;
-			k = (j+pass->numpoints-1)%pass->numpoints;
-			d = DotProduct (pass->points[k], plane.normal) - plane.dist;
-			if (d < -ON_VIS_EPSILON)
-				continue;			
-#endif
+
 		//
 		// flip the normal if we want the back side
 		//
 			if (flipclip)
 			{
-				VectorSubtract (vec3_origin, plane.normal, plane.normal);
-				plane.dist = -plane.dist;
+				normal.x = NegSIMD (normal.x);
+				normal.y = NegSIMD (normal.y);
+				normal.z = NegSIMD (normal.z);
+				dist = NegSIMD (dist);
 			}
 			
 		//
-		// clip target by the seperating plane
+		// clip target by the seperating planes
 		//
-			target = ChopWinding (target, stack, &plane);
-			if (!target)
-				return NULL;		// target is not visible
+			for (lane=0 ; lane<4 ; lane++)
+			{
+				if (!(valid & (1 << lane)))
+					continue;
+
+				plane.normal.Init (SubFloat (normal.x, lane), SubFloat (normal.y, lane), SubFloat (normal.z, lane));
+				plane.dist = SubFloat (dist, lane);
+				target = ChopWinding (target, thread, &plane);
+				if (!target)
+					return NULL;		// target is not visible
+			}
 
 			// JAY: End the loop, no need to find additional separators on this edge ?
 //			j = pass->numpoints;
@@ -486,6 +541,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	int			i, j;
 	long		*test, *might, *vis, more;
 	int			pnum;
+	int			mark;
 
 #ifdef MPI
 	// Early-out if we're a VMPI worker that's told to exit. If we don't do this here, then the
@@ -512,6 +568,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 
 	might = (long *)stack.mightsee;
 	vis = (long *)thread->base->portalvis;
+	mark = thread->arena->top;
 	
 	// check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count() ; i++)
@@ -554,9 +611,10 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		
 		stack.portal = p;
 		stack.next = NULL;
-		stack.freewindings[0] = 1;
-		stack.freewindings[1] = 1;
-		stack.freewindings[2] = 1;
+
+		// release whatever the previous portal clipped at this level
+		thread->arena->top = mark;
+		thread->lastwinding = NULL;
 		
 		float d = DotProduct (p->origin, thread->pstack_head.portalplane.normal);
 		d -= thread->pstack_head.portalplane.dist;
@@ -570,7 +628,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		}
 		else	
 		{
-			stack.pass = ChopWinding (p->winding, &stack, &thread->pstack_head.portalplane);
+			stack.pass = ChopWinding (p->winding, thread, &thread->pstack_head.portalplane);
 			if (!stack.pass)
 				continue;
 		}
@@ -588,7 +646,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		}
 		else	
 		{
-			stack.source = ChopWinding (prevstack->source, &stack, &backplane);
+			stack.source = ChopWinding (prevstack->source, thread, &backplane);
 			if (!stack.source)
 				continue;
 		}
@@ -604,11 +662,11 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 			continue;
 		}
 
-		stack.pass = ClipToSeperators (stack.source, prevstack->pass, stack.pass, false, &stack);
+		stack.pass = ClipToSeperators (stack.source, prevstack->pass, stack.pass, false, thread);
 		if (!stack.pass)
 			continue;
 		
-		stack.pass = ClipToSeperators (prevstack->pass, stack.source, stack.pass, true, &stack);
+		stack.pass = ClipToSeperators (prevstack->pass, stack.source, stack.pass, true, thread);
 		if (!stack.pass)
 			continue;
 
@@ -618,6 +676,8 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		// flow through it for real
 		RecursiveLeafFlow (p->leaf, thread, &stack);
 	}	
+
+	thread->arena->top = mark;
 }
 
 
@@ -636,12 +696,16 @@ void PortalFlow (int iThread, int portalnum)
 	int				c_might, c_can;
 
 	p = sorted_portals[portalnum];
+	if (p->status == stat_done)
+		return;		// reused from the vis cache
 	p->status = stat_working;
 				
 	c_might = CountBits (p->portalflood, g_numportals*2);
 
 	memset (&data, 0, sizeof(data));
 	data.base = p;
+	data.arena = &g_WindingArenas[iThread];
+	data.arena->top = 0;
 	
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
@@ -73,16 +73,26 @@ struct pstack_t
 	winding_t	*source;
 	winding_t	*pass;
 
-	winding_t	windings[3];	// source, pass, temp in any order
-	int			freewindings[3];
-
 	plane_t		portalplane;
 };
 
+// Per-thread bump allocator for the windings clipped in RecursiveLeafFlow.
+// Each portal tried at a recursion level rewinds it to the level's mark, so
+// nothing is freed individually.
+#define WINDING_ARENA_BLOCK	1024
+
+struct windingarena_t
+{
+	CUtlVector<winding_t *>	blocks;
+	int			top;
+};
+
 struct threaddata_t
 {
 	portal_t	*base;
 	int			c_chains;
+	windingarena_t	*arena;
+	winding_t	*lastwinding;	// most recent allocation at this level, may be chopped in place
 	pstack_t	pstack_head;
 };
 
@@ -115,6 +125,9 @@ void BetterPortalVis (int portalnum);
 void PortalFlow (int iThread, int portalnum);
 void WritePortalTrace( const char *source );
 
+void LoadVisCache( const char *pFileName );
+void SaveVisCache( const char *pFileName );
+
 extern	portal_t	*sorted_portals[MAX_MAP_PORTALS*2];
 extern int g_TraceClusterStart, g_TraceClusterStop;
 
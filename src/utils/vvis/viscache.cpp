@@ -0,0 +1,298 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Incremental vis. After a full compile the portalvis of every portal
+//			is written next to the bsp, keyed by a hash of the portal winding and
+//			of the portals leaving the leaf it flows into. On the next -incremental
+//			compile a portal reuses its old result when its own key and the keys
+//			of everything in its mightsee (portalflood) set are unchanged, since
+//			PortalFlow can't reach any geometry outside that set. Only portals
+//			whose flood region touches an edit are flowed again.
+//
+//=============================================================================//
+
+#include "vis.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/utlmap.h"
+
+#define VISCACHE_ID			(('C'<<24)+('S'<<16)+('I'<<8)+'V')
+#define VISCACHE_VERSION	1
+
+struct VisCacheHeader_t
+{
+	int		m_nId;
+	int		m_nVersion;
+	int		m_nPortals;						// g_numportals*2
+	int		m_nVisRefs;						// size of the portal index list after the records
+};
+
+struct VisCachePortal_t
+{
+	uint32	m_nKey;							// PortalKey
+	uint32	m_nFloodHash;					// FloodHash of portalflood
+	int		m_nMightSee;					// bit count of portalflood
+	int		m_nFirstVisRef;					// portalvis, as a list of portal indices
+	int		m_nVisRefs;
+};
+
+static CUtlVector<uint32> s_PortalKeys;
+
+
+static uint32 HashPortalWinding( portal_t *p )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	winding_t *w = p->winding;
+	CRC32_ProcessBuffer( &crc, &w->numpoints, sizeof( w->numpoints ) );
+	CRC32_ProcessBuffer( &crc, w->points, w->numpoints * sizeof( Vector ) );
+	CRC32_ProcessBuffer( &crc, &p->plane, sizeof( p->plane ) );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+// Spreads the key bits so that summing keys makes a usable set hash
+static uint32 MixPortalKey( uint32 h )
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Computes the key of every portal: its own winding plus the windings
+//			of the portals out of the leaf it flows into, which is everything
+//			RecursiveLeafFlow looks at when it passes through this portal.
+//			The leaf's portals are summed so their order in the .prt doesn't matter.
+//-----------------------------------------------------------------------------
+static void CalcPortalKeys( void )
+{
+	int numportals = g_numportals*2;
+
+	CUtlVector<uint32> windingHash;
+	windingHash.SetCount( numportals );
+	for ( int i = 0; i < numportals; i++ )
+	{
+		windingHash[i] = HashPortalWinding( &portals[i] );
+	}
+
+	s_PortalKeys.SetCount( numportals );
+	for ( int i = 0; i < numportals; i++ )
+	{
+		leaf_t *leaf = &leafs[portals[i].leaf];
+		int count = leaf->portals.Count();
+		uint32 neighbors = 0;
+		for ( int j = 0; j < count; j++ )
+		{
+			neighbors += MixPortalKey( windingHash[leaf->portals[j] - portals] );
+		}
+
+		CRC32_t crc;
+		CRC32_Init( &crc );
+		CRC32_ProcessBuffer( &crc, &windingHash[i], sizeof( uint32 ) );
+		CRC32_ProcessBuffer( &crc, &count, sizeof( count ) );
+		CRC32_ProcessBuffer( &crc, &neighbors, sizeof( neighbors ) );
+		CRC32_Final( &crc );
+		s_PortalKeys[i] = crc;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Order independent hash of the keys of the portals in a bit vector,
+//			so it can be compared across compiles that renumbered the portals.
+//-----------------------------------------------------------------------------
+static uint32 FloodHash( byte *bits )
+{
+	uint32 h = 0;
+	for ( int i = 0; i < g_numportals*2; i++ )
+	{
+		if ( CheckBit( bits, i ) )
+		{
+			h += MixPortalKey( s_PortalKeys[i] );
+		}
+	}
+	return h;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Maps portal keys to portal indices. Keys that show up more than
+//			once can't be matched reliably and map to -1.
+//-----------------------------------------------------------------------------
+static void BuildKeyMap( CUtlMap<uint32, int> &map, const uint32 *pKeys, int count )
+{
+	SetDefLessFunc( map );
+	for ( int i = 0; i < count; i++ )
+	{
+		int index = map.Find( pKeys[i] );
+		if ( index == map.InvalidIndex() )
+		{
+			map.Insert( pKeys[i], i );
+		}
+		else
+		{
+			map[index] = -1;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Called after BasePortalVis. Fills in portalvis and marks stat_done
+//			every portal whose cached result is still valid; PortalFlow skips those.
+//-----------------------------------------------------------------------------
+void LoadVisCache( const char *pFileName )
+{
+	CalcPortalKeys();
+
+	FILE *f = fopen( pFileName, "rb" );
+	if ( !f )
+	{
+		Msg( "No vis cache %s, doing a full vis\n", pFileName );
+		return;
+	}
+
+	VisCacheHeader_t header;
+	if ( fread( &header, sizeof( header ), 1, f ) != 1 ||
+		 header.m_nId != VISCACHE_ID ||
+		 header.m_nVersion != VISCACHE_VERSION ||
+		 header.m_nPortals <= 0 || header.m_nVisRefs < 0 )
+	{
+		Warning( "Ignoring invalid vis cache %s\n", pFileName );
+		fclose( f );
+		return;
+	}
+
+	CUtlVector<VisCachePortal_t> cached;
+	CUtlVector<int> visRefs;
+	cached.SetCount( header.m_nPortals );
+	visRefs.SetCount( header.m_nVisRefs );
+	bool bRead = fread( cached.Base(), sizeof( VisCachePortal_t ), header.m_nPortals, f ) == (size_t)header.m_nPortals;
+	if ( header.m_nVisRefs )
+	{
+		bRead = bRead && fread( visRefs.Base(), sizeof( int ), header.m_nVisRefs, f ) == (size_t)header.m_nVisRefs;
+	}
+	fclose( f );
+	if ( !bRead )
+	{
+		Warning( "Ignoring truncated vis cache %s\n", pFileName );
+		return;
+	}
+
+	int numportals = g_numportals*2;
+
+	// match old portals to new ones by key
+	CUtlMap<uint32, int> newKeys;
+	BuildKeyMap( newKeys, s_PortalKeys.Base(), numportals );
+
+	CUtlVector<uint32> oldKeyList;
+	oldKeyList.SetCount( header.m_nPortals );
+	CUtlVector<int> oldToNew;
+	oldToNew.SetCount( header.m_nPortals );
+	for ( int i = 0; i < header.m_nPortals; i++ )
+	{
+		oldKeyList[i] = cached[i].m_nKey;
+		int index = newKeys.Find( cached[i].m_nKey );
+		oldToNew[i] = ( index != newKeys.InvalidIndex() ) ? newKeys[index] : -1;
+	}
+
+	CUtlMap<uint32, int> oldKeys;
+	BuildKeyMap( oldKeys, oldKeyList.Base(), header.m_nPortals );
+
+	int c_reused = 0;
+	for ( int i = 0; i < numportals; i++ )
+	{
+		portal_t *p = &portals[i];
+
+		int index = oldKeys.Find( s_PortalKeys[i] );
+		if ( index == oldKeys.InvalidIndex() || oldKeys[index] < 0 || newKeys[newKeys.Find( s_PortalKeys[i] )] < 0 )
+			continue;
+
+		// the flood region has to hold exactly the same, unchanged portals
+		const VisCachePortal_t &old = cached[oldKeys[index]];
+		if ( old.m_nMightSee != p->nummightsee || old.m_nFloodHash != FloodHash( p->portalflood ) )
+			continue;
+		if ( old.m_nFirstVisRef < 0 || old.m_nVisRefs < 0 || old.m_nFirstVisRef + old.m_nVisRefs > header.m_nVisRefs )
+			continue;
+
+		int j;
+		for ( j = 0; j < old.m_nVisRefs; j++ )
+		{
+			int ref = visRefs[old.m_nFirstVisRef + j];
+			if ( ref < 0 || ref >= header.m_nPortals || oldToNew[ref] < 0 )
+				break;
+			SetBit( p->portalvis, oldToNew[ref] );
+		}
+
+		if ( j != old.m_nVisRefs )
+		{
+			memset( p->portalvis, 0, portalbytes );
+			continue;
+		}
+
+		p->status = stat_done;
+		c_reused++;
+	}
+
+	Msg( "Vis cache: reusing %i of %i portals, %i to flow\n", c_reused, numportals, numportals - c_reused );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Called once every portal is stat_done.
+//-----------------------------------------------------------------------------
+void SaveVisCache( const char *pFileName )
+{
+	int numportals = g_numportals*2;
+	if ( s_PortalKeys.Count() != numportals )
+	{
+		CalcPortalKeys();
+	}
+
+	CUtlVector<VisCachePortal_t> records;
+	CUtlVector<int> visRefs;
+	records.SetCount( numportals );
+	for ( int i = 0; i < numportals; i++ )
+	{
+		portal_t *p = &portals[i];
+		VisCachePortal_t &record = records[i];
+		record.m_nKey = s_PortalKeys[i];
+		record.m_nFloodHash = FloodHash( p->portalflood );
+		record.m_nMightSee = p->nummightsee;
+		record.m_nFirstVisRef = visRefs.Count();
+		for ( int j = 0; j < numportals; j++ )
+		{
+			if ( CheckBit( p->portalvis, j ) )
+			{
+				visRefs.AddToTail( j );
+			}
+		}
+		record.m_nVisRefs = visRefs.Count() - record.m_nFirstVisRef;
+	}
+
+	FILE *f = fopen( pFileName, "wb" );
+	if ( !f )
+	{
+		Warning( "Couldn't write vis cache %s\n", pFileName );
+		return;
+	}
+
+	VisCacheHeader_t header;
+	header.m_nId = VISCACHE_ID;
+	header.m_nVersion = VISCACHE_VERSION;
+	header.m_nPortals = numportals;
+	header.m_nVisRefs = visRefs.Count();
+
+	fwrite( &header, sizeof( header ), 1, f );
+	fwrite( records.Base(), sizeof( VisCachePortal_t ), numportals, f );
+	if ( visRefs.Count() )
+	{
+		fwrite( visRefs.Base(), sizeof( int ), visRefs.Count(), f );
+	}
+	fclose( f );
+
+	Msg( "Wrote vis cache %s\n", pFileName );
+}
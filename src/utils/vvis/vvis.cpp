@@ -56,6 +56,9 @@ double		g_VisRadius = 4096.0f * 4096.0f;
 
 bool		g_bLowPriority = false;
 
+bool		g_bIncrementalVis = false;
+char		g_szVisCacheFile[1024];
+
 //=============================================================================
 
 void PlaneFromWinding (winding_t *w, plane_t *plane)
@@ -346,8 +349,24 @@ void CalcVis (void)
 
 	SortPortals ();
 
+	// fastvis results are just portalflood, and MPI workers can't see the cache
+	bool bUseVisCache = g_bIncrementalVis && !fastvis;
+#ifdef MPI
+	if ( g_bUseMPI )
+		bUseVisCache = false;
+#endif
+	if ( bUseVisCache )
+	{
+		LoadVisCache( g_szVisCacheFile );
+	}
+
 	CalcPortalVis ();
 
+	if ( bUseVisCache )
+	{
+		SaveVisCache( g_szVisCacheFile );
+	}
+
 	//
 	// assemble the leaf vis lists by oring the portal lists
 	//
@@ -959,6 +978,14 @@ int ParseCommandLine( int argc, char **argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-incremental" ) )
+		{
+			g_bIncrementalVis = true;
+		}
+		else if( !Q_stricmp( argv[i], "-numa" ) )
+		{
+			g_bNumaPinThreads = true;
+		}
 		else if ( !Q_stricmp( argv[i], "-FullMinidumps" ) )
 		{
 			EnableFullMinidumps( true );
@@ -1041,7 +1068,10 @@ void PrintUsage( int argc, char **argv )
 #endif
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
+		"  -numa           : Pin worker threads round-robin to NUMA nodes.\n"
 		"  -nosort         : Don't sort portals (sorting is an optimization).\n"
+		"  -incremental    : Cache per-portal vis in <mapname>.viscache and only\n"
+		"                    recompute portals that can see changed geometry.\n"
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
@@ -1172,6 +1202,9 @@ int RunVVis( int argc, char **argv )
 	}
 	strcat (portalfile, ".prt");
 
+	strcpy( g_szVisCacheFile, source );
+	Q_DefaultExtension( g_szVisCacheFile, ".viscache", sizeof( g_szVisCacheFile ) );
+
 	Msg ("reading %s\n", portalfile);
 	LoadPortals (portalfile);
 